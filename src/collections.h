@@ -21,6 +21,9 @@
 #define COLLECTIONS_H
 
 #include <list>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 
 template <class T, bool owns=true> class List : public std::list<T>
 {
@@ -44,4 +47,84 @@ template <class T, bool owns> class List<T*, owns> : public std::list<T*>
 		}
 };
 
+/** Growable byte buffer for data read from or written to a socket. Bytes
+ * are appended at the end and consumed from the front; the remaining
+ * ones are only moved when more room is needed at the end. */
+class ByteBuffer
+{
+	public:
+		ByteBuffer() : data_m(0), begin_m(0), end_m(0), capacity_m(0) {};
+		~ByteBuffer() { free(data_m); };
+
+		const char* data() const { return data_m + begin_m; };
+		size_t size() const { return end_m - begin_m; };
+		bool empty() const { return begin_m == end_m; };
+		/** Room left at the end, see reserve(). */
+		size_t space() const { return capacity_m - end_m; };
+
+		/** Makes room for at least len bytes at the end and returns where
+		 * they go. They are added to the buffer by commit(). */
+		char* reserve(size_t len)
+		{
+			if (capacity_m - end_m < len)
+			{
+				if (begin_m > 0)
+				{
+					memmove(data_m, data_m + begin_m, end_m - begin_m);
+					end_m -= begin_m;
+					begin_m = 0;
+				}
+				if (capacity_m - end_m < len)
+				{
+					size_t capacity = capacity_m ? capacity_m * 2 : 1024;
+					while (capacity - end_m < len)
+						capacity *= 2;
+					char* data = (char*)realloc(data_m, capacity);
+					if (!data)
+						throw std::bad_alloc();
+					data_m = data;
+					capacity_m = capacity;
+				}
+			}
+			return data_m + end_m;
+		}
+		void commit(size_t len) { end_m += len; };
+		void append(const char* data, size_t len)
+		{
+			memcpy(reserve(len), data, len);
+			end_m += len;
+		}
+		void consume(size_t len)
+		{
+			begin_m += len;
+			if (begin_m >= end_m)
+				begin_m = end_m = 0;
+		}
+		void clear() { begin_m = end_m = 0; };
+		/** Frees the memory if the buffer is empty. */
+		void release()
+		{
+			if (begin_m != end_m)
+				return;
+			free(data_m);
+			data_m = 0;
+			begin_m = end_m = capacity_m = 0;
+		}
+		/** Position of the first c at or after from, or -1. */
+		long find(char c, size_t from = 0) const
+		{
+			if (from >= size())
+				return -1;
+			const char* pos = (const char*)memchr(data() + from, c, size() - from);
+			return pos ? pos - data() : -1;
+		}
+
+	private:
+		ByteBuffer(const ByteBuffer&);
+		ByteBuffer& operator=(const ByteBuffer&);
+
+		char* data_m;
+		size_t begin_m, end_m, capacity_m;
+};
+
 #endif
@@ -29,7 +29,7 @@ ObjectController* ObjectController::instance_m;
 
 Logger& Object::logger_m(Logger::getInstance("Object"));
 
-Object::Object() : init_m(false), flags_m(Default), refCount_m(0), gad_m(0), readRequestGad_m(0), persist_m(false), writeLog_m(false), readPending_m(false)
+Object::Object() : init_m(false), flags_m(Default), refCount_m(0), gad_m(0), readRequestGad_m(0), persist_m(false), writeLog_m(false), readPending_m(false), changeSeq_m(0)
 {}
 
 Object::~Object()
@@ -420,7 +420,7 @@ void Object::exportXml(ticpp::Element* pConfig)
     }
 }
 
-void Object::read()
+void Object::requestRead()
 {
     KnxConnection* con = Services::instance()->getKnxConnection();
 	if (con->isVoid())
@@ -435,6 +435,17 @@ void Object::read()
         con->write(getReadRequestGad(), buf, 2);
     }
     readPending_m = true;
+}
+
+void Object::read()
+{
+    KnxConnection* con = Services::instance()->getKnxConnection();
+	if (con->isVoid())
+	{
+		init_m = true;
+		return;
+	}
+    requestRead();
 
     pth_event_t tmout = pth_event (PTH_EVENT_TIME, pth_timeout(1,0));
     int cnt = 0;
@@ -466,6 +477,8 @@ void Object::onUpdate()
 {
     init_m = true;
     logger_m.infoStream() << "New value " << getValue() << " for object " << getID() << " (type: " << getType() << ")" << endlog;
+    if (changeSeq_m)
+        ObjectController::instance()->logChange(this);
     
     ListenerList_t::iterator it;
     for (it = listenerList_m.begin(); it != listenerList_m.end(); it++)
@@ -3143,7 +3156,7 @@ void String14AsciiObject::setStringValue(const std::string& value)
 
 Logger& ObjectController::logger_m(Logger::getInstance("ObjectController"));
 
-ObjectController::ObjectController()
+ObjectController::ObjectController() : seq_m(0), removedSeq_m(0), epoch_m(TimerManager::now())
 {}
 
 ObjectController::~ObjectController()
@@ -3216,6 +3229,7 @@ void ObjectController::addObject(Object* object)
 {
     if (!objectIdMap_m.insert(ObjectIdPair_t(object->getID(), object)).second)
         throw ticpp::Exception("Object ID already exists");
+    logChange(object);
     if (object->getGad())
         objectMap_m.insert(ObjectPair_t(object->getGad(), object));
     std::list<eibaddr_t>::iterator it2, it_end;
@@ -3254,6 +3268,8 @@ void ObjectController::removeObject(Object* object)
 
         if (it->second->inUse())
             throw ticpp::Exception("Delete failed! Object still in use.");
+        changeLog_m.erase(object->changeSeq_m);
+        removedSeq_m = ++seq_m;
         delete it->second;
         objectIdMap_m.erase(it);
     }
@@ -3336,6 +3352,28 @@ void ObjectController::exportObjectValues(ticpp::Element* pObjects)
     }
 }
 
+void ObjectController::logChange(Object* object)
+{
+    if (object->changeSeq_m)
+        changeLog_m.erase(object->changeSeq_m);
+    object->changeSeq_m = ++seq_m;
+    changeLog_m.insert(changeLog_m.end(), ChangeLog_t::value_type(seq_m, object));
+}
+
+bool ObjectController::exportChanges(ticpp::Element* pObjects, uint64_t since, int64_t epoch)
+{
+    bool complete = epoch == epoch_m && since >= removedSeq_m && since <= seq_m;
+    ChangeLog_t::iterator it = complete ? changeLog_m.upper_bound(since) : changeLog_m.begin();
+    for (; it != changeLog_m.end(); it++)
+    {
+        ticpp::Element pElem("object");
+        pElem.SetAttribute("id", (*it).second->getID());
+        pElem.SetAttribute("value", (*it).second->getValue());
+        pObjects->LinkEndChild(&pElem);
+    }
+    return complete;
+}
+
 // Delivers all objects
 std::list<Object*> ObjectController::getObjects()
 {
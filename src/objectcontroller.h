@@ -125,6 +125,11 @@ public:
     //    eibaddr_t getListenerGad(int idx) { return listenerGadList_m[idx]; };
     const eibaddr_t getLastTx() { return lastTx_m; };
     void read();
+    /** Sends a read request without waiting for the response. */
+    void requestRead();
+    /** Gives up waiting for a read response and keeps the current value. */
+    void endRead() { init_m = true; };
+    bool isInitialized() const { return init_m; };
     virtual void onUpdate();
     void onInternalUpdate();
     bool forceUpdate() { return (!init_m || (flags_m & Stateless)); };
@@ -140,6 +145,9 @@ public:
     int decRefCount() { if (refCount_m < 1) { printf("REFCOUNT ERROR %d\n", refCount_m); exit(1); }
         return --refCount_m; };
     bool inUse() { return refCount_m > 0; };
+    /** Sequence number of the last change logged by the ObjectController,
+     * 0 for objects it does not manage. */
+    uint64_t getChangeSeq() { return changeSeq_m; };
 
     static eibaddr_t ReadGroupAddr(const std::string& addr);
     static eibaddr_t ReadAddr(const std::string& addr);
@@ -175,10 +183,13 @@ private:
     bool persist_m;
     bool writeLog_m;
     bool readPending_m;
+    uint64_t changeSeq_m;
     typedef std::list<ChangeListener*> ListenerList_t;
     ListenerList_t listenerList_m;
     typedef std::list<eibaddr_t> ListenerGadList_t;
     ListenerGadList_t listenerGadList_m;
+
+    friend class ObjectController;
 };
 
 class SwitchingObject : public Object
@@ -1376,6 +1387,20 @@ public:
     virtual void onResponse(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len);
     virtual std::list<Object*> getObjects();
 
+    /** Gives the object the next sequence number. Each object is kept in
+     * the change log with its last change only, objects count as changed
+     * when they are added. */
+    void logChange(Object* object);
+    /** Sequence number of the last change. */
+    uint64_t getSeq() { return seq_m; };
+    /** Identifies the sequence numbers of this run of linknx. */
+    int64_t getEpoch() { return epoch_m; };
+    /** Adds the objects changed after the since sequence number to
+     * pObjects, like exportObjectValues. If the changes are not all
+     * known, because epoch is from another run or objects were removed
+     * since, adds all objects and returns false. */
+    bool exportChanges(ticpp::Element* pObjects, uint64_t since, int64_t epoch);
+
 private:
     ObjectController();
     virtual ~ObjectController();
@@ -1388,6 +1413,11 @@ private:
     typedef std::map<std::string ,Object*> ObjectIdMap_t;
     ObjectMap_t objectMap_m;
     ObjectIdMap_t objectIdMap_m;
+    typedef std::map<uint64_t ,Object*> ChangeLog_t;
+    ChangeLog_t changeLog_m;
+    uint64_t seq_m;
+    uint64_t removedSeq_m;
+    int64_t epoch_m;
     static ObjectController* instance_m;
     static Logger& logger_m;
 };
@@ -23,10 +23,12 @@
 #include "luacondition.h"
 #include "ioport.h"
 #include <cmath>
+#include <fnmatch.h>
 
 RuleServer* RuleServer::instance_m;
+Logger& RuleServer::logger_m(Logger::getInstance("RuleServer"));
 
-RuleServer::RuleServer()
+RuleServer::RuleServer() : readyTime_m(-1), lastReloadTime_m(-1), lastReloadCount_m(0)
 {}
 
 RuleServer::~RuleServer()
@@ -45,6 +47,8 @@ RuleServer* RuleServer::instance()
 
 void RuleServer::importXml(ticpp::Element* pConfig)
 {
+    int64_t start = TimerWheel::now();
+    int touched = 0, unchanged = 0;
     ticpp::Iterator< ticpp::Element > child("rule");
     for ( child = pConfig->FirstChildElement("rule", false); child != child.end(); child++ )
     {
@@ -58,15 +62,82 @@ void RuleServer::importXml(ticpp::Element* pConfig)
             Rule* rule = new Rule();
             rule->importXml(&(*child));
             rulesMap_m.insert(RuleIdPair_t(id, rule));
+            touched++;
         }
         else if (del)
         {
             delete it->second;
             rulesMap_m.erase(it);
+            touched++;
         }
-        else
+        else if (!child->FirstChildElement("condition", false) && !child->FirstChildElement("actionlist", false))
+        {
+            // Only attributes are changed, no need to rebuild the rule
             it->second->updateXml(&(*child));
+            touched++;
+        }
+        else if (reloadRule(it, &(*child)))
+            touched++;
+        else
+            unchanged++;
+    }
+    lastReloadTime_m = TimerWheel::now() - start;
+    lastReloadCount_m = touched;
+    logger_m.infoStream() << "Rules imported in " << lastReloadTime_m << "ms (" << touched << " touched, "
+        << unchanged << " unchanged)" << endlog;
+}
+
+static std::string toString(ticpp::Element& element)
+{
+    ticpp::Document doc;
+    doc.InsertEndChild(element);
+    return doc.GetAsString();
+}
+
+bool RuleServer::reloadRule(RuleIdMap_t::iterator it, ticpp::Element* pConfig)
+{
+    Rule* previous = it->second;
+    ticpp::Element current("rule");
+    previous->exportXml(&current);
+
+    // Apply the changes on top of the current definition
+    ticpp::Element merged("rule");
+    ticpp::Iterator< ticpp::Attribute > attr;
+    for (attr = current.FirstAttribute(false); attr != attr.end(); attr++)
+        merged.SetAttribute(attr->Name(), attr->Value());
+    for (attr = pConfig->FirstAttribute(false); attr != attr.end(); attr++)
+        merged.SetAttribute(attr->Name(), attr->Value());
+    ticpp::Element* pCondition = pConfig->FirstChildElement("condition", false);
+    if (!pCondition)
+        pCondition = current.FirstChildElement("condition", false);
+    if (pCondition)
+        merged.InsertEndChild(*pCondition);
+    ticpp::Element* pActions = pConfig->FirstChildElement("actionlist", false) ? pConfig : &current;
+    ticpp::Iterator< ticpp::Element > actionList("actionlist");
+    for (actionList = pActions->FirstChildElement("actionlist", false); actionList != actionList.end(); actionList++)
+        merged.InsertEndChild(*actionList);
+
+    if (toString(merged) == toString(current))
+        return false;
+
+    // Build the new rule before touching the current one. Nothing yields
+    // until the previous rule is deleted, so no telegram reaches both.
+    Rule* rule = new Rule();
+    try
+    {
+        rule->reloadXml(&merged, previous);
     }
+    catch (...)
+    {
+        delete rule;
+        throw;
+    }
+    it->second = rule;
+    delete previous;
+    // Initialising may wait for the bus, only the new rule is left by then
+    if (pConfig->GetAttribute("init") != "")
+        rule->initializeIfReady();
+    return true;
 }
 
 void RuleServer::exportXml(ticpp::Element* pConfig)
@@ -82,6 +153,13 @@ void RuleServer::exportXml(ticpp::Element* pConfig)
 
 void RuleServer::statusXml(ticpp::Element* pStatus)
 {
+    if (readyTime_m >= 0)
+        pStatus->SetAttribute("ready-time", readyTime_m);
+    if (lastReloadTime_m >= 0)
+    {
+        pStatus->SetAttribute("reload-time", lastReloadTime_m);
+        pStatus->SetAttribute("reload-touched", lastReloadCount_m);
+    }
     RuleIdMap_t::iterator it;
     for (it = rulesMap_m.begin(); it != rulesMap_m.end(); it++)
     {
@@ -100,11 +178,60 @@ void RuleServer::initialize()
         pth_sleep(1);
     }
 
+    int64_t start = TimerWheel::now();
+
+    // Request all values needed by the rules at once instead of waiting
+    // for each object to answer while evaluating the rules one by one.
+    std::set<Object*> objects;
+    for (RuleIdMap_t::iterator it = rulesMap_m.begin(); it != rulesMap_m.end(); it++)
+        it->second->collectInitObjects(objects);
+
+    std::list<Object*> pending;
+    for (std::set<Object*>::iterator it = objects.begin(); it != objects.end(); it++)
+    {
+        Object* object = *it;
+        if (object->isInitialized())
+            continue;
+        object->requestRead();
+        if (!object->isInitialized())
+        {
+            pending.push_back(object);
+            // Pace requests to avoid flooding the bus.
+            pth_usleep(InitReadPace * 1000);
+        }
+    }
+    int requested = pending.size();
+
+    int64_t deadline = TimerWheel::now() + InitReadTimeout;
+    while (!pending.empty())
+    {
+        std::list<Object*>::iterator it = pending.begin();
+        while (it != pending.end())
+        {
+            if ((*it)->isInitialized())
+                it = pending.erase(it);
+            else
+                ++it;
+        }
+        if (pending.empty() || TimerWheel::now() >= deadline)
+            break;
+        pth_usleep(10000);
+    }
+    for (std::list<Object*>::iterator it = pending.begin(); it != pending.end(); it++)
+    {
+        logger_m.warnStream() << "No answer to read request for object " << (*it)->getID() << endlog;
+        (*it)->endRead();
+    }
+
     for (RuleIdMap_t::iterator it = rulesMap_m.begin(); it != rulesMap_m.end(); it++)
     {
         Rule *rule = it->second;
         rule->initialize();
-    }  
+    }
+
+    readyTime_m = TimerWheel::now() - start;
+    logger_m.infoStream() << "Rules ready in " << readyTime_m << "ms (" << rulesMap_m.size() << " rules, "
+        << requested << " objects read, " << pending.size() << " without answer)" << endlog;
 }
 
 Rule *RuleServer::getRule(const char *id)
@@ -183,9 +310,26 @@ std::string RuleServer::formatDuration(int duration, bool useMilliseconds)
     return output.str();
 }
 
+int64_t RuleServer::parseLongDuration(const std::string& duration)
+{
+    // Durations in ms don't fit in an int beyond 24 days, so only values
+    // given in ms are parsed as such.
+    if (duration.size() > 2 && duration.compare(duration.size() - 2, 2, "ms") == 0)
+        return parseDuration(duration, false, true);
+    return (int64_t)parseDuration(duration) * 1000;
+}
+
+std::string RuleServer::formatLongDuration(int64_t duration)
+{
+    if (duration % 1000 != 0)
+        return formatDuration((int)duration, true);
+    return formatDuration(duration / 1000);
+}
+
 Logger& Rule::logger_m(Logger::getInstance("Rule"));
 
-Rule::Rule() : condition_m(0), prevValue_m(false), flags_m(Active),
+Rule::Rule() : condition_m(0), prevValue_m(false), debounce_m(0), rateLimit_m(0),
+    lastChange_m(0), lastFired_m(0), flags_m(Active),
     actionsOnTrue_m(ActionList::OnTrue), actionsIfTrue_m(ActionList::IfTrue),
     actionsOnFalse_m(ActionList::OnFalse), actionsIfFalse_m(ActionList::IfFalse)
 {}
@@ -224,6 +368,32 @@ void Rule::setCondition(Condition* condition)
 }
 
 void Rule::importXml(ticpp::Element* pConfig)
+{
+    configure(pConfig);
+
+    initializeIfReady();
+
+    logger_m.infoStream() << "Rule: Configuration done" << endlog;
+}
+
+void Rule::reloadXml(ticpp::Element* pConfig, Rule* previous)
+{
+    configure(pConfig);
+
+    // Keep running state so that reloading does not trigger actions
+    prevValue_m = previous->prevValue_m;
+    lastFired_m = previous->lastFired_m;
+    lastChange_m = previous->lastChange_m;
+    if (previous->isScheduled())
+    {
+        Services::instance()->getTimerWheel()->schedule(this, previous->getDeadline());
+        Services::instance()->getTimerWheel()->cancel(previous);
+    }
+
+    logger_m.infoStream() << "Rule: Reload done" << endlog;
+}
+
+void Rule::configure(ticpp::Element* pConfig)
 {
     pConfig->GetAttribute("id", &id_m, false);
 
@@ -232,6 +402,9 @@ void Rule::importXml(ticpp::Element* pConfig)
 
     pConfig->GetAttribute("description", &descr_m, false);
 
+    debounce_m = RuleServer::parseDuration(pConfig->GetAttribute("debounce"), false, true);
+    rateLimit_m = RuleServer::parseDuration(pConfig->GetAttribute("rate-limit"), false, true);
+
     std::string init = pConfig->GetAttributeOrDefault("init", "");
     flags_m &= ~(InitEval|InitTrue);
     if (init != "")
@@ -273,15 +446,6 @@ void Rule::importXml(ticpp::Element* pConfig)
             addAction(action, type);
         }
     }
-
-    // If init value is "eval", we better wait for a bus connection before we evaluate the condition
-    // If init value is "true", we can set prevValue_m even if no bus connection is available
-    if (Services::instance()->getKnxConnection()->isReady())
-        initialize();
-    else
-        prevValue_m = (flags_m & InitTrue);
-
-    logger_m.infoStream() << "Rule: Configuration done" << endlog;
 }
 
 void Rule::updateXml(ticpp::Element* pConfig)
@@ -292,6 +456,13 @@ void Rule::updateXml(ticpp::Element* pConfig)
 
     pConfig->GetAttribute("description", &descr_m, false);
 
+    value = pConfig->GetAttribute("debounce");
+    if (value != "")
+        debounce_m = RuleServer::parseDuration(value, false, true);
+    value = pConfig->GetAttribute("rate-limit");
+    if (value != "")
+        rateLimit_m = RuleServer::parseDuration(value, false, true);
+
     std::string init = pConfig->GetAttributeOrDefault("init", "");
     if (init != "")
     {
@@ -347,14 +518,7 @@ void Rule::updateXml(ticpp::Element* pConfig)
     }
 
     if (init != "")
-    {
-        // If init value is "eval", we better wait for a bus connection before we evaluate the condition
-        // If init value is "true", we can set prevValue_m even if no bus connection is available
-        if (Services::instance()->getKnxConnection()->isReady())
-            initialize();
-        else
-            prevValue_m = (flags_m & InitTrue);
-    }
+        initializeIfReady();
     logger_m.infoStream() << "Rule: Reconfiguration done" << endlog;
 }
 
@@ -366,6 +530,10 @@ void Rule::exportXml(ticpp::Element* pConfig)
         pConfig->SetAttribute("active", "no");
     if (descr_m != "")
         pConfig->SetAttribute("description", descr_m);
+    if (debounce_m != 0)
+        pConfig->SetAttribute("debounce", RuleServer::formatDuration(debounce_m, true));
+    if (rateLimit_m != 0)
+        pConfig->SetAttribute("rate-limit", RuleServer::formatDuration(rateLimit_m, true));
     if (flags_m & InitEval)
         pConfig->SetAttribute("init", "eval");
     else if (flags_m & InitTrue)
@@ -400,6 +568,8 @@ void Rule::statusXml(ticpp::Element* pStatus)
     pStatus->SetAttribute("id", id_m);
     pStatus->SetAttribute("active", (flags_m & Active ? "true" : "false"));
     pStatus->SetAttribute("state", (prevValue_m ? "true" : "false"));
+    if (isScheduled())
+        pStatus->SetAttribute("pending", "true");
     if (condition_m)
     {
         ticpp::Element pElem("condition");
@@ -408,6 +578,16 @@ void Rule::statusXml(ticpp::Element* pStatus)
     }
 }
 
+void Rule::initializeIfReady()
+{
+    // If init value is "eval", we better wait for a bus connection before we evaluate the condition
+    // If init value is "true", we can set prevValue_m even if no bus connection is available
+    if (Services::instance()->getKnxConnection()->isReady())
+        initialize();
+    else
+        prevValue_m = (flags_m & InitTrue);
+}
+
 void Rule::initialize()
 {
     // #71 Make sure we do not execute stateless actions when
@@ -428,28 +608,69 @@ void Rule::initialize()
         executeActions(actionsIfFalse_m);
 }
 
+void Rule::collectInitObjects(std::set<Object*>& objects)
+{
+    if (isActive() && (flags_m & InitEval) && condition_m)
+        condition_m->collectObjects(objects);
+}
+
 void Rule::onChange(Object* object)
 {
+    if (debounce_m > 0 && isActive())
+    {
+        // Postpone evaluation until inputs have been stable for the
+        // debounce delay. Only the first change of a burst touches the wheel.
+        lastChange_m = TimerWheel::now();
+        if (!isScheduled())
+            Services::instance()->getTimerWheel()->schedule(this, lastChange_m + debounce_m);
+        return;
+    }
     evaluate();
 }
 
+void Rule::onWheelTimer(int64_t now)
+{
+    if (debounce_m > 0 && now - lastChange_m < debounce_m)
+    {
+        Services::instance()->getTimerWheel()->schedule(this, lastChange_m + debounce_m);
+        return;
+    }
+    evaluate(now);
+}
+
 void Rule::evaluate()
+{
+    evaluate(TimerWheel::now());
+}
+
+void Rule::evaluate(int64_t now)
 {
     if (isActive())
     {
+        if (rateLimit_m > 0 && lastFired_m != 0 && now - lastFired_m < rateLimit_m)
+        {
+            // Fired too recently, evaluate once more when the period expires
+            logger_m.debugStream() << "Rule " << id_m << " rate limited" << endlog;
+            if (!isScheduled())
+                Services::instance()->getTimerWheel()->schedule(this, lastFired_m + rateLimit_m);
+            return;
+        }
         logger_m.infoStream() << "Evaluate rule " << id_m << endlog;
         bool curValue = condition_m->evaluate();
         logger_m.infoStream() << "Rule " << id_m << " evaluated as " << curValue << ", prev value was " << prevValue_m << endlog;
+        bool fired;
         if (curValue)
         {
-            executeActions(actionsIfTrue_m);
-            if (!prevValue_m) executeActions(actionsOnTrue_m);
+            fired = executeActions(actionsIfTrue_m);
+            if (!prevValue_m) fired |= executeActions(actionsOnTrue_m);
         }
         else
         {
-            executeActions(actionsIfFalse_m);
-            if (prevValue_m) executeActions(actionsOnFalse_m);
+            fired = executeActions(actionsIfFalse_m);
+            if (prevValue_m) fired |= executeActions(actionsOnFalse_m);
         }
+        if (fired)
+            lastFired_m = now;
 
         prevValue_m = curValue;
     }
@@ -460,6 +681,8 @@ void Rule::setActive(bool active)
     if (isActive() == active) return;
 
     flags_m ^= Active;
+    // The active flag is part of the exported configuration
+    Services::instance()->configChanged();
 }
 
 void Rule::cancel()
@@ -543,6 +766,88 @@ void Action::exportXml(ticpp::Element* pConfig)
         pConfig->SetAttribute("delay", RuleServer::formatDuration(delay_m, true));
 }
 
+Action::~Action()
+{
+    while (!instances_m.empty())
+    {
+        delete instances_m.front();
+        instances_m.pop_front();
+    }
+}
+
+void Action::execute()
+{
+    if (!isSequenced())
+    {
+        Start(true);
+        return;
+    }
+    removeFinished();
+    ActionInstance* instance = new ActionInstance(this);
+    instances_m.push_back(instance);
+    Services::instance()->getTimerWheel()->scheduleIn(instance, delay_m);
+}
+
+void Action::cancel()
+{
+    std::list<ActionInstance*>::iterator it;
+    for (it = instances_m.begin(); it != instances_m.end(); ++it)
+        (*it)->cancel();
+    removeFinished();
+    Stop();
+}
+
+bool Action::isFinished()
+{
+    removeFinished();
+    return instances_m.empty() && Thread::isFinished();
+}
+
+void Action::removeFinished()
+{
+    std::list<ActionInstance*>::iterator it = instances_m.begin();
+    while (it != instances_m.end())
+    {
+        if ((*it)->isFinished())
+        {
+            delete *it;
+            it = instances_m.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+void ActionInstance::cancel()
+{
+    // A step running in its thread completes but doesn't resume.
+    cancelled_m = true;
+    Services::instance()->getTimerWheel()->cancel(this);
+}
+
+void ActionInstance::onWheelTimer(int64_t now)
+{
+    now_m = now;
+    if (action_m->isNonBlocking())
+        runStep();
+    else
+        Start();
+}
+
+void ActionInstance::Run (pth_sem_t *)
+{
+    runStep();
+}
+
+void ActionInstance::runStep()
+{
+    running_m = true;
+    int next = action_m->runStep(step_m++);
+    running_m = false;
+    if (next >= 0 && !cancelled_m)
+        Services::instance()->getTimerWheel()->schedule(this, now_m + next);
+}
+
 bool Action::sleep(int delay, pth_sem_t * stop)
 {
     struct timeval timeout;
@@ -640,50 +945,49 @@ void DimUpAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
-void DimUpAction::Run (pth_sem_t * stop)
+int DimUpAction::runStep(int step)
 {
-    if (sleep(delay_m, stop))
-        return;
     if (stop_m > start_m)
     {
-        logger_m.infoStream() << "Execute DimUpAction" << endlog;
         /* set increment to send 2 values per second at most */
         unsigned long incr = (((stop_m - start_m) * 1000/2 / duration_m) + 1);
-
-        unsigned long step = (duration_m / (stop_m - start_m));
-        for (unsigned int idx=start_m; idx < stop_m; idx+=incr)
+        unsigned long delay = (duration_m / (stop_m - start_m));
+        if (step == 0)
+            logger_m.infoStream() << "Execute DimUpAction" << endlog;
+        else if (object_m->getIntValue() < start_m + (step - 1) * incr)
         {
-            object_m->setIntValue(idx);
-            if (sleep(step*incr, stop))
-                return;
-            if (object_m->getIntValue() < idx)
-            {
-                logger_m.infoStream() << "Abort DimUpAction" << endlog;
-                return;
-            }
+            logger_m.infoStream() << "Abort DimUpAction" << endlog;
+            return -1;
         }
-        object_m->setIntValue(stop_m);
+        unsigned long idx = start_m + step * incr;
+        if (idx >= stop_m)
+        {
+            object_m->setIntValue(stop_m);
+            return -1;
+        }
+        object_m->setIntValue(idx);
+        return delay * incr;
     }
     else
     {
-        logger_m.infoStream() << "Execute DimUpAction (decrease)" << endlog;
         unsigned int incr = (((start_m - stop_m) * 500 / duration_m) + 1.0);
-
-        unsigned long step = (duration_m / (start_m - stop_m));
-        for (unsigned int idx=start_m; idx > stop_m; idx-=incr)
+        unsigned long delay = (duration_m / (start_m - stop_m));
+        if (step == 0)
+            logger_m.infoStream() << "Execute DimUpAction (decrease)" << endlog;
+        else if (object_m->getIntValue() > start_m - (step - 1) * incr)
         {
-            object_m->setIntValue(idx);
-            if (sleep(step*incr, stop))
-                return;
-            if (object_m->getIntValue() > idx)
-            {
-                logger_m.infoStream() << "Abort DimUpAction" << endlog;
-                return;
-            }
-            if (idx < incr)
-                break; // since idx is unsigned, we need to avoid underflow
+            logger_m.infoStream() << "Abort DimUpAction" << endlog;
+            return -1;
+        }
+        // Compare before subtracting since values are unsigned
+        unsigned long dec = step * incr;
+        if (dec >= start_m - stop_m)
+        {
+            object_m->setIntValue(stop_m);
+            return -1;
         }
-        object_m->setIntValue(stop_m);
+        object_m->setIntValue(start_m - dec);
+        return delay * incr;
     }
 }
 
@@ -722,15 +1026,14 @@ void SetValueAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
-void SetValueAction::Run (pth_sem_t * stop)
+int SetValueAction::runStep(int)
 {
-    if (sleep(delay_m, stop))
-        return;
     if (object_m)
     {
         logger_m.infoStream() << "Execute SetValueAction: set " << object_m->getID() << " with value " << value_m->toString() << endlog;
         object_m->setValue(value_m);
     }
+    return -1;
 }
 
 CopyValueAction::CopyValueAction() : from_m(0), to_m(0)
@@ -769,12 +1072,10 @@ void CopyValueAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
-void CopyValueAction::Run (pth_sem_t * stop)
+int CopyValueAction::runStep(int)
 {
     if (from_m && to_m)
     {
-        if (sleep(delay_m, stop))
-            return;
         try
         {
             std::string value = from_m->getValue();
@@ -786,6 +1087,7 @@ void CopyValueAction::Run (pth_sem_t * stop)
             logger_m.warnStream() << "Error in CopyValueAction: " << ex.m_details << endlog;
         }
     }
+    return -1;
 }
 
 ToggleValueAction::ToggleValueAction() : object_m(0)
@@ -824,15 +1126,14 @@ void ToggleValueAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
-void ToggleValueAction::Run (pth_sem_t * stop)
+int ToggleValueAction::runStep(int)
 {
-    if (sleep(delay_m, stop))
-        return;
     if (object_m)
     {
         logger_m.infoStream() << "Execute ToggleValueAction on object " << object_m->getID() << endlog;
         object_m->setBoolValue(!object_m->getBoolValue());
     }
+    return -1;
 }
 
 FormulaAction::FormulaAction() : object_m(0), x_m(0), y_m(0), a_m(1), b_m(1), c_m(0), m_m(1), n_m(1)
@@ -902,10 +1203,8 @@ void FormulaAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
-void FormulaAction::Run (pth_sem_t * stop)
+int FormulaAction::runStep(int)
 {
-    if (sleep(delay_m, stop))
-        return;
     if (object_m)
     {
         logger_m.infoStream() << "Execute FormulaAction: set " << object_m->getID() << endlog;
@@ -916,6 +1215,7 @@ void FormulaAction::Run (pth_sem_t * stop)
             res += b_m * pow(y_m->getFloatValue(), n_m);
         object_m->setFloatValue(res);
     }
+    return -1;
 }
 
 SetStringAction::SetStringAction() : object_m(0)
@@ -951,10 +1251,8 @@ void SetStringAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
-void SetStringAction::Run (pth_sem_t * stop)
+int SetStringAction::runStep(int)
 {
-    if (sleep(delay_m, stop))
-        return;
     std::string value = value_m;
     parseVarString(value);
     if (object_m)
@@ -962,6 +1260,7 @@ void SetStringAction::Run (pth_sem_t * stop)
         logger_m.infoStream() << "Execute SetStringAction for object " << object_m->getID() << " with value " << value << endlog;
         object_m->setValue(value);
     }
+    return -1;
 }
 
 SendReadRequestAction::SendReadRequestAction() : object_m(0)
@@ -1004,7 +1303,7 @@ void SendReadRequestAction::Run (pth_sem_t * stop)
 }
 
 CycleOnOffAction::CycleOnOffAction()
-    : object_m(0), delayOn_m(0), delayOff_m(0), count_m(0), stopCondition_m(0), running_m(false)
+    : object_m(0), delayOn_m(0), delayOff_m(0), count_m(0), stopCondition_m(0)
 {}
 
 CycleOnOffAction::~CycleOnOffAction()
@@ -1070,35 +1369,31 @@ void CycleOnOffAction::exportXml(ticpp::Element* pConfig)
 
 void CycleOnOffAction::onChange(Object* object)
 {
-    if (stopCondition_m && running_m && stopCondition_m->evaluate())
-        running_m = false;
+    // Stops every running cycle, a later execution starts a new one
+    if (stopCondition_m && !Action::isFinished() && stopCondition_m->evaluate())
+    {
+        logger_m.infoStream() << "CycleOnOffAction stopped by condition" << endlog;
+        Action::cancel();
+    }
 }
 
-void CycleOnOffAction::Run (pth_sem_t * stop)
+void CycleOnOffAction::execute()
 {
     if (!object_m)
         return;
-    running_m = true;
-    if (sleep(delay_m, stop))
-        return;
-    logger_m.infoStream() << "Execute CycleOnOffAction" << endlog;
-    for (int i=0; i<count_m; i++)
-    {
-        if (!running_m)
-            break;
-        object_m->setBoolValue(true);
-        if (sleep(delayOn_m, stop))
-            return;
-        if (!running_m)
-            break;
-        object_m->setBoolValue(false);
-        if (sleep(delayOff_m, stop))
-            return;
-    }
-    if (running_m)
-        running_m = false;
-    else
-        logger_m.infoStream() << "CycleOnOffAction stopped by condition" << endlog;
+    Action::execute();
+}
+
+int CycleOnOffAction::runStep(int step)
+{
+    if (step == 0)
+        logger_m.infoStream() << "Execute CycleOnOffAction" << endlog;
+    if (step >= 2 * count_m)
+        return -1;
+    // Even steps switch on, odd steps switch off
+    bool on = (step % 2 == 0);
+    object_m->setBoolValue(on);
+    return on ? delayOn_m : delayOff_m;
 }
 
 RepeatListAction::RepeatListAction()
@@ -1150,45 +1445,37 @@ void RepeatListAction::exportXml(ticpp::Element* pConfig)
     }
 }
 
-void RepeatListAction::Run (pth_sem_t * stop)
+int RepeatListAction::runStep(int step)
 {
-    bool running = true;
-    if (sleep(delay_m, stop))
-        return;
-    logger_m.infoStream() << "Execute RepeatListAction" << endlog;
-    for (int i=0; i<count_m; i++)
-    {
-        ActionsList_t::iterator it;
-        for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
-            (*it)->execute();
-        if (sleep(period_m, stop))
-        {
-            for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
-                (*it)->cancel();
-            return;
-        }
-    }
-    // Wait until all actions are finished to be able to cancel them if main action is canceled
-    while (running)
+    if (step >= count_m)
+        return -1;
+    if (step == 0)
+        logger_m.infoStream() << "Execute RepeatListAction" << endlog;
+    ActionsList_t::iterator it;
+    for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
+        (*it)->execute();
+    return period_m;
+}
+
+void RepeatListAction::cancel()
+{
+    Action::cancel();
+    ActionsList_t::iterator it;
+    for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
+        (*it)->cancel();
+}
+
+bool RepeatListAction::isFinished()
+{
+    if (!Action::isFinished())
+        return false;
+    ActionsList_t::iterator it;
+    for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
     {
-        ActionsList_t::iterator it;
-        running = false;
-        for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
-        {
-            if (!(*it)->isFinished())
-            {
-                running = true;
-                if (sleep(1000, stop))
-                {
-                    logger_m.infoStream() << "RepeatListAction canceled." << endlog;
-                    for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
-                        (*it)->cancel();
-                    return;
-                }
-                break;
-            }
-        }
+        if (!(*it)->isFinished())
+            return false;
     }
+    return true;
 }
 
 ConditionalAction::ConditionalAction()
@@ -1243,11 +1530,8 @@ void ConditionalAction::exportXml(ticpp::Element* pConfig)
     }
 }
 
-void ConditionalAction::Run (pth_sem_t * stop)
+int ConditionalAction::runStep(int)
 {
-    bool running = true;
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute ConditionalAction" << endlog;
     bool curValue = condition_m->evaluate();
     logger_m.infoStream() << "ConditionalAction evaluated as " << curValue << endlog;
@@ -1257,27 +1541,28 @@ void ConditionalAction::Run (pth_sem_t * stop)
         for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
             (*it)->execute();
     }
-    // Wait until all actions are finished to be able to cancel them if main action is canceled
-    while (running)
+    return -1;
+}
+
+void ConditionalAction::cancel()
+{
+    Action::cancel();
+    ActionsList_t::iterator it;
+    for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
+        (*it)->cancel();
+}
+
+bool ConditionalAction::isFinished()
+{
+    if (!Action::isFinished())
+        return false;
+    ActionsList_t::iterator it;
+    for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
     {
-        ActionsList_t::iterator it;
-        running = false;
-        for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
-        {
-            if (!(*it)->isFinished())
-            {
-                running = true;
-                if (sleep(1000, stop))
-                {
-                    logger_m.infoStream() << "ConditionalAction canceled." << endlog;
-                    for(it=actionsList_m.begin(); it != actionsList_m.end(); ++it)
-                        (*it)->cancel();
-                    return;
-                }
-                break;
-            }
-        }
+        if (!(*it)->isFinished())
+            return false;
     }
+    return true;
 }
 
 SendSmsAction::SendSmsAction() : varFlags_m(0)
@@ -1469,10 +1754,8 @@ void StartActionlistAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
-void StartActionlistAction::Run (pth_sem_t * stop)
+int StartActionlistAction::runStep(int)
 {
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute StartActionlistAction for rule ID: " << ruleId_m << endlog;
 
     Rule* rule = RuleServer::instance()->getRule(ruleId_m.c_str());
@@ -1490,6 +1773,7 @@ void StartActionlistAction::Run (pth_sem_t * stop)
     }
     else
         logger_m.errorStream() << "CancelAction: Rule not found '" << ruleId_m << "'" << endlog;
+    return -1;
 }
 
 CancelAction::CancelAction()
@@ -1513,10 +1797,8 @@ void CancelAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
-void CancelAction::Run (pth_sem_t * stop)
+int CancelAction::runStep(int)
 {
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute CancelAction for rule ID: " << ruleId_m << endlog;
 
     Rule* rule = RuleServer::instance()->getRule(ruleId_m.c_str());
@@ -1524,6 +1806,7 @@ void CancelAction::Run (pth_sem_t * stop)
         rule->cancel();
     else
         logger_m.errorStream() << "CancelAction: Rule not found '" << ruleId_m << "'" << endlog;
+    return -1;
 }
 
 SetRuleActiveAction::SetRuleActiveAction() : active_m(true)
@@ -1550,10 +1833,8 @@ void SetRuleActiveAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
-void SetRuleActiveAction::Run (pth_sem_t * stop)
+int SetRuleActiveAction::runStep(int)
 {
-    if (sleep(delay_m, stop))
-        return;
     logger_m.infoStream() << "Execute SetRuleActiveAction for rule ID: " << ruleId_m << endlog;
 
     Rule* rule = RuleServer::instance()->getRule(ruleId_m.c_str());
@@ -1561,6 +1842,7 @@ void SetRuleActiveAction::Run (pth_sem_t * stop)
         rule->setActive(active_m);
     else
         logger_m.errorStream() << "SetRuleActiveAction: Rule not found '" << ruleId_m << "'" << endlog;
+    return -1;
 }
 
 Logger& Condition::logger_m(Logger::getInstance("Condition"));
@@ -1585,6 +1867,8 @@ Condition* Condition::create(const std::string& type, ChangeListener* cl)
         return new ObjectThresholdCondition(cl);
     else if (type == "time-counter")
         return new TimeCounterCondition(cl);
+    else if (type == "aggregate")
+        return new AggregateCondition(cl);
     else if (type == "ioport-rx")
         return new RxCondition(cl);
     else if (type == "ioport-connect")
@@ -1631,6 +1915,13 @@ bool AndCondition::evaluate()
     return true;
 }
 
+void AndCondition::collectObjects(std::set<Object*>& objects)
+{
+    ConditionsList_t::iterator it;
+    for(it=conditionsList_m.begin(); it != conditionsList_m.end(); ++it)
+        (*it)->collectObjects(objects);
+}
+
 void AndCondition::importXml(ticpp::Element* pConfig)
 {
     ticpp::Iterator< ticpp::Element > child("condition");
@@ -1684,6 +1975,13 @@ bool OrCondition::evaluate()
     return false;
 }
 
+void OrCondition::collectObjects(std::set<Object*>& objects)
+{
+    ConditionsList_t::iterator it;
+    for(it=conditionsList_m.begin(); it != conditionsList_m.end(); ++it)
+        (*it)->collectObjects(objects);
+}
+
 void OrCondition::importXml(ticpp::Element* pConfig)
 {
     ticpp::Iterator< ticpp::Element > child("condition");
@@ -1732,6 +2030,11 @@ bool NotCondition::evaluate()
     return !condition_m->evaluate();
 }
 
+void NotCondition::collectObjects(std::set<Object*>& objects)
+{
+    condition_m->collectObjects(objects);
+}
+
 void NotCondition::importXml(ticpp::Element* pConfig)
 {
     condition_m = Condition::create(pConfig->FirstChildElement("condition"), cl_m);
@@ -1787,6 +2090,11 @@ bool ObjectCondition::evaluate()
     return val;
 }
 
+void ObjectCondition::collectObjects(std::set<Object*>& objects)
+{
+    objects.insert(object_m);
+}
+
 void ObjectCondition::importXml(ticpp::Element* pConfig)
 {
     std::string trigger;
@@ -1893,6 +2201,12 @@ bool ObjectComparisonCondition::evaluate()
     return val;
 }
 
+void ObjectComparisonCondition::collectObjects(std::set<Object*>& objects)
+{
+    objects.insert(object_m);
+    objects.insert(object2_m);
+}
+
 void ObjectComparisonCondition::importXml(ticpp::Element* pConfig)
 {
     std::string trigger;
@@ -2039,6 +2353,13 @@ bool ObjectThresholdCondition::evaluate()
     return false;
 }
 
+void ObjectThresholdCondition::collectObjects(std::set<Object*>& objects)
+{
+    objects.insert(object_m);
+    if (condition_m)
+        condition_m->collectObjects(objects);
+}
+
 void ObjectThresholdCondition::importXml(ticpp::Element* pConfig)
 {
     if (!cl_m)
@@ -2117,6 +2438,324 @@ void ObjectThresholdCondition::statusXml(ticpp::Element* pStatus)
 }
 
 
+AggregateCondition::AggregateCondition(ChangeListener* cl)
+    : cl_m(cl), trigger_m(false), function_m(Any), op_m(ObjectCondition::eq),
+    minCount_m(-1), maxCount_m(-1), dirty_m(true), count_m(0), sum_m(0)
+{}
+
+AggregateCondition::~AggregateCondition()
+{
+    clear();
+}
+
+void AggregateCondition::clear()
+{
+    MemberMap_t::iterator it;
+    for (it = members_m.begin(); it != members_m.end(); it++)
+    {
+        delete it->second.value;
+        it->first->removeChangeListener(this);
+        it->first->decRefCount();
+    }
+    members_m.clear();
+    numbers_m.clear();
+    dirty_m = true;
+}
+
+void AggregateCondition::addMember(Object* object)
+{
+    if (members_m.find(object) != members_m.end())
+    {
+        object->decRefCount();
+        return;
+    }
+    Member member;
+    member.value = 0;
+    member.match = false;
+    member.number = 0;
+    if (function_m == Any || function_m == All || function_m == Count)
+    {
+        try
+        {
+            member.value = object->createObjectValue(value_m);
+        }
+        catch (...)
+        {
+            object->decRefCount();
+            throw;
+        }
+    }
+    members_m.insert(MemberMap_t::value_type(object, member));
+    object->addChangeListener(this);
+}
+
+bool AggregateCondition::compare(int res) const
+{
+    return ((op_m & ObjectCondition::eq) && (res == 0)) || ((op_m & ObjectCondition::lt) && (res == -1)) || ((op_m & ObjectCondition::gt) && (res == 1));
+}
+
+void AggregateCondition::update(Object* object, Member& member)
+{
+    if (member.value)
+    {
+        bool match = compare(object->get()->compare(member.value));
+        count_m += (int)match - (int)member.match;
+        member.match = match;
+    }
+    else
+    {
+        // NaN members are left out of the sum and of numbers_m
+        double number = object->get()->toNumber();
+        if (!std::isnan(member.number))
+        {
+            sum_m -= member.number;
+            numbers_m.erase(numbers_m.find(member.number));
+        }
+        if (!std::isnan(number))
+        {
+            sum_m += number;
+            numbers_m.insert(number);
+        }
+        member.number = number;
+    }
+}
+
+void AggregateCondition::refresh()
+{
+    count_m = 0;
+    sum_m = 0;
+    numbers_m.clear();
+    MemberMap_t::iterator it;
+    for (it = members_m.begin(); it != members_m.end(); it++)
+    {
+        Member& member = it->second;
+        if (member.value)
+        {
+            member.match = compare(it->first->get()->compare(member.value));
+            if (member.match)
+                count_m++;
+        }
+        else
+        {
+            member.number = it->first->get()->toNumber();
+            if (!std::isnan(member.number))
+            {
+                sum_m += member.number;
+                numbers_m.insert(member.number);
+            }
+        }
+    }
+    dirty_m = false;
+}
+
+double AggregateCondition::getNumber() const
+{
+    if (numbers_m.empty())
+        return NAN;
+    if (function_m == Avg)
+        return sum_m / numbers_m.size();
+    return function_m == Min ? *numbers_m.begin() : *numbers_m.rbegin();
+}
+
+bool AggregateCondition::evaluate()
+{
+    if (dirty_m)
+        refresh();
+    bool val;
+    switch (function_m)
+    {
+        case Any:
+            val = (count_m > 0);
+            break;
+        case All:
+            val = (count_m == (int)members_m.size());
+            break;
+        case Count:
+            val = (minCount_m < 0 || count_m >= minCount_m) && (maxCount_m < 0 || count_m <= maxCount_m);
+            break;
+        default:
+        {
+            if (members_m.empty())
+            {
+                val = false;
+                break;
+            }
+            double number = getNumber();
+            double ref = atof(value_m.c_str());
+            val = !std::isnan(number) && compare(number < ref ? -1 : (number > ref ? 1 : 0));
+        }
+    }
+    logger_m.infoStream() << "AggregateCondition (" << members_m.size() << " objects, "
+    << count_m << " matching) evaluated as '" << val << "'" << endlog;
+    return val;
+}
+
+void AggregateCondition::collectObjects(std::set<Object*>& objects)
+{
+    MemberMap_t::iterator it;
+    for (it = members_m.begin(); it != members_m.end(); it++)
+        objects.insert(it->first);
+}
+
+void AggregateCondition::onChange(Object* object)
+{
+    if (!dirty_m)
+    {
+        MemberMap_t::iterator it = members_m.find(object);
+        if (it != members_m.end())
+            update(object, it->second);
+    }
+    if (trigger_m)
+        cl_m->onChange(object);
+}
+
+void AggregateCondition::importXml(ticpp::Element* pConfig)
+{
+    clear();
+    ids_m.clear();
+
+    std::string function = pConfig->GetAttribute("function");
+    if (function == "" || function == "any")
+        function_m = Any;
+    else if (function == "all")
+        function_m = All;
+    else if (function == "count")
+        function_m = Count;
+    else if (function == "min")
+        function_m = Min;
+    else if (function == "max")
+        function_m = Max;
+    else if (function == "avg")
+        function_m = Avg;
+    else
+    {
+        std::stringstream msg;
+        msg << "AggregateCondition: function not supported: '" << function << "'";
+        throw ticpp::Exception(msg.str());
+    }
+
+    std::string op = pConfig->GetAttribute("op");
+    if (op == "" || op == "eq")
+        op_m = ObjectCondition::eq;
+    else if (op == "lt")
+        op_m = ObjectCondition::lt;
+    else if (op == "gt")
+        op_m = ObjectCondition::gt;
+    else if (op == "ne")
+        op_m = ObjectCondition::lt | ObjectCondition::gt;
+    else if (op == "lte")
+        op_m = ObjectCondition::lt | ObjectCondition::eq;
+    else if (op == "gte")
+        op_m = ObjectCondition::gt | ObjectCondition::eq;
+    else
+    {
+        std::stringstream msg;
+        msg << "AggregateCondition: operation not supported: '" << op << "'";
+        throw ticpp::Exception(msg.str());
+    }
+
+    value_m = pConfig->GetAttribute("value");
+    pConfig->GetAttributeOrDefault("min", &minCount_m, -1);
+    pConfig->GetAttributeOrDefault("max", &maxCount_m, -1);
+
+    std::string trigger = pConfig->GetAttribute("trigger");
+    trigger_m = (trigger == "true");
+    if (trigger_m && !cl_m)
+        throw ticpp::Exception("Trigger not supported in this context");
+
+    pattern_m = pConfig->GetAttribute("pattern");
+    std::list<Object*> objects;
+    if (pattern_m != "")
+        objects = ObjectController::instance()->getObjects();
+    try
+    {
+        ticpp::Iterator<ticpp::Element> child("object");
+        for (child = pConfig->FirstChildElement("object", false); child != child.end(); child++)
+        {
+            std::string id = child->GetAttribute("id");
+            ids_m.push_back(id);
+            addMember(ObjectController::instance()->getObject(id));
+        }
+        while (!objects.empty())
+        {
+            Object* object = objects.front();
+            objects.pop_front();
+            if (fnmatch(pattern_m.c_str(), object->getID(), 0) == 0)
+                addMember(object);
+            else
+                object->decRefCount();
+        }
+    }
+    catch (...)
+    {
+        // Release the members and the objects not matched yet
+        std::list<Object*>::iterator it;
+        for (it = objects.begin(); it != objects.end(); it++)
+            (*it)->decRefCount();
+        clear();
+        throw;
+    }
+
+    if (members_m.empty())
+        throw ticpp::Exception("AggregateCondition: no object matches");
+
+    logger_m.infoStream() << "AggregateCondition: configured with " << members_m.size() << " objects" << endlog;
+}
+
+void AggregateCondition::exportXml(ticpp::Element* pConfig)
+{
+    static const char* functions[] = { "any", "all", "count", "min", "max", "avg" };
+    pConfig->SetAttribute("type", "aggregate");
+    pConfig->SetAttribute("function", functions[function_m]);
+    if (op_m != ObjectCondition::eq)
+    {
+        std::string op;
+        if (op_m == ObjectCondition::lt)
+            op = "lt";
+        else if (op_m == ObjectCondition::gt)
+            op = "gt";
+        else if (op_m == (ObjectCondition::lt | ObjectCondition::eq))
+            op = "lte";
+        else if (op_m == (ObjectCondition::gt | ObjectCondition::eq))
+            op = "gte";
+        else
+            op = "ne";
+        pConfig->SetAttribute("op", op);
+    }
+    if (value_m != "")
+        pConfig->SetAttribute("value", value_m);
+    if (minCount_m >= 0)
+        pConfig->SetAttribute("min", minCount_m);
+    if (maxCount_m >= 0)
+        pConfig->SetAttribute("max", maxCount_m);
+    if (pattern_m != "")
+        pConfig->SetAttribute("pattern", pattern_m);
+    if (trigger_m)
+        pConfig->SetAttribute("trigger", "true");
+    std::list<std::string>::iterator it;
+    for (it = ids_m.begin(); it != ids_m.end(); it++)
+    {
+        ticpp::Element pElem("object");
+        pElem.SetAttribute("id", *it);
+        pConfig->LinkEndChild(&pElem);
+    }
+}
+
+void AggregateCondition::statusXml(ticpp::Element* pStatus)
+{
+    pStatus->SetAttribute("type", "aggregate");
+    pStatus->SetAttribute("objects", members_m.size());
+    if (!dirty_m)
+    {
+        if (function_m == Any || function_m == All || function_m == Count)
+            pStatus->SetAttribute("count", count_m);
+        else if (!members_m.empty())
+            pStatus->SetAttribute("value", getNumber());
+    }
+    if (trigger_m)
+        pStatus->SetAttribute("trigger", "true");
+}
+
 TimerCondition::TimerCondition(ChangeListener* cl)
         : PeriodicTask(cl), trigger_m(false), initVal_m(initValGuess)
 {}
@@ -2155,7 +2794,7 @@ void TimerCondition::importXml(ticpp::Element* pConfig)
         at_m = TimeSpec::create(at, this);
     }
     else if (every)
-        after_m = RuleServer::parseDuration(every->GetText());
+        after_m = RuleServer::parseLongDuration(every->GetText());
     else
         throw ticpp::Exception("Timer must define <at> or <every> elements");
 
@@ -2165,7 +2804,7 @@ void TimerCondition::importXml(ticpp::Element* pConfig)
         throw ticpp::Exception("Timer can't define <until> and <during> elements simultaneously");
     if (during)
     {
-        during_m = RuleServer::parseDuration(during->GetText());
+        during_m = RuleServer::parseLongDuration(during->GetText());
         if (every && after_m > during_m)
             after_m -= during_m;
         else if (every)
@@ -2219,10 +2858,10 @@ void TimerCondition::exportXml(ticpp::Element* pConfig)
     else
     {
         ticpp::Element pEvery("every");
-        int every = after_m;
+        int64_t every = after_m;
         if (during_m > 0)
             every += during_m;
-        pEvery.SetText(RuleServer::formatDuration(every));
+        pEvery.SetText(RuleServer::formatLongDuration(every));
         pConfig->LinkEndChild(&pEvery);
     }
 
@@ -2235,7 +2874,7 @@ void TimerCondition::exportXml(ticpp::Element* pConfig)
     else if (during_m != 0)
     {
         ticpp::Element pDuring("during");
-        pDuring.SetText(RuleServer::formatDuration(during_m));
+        pDuring.SetText(RuleServer::formatLongDuration(during_m));
         pConfig->LinkEndChild(&pDuring);
     }
 }
@@ -2259,7 +2898,7 @@ TimeCounterCondition::~TimeCounterCondition()
 
 bool TimeCounterCondition::evaluate()
 {
-    time_t now = time(0);
+    int64_t now = TimerManager::now();
     bool val = condition_m->evaluate(); 
     if (lastVal_m && (counter_m < threshold_m))
     {
@@ -2272,7 +2911,7 @@ bool TimeCounterCondition::evaluate()
         lastVal_m = true;
         if (counter_m < threshold_m)
         {
-            execTime_m = now + (threshold_m - counter_m) + 1;
+            setExecTime(now + (threshold_m - counter_m) + 1);
             Services::instance()->getTimerManager()->removeTask(this);
             reschedule(0);
         }
@@ -2281,7 +2920,7 @@ bool TimeCounterCondition::evaluate()
     {
         lastTime_m = now;
         lastVal_m = false;
-        execTime_m = now + resetDelay_m + 1;
+        setExecTime(now + resetDelay_m + 1);
         Services::instance()->getTimerManager()->removeTask(this);
         reschedule(0);
     }
@@ -2298,6 +2937,11 @@ bool TimeCounterCondition::evaluate()
     }
 }
 
+void TimeCounterCondition::collectObjects(std::set<Object*>& objects)
+{
+    condition_m->collectObjects(objects);
+}
+
 void TimeCounterCondition::onTimer(time_t time)
 {
     if (cl_m)
@@ -2308,8 +2952,8 @@ void TimeCounterCondition::importXml(ticpp::Element* pConfig)
 {
     if (!cl_m)
         throw ticpp::Exception("TimeCounter condition not supported in this context");
-    threshold_m = RuleServer::parseDuration(pConfig->GetAttribute("threshold"));
-    resetDelay_m = RuleServer::parseDuration(pConfig->GetAttribute("reset-delay"));
+    threshold_m = RuleServer::parseLongDuration(pConfig->GetAttribute("threshold"));
+    resetDelay_m = RuleServer::parseLongDuration(pConfig->GetAttribute("reset-delay"));
     condition_m = Condition::create(pConfig->FirstChildElement("condition"), cl_m);
 }
 
@@ -2317,9 +2961,9 @@ void TimeCounterCondition::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "time-counter");
     if (threshold_m != 0)
-        pConfig->SetAttribute("threshold", RuleServer::formatDuration(threshold_m));
+        pConfig->SetAttribute("threshold", RuleServer::formatLongDuration(threshold_m));
     if (resetDelay_m != 0)
-        pConfig->SetAttribute("reset-delay", RuleServer::formatDuration(resetDelay_m));
+        pConfig->SetAttribute("reset-delay", RuleServer::formatLongDuration(resetDelay_m));
 
     if (condition_m)
     {
@@ -2333,7 +2977,7 @@ void TimeCounterCondition::statusXml(ticpp::Element* pStatus)
 {
     pStatus->SetAttribute("type", "time-counter");
     FixedTimeTask::statusXml(pStatus);
-    pStatus->SetAttribute("counter", counter_m);
+    pStatus->SetAttribute("counter", counter_m / 1000);
     if (condition_m)
     {
         ticpp::Element pElem("condition");
@@ -2347,7 +2991,7 @@ void RuleInitializer::Run (pth_sem_t * stop)
     RuleServer::instance()->initialize();
 }
 
-void Rule::executeActions(ActionList &actions)
+bool Rule::executeActions(ActionList &actions)
 {
     for(ActionList::iterator it=actions.begin(); it != actions.end(); ++it)
     {
@@ -2355,6 +2999,7 @@ void Rule::executeActions(ActionList &actions)
     }
 
     logger_m.debugStream() << "Action list '" << actions.getTriggerTypeToString()  << "' executed for rule " << id_m << endlog;
+    return !actions.empty();
 }
 
 void ActionList::exportXml(ticpp::Element *pConfig)
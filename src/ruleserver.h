@@ -21,6 +21,7 @@
 #define RULESERVER_H
 
 #include <list>
+#include <set>
 #include <string>
 #include "config.h"
 #include "logger.h"
@@ -41,6 +42,8 @@ public:
     virtual void importXml(ticpp::Element* pConfig) = 0;
     virtual void exportXml(ticpp::Element* pConfig) = 0;
     virtual void statusXml(ticpp::Element* pStatus) = 0;
+    /** Adds the objects read by evaluate() to the set. */
+    virtual void collectObjects(std::set<Object*>& objects) {};
 
     typedef std::list<Condition*> ConditionsList_t;
 protected:
@@ -57,6 +60,7 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectObjects(std::set<Object*>& objects);
 
 private:
     ConditionsList_t conditionsList_m;
@@ -73,6 +77,7 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectObjects(std::set<Object*>& objects);
 
 private:
     ConditionsList_t conditionsList_m;
@@ -89,6 +94,7 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectObjects(std::set<Object*>& objects);
 
 private:
     Condition* condition_m;
@@ -105,18 +111,19 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectObjects(std::set<Object*>& objects);
 
-protected:
-    Object* object_m;
-    ChangeListener* cl_m;
-    bool trigger_m;
-    int op_m;
     enum Operation
     {
         eq = 0x01,
         gt = 0x02,
         lt = 0x04
     };
+protected:
+    Object* object_m;
+    ChangeListener* cl_m;
+    bool trigger_m;
+    int op_m;
 private:
     ObjectValue* value_m;
 };
@@ -131,6 +138,7 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectObjects(std::set<Object*>& objects);
 
 protected:
     Object* object2_m;
@@ -161,6 +169,7 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectObjects(std::set<Object*>& objects);
 
 protected:
     double refValue_m;
@@ -168,6 +177,62 @@ protected:
     Condition* condition_m;
 };
 
+/** Condition over a set of objects (explicit ids and/or an id pattern).
+ * Member values are cached and the aggregate is updated on each member
+ * change, so evaluating does not read every member again. */
+class AggregateCondition : public Condition, public ChangeListener
+{
+public:
+    AggregateCondition(ChangeListener* cl);
+    virtual ~AggregateCondition();
+
+    virtual bool evaluate();
+    virtual void importXml(ticpp::Element* pConfig);
+    virtual void exportXml(ticpp::Element* pConfig);
+    virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectObjects(std::set<Object*>& objects);
+    virtual void onChange(Object* object);
+
+private:
+    enum Function
+    {
+        Any,
+        All,
+        Count,
+        Min,
+        Max,
+        Avg
+    };
+    struct Member
+    {
+        ObjectValue* value;
+        bool match;
+        double number;
+    };
+    typedef std::map<Object*, Member> MemberMap_t;
+
+    void clear();
+    void addMember(Object* object);
+    void refresh();
+    void update(Object* object, Member& member);
+    bool compare(int res) const;
+    double getNumber() const;
+
+    ChangeListener* cl_m;
+    bool trigger_m;
+    Function function_m;
+    int op_m;
+    std::string value_m;
+    std::string pattern_m;
+    std::list<std::string> ids_m;
+    int minCount_m, maxCount_m;
+    MemberMap_t members_m;
+    bool dirty_m;
+    int count_m;
+    double sum_m;
+    std::multiset<double> numbers_m;
+};
+
 class TimerCondition : public Condition, public PeriodicTask
 {
 public:
@@ -200,22 +265,49 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectObjects(std::set<Object*>& objects);
 
 private:
     Condition* condition_m;
     ChangeListener* cl_m;
-    time_t lastTime_m;
+    /** Times and durations in ms. */
+    int64_t lastTime_m;
     bool lastVal_m;
-    int counter_m;
-    int threshold_m;
-    int resetDelay_m;
+    int64_t counter_m;
+    int64_t threshold_m;
+    int64_t resetDelay_m;
+};
+
+class Action;
+
+/** One execution of a sequenced action. It waits for its delay and between
+ * its steps on the shared TimerWheel. Steps that may block run in a thread
+ * of their own so that they don't hold up the wheel. */
+class ActionInstance : public WheelTask, protected Thread
+{
+public:
+    ActionInstance(Action* action) : action_m(action), step_m(0), now_m(0), running_m(false), cancelled_m(false) {};
+    virtual ~ActionInstance() {};
+
+    void cancel();
+    bool isFinished() { return !running_m && !isScheduled() && Thread::isFinished(); };
+private:
+    virtual void onWheelTimer(int64_t now);
+    virtual void Run (pth_sem_t * stop);
+    void runStep();
+
+    Action* action_m;
+    int step_m;
+    int64_t now_m;
+    bool running_m;
+    bool cancelled_m;
 };
 
 class Action : protected Thread
 {
 public:
     Action() : delay_m(0) {};
-    virtual ~Action() {};
+    virtual ~Action();
 
     static Action* create(ticpp::Element* pConfig);
     static Action* create(const std::string& type);
@@ -223,12 +315,28 @@ public:
     virtual void importXml(ticpp::Element* pConfig) = 0;
     virtual void exportXml(ticpp::Element* pConfig);
 
-    virtual void execute() { Start(true); };
-    virtual void cancel() { Stop(); };
-    virtual bool isFinished() { return Thread::isFinished(); };
+    virtual void execute();
+    virtual void cancel();
+    virtual bool isFinished();
 private:
-    virtual void Run (pth_sem_t * stop) = 0;
+    friend class ActionInstance;
+    virtual void Run (pth_sem_t *) {};
+    void removeFinished();
+    std::list<ActionInstance*> instances_m;
 protected:
+    /** Sequenced actions wait for their delay and between their steps on
+     * the shared TimerWheel instead of in a sleeping thread. Executing one
+     * that is still pending starts a concurrent instance. */
+    virtual bool isSequenced() { return false; };
+    /** Steps that only start or cancel other actions, or that switch an
+     * object whose value is already known, run directly on the TimerWheel
+     * thread. Any other step may end up in Object::read() and runs in a
+     * thread of its own. */
+    virtual bool isNonBlocking() { return false; };
+    /** Executes one step of the action, starting with step 0 once the delay
+     * has elapsed. Returns the delay in ms before the next step or -1 when
+     * the action is done. */
+    virtual int runStep(int) { return -1; };
     static bool sleep(int delay, pth_sem_t * stop);
     static bool usleep(int delay, pth_sem_t * stop);
     bool parseVarString(std::string &str, bool checkOnly = false);
@@ -246,7 +354,9 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual bool isNonBlocking() { return !object_m || object_m->isInitialized(); };
+    virtual int runStep(int step);
 
     UIntObject* object_m;
     unsigned int start_m, stop_m, duration_m;
@@ -262,7 +372,9 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual bool isNonBlocking() { return !object_m || object_m->isInitialized(); };
+    virtual int runStep(int step);
 
     Object* object_m;
     ObjectValue* value_m;
@@ -278,7 +390,8 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual int runStep(int step);
 
     Object* from_m;
     Object* to_m;
@@ -294,7 +407,9 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual bool isNonBlocking() { return !object_m || object_m->isInitialized(); };
+    virtual int runStep(int step);
 
     SwitchingObject* object_m;
 };
@@ -309,7 +424,8 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual int runStep(int step);
 
     Object *object_m, *x_m, *y_m;
     float a_m, b_m, c_m, m_m, n_m;
@@ -325,7 +441,8 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual int runStep(int step);
 
     Object* object_m;
     std::string value_m;
@@ -355,14 +472,16 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void onChange(Object* object);
+    virtual void execute();
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual bool isNonBlocking() { return !object_m || object_m->isInitialized(); };
+    virtual int runStep(int step);
 
     SwitchingObject* object_m;
     int delayOn_m, delayOff_m, count_m;
     Condition* stopCondition_m;
-    bool running_m;
 };
 
 class RepeatListAction : public Action
@@ -373,9 +492,13 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void cancel();
+    virtual bool isFinished();
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual bool isNonBlocking() { return true; };
+    virtual int runStep(int step);
 
     int period_m, count_m;
     typedef std::list<Action*> ActionsList_t;
@@ -390,9 +513,12 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void cancel();
+    virtual bool isFinished();
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual int runStep(int step);
 
     Condition *condition_m;
     typedef std::list<Action*> ActionsList_t;
@@ -478,7 +604,9 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual bool isNonBlocking() { return true; };
+    virtual int runStep(int step);
 
     std::string ruleId_m;
     bool list_m;
@@ -494,7 +622,9 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual bool isNonBlocking() { return true; };
+    virtual int runStep(int step);
 
     std::string ruleId_m;
 };
@@ -509,7 +639,9 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
 private:
-    virtual void Run (pth_sem_t * stop);
+    virtual bool isSequenced() { return true; };
+    virtual bool isNonBlocking() { return true; };
+    virtual int runStep(int step);
 
     std::string ruleId_m;
     bool active_m;
@@ -545,7 +677,7 @@ private:
     TriggerType triggerType_m;
 };
 
-class Rule : public ChangeListener
+class Rule : public ChangeListener, protected WheelTask
 {
 public:
     Rule();
@@ -555,6 +687,9 @@ public:
     virtual void updateXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    /** Configures this rule as the replacement of previous and takes over
+     * its state, including a pending debounce or rate limit. */
+    void reloadXml(ticpp::Element* pConfig, Rule* previous);
 
     virtual const char* getID() { return id_m.c_str(); };
     virtual void onChange(Object* object);
@@ -562,8 +697,17 @@ public:
     void evaluate();
     bool isActive() const {return (flags_m & Active) != 0;}
     void setActive(bool active);
+    /** Minimum time in ms the inputs must be stable before evaluating. */
+    void setDebounce(int debounce) { debounce_m = debounce; };
+    /** Minimum time in ms between two executions of the action lists. */
+    void setRateLimit(int rateLimit) { rateLimit_m = rateLimit; };
     void cancel();
     void initialize();
+    /** Initializes the rule now if the bus is ready, else sets the initial
+     * value from the init attribute. */
+    void initializeIfReady();
+    /** Adds the objects that initialize() will read to the set. */
+    void collectInitObjects(std::set<Object*>& objects);
 
     void executeActions(ActionList::TriggerType type)
     {
@@ -578,7 +722,10 @@ public:
     void addAction(Action *action, ActionList::TriggerType trigger);
 
 private:
-    void executeActions(ActionList &actions);
+    void configure(ticpp::Element* pConfig);
+    bool executeActions(ActionList &actions);
+    void evaluate(int64_t now);
+    virtual void onWheelTimer(int64_t now);
     ActionList &getActions(ActionList::TriggerType trigger);
     static void exportActions(ActionList &actions, ticpp::Element *pRuleConfig);
 
@@ -591,6 +738,10 @@ private:
     ActionList actionsOnFalse_m;
     ActionList actionsIfFalse_m;
     bool prevValue_m;
+    int debounce_m;
+    int rateLimit_m;
+    int64_t lastChange_m;
+    int64_t lastFired_m;
     enum Flags
     {
         None = 0x00,
@@ -619,19 +770,34 @@ public:
     virtual void statusXml(ticpp::Element* pStatus);
 
     void initialize();
+    /** Time in ms taken by the last initialize(), -1 if not done yet. */
+    int getReadyTime() const { return readyTime_m; };
     
     Rule *getRule(const char *id);
 
     static int parseDuration(const std::string& duration, bool allowNegative = false, bool useMilliseconds = false);
     static std::string formatDuration(int duration, bool useMilliseconds = false);
+    /** Same as parseDuration with useMilliseconds, but for durations that may
+     * be longer than what an int of ms can hold. */
+    static int64_t parseLongDuration(const std::string& duration);
+    static std::string formatLongDuration(int64_t duration);
 
 private:
     RuleServer();
     ~RuleServer();
     typedef std::pair<std::string ,Rule*> RuleIdPair_t;
     typedef std::map<std::string ,Rule*> RuleIdMap_t;
+    bool reloadRule(RuleIdMap_t::iterator it, ticpp::Element* pConfig);
     RuleIdMap_t rulesMap_m;
+    int readyTime_m;
+    int lastReloadTime_m;
+    int lastReloadCount_m;
+    /** Delay in ms between two read requests sent by initialize(). */
+    static const int InitReadPace = 20;
+    /** Time in ms to wait for answers after the last read request. */
+    static const int InitReadTimeout = 1000;
     static RuleServer* instance_m;
+    static Logger& logger_m;
 };
 
 class RuleInitializer : public Thread
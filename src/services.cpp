@@ -21,9 +21,12 @@
 #include "ioport.h"
 
 Services* Services::instance_m;
+uint64_t Services::configVersion_m;
 
 Services::Services() : xmlServer_m(0), persistentStorage_m(0)
-{}
+{
+    configVersion_m++;
+}
 
 Services::~Services()
 {
@@ -45,6 +48,7 @@ Services* Services::instance()
 void Services::start()
 {
     timers_m.startManager();
+    wheel_m.startWheel();
     knxConnection_m.startConnection();
 }
 
@@ -52,6 +56,7 @@ void Services::stop()
 {
     infoStream("Services") << "Stopping services" << endlog;
     timers_m.stopManager();
+    wheel_m.stopWheel();
     knxConnection_m.stopConnection();
 }
 
@@ -86,6 +91,9 @@ void Services::importXml(ticpp::Element* pConfig)
     ticpp::Element* pLocationInfo = pConfig->FirstChildElement("location", false);
     if (pLocationInfo)
         locationInfo_m.importXml(pLocationInfo);
+    ticpp::Element* pTimers = pConfig->FirstChildElement("timers", false);
+    if (pTimers)
+        timers_m.importXml(pTimers);
     ticpp::Element* pPersistence = pConfig->FirstChildElement("persistence", false);
     if (pPersistence)
     {
@@ -130,6 +138,11 @@ void Services::exportXml(ticpp::Element* pConfig)
         pConfig->LinkEndChild(&pLocationInfo);
     }
 
+    ticpp::Element pTimers("timers");
+    timers_m.exportXml(&pTimers);
+    if (pTimers.FirstAttribute(false))
+        pConfig->LinkEndChild(&pTimers);
+
     if (persistentStorage_m)
     {
         ticpp::Element pPersistence("persistence");
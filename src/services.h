@@ -52,11 +52,16 @@ public:
     SmsGateway* getSmsGateway() { return &smsGateway_m; };
     EmailGateway* getEmailGateway() { return &emailGateway_m; };
     TimerManager* getTimerManager() { return &timers_m; };
+    TimerWheel* getTimerWheel() { return &wheel_m; };
     ExceptionDays* getExceptionDays() { return &exceptionDays_m; };
     PersistentStorage* getPersistentStorage() { return persistentStorage_m; };
     LocationInfo* getLocationInfo() { return &locationInfo_m; };
     void setConfigFile(const char* filename) { if (filename) configFile_m = filename; };
     std::string getConfigFile() { return configFile_m; };
+    /** Version of the exported configuration, increased by every change
+     * of it at runtime and by a reset. */
+    uint64_t getConfigVersion() { return configVersion_m; };
+    void configChanged() { configVersion_m++; };
     void createDefault();
 
 private:
@@ -68,6 +73,7 @@ private:
     XmlServer *xmlServer_m;
     PersistentStorage *persistentStorage_m;
     TimerManager timers_m;
+    TimerWheel wheel_m;
     SmsGateway smsGateway_m;
     EmailGateway emailGateway_m;
     KnxConnection knxConnection_m;
@@ -75,6 +81,7 @@ private:
     LocationInfo locationInfo_m;
     
     std::string configFile_m;
+    static uint64_t configVersion_m;
 };
 
 #endif
@@ -24,6 +24,7 @@
 
 #include "suncalc.h"
 #include "services.h"
+#include "timezone.h"
 #include <stdio.h>
 #include <cmath>
 #include <time.h>
@@ -439,6 +440,7 @@ SolarTimeSpec::~SolarTimeSpec() {};
 SunriseTimeSpec::~SunriseTimeSpec() {};
 SunsetTimeSpec::~SunsetTimeSpec() {};
 SolarNoonTimeSpec::~SolarNoonTimeSpec() {};
+TwilightTimeSpec::~TwilightTimeSpec() {};
 
 void SunriseTimeSpec::exportXml(ticpp::Element* pConfig)
 {
@@ -458,6 +460,24 @@ void SolarNoonTimeSpec::exportXml(ticpp::Element* pConfig)
     SolarTimeSpec::exportXml(pConfig);
 }
 
+void TwilightTimeSpec::exportXml(ticpp::Element* pConfig)
+{
+    std::string type;
+    if (event_m == LocationInfo::CivilTwilight)
+        type = "civil";
+    else if (event_m == LocationInfo::NauticalTwilight)
+        type = "nautical";
+    else
+        type = "astronomical";
+    pConfig->SetAttribute("type", type + (dawn_m ? "-dawn" : "-dusk"));
+    SolarTimeSpec::exportXml(pConfig);
+}
+
+double TwilightTimeSpec::computeTime(double rise, double set) const
+{
+    return dawn_m ? rise : set;
+}
+
 double SunriseTimeSpec::computeTime(double rise, double set) const
 {
     return rise;
@@ -500,40 +520,34 @@ void SolarTimeSpec::getDay(const tm &current, int &mday, int &mon, int &year, in
     year = solarTime.getYear();
 }
 
+/** Converts a time in hours UT on the given day to local time. */
+static void toLocalTime(int year, int mon, int mday, double ut, int *hour, int *min)
+{
+    struct tm timeinfo;
+    memset(&timeinfo, 0, sizeof(timeinfo));
+    timeinfo.tm_year = year;
+    timeinfo.tm_mon = mon;
+    timeinfo.tm_mday = mday;
+    time_t time = TimeZone::makeUtc(&timeinfo) + (time_t)floor(ut * 60) * 60;
+    TimeZone::instance()->toLocal(time, &timeinfo);
+    *hour = timeinfo.tm_hour;
+    *min = timeinfo.tm_min;
+}
+
 void SolarTimeSpec::getTime(int mday, int mon, int year, int &min, int &hour) const
 {
     TimeSpec::getTime(mday, mon, year, min, hour);
 
     LocationInfo* params = Services::instance()->getLocationInfo();
-    double lon, lat;
-    params->getCoord(&lon, &lat);
 
     // Get sunrise/sunset in GMT.
     logger_m.infoStream() << "sun_rise_set date " << year+1900<< "-" << mon+1 << "-" << mday << endlog;
     double rise, set;
-    int rs = suncalc::sun_rise_set( year+1900, mon+1, mday, lon, lat, &rise, &set );
+    int rs = params->getSunTimes(getSunEvent(), year, mon, mday, &rise, &set);
 
     if (rs == 0)
     {
-        long tzOffset = params->getGmtOffset();
-        double res = computeTime(rise, set);
-        min = minutes(res + minutes((double)tzOffset/3600));
-        hour = hours(res + (double)tzOffset/3600);
-
-        // At this point, min and hour are expressed with DST off. Fix local
-        // time.
-        struct tm dateTime;
-        dateTime.tm_year = year;
-        dateTime.tm_mon = mon;
-        dateTime.tm_mday = mday;
-        dateTime.tm_hour = hour;
-        dateTime.tm_min = min;
-        dateTime.tm_sec = 0;
-        dateTime.tm_isdst = 0; // 0 because by definition, the time is currently expressed as if DST was off. mktime is going to fix that.
-        mktime(&dateTime);
-        hour = dateTime.tm_hour;
-        min = dateTime.tm_min;
-
+        toLocalTime(year, mon, mday, computeTime(rise, set), &hour, &min);
         logger_m.infoStream() << "sun_rise_set returned " << hour<< ":" <<min << endlog;
     }
     else
@@ -550,12 +564,9 @@ Logger& SolarInfo::logger_m(Logger::getInstance("SolarInfo"));
 SolarInfo::SolarInfo(struct tm * timeinfo) : rs_m(0), year_m(timeinfo->tm_year), mon_m(timeinfo->tm_mon), mday_m(timeinfo->tm_mday)
 {
     LocationInfo* params = Services::instance()->getLocationInfo();
-    double lon, lat;
-    params->getCoord(&lon, &lat);
-    tz_offset_m = params->getGmtOffset();
 
     logger_m.infoStream() << "SolarInfo date " << year_m+1900<< "-" <<mon_m+1 << "-" << mday_m << endlog;
-    rs_m  = suncalc::sun_rise_set( year_m+1900, mon_m+1, mday_m, lon, lat, &rise_m, &set_m );
+    rs_m = params->getSunTimes(LocationInfo::RiseSet, year_m, mon_m, mday_m, &rise_m, &set_m);
 }
 
 SolarInfo::~SolarInfo() {};
@@ -579,27 +590,7 @@ bool SolarInfo::get(double res, int *min, int *hour)
 {
     if (rs_m == 0)
     {
-        *min = minutes(res + minutes((double)tz_offset_m/3600));
-        *hour = hours(res + (double)tz_offset_m/3600);
-        if (*min < 0 || *hour < 0)
-        {
-            *min = 0;
-            *hour = 0;
-        }
-
-        // At this point, min and hour are expressed with DST off. Fix local
-        // time.
-        struct tm dateTime;
-        dateTime.tm_year = year_m;
-        dateTime.tm_mon = mon_m;
-        dateTime.tm_mday = mday_m;
-        dateTime.tm_hour = *hour;
-        dateTime.tm_min = *min;
-        dateTime.tm_sec = 0;
-        dateTime.tm_isdst = 0; // 0 because by definition, the time is currently expressed as if DST was off. mktime is going to fix that.
-        mktime(&dateTime);
-        *hour = dateTime.tm_hour;
-        *min = dateTime.tm_min;
+        toLocalTime(year_m, mon_m, mday_m, res, hour, min);
         logger_m.infoStream() << "returned " << *hour<< ":" << *min << endlog;
     }
     else
@@ -614,6 +605,7 @@ void LocationInfo::importXml(ticpp::Element* pConfig)
 {
     pConfig->GetAttributeOrDefault("lon", &lon_m, 0);
     pConfig->GetAttributeOrDefault("lat", &lat_m, 0);
+    ephemeris_m.clear();
 }
 
 void LocationInfo::exportXml(ticpp::Element* pConfig)
@@ -622,33 +614,42 @@ void LocationInfo::exportXml(ticpp::Element* pConfig)
     pConfig->SetAttribute("lat", lat_m);
 }
 
-/* The GMT offset calculation code below has been borrowed from the APR library
- * Licensed to the Apache Software Foundation (ASF) under one or more
- * contributor license agreements.  See the NOTICE file distributed with
- * this work for additional information regarding copyright ownership.
- * The ASF licenses this file to You under the Apache License, Version 2.0
- * (the "License"); you may not use this file except in compliance with
- * the License.  You may obtain a copy of the License at
- *
- *     http://www.apache.org/licenses/LICENSE-2.0
- *
- * Unless required by applicable law or agreed to in writing, software
- * distributed under the License is distributed on an "AS IS" BASIS,
- * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
- * See the License for the specific language governing permissions and
- * limitations under the License.
- */
-
 LocationInfo::LocationInfo() : lon_m(0), lat_m(0)
-{
-    // Get any time as reference and compute the broken-down GMT time.
-    // Then reverse the computation by interpreting the broken-down time as
-    // local time. The result is the 
-    time_t ref = 0;
-    gmtOffset_m = -mktime(gmtime(&ref));
-}
+{}
 
-long LocationInfo::getGmtOffset()
+int LocationInfo::getSunTimes(SunEvent event, int year, int mon, int mday, double *start, double *end)
 {
-    return gmtOffset_m;
+    int key = ((year + 1900) * 16 + mon) * 32 + mday;
+    EphemerisMap_t::iterator it = ephemeris_m.find(key);
+    if (it == ephemeris_m.end())
+    {
+        if (ephemeris_m.size() >= MaxEphemerisDays)
+            ephemeris_m.clear();
+        it = ephemeris_m.insert(EphemerisMap_t::value_type(key, DayEphemeris())).first;
+    }
+    DayEphemeris &day = it->second;
+    if (!(day.computed & (1 << event)))
+    {
+        double *s = &day.start[event];
+        double *e = &day.end[event];
+        switch (event)
+        {
+            case RiseSet:
+                day.rs[event] = suncalc::sun_rise_set(year+1900, mon+1, mday, lon_m, lat_m, s, e);
+                break;
+            case CivilTwilight:
+                day.rs[event] = suncalc::civil_twilight(year+1900, mon+1, mday, lon_m, lat_m, s, e);
+                break;
+            case NauticalTwilight:
+                day.rs[event] = suncalc::nautical_twilight(year+1900, mon+1, mday, lon_m, lat_m, s, e);
+                break;
+            case AstronomicalTwilight:
+                day.rs[event] = suncalc::astronomical_twilight(year+1900, mon+1, mday, lon_m, lat_m, s, e);
+                break;
+        }
+        day.computed |= 1 << event;
+    }
+    *start = day.start[event];
+    *end = day.end[event];
+    return day.rs[event];
 }
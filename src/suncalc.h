@@ -22,12 +22,54 @@
 
 #include <list>
 #include <string>
+#include <map>
 #include "config.h"
 #include "logger.h"
 #include "objectcontroller.h"
 #include "ruleserver.h"
 #include "ticpp.h"
 
+class LocationInfo
+{
+public:
+    /** Sun altitudes for which rise and set times can be computed. */
+    enum SunEvent
+    {
+        RiseSet,
+        CivilTwilight,
+        NauticalTwilight,
+        AstronomicalTwilight
+    };
+
+    LocationInfo();
+    void importXml(ticpp::Element* pConfig);
+    void exportXml(ticpp::Element* pConfig);
+    void getCoord(double *lon, double *lat) { *lon = lon_m; *lat = lat_m; };
+    void setCoord(double lon, double lat) { lon_m = lon; lat_m = lat; ephemeris_m.clear(); };
+    bool isEmpty() { return lon_m==0 && lat_m==0; };
+
+    /** Gets start and end of the event in hours UT for the given day. Each
+     * day is computed once and cached until the location changes. Returns
+     * 0 on success, like sun_rise_set. */
+    int getSunTimes(SunEvent event, int year, int mon, int mday, double *start, double *end);
+
+protected:
+    double lon_m, lat_m;
+
+private:
+    /** About two years of days. */
+    static const unsigned int MaxEphemerisDays = 800;
+    struct DayEphemeris
+    {
+        DayEphemeris() : computed(0) {};
+        int computed;
+        int rs[4];
+        double start[4], end[4];
+    };
+    typedef std::map<int, DayEphemeris> EphemerisMap_t;
+    EphemerisMap_t ephemeris_m;
+};
+
 class SolarTimeSpec : public TimeSpec
 {
 public:
@@ -37,8 +79,10 @@ public:
 public:
     virtual void getDay(const tm &current, int &mday, int &mon, int &year, int &wdays) const;
     virtual void getTime(int mday, int mon, int year, int &min, int &hour) const;
+    virtual bool isStatic() const { return false; }
 
 protected:
+    virtual LocationInfo::SunEvent getSunEvent() const { return LocationInfo::RiseSet; };
     virtual double computeTime(double rise, double set) const = 0;
 
 private:
@@ -75,6 +119,21 @@ protected:
 
 };
 
+/** Start (dawn) or end (dusk) of civil, nautical or astronomical twilight. */
+class TwilightTimeSpec : public SolarTimeSpec
+{
+public:
+    TwilightTimeSpec(LocationInfo::SunEvent event, bool dawn) : event_m(event), dawn_m(dawn) {};
+    virtual ~TwilightTimeSpec();
+    virtual void exportXml(ticpp::Element* pConfig);
+protected:
+    virtual LocationInfo::SunEvent getSunEvent() const { return event_m; };
+    virtual double computeTime(double rise, double set) const;
+private:
+    LocationInfo::SunEvent event_m;
+    bool dawn_m;
+};
+
 class SolarInfo
 {
 public:
@@ -91,24 +150,7 @@ private:
 	int year_m;
 	int mon_m;
 	int mday_m;
-    long tz_offset_m;
     static Logger& logger_m;
 };
 
-class LocationInfo
-{
-public:
-    LocationInfo();
-    void importXml(ticpp::Element* pConfig);
-    void exportXml(ticpp::Element* pConfig);
-    void getCoord(double *lon, double *lat) { *lon = lon_m; *lat = lat_m; };
-    void setCoord(double lon, double lat) { lon_m = lon; lat_m = lat; };
-    long getGmtOffset();
-    bool isEmpty() { return lon_m==0 && lat_m==0; };
-
-protected:
-    double lon_m, lat_m;
-    long gmtOffset_m;
-};
-
 #endif
@@ -20,9 +20,16 @@
 #include "timermanager.h"
 #include "suncalc.h"
 #include "services.h"
+#include "timezone.h"
 #include <iostream>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <sys/time.h>
 #include <iomanip>
+#include <fstream>
+#include <algorithm>
+#include <set>
 
 Logger& TimerManager::logger_m(Logger::getInstance("TimerManager"));
 
@@ -113,7 +120,7 @@ time_t DateTime::getTime(tm *outBrokenDownTime) const
     t->tm_sec = 0;
     t->tm_isdst = -1;
 
-    time_t time = mktime(t);
+    time_t time = TimeZone::instance()->toUtc(t);
     if (outBrokenDownTime == NULL)
     {
         delete t;
@@ -279,91 +286,569 @@ void DateTime::resetFieldIfFree(FieldType field, bool recurses)
 }
 
 TimerManager::TimerManager()
-{}
+    : seq_m(0), nextWakeup_m(-1), catchUp_m(Skip), tolerance_m(60000),
+    firedCount_m(0), lateSum_m(0), lateMax_m(0), lateCount_m(0), skippedCount_m(0),
+    clockJumps_m(0), lastClock_m(-1), lastMonotonic_m(-1),
+    removedFloor_m(0), revision_m(0), nextId_m(1)
+{
+    pth_sem_init(&wakeup_m);
+}
+
+void TimerManager::importXml(ticpp::Element* pConfig)
+{
+    std::string catchUp = pConfig->GetAttribute("catch-up");
+    if (catchUp == "fire-all")
+        catchUp_m = FireAll;
+    else if (catchUp == "fire-latest")
+        catchUp_m = FireLatest;
+    else if (catchUp == "skip" || catchUp == "")
+        catchUp_m = Skip;
+    else
+    {
+        std::stringstream msg;
+        msg << "TimerManager: Bad catch-up policy: '" << catchUp << "'" << std::endl;
+        throw ticpp::Exception(msg.str());
+    }
+    std::string tolerance = pConfig->GetAttribute("tolerance");
+    tolerance_m = tolerance == "" ? 60000 : RuleServer::parseDuration(tolerance, false, true);
+}
+
+void TimerManager::exportXml(ticpp::Element* pConfig)
+{
+    if (catchUp_m == FireAll)
+        pConfig->SetAttribute("catch-up", "fire-all");
+    else if (catchUp_m == FireLatest)
+        pConfig->SetAttribute("catch-up", "fire-latest");
+    if (tolerance_m != 60000)
+        pConfig->SetAttribute("tolerance", RuleServer::formatDuration(tolerance_m, true));
+}
 
 TimerManager::~TimerManager()
 {
     StopDelete ();
 }
 
+int64_t TimerManager::now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
 TimerManager::TimerCheck TimerManager::checkTaskList(time_t now)
 {
-    if (taskList_m.empty())
+    return checkTasks((int64_t)now * 1000);
+}
+
+TimerManager::TimerCheck TimerManager::checkTasks(int64_t now)
+{
+    if (heap_m.empty())
         return Long;
 
-    TimerTask* first = taskList_m.front();
-    time_t nextExec = first->getExecTime();
+    TimerTask* first = heap_m.front().task;
+    int64_t nextExec = heap_m.front().deadline;
+    unsigned long seq = heap_m.front().seq;
     if (nextExec > now)
         return Short;
 
-    if (nextExec > now-60)
+    if (nextExec > now-tolerance_m)
     {
-        logger_m.infoStream() << "TimerTask execution. " << nextExec << endlog;
-        first->onTimer(now);
+        logger_m.infoStream() << "TimerTask execution. " << nextExec / 1000 << endlog;
+        first->onTimer(now / 1000);
+    }
+    else if (catchUp_m == Skip)
+    {
+        logger_m.warnStream() << "TimerTask skipped due to clock skew or heavy load. " << nextExec / 1000 << endlog;
+        skippedCount_m++;
     }
     else
-        logger_m.warnStream() << "TimerTask skipped due to clock skew or heavy load. " << nextExec << endlog;
+    {
+        logger_m.warnStream() << "Late TimerTask execution due to clock skew or heavy load. " << nextExec / 1000 << endlog;
+        lateCount_m++;
+        if (catchUp_m == FireLatest)
+            first->onCatchUp(now / 1000);
+        else
+            first->onTimer(now / 1000);
+    }
 
-    if (first == taskList_m.front())
+    if (!heap_m.empty() && heap_m.front().seq == seq)
     {
-        // If the taskList was modified, do not remove the first item
-        // because it's not the one we just called onTimer for.
-        taskList_m.pop_front();
-        first->reschedule(now);
+        // If the task was rescheduled by onTimer or another task is now
+        // first, do not remove it because it's not the one we just called
+        // onTimer for.
+        unlink(first);
+        first->reschedule(now / 1000);
+        if (first->heapIndex_m < 0)
+            logRemoval(first);
     }
     return Immediate;
 }
 
+int64_t TimerManager::processTasks(int64_t now)
+{
+    // Tasks rescheduled at or before 'now' are left for the next call so
+    // that a misbehaving task cannot keep the loop from sleeping.
+    int count = heap_m.size();
+    while (count-- > 0 && !heap_m.empty() && heap_m.front().deadline <= now)
+    {
+        int64_t late = now - heap_m.front().deadline;
+        int skipped = skippedCount_m;
+        if (checkTasks(now) != Immediate)
+            break;
+        if (skippedCount_m != skipped)
+            continue;
+        firedCount_m++;
+        lateSum_m += late;
+        if (late > lateMax_m)
+            lateMax_m = late;
+    }
+    if (heap_m.empty())
+        return -1;
+    int64_t delay = heap_m.front().deadline - now;
+    return delay > 0 ? delay : 0;
+}
+
+void TimerManager::checkClock(int64_t now, int64_t monotonicNow)
+{
+    int64_t drift = 0;
+    if (lastClock_m != -1)
+        drift = (now - lastClock_m) - (monotonicNow - lastMonotonic_m);
+    lastClock_m = now;
+    lastMonotonic_m = monotonicNow;
+    if (drift > -1000 && drift < 1000)
+        return;
+
+    clockJumps_m++;
+    logger_m.warnStream() << "Clock jump of " << drift / 1000 << "s detected" << endlog;
+
+    // Durations keep their remaining time. Dates and times are computed
+    // again after a jump backwards, those now due after a jump forwards
+    // are handled by the catch-up policy.
+    TaskHeap_t tasks(heap_m);
+    std::sort(tasks.begin(), tasks.end());
+    TaskHeap_t::iterator it;
+    for (it = tasks.begin(); it != tasks.end(); it++)
+        unlink((*it).task);
+    for (it = tasks.begin(); it != tasks.end(); it++)
+    {
+        TimerTask* task = (*it).task;
+        if (task->shiftDeadline(drift) || drift > 0)
+            addTask(task);
+        else
+        {
+            task->reschedule(now / 1000);
+            if (task->heapIndex_m < 0)
+                logRemoval(task);
+        }
+    }
+}
+
 void TimerManager::Run (pth_sem_t * stop1)
 {
     pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t wakeup = pth_event (PTH_EVENT_SEM, &wakeup_m);
+    pth_event_concat (stop, wakeup, NULL);
     logger_m.debugStream() << "Starting TimerManager loop." << endlog;
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
     while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
     {
-        TimerCheck interval = checkTaskList(time(0));
-        if (interval == Immediate)
-            tv.tv_sec = 0;
-        else if (interval == Short)
-            tv.tv_sec = 1;
+        pth_sem_set_value (&wakeup_m, 0);
+        checkClock(now(), TimerWheel::now());
+        int64_t delay = processTasks(now());
+        if (delay == -1)
+        {
+            nextWakeup_m = -1;
+            pth_select_ev(0,0,0,0,NULL,stop);
+        }
         else
-            tv.tv_sec = 10;
-        pth_select_ev(0,0,0,0,&tv,stop);
+        {
+            nextWakeup_m = heap_m.front().deadline;
+            if (delay > MaxSleep)
+                delay = MaxSleep;
+            struct timeval tv;
+            tv.tv_sec = delay / 1000;
+            tv.tv_usec = (delay % 1000) * 1000;
+            pth_select_ev(0,0,0,0,&tv,stop);
+        }
     }
+    nextWakeup_m = -1;
     logger_m.debugStream() << "Out of TimerManager loop." << endlog;
+    pth_event_isolate (wakeup);
+    pth_event_free (wakeup, PTH_FREE_THIS);
     pth_event_free (stop, PTH_FREE_THIS);
 }
 
-void TimerManager::addTask(TimerTask* task)
+void TimerManager::place(int idx, const HeapEntry& entry)
+{
+    heap_m[idx] = entry;
+    entry.task->heapIndex_m = idx;
+}
+
+void TimerManager::siftUp(int idx)
+{
+    HeapEntry entry = heap_m[idx];
+    while (idx > 0)
+    {
+        int parent = (idx - 1) / 2;
+        if (!(entry < heap_m[parent]))
+            break;
+        place(idx, heap_m[parent]);
+        idx = parent;
+    }
+    place(idx, entry);
+}
+
+void TimerManager::siftDown(int idx)
 {
-    TaskList_t::iterator it;
-    time_t execTime = task->getExecTime();
-    for (it = taskList_m.begin(); it != taskList_m.end(); it++)
+    HeapEntry entry = heap_m[idx];
+    int size = heap_m.size();
+    while (true)
     {
-        if (execTime < (*it)->getExecTime())
+        int child = 2 * idx + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size && heap_m[child + 1] < heap_m[child])
+            child++;
+        if (!(heap_m[child] < entry))
             break;
+        place(idx, heap_m[child]);
+        idx = child;
     }
-    taskList_m.insert(it, task);
+    place(idx, entry);
+}
+
+void TimerManager::addTask(TimerTask* task)
+{
+    if (task->heapIndex_m >= 0)
+        unlink(task);
+    if (task->statusId_m == 0)
+        task->statusId_m = nextId_m++;
+    task->statusRevision_m = ++revision_m;
+    HeapEntry entry;
+    entry.deadline = (int64_t)task->getExecTime() * 1000 + task->getExecMillis();
+    entry.seq = seq_m++;
+    entry.task = task;
+    heap_m.push_back(entry);
+    siftUp(heap_m.size() - 1);
+    // Wake up the loop if it sleeps past the new deadline.
+    if (task->heapIndex_m == 0 && (nextWakeup_m == -1 || entry.deadline < nextWakeup_m))
+        pth_sem_inc(&wakeup_m, FALSE);
 }
 
 void TimerManager::removeTask(TimerTask* task)
 {
-    taskList_m.remove(task);
+    int idx = task->heapIndex_m;
+    if (idx < 0 || idx >= (int)heap_m.size() || heap_m[idx].task != task)
+        return;
+    unlink(task);
+    logRemoval(task);
+}
+
+void TimerManager::unlink(TimerTask* task)
+{
+    int idx = task->heapIndex_m;
+    task->heapIndex_m = -1;
+    HeapEntry last = heap_m.back();
+    heap_m.pop_back();
+    if (idx == (int)heap_m.size())
+        return;
+    place(idx, last);
+    if (idx > 0 && last < heap_m[(idx - 1) / 2])
+        siftUp(idx);
+    else
+        siftDown(idx);
+}
+
+void TimerManager::logRemoval(TimerTask* task)
+{
+    task->statusRevision_m = ++revision_m;
+    removed_m.push_back(std::make_pair(revision_m, task->statusId_m));
+    if (removed_m.size() > MaxRemovedLog)
+    {
+        removedFloor_m = removed_m.front().first;
+        removed_m.pop_front();
+    }
+}
+
+/** Parses a time given in seconds since the epoch or as local
+ * "YYYY-MM-DD HH:MM:SS" and returns it in ms, or def if empty. */
+static int64_t parseStatusTime(const std::string& value, int64_t def)
+{
+    if (value == "")
+        return def;
+    struct tm timeinfo;
+    memset(&timeinfo, 0, sizeof(timeinfo));
+    char extra;
+    long long secs;
+    if (sscanf(value.c_str(), "%d-%d-%d %d:%d:%d%c", &timeinfo.tm_year, &timeinfo.tm_mon, &timeinfo.tm_mday,
+               &timeinfo.tm_hour, &timeinfo.tm_min, &timeinfo.tm_sec, &extra) >= 3)
+    {
+        timeinfo.tm_year -= 1900;
+        timeinfo.tm_mon -= 1;
+        timeinfo.tm_isdst = -1;
+        return (int64_t)TimeZone::instance()->toUtc(&timeinfo) * 1000;
+    }
+    if (sscanf(value.c_str(), "%lld%c", &secs, &extra) == 1)
+        return (int64_t)secs * 1000;
+    std::stringstream msg;
+    msg << "TimerManager: Bad time in status request: '" << value << "'" << std::endl;
+    throw ticpp::Exception(msg.str());
 }
 
 void TimerManager::statusXml(ticpp::Element* pStatus)
 {
-    TaskList_t::iterator it;
-    for (it = taskList_m.begin(); it != taskList_m.end(); it++)
+    int64_t from = parseStatusTime(pStatus->GetAttribute("from"), 0);
+    int64_t to = parseStatusTime(pStatus->GetAttribute("to"), -1);
+    std::string owner = pStatus->GetAttribute("owner");
+    unsigned int offset, limit;
+    pStatus->GetAttributeOrDefault("offset", &offset, 0);
+    pStatus->GetAttributeOrDefault("limit", &limit, 0);
+    bool isDelta = pStatus->GetAttribute("since") != "";
+    unsigned long since = 0;
+    if (isDelta)
+    {
+        pStatus->GetAttribute("since", &since);
+        if (since < removedFloor_m || since > revision_m)
+        {
+            // Changes since then are not known anymore, send everything.
+            pStatus->SetAttribute("reset", "true");
+            isDelta = false;
+        }
+    }
+
+    pStatus->SetAttribute("fired", firedCount_m);
+    pStatus->SetAttribute("late", lateCount_m);
+    pStatus->SetAttribute("skipped", skippedCount_m);
+    if (clockJumps_m > 0)
+        pStatus->SetAttribute("clock-jumps", clockJumps_m);
+    if (firedCount_m > 0)
+    {
+        pStatus->SetAttribute("late-avg", lateSum_m / firedCount_m);
+        pStatus->SetAttribute("late-max", lateMax_m);
+    }
+    pStatus->SetAttribute("revision", revision_m);
+
+    // Removals come first, a task removed then added again is listed
+    // after its removal.
+    std::set<unsigned long> removed;
+    if (isDelta)
+    {
+        RemovedLog_t::iterator it = std::upper_bound(removed_m.begin(), removed_m.end(),
+                                                     std::make_pair(since, (unsigned long)-1));
+        for (; it != removed_m.end(); it++)
+        {
+            if (!removed.insert((*it).second).second)
+                continue;
+            ticpp::Element pElem("removed");
+            pElem.SetAttribute("id", (*it).second);
+            pStatus->LinkEndChild(&pElem);
+        }
+    }
+
+    TaskHeap_t tasks;
+    TaskHeap_t::iterator it;
+    for (it = heap_m.begin(); it != heap_m.end(); it++)
+    {
+        TimerTask* task = (*it).task;
+        if (isDelta && task->statusRevision_m <= since)
+            continue;
+        bool match = (*it).deadline >= from && (to == -1 || (*it).deadline <= to);
+        if (match && owner != "")
+        {
+            const char* id = task->getOwnerID();
+            match = id && owner == id;
+        }
+        if (match)
+            tasks.push_back(*it);
+        else if (isDelta && removed.insert(task->statusId_m).second)
+        {
+            // The client may have it from when it was in the window
+            ticpp::Element pElem("removed");
+            pElem.SetAttribute("id", task->statusId_m);
+            pStatus->LinkEndChild(&pElem);
+        }
+    }
+    pStatus->SetAttribute("total", tasks.size());
+
+    unsigned int end = tasks.size();
+    if (limit > 0 && offset + limit < end)
+        end = offset + limit;
+    if (offset >= end)
+        return;
+    std::partial_sort(tasks.begin(), tasks.begin() + end, tasks.end());
+    for (it = tasks.begin() + offset; it != tasks.begin() + end; it++)
     {
         ticpp::Element pElem("task");
-        (*it)->statusXml(&pElem);
+        (*it).task->statusXml(&pElem);
+        pElem.SetAttribute("id", (*it).task->statusId_m);
         pStatus->LinkEndChild(&pElem);
     }
 }
 
+void WheelLink::linkBefore(WheelLink* node)
+{
+    prev_m = node->prev_m;
+    next_m = node;
+    node->prev_m->next_m = this;
+    node->prev_m = this;
+}
+
+void WheelLink::unlink()
+{
+    prev_m->next_m = next_m;
+    next_m->prev_m = prev_m;
+    prev_m = next_m = this;
+}
+
+WheelTask::~WheelTask()
+{
+    if (wheel_m)
+        wheel_m->cancel(this);
+}
+
+Logger& TimerWheel::logger_m(Logger::getInstance("TimerWheel"));
+
+TimerWheel::TimerWheel(int resolution, int slots)
+    : resolution_m(resolution > 0 ? resolution : 1), count_m(0), nextWakeup_m(-1)
+{
+    // Slot count must be a power of two to map ticks with a simple mask.
+    slotCount_m = 1;
+    while (slotCount_m < slots)
+        slotCount_m <<= 1;
+    slots_m = new WheelLink[slotCount_m];
+    current_m = now();
+    pth_sem_init(&wakeup_m);
+}
+
+TimerWheel::~TimerWheel()
+{
+    Stop ();
+    for (int i = 0; i < slotCount_m; i++)
+    {
+        while (slots_m[i].isLinked())
+            cancel(static_cast<WheelTask*>(slots_m[i].next_m));
+    }
+    delete[] slots_m;
+}
+
+int64_t TimerWheel::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void TimerWheel::schedule(WheelTask* task, int64_t deadline)
+{
+    if (task->wheel_m)
+        cancel(task);
+    task->deadline_m = deadline;
+    task->wheel_m = this;
+    // A deadline already in the past goes in the current slot so that the
+    // next call to advance() fires it.
+    task->linkBefore(&getSlot(deadline < current_m ? current_m : deadline));
+    count_m++;
+    if (nextWakeup_m == -1 || deadline < nextWakeup_m)
+        pth_sem_inc(&wakeup_m, FALSE);
+}
+
+void TimerWheel::cancel(WheelTask* task)
+{
+    if (task->wheel_m != this)
+        return;
+    task->unlink();
+    task->wheel_m = 0;
+    count_m--;
+}
+
+int TimerWheel::advance(int64_t now)
+{
+    if (count_m == 0 || now < current_m)
+    {
+        if (now > current_m)
+            current_m = now;
+        return 0;
+    }
+
+    // Move due tasks to a separate list first so that callbacks are free to
+    // schedule or cancel any task, including the ones about to be fired.
+    WheelLink expired;
+    int64_t tick = current_m / resolution_m;
+    int64_t last = now / resolution_m;
+    if (last - tick >= slotCount_m)
+        tick = last - slotCount_m + 1;
+    for (; tick <= last; tick++)
+    {
+        WheelLink& slot = slots_m[tick & (slotCount_m - 1)];
+        WheelLink* link = slot.next_m;
+        while (link != &slot)
+        {
+            WheelLink* next = link->next_m;
+            if (static_cast<WheelTask*>(link)->deadline_m <= now)
+            {
+                link->unlink();
+                link->linkBefore(&expired);
+            }
+            link = next;
+        }
+    }
+    current_m = now;
+
+    int fired = 0;
+    while (expired.isLinked())
+    {
+        WheelTask* task = static_cast<WheelTask*>(expired.next_m);
+        cancel(task);
+        task->onWheelTimer(now);
+        fired++;
+    }
+    return fired;
+}
+
+int64_t TimerWheel::getNextTick(int64_t now) const
+{
+    if (count_m == 0)
+        return -1;
+    int64_t tick = (now > current_m ? now : current_m) / resolution_m;
+    for (int i = 0; i < slotCount_m; i++, tick++)
+    {
+        // Wake up at the end of the slot so that every task it holds for
+        // the current round is due.
+        if (slots_m[tick & (slotCount_m - 1)].isLinked())
+            return (tick + 1) * resolution_m;
+    }
+    return -1;
+}
+
+void TimerWheel::Run (pth_sem_t * stop1)
+{
+    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t wakeup = pth_event (PTH_EVENT_SEM, &wakeup_m);
+    pth_event_concat (stop, wakeup, NULL);
+    logger_m.debugStream() << "Starting TimerWheel loop." << endlog;
+    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    {
+        pth_sem_set_value (&wakeup_m, 0);
+        int64_t now = TimerWheel::now();
+        advance(now);
+        nextWakeup_m = getNextTick(now);
+        if (nextWakeup_m == -1)
+            pth_select_ev(0,0,0,0,NULL,stop);
+        else
+        {
+            struct timeval tv;
+            int64_t delay = nextWakeup_m > now ? nextWakeup_m - now : 0;
+            tv.tv_sec = delay / 1000;
+            tv.tv_usec = (delay % 1000) * 1000;
+            pth_select_ev(0,0,0,0,&tv,stop);
+        }
+    }
+    nextWakeup_m = -1;
+    logger_m.debugStream() << "Out of TimerWheel loop." << endlog;
+    pth_event_isolate (wakeup);
+    pth_event_free (wakeup, PTH_FREE_THIS);
+    pth_event_free (stop, PTH_FREE_THIS);
+}
+
 TimeSpec* TimeSpec::create(const std::string& type, ChangeListener* cl)
 {
     if (type == "variable")
@@ -374,6 +859,18 @@ TimeSpec* TimeSpec::create(const std::string& type, ChangeListener* cl)
         return new SunsetTimeSpec();
     if (type == "noon")
         return new SolarNoonTimeSpec();
+    if (type == "civil-dawn")
+        return new TwilightTimeSpec(LocationInfo::CivilTwilight, true);
+    if (type == "civil-dusk")
+        return new TwilightTimeSpec(LocationInfo::CivilTwilight, false);
+    if (type == "nautical-dawn")
+        return new TwilightTimeSpec(LocationInfo::NauticalTwilight, true);
+    if (type == "nautical-dusk")
+        return new TwilightTimeSpec(LocationInfo::NauticalTwilight, false);
+    if (type == "astronomical-dawn")
+        return new TwilightTimeSpec(LocationInfo::AstronomicalTwilight, true);
+    if (type == "astronomical-dusk")
+        return new TwilightTimeSpec(LocationInfo::AstronomicalTwilight, false);
     else
         return new TimeSpec();
 }
@@ -419,6 +916,13 @@ void TimeSpec::checkIsValid() const
     }
 }
 
+bool TimeSpec::isSameAs(const TimeSpec &other) const
+{
+    return min_m == other.min_m && hour_m == other.hour_m && mday_m == other.mday_m &&
+        mon_m == other.mon_m && year_m == other.year_m && wdays_m == other.wdays_m &&
+        offset_m == other.offset_m && exception_m == other.exception_m;
+}
+
 bool TimeSpec::isValid() const
 {
     bool hasDay = mday_m != -1;
@@ -436,8 +940,8 @@ bool TimeSpec::isValid() const
         timeinfo.tm_sec = 0;
         timeinfo.tm_isdst = -1;
 
-        // Use C Library to resolve the time spec.
-        mktime(&timeinfo);
+        // Normalize the fields to resolve the time spec.
+        TimeZone::instance()->toUtc(&timeinfo);
 
         // Make sure that did not change the time spec or it is not deemed
         // valid.
@@ -695,9 +1199,11 @@ void VariableTimeSpec::getDataFromObject(int &min, int &hour, int &mday, int &mo
 }
 
 Logger& PeriodicTask::logger_m(Logger::getInstance("PeriodicTask"));
+unsigned long PeriodicTask::findNextCount_m = 0;
+unsigned long PeriodicTask::findNextHits_m = 0;
 
 PeriodicTask::PeriodicTask(ChangeListener* cl)
-        : at_m(0), until_m(0), during_m(0), after_m(-1), nextExecTime_m(0), cl_m(cl), value_m(false)
+        : at_m(0), until_m(0), during_m(0), after_m(-1), nextExecTime_m(0), nextExecMillis_m(0), cl_m(cl), value_m(false)
 {}
 
 PeriodicTask::~PeriodicTask()
@@ -722,65 +1228,93 @@ void PeriodicTask::onTimer(time_t time)
     }
 }
 
+void PeriodicTask::onCatchUp(time_t time)
+{
+    if (during_m == 0)
+    {
+        // A missed pulse is sent once.
+        onTimer(time);
+        return;
+    }
+    // Compute the current state as on first schedule and only notify if it
+    // differs from the one before the missed executions.
+    bool value = value_m;
+    Services::instance()->getTimerManager()->removeTask(this);
+    nextExecTime_m = 0;
+    reschedule(time);
+    if (value_m != value && cl_m)
+        cl_m->onChange(0);
+}
+
 void PeriodicTask::onChange(Object* object)
 {
     Services::instance()->getTimerManager()->removeTask(this);
     reschedule(0);
 }
 
-void PeriodicTask::reschedule(time_t now)
+void PeriodicTask::reschedule(time_t from)
 {
-    if (now == 0)
-        now = time(0);
+    // Work in ms. When called back by TimerManager for the current
+    // execution, start from its exact deadline so that periods don't drift.
+    int64_t now;
+    if (from == 0)
+        now = TimerManager::now();
+    else if (from == nextExecTime_m)
+        now = (int64_t)from * 1000 + nextExecMillis_m;
+    else
+        now = (int64_t)from * 1000;
+    int64_t next;
     if (nextExecTime_m == 0 && during_m != 0)
     {
         // first schedule. check if value must be on or off (except if timer is instantaneous)
-        time_t start, stop;
+        int64_t start, stop;
         if (during_m != -1)
         {
             if (after_m == -1)
-                stop = findNext(now-during_m, at_m)+during_m;
+                stop = (int64_t)findNext((now-during_m) / 1000, at_m) * 1000 + during_m;
             else
                 stop = now + during_m;
         }
         else
-            stop = findNext(now, until_m);
+            stop = (int64_t)findNext(now / 1000, until_m) * 1000;
 
         if (after_m != -1)
             start = now + after_m;
         else
-            start = findNext(now, at_m);
+            start = (int64_t)findNext(now / 1000, at_m) * 1000;
 
         if (stop < start)
         {
             value_m = true;
-            nextExecTime_m = stop;
+            next = stop;
         }
         else
         {
             value_m = false;
-            nextExecTime_m = start;
+            next = start;
         }
     }
     else if (value_m)
     {
         if (during_m != -1)
-            nextExecTime_m = now + during_m;
+            next = now + during_m;
         else
-            nextExecTime_m = findNext(now, until_m);
+            next = (int64_t)findNext(now / 1000, until_m) * 1000;
     }
     else
     {
         if (after_m != -1)
-            nextExecTime_m = now + after_m;
+            next = now + after_m;
         else
-            nextExecTime_m = findNext(now, at_m);
+            next = (int64_t)findNext(now / 1000, at_m) * 1000;
 
     }
+    nextExecTime_m = next / 1000;
+    nextExecMillis_m = next % 1000;
     if (nextExecTime_m != 0)
     {
         struct tm timeinfo;
-        memcpy(&timeinfo, localtime(&nextExecTime_m), sizeof(struct tm));
+        TimeZone::instance()->toLocal(nextExecTime_m, &timeinfo);
         logger_m.infoStream() << "Rescheduled at "
         << timeinfo.tm_year + 1900 << "-"
         << timeinfo.tm_mon + 1 << "-"
@@ -790,7 +1324,9 @@ void PeriodicTask::reschedule(time_t now)
         << std::setfill('0') << std::setw(2)
         << timeinfo.tm_min << ":"
         << std::setfill('0') << std::setw(2)
-        << timeinfo.tm_sec << " ("
+        << timeinfo.tm_sec << "."
+        << std::setfill('0') << std::setw(3)
+        << nextExecMillis_m << " ("
         << nextExecTime_m << ")" << endlog;
         Services::instance()->getTimerManager()->addTask(this);
     }
@@ -799,35 +1335,20 @@ void PeriodicTask::reschedule(time_t now)
 
 }
 
-time_t PeriodicTask::mktimeNoDst(struct tm * timeinfo)
+bool PeriodicTask::shiftDeadline(int64_t drift)
 {
-    time_t ret;
-    int dst = timeinfo->tm_isdst;
-    ret = mktime(timeinfo);
-    if (dst != timeinfo->tm_isdst)
-    {
-        logger_m.infoStream() << "PeriodicTask: DST change detected" << endlog;
-        if (dst == 1) // If day changed due to DST adjustment, we revert the change.
-            timeinfo->tm_hour++;
-        else if (dst == 0 && timeinfo->tm_hour == 3)
-        {
-            // If between 3am and 4am, do not go back before 3am
-            // because we would fall inside the non-existing hour
-            timeinfo->tm_hour = 3;
-            timeinfo->tm_min = 0;
-            timeinfo->tm_sec = 0;
-        }
-        else
-            timeinfo->tm_hour--;
-        ret = mktime(timeinfo);
-    }
-    return ret;
+    // The next change is either the end of the 'during' duration or the
+    // start 'after' the condition, or comes from the 'until'/'at' spec.
+    if (value_m ? during_m == -1 : after_m == -1)
+        return false;
+    int64_t next = (int64_t)nextExecTime_m * 1000 + nextExecMillis_m + drift;
+    nextExecTime_m = next / 1000;
+    nextExecMillis_m = next % 1000;
+    return true;
 }
 
 time_t PeriodicTask::findNext(time_t start, TimeSpec* next)
 {
-    struct tm timeinfostruct;
-    struct tm * timeinfo;
     if (!next)
     {
         logger_m.infoStream() << "PeriodicTask: no more schedule available" << endlog;
@@ -839,14 +1360,63 @@ time_t PeriodicTask::findNext(time_t start, TimeSpec* next)
         return 0;
     }
 
-    // make a copy of value returned by localtime to avoid interference
-    // with other calls to localtime or gmtime
-    memcpy(&timeinfostruct, localtime(&start), sizeof(struct tm));
-    timeinfo = &timeinfostruct;
+    findNextCount_m++;
+
+    // No occurrence lies between the start time of the last search and its
+    // result, so any start time in that range gives the same result.
+    NextCache &cache = cache_m[next == until_m ? 1 : 0];
+    bool isStatic = next->isStatic();
+    int revision = ExceptionDays::getRevision();
+    if (isStatic && cache.spec == next && cache.revision == revision &&
+            start >= cache.from && start < cache.until && cache.value.isSameAs(*next))
+    {
+        findNextHits_m++;
+        return cache.result;
+    }
+
+    time_t from = start;
+    time_t result = 0;
+    while (result == 0)
+    {
+        if (start - from > MaxSearchDays * 86400)
+        {
+            logger_m.infoStream() << "No schedule found in the next " << MaxSearchDays << " days" << endlog;
+            return 0;
+        }
+        time_t restart = 0;
+        result = findNextCandidate(start, next, restart);
+        if (result == 0 && restart == 0)
+            return 0;
+        start = restart;
+    }
+
+    if (isStatic)
+    {
+        // With a positive offset, a start time past the base occurrence
+        // would find the next one.
+        int offset = next->getOffsetInSeconds();
+        cache.spec = next;
+        cache.value = *next;
+        cache.revision = revision;
+        cache.from = from;
+        cache.until = offset > 0 ? result - offset : result;
+        cache.result = result;
+    }
+    return result;
+}
+
+/** Returns the next occurrence after start, or 0 with the time to
+ * search from in restart if the candidate found was rejected. */
+time_t PeriodicTask::findNextCandidate(time_t start, TimeSpec* next, time_t &restart)
+{
+    struct tm timeinfostruct;
+    struct tm * timeinfo = &timeinfostruct;
+    TimeZone* tz = TimeZone::instance();
+    tz->toLocal(start, timeinfo);
 
     // Move forward 1 minute.
     timeinfo->tm_min++;
-    mktime(timeinfo);
+    tz->toUtc(timeinfo);
 
     int dayOfMonth, month, year, weekdays;
     next->getDay(*timeinfo, dayOfMonth, month, year, weekdays);
@@ -876,7 +1446,8 @@ time_t PeriodicTask::findNext(time_t start, TimeSpec* next)
         case DateTime::Resolution_Resolved:
             break;
         case DateTime::Resolution_Unresolved:
-            return goToNextDayAndFindNext(target, next);
+            restart = goToNextDay(target);
+            return 0;
         case DateTime::Resolution_Impossible:
             // No schedule available.
             logger_m.infoStream() << "No more schedule available" << endlog;
@@ -893,7 +1464,8 @@ time_t PeriodicTask::findNext(time_t start, TimeSpec* next)
         case DateTime::Resolution_Resolved:
             break;
         case DateTime::Resolution_Unresolved:
-            return goToNextDayAndFindNext(target, next);
+            restart = goToNextDay(target);
+            return 0;
         case DateTime::Resolution_Impossible:
             // No schedule available.
             logger_m.infoStream() << "No more schedule available" << endlog;
@@ -913,18 +1485,19 @@ time_t PeriodicTask::findNext(time_t start, TimeSpec* next)
         bool isException = Services::instance()->getExceptionDays()->isException(nextExecTime);
         if (isException && exception == TimeSpec::No || !isException && exception == TimeSpec::Yes)
         {
-            logger_m.debugStream() << "Calling findNext recursively! (" << nextExecTime << ")" << endlog;
-
-            return goToNextDayAndFindNext(target, next);
+            logger_m.debugStream() << "Skipping day of " << nextExecTime << endlog;
+            restart = goToNextDay(target);
+            return 0;
         }
     }
 
     // Apply offset. If offset is negative, that can move to a time in the past.
-    // In that case, recurse to find next occurrence.
+    // In that case, search again from there.
     time_t nextExecTimeWithOffset = nextExecTime + next->getOffsetInSeconds(); 
     if (nextExecTimeWithOffset <= start)
     {
-        return findNext(nextExecTime, next);
+        restart = nextExecTime;
+        return 0;
     }
     else
     {
@@ -932,7 +1505,7 @@ time_t PeriodicTask::findNext(time_t start, TimeSpec* next)
     }
 }
 
-time_t PeriodicTask::goToNextDayAndFindNext(const DateTime &current, TimeSpec* next)
+time_t PeriodicTask::goToNextDay(const DateTime &current)
 {
     tm timeinfo;
     current.getTime(&timeinfo);
@@ -941,16 +1514,14 @@ time_t PeriodicTask::goToNextDayAndFindNext(const DateTime &current, TimeSpec* n
     // switches to the next day.
     timeinfo.tm_hour = 23;
     timeinfo.tm_min = 59;
-    time_t nextExecTime = mktime(&timeinfo);
-
-    return findNext(nextExecTime, next);
+    return TimeZone::instance()->toUtc(&timeinfo);
 }
 
 void PeriodicTask::statusXml(ticpp::Element* pStatus)
 {
     struct tm timeinfo;
     std::stringstream execTime;
-    memcpy(&timeinfo, localtime(&nextExecTime_m), sizeof(struct tm));
+    TimeZone::instance()->toLocal(nextExecTime_m, &timeinfo);
     execTime << timeinfo.tm_year + 1900 << "-"
     << timeinfo.tm_mon + 1 << "-"
     << timeinfo.tm_mday << " "
@@ -960,6 +1531,8 @@ void PeriodicTask::statusXml(ticpp::Element* pStatus)
     << timeinfo.tm_min << ":"
     << std::setfill('0') << std::setw(2)
     << timeinfo.tm_sec;
+    if (nextExecMillis_m)
+        execTime << "." << std::setfill('0') << std::setw(3) << nextExecMillis_m;
     pStatus->SetAttribute("next-exec", execTime.str());
     if (cl_m)
         pStatus->SetAttribute("owner", cl_m->getID());
@@ -967,7 +1540,7 @@ void PeriodicTask::statusXml(ticpp::Element* pStatus)
 
 Logger& FixedTimeTask::logger_m(Logger::getInstance("FixedTimeTask"));
 
-FixedTimeTask::FixedTimeTask() : execTime_m(0)
+FixedTimeTask::FixedTimeTask() : execTime_m(0), execMillis_m(0)
 {}
 
 FixedTimeTask::~FixedTimeTask()
@@ -975,14 +1548,26 @@ FixedTimeTask::~FixedTimeTask()
     Services::instance()->getTimerManager()->removeTask(this);
 }
 
-void FixedTimeTask::reschedule(time_t now)
+bool FixedTimeTask::shiftDeadline(int64_t drift)
+{
+    // Execution times are set a delay after an event
+    setExecTime((int64_t)execTime_m * 1000 + execMillis_m + drift);
+    return true;
+}
+
+void FixedTimeTask::reschedule(time_t from)
 {
-    if (now == 0)
-        now = time(0);
-    if (execTime_m > now)
+    // A task called back by TimerManager in the second of its execution
+    // has been executed, so compare with the end of that second.
+    int64_t now;
+    if (from == 0)
+        now = TimerManager::now();
+    else
+        now = (int64_t)from * 1000 + 999;
+    if ((int64_t)execTime_m * 1000 + execMillis_m > now)
     {
         struct tm timeinfo;
-        memcpy(&timeinfo, localtime(&execTime_m), sizeof(struct tm));
+        TimeZone::instance()->toLocal(execTime_m, &timeinfo);
         logger_m.infoStream() << "Rescheduled at "
         << timeinfo.tm_year + 1900 << "-"
         << timeinfo.tm_mon + 1 << "-"
@@ -992,7 +1577,9 @@ void FixedTimeTask::reschedule(time_t now)
         << std::setfill('0') << std::setw(2)
         << timeinfo.tm_min << ":"
         << std::setfill('0') << std::setw(2)
-        << timeinfo.tm_sec << " ("
+        << timeinfo.tm_sec << "."
+        << std::setfill('0') << std::setw(3)
+        << execMillis_m << " ("
         << execTime_m << ")" << endlog;
         Services::instance()->getTimerManager()->addTask(this);
     }
@@ -1004,7 +1591,7 @@ void FixedTimeTask::statusXml(ticpp::Element* pStatus)
 {
     struct tm timeinfo;
     std::stringstream execTime;
-    memcpy(&timeinfo, localtime(&execTime_m), sizeof(struct tm));
+    TimeZone::instance()->toLocal(execTime_m, &timeinfo);
     execTime << timeinfo.tm_year + 1900 << "-"
     << timeinfo.tm_mon + 1 << "-"
     << timeinfo.tm_mday << " "
@@ -1014,6 +1601,8 @@ void FixedTimeTask::statusXml(ticpp::Element* pStatus)
     << timeinfo.tm_min << ":"
     << std::setfill('0') << std::setw(2)
     << timeinfo.tm_sec;
+    if (execMillis_m)
+        execTime << "." << std::setfill('0') << std::setw(3) << execMillis_m;
     pStatus->SetAttribute("next-exec", execTime.str());
 }
 
@@ -1044,20 +1633,36 @@ void DaySpec::exportXml(ticpp::Element* pConfig)
 }
 
 
-ExceptionDays::ExceptionDays()
-{}
+int ExceptionDays::revision_m = 0;
+
+ExceptionDays::ExceptionDays() : indexDirty_m(false)
+{
+    revision_m++;
+}
 
 ExceptionDays::~ExceptionDays()
 {
     clear();
 }
 
-void ExceptionDays::clear()
+void ExceptionDays::clearDays(DaysList_t& days)
 {
     DaysList_t::iterator it;
-    for (it = daysList_m.begin(); it != daysList_m.end(); it++)
+    for (it = days.begin(); it != days.end(); it++)
         delete (*it);
-    daysList_m.clear();
+    days.clear();
+}
+
+void ExceptionDays::clear()
+{
+    clearDays(daysList_m);
+    clearDays(calendarDays_m);
+    CalendarFiles_t::iterator it;
+    for (it = calendarFiles_m.begin(); it != calendarFiles_m.end(); it++)
+        clearDays((*it).second);
+    calendarFiles_m.clear();
+    indexDirty_m = true;
+    revision_m++;
 }
 
 void ExceptionDays::importXml(ticpp::Element* pConfig)
@@ -1073,11 +1678,17 @@ void ExceptionDays::importXml(ticpp::Element* pConfig)
             day->importXml(&(*child));
             daysList_m.push_back(day);
         }
+        else if (child->Value() == "calendar")
+        {
+            importCalendar(child->GetAttribute("file"));
+        }
         else
         {
             throw ticpp::Exception("Invalid element inside 'exceptiondays' section");
         }
     }
+    indexDirty_m = true;
+    revision_m++;
 }
 
 void ExceptionDays::exportXml(ticpp::Element* pConfig)
@@ -1089,39 +1700,176 @@ void ExceptionDays::exportXml(ticpp::Element* pConfig)
         (*it)->exportXml(&pElem);
         pConfig->LinkEndChild(&pElem);
     }
+    CalendarFiles_t::iterator fileIt;
+    for (fileIt = calendarFiles_m.begin(); fileIt != calendarFiles_m.end(); fileIt++)
+    {
+        ticpp::Element pElem("calendar");
+        pElem.SetAttribute("file", (*fileIt).first);
+        pConfig->LinkEndChild(&pElem);
+    }
 }
 
-bool ExceptionDays::isException(time_t time)
+void ExceptionDays::importCalendar(const std::string& file)
 {
-    struct tm timeinfo;
-    memcpy(&timeinfo, localtime(&time), sizeof(struct tm));
+    std::ifstream input(file.c_str());
+    if (!input)
+    {
+        std::stringstream msg;
+        msg << "ExceptionDays: Unable to open calendar file '" << file << "'" << std::endl;
+        throw ticpp::Exception(msg.str());
+    }
+    DaysList_t& days = calendarFiles_m[file];
+    clearDays(days);
+    parseCalendar(input, days);
+}
 
-    DaysList_t::iterator it;
-    for (it = daysList_m.begin(); it != daysList_m.end(); it++)
+static bool parseCalendarDate(const std::string& line, struct tm* date)
+{
+    // DTSTART;VALUE=DATE:20241225 or DTSTART:20241225T000000Z
+    std::string::size_type pos = line.find(':');
+    if (pos == std::string::npos || line.size() < pos + 9)
+        return false;
+    std::string value = line.substr(pos + 1, 8);
+    if (value.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    memset(date, 0, sizeof(struct tm));
+    date->tm_year = atoi(value.substr(0, 4).c_str()) - 1900;
+    date->tm_mon = atoi(value.substr(4, 2).c_str()) - 1;
+    date->tm_mday = atoi(value.substr(6, 2).c_str());
+    date->tm_hour = 12;
+    date->tm_isdst = -1;
+    return true;
+}
+
+void ExceptionDays::importCalendar(std::istream& input)
+{
+    parseCalendar(input, calendarDays_m);
+}
+
+void ExceptionDays::parseCalendar(std::istream& input, DaysList_t& days)
+{
+    std::string line;
+    bool inEvent = false, yearly = false, hasStart = false, hasEnd = false;
+    struct tm start, end;
+    int count = 0;
+    while (std::getline(input, line))
     {
-        if (((*it)->year_m == -1 || (*it)->year_m == timeinfo.tm_year) &&
-                ((*it)->mon_m == -1 || (*it)->mon_m == timeinfo.tm_mon) &&
-                ((*it)->mday_m == -1 || (*it)->mday_m == timeinfo.tm_mday))
+        if (!line.empty() && line[line.size()-1] == '\r')
+            line.erase(line.size()-1);
+        if (line == "BEGIN:VEVENT")
         {
-            infoStream("ExceptionDays")
-            << timeinfo.tm_year+1900 << "-"
-            << timeinfo.tm_mon+1 << "-"
-            << timeinfo.tm_mday << " is an exception day!" << endlog;
-            return true;
+            inEvent = true;
+            yearly = hasStart = hasEnd = false;
+        }
+        else if (!inEvent)
+            continue;
+        else if (line.compare(0, 7, "DTSTART") == 0)
+            hasStart = parseCalendarDate(line, &start);
+        else if (line.compare(0, 5, "DTEND") == 0)
+            hasEnd = parseCalendarDate(line, &end);
+        else if (line.compare(0, 6, "RRULE:") == 0)
+            yearly = line.find("FREQ=YEARLY") != std::string::npos;
+        else if (line == "END:VEVENT")
+        {
+            inEvent = false;
+            if (!hasStart)
+                continue;
+            // DTEND is exclusive, events without it last one day.
+            TimeZone* tz = TimeZone::instance();
+            time_t first = tz->toUtc(&start);
+            time_t last = hasEnd ? tz->toUtc(&end) - 86400 : first;
+            if (last - first > 366 * 86400)
+                last = first + 366 * 86400;
+            for (time_t t = first; t <= last + 3600; t += 86400)
+            {
+                struct tm timeinfo;
+                tz->toLocal(t, &timeinfo);
+                DaySpec* day = new DaySpec();
+                day->mday_m = timeinfo.tm_mday;
+                day->mon_m = timeinfo.tm_mon;
+                day->year_m = yearly ? -1 : timeinfo.tm_year;
+                days.push_back(day);
+                count++;
+            }
         }
     }
-    return false;
+    debugStream("ExceptionDays") << "Imported " << count << " days from calendar" << endlog;
+    indexDirty_m = true;
+    revision_m++;
 }
 
-void ExceptionDays::addDay(DaySpec* day)
+void ExceptionDays::setDays(DaySpec* day)
+{
+    DayMask_t mask;
+    for (int mon = 0; mon < 12; mon++)
+    {
+        if (day->mon_m != -1 && day->mon_m != mon)
+            continue;
+        if (day->mday_m != -1)
+        {
+            if (day->mday_m >= 1 && day->mday_m <= 31)
+                mask.set(mon * 31 + day->mday_m - 1);
+        }
+        else
+        {
+            for (int mday = 0; mday < 31; mday++)
+                mask.set(mon * 31 + mday);
+        }
+    }
+    if (day->year_m == -1)
+        recurring_m |= mask;
+    else
+        years_m[day->year_m] |= mask;
+}
+
+void ExceptionDays::updateIndex()
 {
+    recurring_m.reset();
+    years_m.clear();
     DaysList_t::iterator it;
     for (it = daysList_m.begin(); it != daysList_m.end(); it++)
-    {}
-    daysList_m.insert(it, day);
+        setDays(*it);
+    for (it = calendarDays_m.begin(); it != calendarDays_m.end(); it++)
+        setDays(*it);
+    CalendarFiles_t::iterator fileIt;
+    for (fileIt = calendarFiles_m.begin(); fileIt != calendarFiles_m.end(); fileIt++)
+    {
+        for (it = (*fileIt).second.begin(); it != (*fileIt).second.end(); it++)
+            setDays(*it);
+    }
+    indexDirty_m = false;
+}
+
+bool ExceptionDays::isException(time_t time)
+{
+    struct tm timeinfo;
+    TimeZone::instance()->toLocal(time, &timeinfo);
+    return isException(timeinfo.tm_year, timeinfo.tm_mon, timeinfo.tm_mday);
+}
+
+bool ExceptionDays::isException(int year, int mon, int mday)
+{
+    if (indexDirty_m)
+        updateIndex();
+    if (mon < 0 || mon > 11 || mday < 1 || mday > 31)
+        return false;
+    int idx = mon * 31 + mday - 1;
+    if (recurring_m.test(idx))
+        return true;
+    YearMasks_t::iterator it = years_m.find(year);
+    return it != years_m.end() && it->second.test(idx);
+}
+
+void ExceptionDays::addDay(DaySpec* day)
+{
+    daysList_m.push_back(day);
+    indexDirty_m = true;
+    revision_m++;
 }
 
 void ExceptionDays::removeDay(DaySpec* day)
 {
     daysList_m.remove(day);
+    indexDirty_m = true;
+    revision_m++;
 }
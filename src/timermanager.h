@@ -23,6 +23,10 @@
 #include <list>
 #include <string>
 #include <map>
+#include <vector>
+#include <deque>
+#include <bitset>
+#include <istream>
 #include "config.h"
 #include "logger.h"
 #include "threads.h"
@@ -114,11 +118,33 @@ private:
 class TimerTask
 {
 public:
+    TimerTask() : heapIndex_m(-1), statusId_m(0), statusRevision_m(0) {};
     virtual ~TimerTask() {};
     virtual void onTimer(time_t time) = 0;
+    /** Called instead of onTimer for a late task with the fire-latest
+     * catch-up policy. Tasks that track a state can jump to the state
+     * they should have now instead of replaying the missed change. */
+    virtual void onCatchUp(time_t time) { onTimer(time); };
     virtual void reschedule(time_t from = 0) = 0;
+    /** Moves the execution time by 'drift' ms after the wall clock
+     * jumped. Returns false if it comes from a date and time and must be
+     * computed again instead, true if it is a duration from an earlier
+     * event, whose remaining time is kept. */
+    virtual bool shiftDeadline(int64_t drift) { return false; };
     virtual time_t getExecTime() = 0;
+    /** Millisecond part of the execution time. */
+    virtual int getExecMillis() { return 0; };
     virtual void statusXml(ticpp::Element* pStatus) = 0;
+    /** ID of the rule owning the task, if any. */
+    virtual const char* getOwnerID() { return 0; };
+
+private:
+    friend class TimerManager;
+    /** Position in the TimerManager heap, -1 if not scheduled. */
+    int heapIndex_m;
+    /** Identifier in the status feed, and revision of its last change. */
+    unsigned long statusId_m;
+    unsigned long statusRevision_m;
 };
 
 class TimeSpec
@@ -172,6 +198,11 @@ public:
     ExceptionDays getExceptions() const { return exception_m; }
 	void checkIsValid() const;
 
+    /** Returns true if occurrences only depend on the fields of this spec
+     * and on exception days, so that they can be memoised. */
+    virtual bool isStatic() const { return true; }
+    bool isSameAs(const TimeSpec &other) const;
+
 private:
     int min_m;
     int hour_m;
@@ -197,6 +228,7 @@ public:
 
     virtual void getDay(const tm &current, int &mday, int &mon, int &year, int &wdays) const;
     virtual void getTime(int mday, int mon, int year, int &min, int &hour) const;
+    virtual bool isStatic() const { return false; }
 
 private:
 	void getDataFromObject(int &min, int &hour, int &mday, int &mon, int &year, int &wdays) const;
@@ -213,28 +245,58 @@ public:
     virtual ~PeriodicTask();
 
     virtual void onTimer(time_t time);
+    virtual void onCatchUp(time_t time);
     virtual void reschedule(time_t from);
+    virtual bool shiftDeadline(int64_t drift);
     virtual time_t getExecTime() { return nextExecTime_m; };
+    virtual int getExecMillis() { return nextExecMillis_m; };
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual const char* getOwnerID() { return cl_m ? cl_m->getID() : 0; };
 
     void setAt(TimeSpec* at) { at_m = at; };
     void setUntil(TimeSpec* until) { until_m = until; };
-    void setDuring(int during) { during_m = during; };
+    /** Duration in ms, 0 for a pulse or -1 to use the 'until' spec. */
+    void setDuring(int64_t during) { during_m = during; };
     virtual void onChange(Object* object);
 
+    /** Number of findNext calls since startup, and how many of them were
+     * answered from the cache. */
+    static unsigned long getFindNextCount() { return findNextCount_m; };
+    static unsigned long getFindNextCacheHits() { return findNextHits_m; };
+
 protected:
     TimeSpec *at_m, *until_m;
-    int during_m, after_m;
+    /** Durations in ms. */
+    int64_t during_m, after_m;
     time_t nextExecTime_m;
+    int nextExecMillis_m;
     ChangeListener* cl_m;
     bool value_m;
 
     time_t findNext(time_t start, TimeSpec* next);
-    time_t mktimeNoDst(struct tm * timeinfo);
     static Logger& logger_m;
 
 private:
-	time_t goToNextDayAndFindNext(const DateTime &curent, TimeSpec *next);
+	time_t findNextCandidate(time_t start, TimeSpec* next, time_t &restart);
+	time_t goToNextDay(const DateTime &curent);
+
+    /** How far findNext looks ahead when candidate days keep being
+     * rejected (exception days, ...). */
+    static const int MaxSearchDays = 3660;
+
+    /** Last occurrence found for a static spec, and the range of start
+     * times for which findNext gives the same result. */
+    struct NextCache
+    {
+        NextCache() : spec(0), from(0), until(0), result(0), revision(-1) {};
+        TimeSpec* spec;
+        TimeSpec value;
+        time_t from, until, result;
+        int revision;
+    };
+    NextCache cache_m[2];
+    static unsigned long findNextCount_m;
+    static unsigned long findNextHits_m;
 };
 
 class FixedTimeTask : public TimerTask
@@ -245,11 +307,17 @@ public:
 
     virtual void onTimer(time_t time) = 0;
     virtual void reschedule(time_t from);
+    virtual bool shiftDeadline(int64_t drift);
     virtual time_t getExecTime() { return execTime_m; };
+    virtual int getExecMillis() { return execMillis_m; };
     virtual void statusXml(ticpp::Element* pStatus);
 
+    /** Sets the execution time in ms since the epoch. */
+    void setExecTime(int64_t time) { execTime_m = time / 1000; execMillis_m = time % 1000; };
+
 protected:
     time_t execTime_m;
+    int execMillis_m;
     static Logger& logger_m;
 };
 
@@ -263,24 +331,178 @@ public:
         Long
     };
 
+    /** What to do with tasks found late by more than the tolerance, after
+     * a clock jump or a suspend. */
+    enum CatchUpPolicy
+    {
+        FireAll,
+        FireLatest,
+        Skip
+    };
+
     TimerManager();
     virtual ~TimerManager();
 
+    void importXml(ticpp::Element* pConfig);
+    void exportXml(ticpp::Element* pConfig);
+    void setCatchUpPolicy(CatchUpPolicy policy, int tolerance) { catchUp_m = policy; tolerance_m = tolerance; };
+
     TimerCheck checkTaskList(time_t now);
+    TimerCheck checkTasks(int64_t now);
+    /** Fires every task due at 'now' (wall clock in ms) and returns the
+     * delay in ms until the next one, or -1 if no task is pending. */
+    int64_t processTasks(int64_t now);
+    /** Compares wall clock and monotonic clock progress since the last call.
+     * If the wall clock jumped, durations are shifted by the drift and
+     * deadlines from a date and time are computed again if it went back. */
+    void checkClock(int64_t now, int64_t monotonicNow);
 
     void addTask(TimerTask* task);
     void removeTask(TimerTask* task);
+    int getTaskCount() const { return heap_m.size(); };
+    int getFiredCount() const { return firedCount_m; };
+    int64_t getMaxLateness() const { return lateMax_m; };
+    int getLateCount() const { return lateCount_m; };
+    int getSkippedCount() const { return skippedCount_m; };
+    int getClockJumpCount() const { return clockJumps_m; };
+    /** Incremented each time a task is added, rescheduled or removed. */
+    unsigned long getRevision() const { return revision_m; };
+
+    static int64_t now();
 
     void startManager() { Start(); };
     void stopManager() { Stop(); };
 
+    /** Lists the tasks in order of execution. The request attributes
+     * from/to (next-exec window), owner (rule id) and offset/limit filter
+     * the list; since="N" only lists the tasks changed and removed after
+     * revision N, changed tasks that left the filter are listed as removed. */
     virtual void statusXml(ticpp::Element* pStatus);
 
 private:
     void Run (pth_sem_t * stop);
+    void unlink(TimerTask* task);
+    void logRemoval(TimerTask* task);
+
+    /** Longest sleep in ms. Deadlines are wall clock times, so the loop
+     * wakes up from time to time to follow clock adjustments. */
+    static const int MaxSleep = 300000;
+
+    /** Tasks are kept in a binary heap ordered by deadline in ms, then by
+     * insertion order. Each task knows its own position in the heap, so
+     * that it can be removed in O(log n). */
+    struct HeapEntry
+    {
+        int64_t deadline;
+        unsigned long seq;
+        TimerTask* task;
+        bool operator<(const HeapEntry& other) const
+        {
+            return deadline < other.deadline || (deadline == other.deadline && seq < other.seq);
+        };
+    };
+    typedef std::vector<HeapEntry> TaskHeap_t;
+    void place(int idx, const HeapEntry& entry);
+    void siftUp(int idx);
+    void siftDown(int idx);
+
+    TaskHeap_t heap_m;
+    unsigned long seq_m;
+    int64_t nextWakeup_m;
+    pth_sem_t wakeup_m;
+    CatchUpPolicy catchUp_m;
+    /** Lateness in ms beyond which the catch-up policy applies. */
+    int tolerance_m;
+    int firedCount_m;
+    int64_t lateSum_m;
+    int64_t lateMax_m;
+    int lateCount_m;
+    int skippedCount_m;
+    int clockJumps_m;
+    int64_t lastClock_m;
+    int64_t lastMonotonic_m;
+
+    /** Removals are remembered for clients polling the changes since a
+     * revision. Older clients get the full list again. */
+    static const unsigned int MaxRemovedLog = 4096;
+    typedef std::deque<std::pair<unsigned long, unsigned long> > RemovedLog_t;
+    RemovedLog_t removed_m;
+    unsigned long removedFloor_m;
+    unsigned long revision_m;
+    unsigned long nextId_m;
+    static Logger& logger_m;
+};
+
+class TimerWheel;
+
+/** Intrusive link used by TimerWheel slots. Unlinking only needs the node
+ * itself, which makes cancellation O(1). */
+class WheelLink
+{
+public:
+    WheelLink() : prev_m(this), next_m(this) {};
+
+    bool isLinked() const { return next_m != this; };
+    void linkBefore(WheelLink* node);
+    void unlink();
+
+    WheelLink *prev_m, *next_m;
+};
+
+class WheelTask : private WheelLink
+{
+public:
+    WheelTask() : wheel_m(0), deadline_m(0) {};
+    virtual ~WheelTask();
 
-    typedef std::list<TimerTask*> TaskList_t;
-    TaskList_t taskList_m;
+    virtual void onWheelTimer(int64_t now) = 0;
+
+    bool isScheduled() const { return wheel_m != 0; };
+    int64_t getDeadline() const { return deadline_m; };
+
+private:
+    friend class TimerWheel;
+    TimerWheel* wheel_m;
+    int64_t deadline_m;
+};
+
+/** Hashed timing wheel for short-lived, millisecond resolution deadlines
+ * (rule debouncing, rate limiting, ...). Unlike TimerManager, scheduling
+ * and cancelling a task is O(1). */
+class TimerWheel : protected Thread
+{
+public:
+    TimerWheel(int resolution = 10, int slots = 512);
+    virtual ~TimerWheel();
+
+    /** Schedules task at the given absolute monotonic time in ms. A task
+     * already pending is moved to the new deadline. */
+    void schedule(WheelTask* task, int64_t deadline);
+    void scheduleIn(WheelTask* task, int delay) { schedule(task, now() + delay); };
+    void cancel(WheelTask* task);
+
+    /** Fires every task due at 'now' and returns the number of tasks fired. */
+    int advance(int64_t now);
+    /** Returns the time of the next non-empty slot or -1 if the wheel is empty. */
+    int64_t getNextTick(int64_t now) const;
+    int getTaskCount() const { return count_m; };
+
+    static int64_t now();
+
+    void startWheel() { Start(); };
+    void stopWheel() { Stop(); };
+
+private:
+    void Run (pth_sem_t * stop);
+    WheelLink& getSlot(int64_t time) const { return slots_m[(time / resolution_m) & (slotCount_m - 1)]; };
+
+    WheelLink* slots_m;
+    int slotCount_m;
+    int resolution_m;
+    int count_m;
+    int64_t current_m;
+    int64_t nextWakeup_m;
+    pth_sem_t wakeup_m;
     static Logger& logger_m;
 };
 
@@ -307,14 +529,45 @@ public:
     void addDay(DaySpec* date);
     void removeDay(DaySpec* date);
 
+    /** Adds the all-day events of an iCalendar file (public holidays, ...).
+     * Yearly events are added as recurring days. Importing a file again
+     * replaces the days it added before. */
+    void importCalendar(const std::string& file);
+    void importCalendar(std::istream& input);
+
     void importXml(ticpp::Element* pConfig);
     void exportXml(ticpp::Element* pConfig);
 
     bool isException(time_t time);
+    bool isException(int year, int mon, int mday);
+
+    /** Changes whenever any exception days list is modified. */
+    static int getRevision() { return revision_m; };
 
 private:
+    void updateIndex();
+    void setDays(DaySpec* day);
+
     typedef std::list<DaySpec*> DaysList_t;
+    static void clearDays(DaysList_t& days);
+    void parseCalendar(std::istream& input, DaysList_t& days);
+
     DaysList_t daysList_m;
+    /** Days loaded from calendar streams, and from calendar files by file
+     * name. The latter are exported as the file name. */
+    DaysList_t calendarDays_m;
+    typedef std::map<std::string, DaysList_t> CalendarFiles_t;
+    CalendarFiles_t calendarFiles_m;
+
+    /** Days are indexed by mon*31+mday-1, in a mask for days recurring
+     * every year and in one mask per year. */
+    typedef std::bitset<12*31> DayMask_t;
+    typedef std::map<int, DayMask_t> YearMasks_t;
+    DayMask_t recurring_m;
+    YearMasks_t years_m;
+    bool indexDirty_m;
+
+    static int revision_m;
     static ExceptionDays* instance_m;
 };
 
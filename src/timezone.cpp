@@ -0,0 +1,507 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "timezone.h"
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <stdint.h>
+
+TimeZone* TimeZone::instance_m;
+Logger& TimeZone::logger_m(Logger::getInstance("TimeZone"));
+
+/** Last year for which the transitions of a POSIX rule are computed. */
+static const int LastRuleYear = 2200;
+
+// Proleptic Gregorian calendar conversions, days counted from 1970-01-01.
+static long daysFromCivil(long y, int m, int d)
+{
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void civilFromDays(long z, long *year, int *mon, int *mday)
+{
+    z += 719468;
+    long era = (z >= 0 ? z : z - 146096) / 146097;
+    long doe = z - era * 146097;
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long mp = (5 * doy + 2) / 153;
+    *mday = doy - (153 * mp + 2) / 5 + 1;
+    *mon = mp < 10 ? mp + 3 : mp - 9;
+    *year = yoe + era * 400 + (*mon <= 2);
+}
+
+static bool isLeap(long y)
+{
+    return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+static long floorDiv(long long a, long b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+TimeZone::TimeZone() : hasRule_m(false)
+{
+    initial_m.gmtoff = 0;
+    initial_m.isDst = false;
+}
+
+TimeZone* TimeZone::instance()
+{
+    if (instance_m == 0)
+    {
+        instance_m = new TimeZone();
+        const char* tz = getenv("TZ");
+        std::string name = tz ? tz : "/etc/localtime";
+        if (name.empty())
+            name = "UTC0";
+        else if (name[0] == ':')
+            name.erase(0, 1);
+        if (!instance_m->load(name))
+            logger_m.infoStream() << "Unable to load time zone '" << name << "', using C library" << endlog;
+    }
+    return instance_m;
+}
+
+bool TimeZone::load(const std::string &name)
+{
+    std::string path = name;
+    if (name.empty() || name[0] != '/')
+    {
+        const char* dir = getenv("TZDIR");
+        path = std::string(dir ? dir : "/usr/share/zoneinfo") + "/" + name;
+    }
+    if (name.find("..") == std::string::npos)
+    {
+        std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+        if (in.good() && loadFile(in))
+        {
+            logger_m.debugStream() << "Loaded " << transitions_m.size() << " transitions from " << path << endlog;
+            return true;
+        }
+    }
+    return loadRule(name);
+}
+
+static int64_t readInt(const unsigned char *p, int size)
+{
+    int64_t value = (signed char)p[0];
+    for (int i = 1; i < size; i++)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+/** Clamps a 64-bit transition time to time_t, which keeps the transitions
+ * sorted where time_t only has 32 bits. */
+static time_t toTime(int64_t value)
+{
+    if (value > (int64_t)std::numeric_limits<time_t>::max())
+        return std::numeric_limits<time_t>::max();
+    if (value < (int64_t)std::numeric_limits<time_t>::min())
+        return std::numeric_limits<time_t>::min();
+    return (time_t)value;
+}
+
+bool TimeZone::loadFile(std::istream &in)
+{
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const unsigned char *p = (const unsigned char *)data.data();
+    size_t size = data.size();
+    if (size < 44 || data.compare(0, 4, "TZif") != 0)
+        return false;
+
+    // Skip the 32-bit block of version 2+ files, the 64-bit one follows.
+    int timeSize = 4;
+    size_t pos = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (size < pos + 44)
+            return false;
+        const unsigned char *h = p + pos + 20;
+        int64_t isutcnt = readInt(h, 4), isstdcnt = readInt(h + 4, 4), leapcnt = readInt(h + 8, 4);
+        int64_t timecnt = readInt(h + 12, 4), typecnt = readInt(h + 16, 4), charcnt = readInt(h + 20, 4);
+        if (isutcnt < 0 || isstdcnt < 0 || leapcnt < 0 || timecnt < 0 || typecnt <= 0 || charcnt < 0)
+            return false;
+        // Counts are below 2^31, the sum can't overflow 64 bits
+        int64_t blockSize = timecnt * timeSize + timecnt + typecnt * 6 + charcnt
+                            + leapcnt * (timeSize + 4) + isstdcnt + isutcnt;
+        if ((int64_t)(size - pos - 44) < blockSize)
+            return false;
+        if (pass == 0 && p[4] >= '2')
+        {
+            pos += 44 + blockSize;
+            timeSize = 8;
+            continue;
+        }
+
+        const unsigned char *times = p + pos + 44;
+        const unsigned char *idx = times + timecnt * timeSize;
+        const unsigned char *types = idx + timecnt;
+        std::vector<Offset> ttinfo(typecnt);
+        for (long i = 0; i < typecnt; i++)
+        {
+            ttinfo[i].gmtoff = (long)readInt(types + i * 6, 4);
+            ttinfo[i].isDst = types[i * 6 + 4] != 0;
+        }
+        transitions_m.clear();
+        offsets_m.clear();
+        initial_m = ttinfo[0];
+        for (long i = 0; i < timecnt; i++)
+        {
+            if (idx[i] >= typecnt)
+                return false;
+            addTransition(toTime(readInt(times + i * timeSize, timeSize)), ttinfo[idx[i]]);
+        }
+        if (offsets_m.empty())
+            addTransition(0, initial_m);
+        pos += 44 + blockSize;
+        break;
+    }
+
+    // Transitions after the last one in the file follow the footer rule.
+    hasRule_m = false;
+    if (timeSize == 8 && pos < size && p[pos] == '\n')
+    {
+        size_t end = data.find('\n', pos + 1);
+        if (end != std::string::npos && parseRule(data.substr(pos + 1, end - pos - 1)) && hasRule_m)
+        {
+            time_t last = transitions_m.back();
+            long year;
+            int mon, mday;
+            civilFromDays(floorDiv(last, 86400), &year, &mon, &mday);
+            for (; year <= LastRuleYear; year++)
+                addRule(year, last);
+        }
+    }
+    return true;
+}
+
+static const char* parseName(const char* p)
+{
+    if (*p == '<')
+    {
+        const char* end = strchr(p, '>');
+        return end ? end + 1 : 0;
+    }
+    const char* start = p;
+    while (isalpha(*p))
+        p++;
+    return p - start >= 3 ? p : 0;
+}
+
+/** Parses [+-]hh[:mm[:ss]] as seconds. */
+static const char* parseTime(const char* p, long *value)
+{
+    int sign = 1;
+    if (*p == '+' || *p == '-')
+        sign = (*p++ == '-') ? -1 : 1;
+    if (!isdigit(*p))
+        return 0;
+    long secs = 0;
+    for (int part = 0; part < 3; part++)
+    {
+        long n = 0;
+        while (isdigit(*p))
+            n = n * 10 + (*p++ - '0');
+        secs += n * (part == 0 ? 3600 : part == 1 ? 60 : 1);
+        if (part < 2 && *p == ':' && isdigit(p[1]))
+            p++;
+        else
+            break;
+    }
+    *value = sign * secs;
+    return p;
+}
+
+static const char* parseNumber(const char* p, int *value)
+{
+    if (!isdigit(*p))
+        return 0;
+    *value = 0;
+    while (isdigit(*p))
+        *value = *value * 10 + (*p++ - '0');
+    return p;
+}
+
+bool TimeZone::loadRule(const std::string &rule)
+{
+    if (!parseRule(rule))
+        return false;
+    transitions_m.clear();
+    offsets_m.clear();
+    initial_m = std_m;
+    addTransition(0, std_m);
+    if (hasRule_m)
+    {
+        for (int year = 1970; year <= LastRuleYear; year++)
+            addRule(year, 0);
+    }
+    return true;
+}
+
+bool TimeZone::parseRule(const std::string &rule)
+{
+    const char* p = parseName(rule.c_str());
+    long value;
+    if (!p || !(p = parseTime(p, &value)))
+        return false;
+    Offset std, dst;
+    std.gmtoff = -value;
+    std.isDst = false;
+    dst = std;
+    RuleDate dates[2];
+    bool hasDst = *p != 0;
+    if (hasDst)
+    {
+        if (!(p = parseName(p)))
+            return false;
+        dst.gmtoff = std.gmtoff + 3600;
+        dst.isDst = true;
+        if (*p != ',' && *p != 0)
+        {
+            if (!(p = parseTime(p, &value)))
+                return false;
+            dst.gmtoff = -value;
+        }
+        // Without dates, POSIX leaves the rule to the implementation.
+        std::string dateRule(*p ? p : ",M3.2.0,M11.1.0");
+        p = dateRule.c_str();
+        for (int i = 0; i < 2; i++)
+        {
+            RuleDate &date = dates[i];
+            if (*p++ != ',')
+                return false;
+            date.kind = 'D';
+            if (*p == 'M')
+            {
+                date.kind = *p++;
+                if (!(p = parseNumber(p, &date.mon)) || *p++ != '.' ||
+                        !(p = parseNumber(p, &date.week)) || *p++ != '.' ||
+                        !(p = parseNumber(p, &date.wday)))
+                    return false;
+                if (date.mon < 1 || date.mon > 12 || date.week < 1 || date.week > 5 || date.wday > 6)
+                    return false;
+            }
+            else
+            {
+                if (*p == 'J')
+                    date.kind = *p++;
+                if (!(p = parseNumber(p, &date.day)) || date.day > 365)
+                    return false;
+            }
+            date.time = 7200;
+            if (*p == '/' && !(p = parseTime(p + 1, &date.time)))
+                return false;
+        }
+        if (*p != 0)
+            return false;
+    }
+
+    std_m = std;
+    dst_m = dst;
+    start_m = dates[0];
+    end_m = dates[1];
+    hasRule_m = hasDst;
+    return true;
+}
+
+/** Adds the transitions of the rule in the given year that follow after. */
+void TimeZone::addRule(int year, time_t after)
+{
+    time_t times[2];
+    const RuleDate *dates[2] = { &start_m, &end_m };
+    for (int i = 0; i < 2; i++)
+    {
+        const RuleDate &date = *dates[i];
+        long day;
+        if (date.kind == 'M')
+        {
+            long first = daysFromCivil(year, date.mon, 1);
+            int wday = (int)((first % 7 + 11) % 7); // 1970-01-01 was a Thursday
+            int mday = 1 + (date.wday - wday + 7) % 7 + (date.week - 1) * 7;
+            static const int monthDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+            int days = monthDays[date.mon - 1] + (date.mon == 2 && isLeap(year));
+            while (mday > days)
+                mday -= 7;
+            day = first + mday - 1;
+        }
+        else if (date.kind == 'J')
+            day = daysFromCivil(year, 1, 1) + date.day - 1 + (isLeap(year) && date.day >= 60);
+        else
+            day = daysFromCivil(year, 1, 1) + date.day;
+        // The start is given in standard time, the end in daylight time.
+        times[i] = (time_t)day * 86400 + date.time - (i == 0 ? std_m.gmtoff : dst_m.gmtoff);
+    }
+    int order = times[0] < times[1] ? 0 : 1;
+    for (int i = 0; i < 2; i++)
+    {
+        int j = (i + order) % 2;
+        if (times[j] > after)
+            addTransition(times[j], j == 0 ? dst_m : std_m);
+    }
+}
+
+void TimeZone::addTransition(time_t time, const Offset& offset)
+{
+    if (!offsets_m.empty())
+    {
+        const Offset &last = offsets_m.back();
+        if (last.gmtoff == offset.gmtoff && last.isDst == offset.isDst)
+            return;
+    }
+    transitions_m.push_back(time);
+    offsets_m.push_back(offset);
+}
+
+int TimeZone::find(time_t time) const
+{
+    return std::upper_bound(transitions_m.begin(), transitions_m.end(), time) - transitions_m.begin() - 1;
+}
+
+const TimeZone::Offset& TimeZone::offsetAt(time_t time) const
+{
+    return period(find(time));
+}
+
+void TimeZone::toLocal(time_t time, struct tm *timeinfo) const
+{
+    if (!isLoaded())
+    {
+        localtime_r(&time, timeinfo);
+        return;
+    }
+    const Offset &offset = offsetAt(time);
+    long long local = (long long)time + offset.gmtoff;
+    long days = floorDiv(local, 86400);
+    long secs = (long)(local - (long long)days * 86400);
+    long year;
+    int mon, mday;
+    civilFromDays(days, &year, &mon, &mday);
+    timeinfo->tm_year = year - 1900;
+    timeinfo->tm_mon = mon - 1;
+    timeinfo->tm_mday = mday;
+    timeinfo->tm_hour = secs / 3600;
+    timeinfo->tm_min = secs / 60 % 60;
+    timeinfo->tm_sec = secs % 60;
+    timeinfo->tm_wday = (int)((days % 7 + 11) % 7);
+    timeinfo->tm_yday = days - daysFromCivil(year, 1, 1);
+    timeinfo->tm_isdst = offset.isDst;
+}
+
+time_t TimeZone::makeUtc(const struct tm *timeinfo)
+{
+    long year = timeinfo->tm_year + 1900L + floorDiv(timeinfo->tm_mon, 12);
+    int mon = timeinfo->tm_mon - floorDiv(timeinfo->tm_mon, 12) * 12;
+    return (time_t)(((long long)daysFromCivil(year, mon + 1, 1) + timeinfo->tm_mday - 1) * 86400
+                    + timeinfo->tm_hour * 3600LL + timeinfo->tm_min * 60LL + timeinfo->tm_sec);
+}
+
+time_t TimeZone::toUtc(struct tm *timeinfo) const
+{
+    if (!isLoaded())
+        return mktime(timeinfo);
+
+    long long local = makeUtc(timeinfo);
+
+    // Offsets never exceed 26 hours, so only the periods around the local
+    // time can contain it.
+    int first = find(local - 93600), last = find(local + 93600);
+    bool isDst = timeinfo->tm_isdst > 0;
+    int valid = -2, match = -2;
+    for (int i = first; i <= last; i++)
+    {
+        if (find(local - period(i).gmtoff) != i)
+            continue;
+        // Local times repeated by a backward transition resolve to the
+        // later one.
+        valid = i;
+        if (period(i).isDst == isDst)
+            match = i;
+    }
+
+    long gmtoff;
+    if (timeinfo->tm_isdst >= 0 && match == -2)
+    {
+        // Read the time with the offset of the requested kind nearest to it.
+        int pivot = valid != -2 ? valid : first;
+        long long time = local - period(pivot).gmtoff;
+        int before = pivot - 1, after = pivot + 1;
+        while (before >= -1 && period(before).isDst != isDst)
+            before--;
+        while (after < (int)offsets_m.size() && period(after).isDst != isDst)
+            after++;
+        if (before >= -1)
+            match = before;
+        if (after < (int)offsets_m.size() &&
+                (match == -2 || (long long)transitions_m[after] - time < time - (long long)transitions_m[before + 1]))
+            match = after;
+    }
+    if (timeinfo->tm_isdst >= 0 && match != -2)
+        gmtoff = period(match).gmtoff;
+    else if (valid != -2)
+        gmtoff = period(valid).gmtoff;
+    else
+    {
+        // Skipped by a forward transition: use the offset before it, which
+        // moves the time forward by the size of the gap.
+        gmtoff = period(first).gmtoff;
+        for (int i = first + 1; i <= last; i++)
+        {
+            if (local >= transitions_m[i] + period(i - 1).gmtoff && local < transitions_m[i] + period(i).gmtoff)
+                gmtoff = period(i - 1).gmtoff;
+        }
+    }
+
+    time_t time = (time_t)(local - gmtoff);
+    toLocal(time, timeinfo);
+    return time;
+}
+
+long TimeZone::getStandardOffset(time_t time) const
+{
+    if (!isLoaded())
+    {
+        struct tm gmt;
+        gmtime_r(&time, &gmt);
+        gmt.tm_isdst = 0;
+        return (long)(time - mktime(&gmt));
+    }
+    int i = find(time);
+    for (int j = i; j >= -1; j--)
+    {
+        if (!period(j).isDst)
+            return period(j).gmtoff;
+    }
+    for (int j = i + 1; j < (int)offsets_m.size(); j++)
+    {
+        if (!offsets_m[j].isDst)
+            return offsets_m[j].gmtoff;
+    }
+    return offsetAt(time).gmtoff;
+}
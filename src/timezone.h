@@ -0,0 +1,100 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef TIMEZONE_H
+#define TIMEZONE_H
+
+#include <ctime>
+#include <string>
+#include <vector>
+#include <istream>
+#include "config.h"
+#include "logger.h"
+
+/** Conversions between UTC and local civil time. The offsets of the zone
+ * are loaded once from tzdata (TZ or /etc/localtime) and looked up with a
+ * binary search, so the conversions are re-entrant and do not touch the
+ * libc timezone state. If no zone can be loaded, localtime_r and mktime
+ * are used instead. */
+class TimeZone
+{
+public:
+    TimeZone();
+
+    static TimeZone* instance();
+    static void reset()
+    {
+        if (instance_m)
+            delete instance_m;
+        instance_m = 0;
+    };
+
+    /** Loads a zone from a TZif file or a name relative to the zoneinfo
+     * directory, falling back to a POSIX TZ rule like "CET-1CEST,M3.5.0,M10.5.0/3". */
+    bool load(const std::string &name);
+    bool loadFile(std::istream &in);
+    bool loadRule(const std::string &rule);
+    bool isLoaded() const { return !offsets_m.empty(); };
+
+    /** Same as localtime_r. */
+    void toLocal(time_t time, struct tm *timeinfo) const;
+    /** Same as mktime: normalizes the fields and returns the matching UTC
+     * time. A tm_isdst of 0 or 1 reads the fields as standard or daylight
+     * time, -1 picks the offset in effect at that local time. Local times
+     * skipped by a forward transition are moved forward. */
+    time_t toUtc(struct tm *timeinfo) const;
+    /** Same as timegm: reads the fields as UTC, without normalizing them. */
+    static time_t makeUtc(const struct tm *timeinfo);
+    /** Offset to UTC in seconds without daylight saving. */
+    long getStandardOffset(time_t time) const;
+
+private:
+    struct Offset
+    {
+        long gmtoff;
+        bool isDst;
+    };
+    /** Index of the offset in effect at time, -1 before the first transition. */
+    int find(time_t time) const;
+    const Offset& period(int i) const { return i < 0 ? initial_m : offsets_m[i]; };
+    const Offset& offsetAt(time_t time) const;
+    bool parseRule(const std::string &rule);
+    void addRule(int year, time_t after);
+    void addTransition(time_t time, const Offset& offset);
+
+    /** Start of each period in UTC, with the offset in effect in it. */
+    std::vector<time_t> transitions_m;
+    std::vector<Offset> offsets_m;
+    Offset initial_m;
+
+    struct RuleDate
+    {
+        char kind; // 'M', 'J' or 'D' (zero-based day of year)
+        int mon, week, wday, day;
+        long time;
+    };
+    bool hasRule_m;
+    Offset std_m, dst_m;
+    RuleDate start_m, end_m;
+
+    static TimeZone* instance_m;
+    static Logger& logger_m;
+};
+
+#endif
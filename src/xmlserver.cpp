@@ -24,47 +24,715 @@
 #include "xmlserver.h"
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <vector>
 #include "ruleserver.h"
 #include "objectcontroller.h"
 #include "timermanager.h"
 #include "services.h"
 
+/** Number of events handled per wakeup, and of connections accepted. */
+static const int MaxEvents = 64;
+/** Notifications sent by a single writev. */
+static const int MaxIovecs = 64;
+/** Output buffered while a batch of messages is processed before it is
+ * written anyway. */
+static const size_t FlushThreshold = 64 * 1024;
+/** Milliseconds a read waits for the bus before the default value is
+ * sent, like Object::read(). */
+static const int ReadTimeout = 1000;
+
+std::string ClientConnection::configCache_m;
+uint64_t ClientConnection::configCacheVersion_m;
+Logger& ClientConnection::logger_m(Logger::getInstance("ClientConnection"));
+
+/** Microseconds since the epoch. */
+static int64_t microseconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+ConfigSaver::~ConfigSaver ()
+{
+    Stop ();
+    if (pipe_m != -1)
+        close (pipe_m);
+}
+
+void ConfigSaver::save (const std::string& filename)
+{
+    int fds[2];
+    if (pipe (fds) == -1)
+    {
+        error_m = errno;
+        done_m = true;
+        return;
+    }
+    // The child has a copy of the configuration as it is now.
+    pid_m = pth_fork ();
+    if (pid_m == 0)
+    {
+        close (fds[0]);
+        writeConfig (filename, fds[1]);
+        _exit (0);
+    }
+    close (fds[1]);
+    if (pid_m == -1)
+    {
+        error_m = errno;
+        close (fds[0]);
+        done_m = true;
+        return;
+    }
+    pipe_m = fds[0];
+    filename_m = filename;
+    Start ();
+}
+
+void ConfigSaver::Run (pth_sem_t * stop)
+{
+    std::string result;
+    char buf[64];
+    ssize_t len;
+    while ((len = pth_read (pipe_m, buf, sizeof(buf))) > 0)
+        result.append(buf, len);
+    int status;
+    pth_waitpid (pid_m, &status, 0);
+    std::stringstream report(result);
+    if (!(report >> error_m >> serialiseTime_m >> writeTime_m))
+        error_m = EIO;
+    if (!error_m)
+        infoStream("ConfigSaver") << "Config saved to " << filename_m << " (serialise " << serialiseTime_m
+                                  << " us, write " << writeTime_m << " us)" << endlog;
+    done_m = true;
+    // Not while the connection is being deleted
+    unsigned stopping = 0;
+    pth_sem_get_value (stop, &stopping);
+    if (con_m->server_m && !stopping)
+        con_m->server_m->wakeup (con_m);
+}
+
+void ConfigSaver::writeConfig (const std::string& filename, int fd)
+{
+    int64_t start = microseconds(), serialised = start;
+    std::stringstream tmp;
+    tmp << filename << ".tmp" << getpid();
+    int error = 0;
+    errno = 0;
+    try
+    {
+        ticpp::Document doc;
+        ticpp::Declaration decl("1.0", "", "");
+        doc.LinkEndChild(&decl);
+
+        ticpp::Element pConfig("config");
+
+        ticpp::Element pServices("services");
+        Services::instance()->exportXml(&pServices);
+        pConfig.LinkEndChild(&pServices);
+        ticpp::Element pObjects("objects");
+        ObjectController::instance()->exportXml(&pObjects);
+        pConfig.LinkEndChild(&pObjects);
+        ticpp::Element pRules("rules");
+        RuleServer::instance()->exportXml(&pRules);
+        pConfig.LinkEndChild(&pRules);
+        ticpp::Element pLogging("logging");
+        Logging::instance()->exportXml(&pLogging);
+        pConfig.LinkEndChild(&pLogging);
+
+        doc.LinkEndChild(&pConfig);
+        serialised = microseconds();
+        doc.SaveFile(tmp.str());
+    }
+    catch( ticpp::Exception& )
+    {
+        error = errno ? errno : EIO;
+    }
+
+    // The file replaces the old one only once it is on disk
+    int file = error ? -1 : open(tmp.str().c_str(), O_WRONLY);
+    if (file == -1 && !error)
+        error = errno;
+    if (file != -1)
+    {
+        if (fsync(file) == -1)
+            error = errno;
+        close(file);
+    }
+    if (!error && rename(tmp.str().c_str(), filename.c_str()) == -1)
+        error = errno;
+    if (error)
+        unlink(tmp.str().c_str());
+
+    std::stringstream report;
+    report << error << ' ' << serialised - start << ' ' << microseconds() - serialised;
+    std::string msg = report.str();
+    if (write(fd, msg.data(), msg.size()) == -1)
+        _exit(1);
+    close(fd);
+}
+
+NotificationFilter* NotificationFilter::create(ticpp::Element* pConfig)
+{
+    std::string id = pConfig->GetAttribute("id");
+    std::string gad = pConfig->GetAttribute("gad");
+    std::string type = pConfig->GetAttribute("type");
+    std::string minInterval = pConfig->GetAttribute("min-interval");
+    std::string deadband = pConfig->GetAttribute("deadband");
+    if (id.find_first_of("*?[") == std::string::npos && gad == "" && type == "" && minInterval == "" && deadband == "")
+        return 0;
+
+    NotificationFilter* filter = new NotificationFilter();
+    filter->id_m = id;
+    filter->type_m = type;
+    try
+    {
+        if (gad != "")
+        {
+            std::string::size_type dash = gad.find('-');
+            filter->gadMin_m = Object::ReadGroupAddr(gad.substr(0, dash));
+            filter->gadMax_m = dash == std::string::npos ? filter->gadMin_m : Object::ReadGroupAddr(gad.substr(dash + 1));
+        }
+        if (minInterval != "")
+            filter->minInterval_m = RuleServer::parseDuration(minInterval, false, true);
+        pConfig->GetAttributeOrDefault("deadband", &filter->deadband_m, 0.0);
+    }
+    catch( ... )
+    {
+        delete filter;
+        throw;
+    }
+    return filter;
+}
+
+bool NotificationFilter::matches(Object* object)
+{
+    if (id_m != "" && fnmatch(id_m.c_str(), object->getID(), 0) != 0)
+        return false;
+    if (type_m != "" && fnmatch(type_m.c_str(), object->getType().c_str(), 0) != 0)
+        return false;
+    // Objects without a group address only match when no range is given
+    eibaddr_t gad = object->getGad();
+    if ((gadMin_m != 0 || gadMax_m != 0xffff) && (gad == 0 || gad < gadMin_m || gad > gadMax_m))
+        return false;
+    return true;
+}
+
+/** Recognises the few message shapes answered without building a DOM.
+ * It only accepts what TinyXML would read the same way: anything else,
+ * including entities in attribute values, makes the caller fall back to
+ * the DOM, which also reports the errors. */
+class SimpleRequest
+{
+public:
+    struct Attribute
+    {
+        const char *name;
+        const char *value;
+        size_t length;
+    };
+
+    SimpleRequest(const std::string& msg) : p_m(msg.data()), end_m(msg.data() + msg.size()) {};
+
+    /** Reads "<name", does not move if the next tag is a different one. */
+    bool start(const char *name)
+    {
+        skipSpace();
+        size_t len = strlen(name);
+        if ((size_t)(end_m - p_m) < len + 2 || *p_m != '<' || memcmp(p_m + 1, name, len) != 0)
+            return false;
+        char c = p_m[len + 1];
+        if (c != '/' && c != '>' && !isSpace(c))
+            return false;
+        p_m += len + 1;
+        return true;
+    };
+
+    /** Reads the attributes of the tag opened by start() into attrs, a
+     * value is left to 0 if the attribute is missing. Returns 1 for an
+     * empty element, 2 for an element with content and 0 for anything
+     * else, or for attributes not listed in attrs. */
+    int attributes(Attribute *attrs, int count)
+    {
+        for (int i = 0; i < count; i++)
+            attrs[i].value = 0;
+        while (true)
+        {
+            skipSpace();
+            if (p_m == end_m)
+                return 0;
+            if (*p_m == '>')
+            {
+                p_m++;
+                return 2;
+            }
+            if (*p_m == '/')
+            {
+                if (end_m - p_m < 2 || p_m[1] != '>')
+                    return 0;
+                p_m += 2;
+                return 1;
+            }
+            const char *name = p_m;
+            while (p_m != end_m && *p_m != '=' && !isSpace(*p_m))
+                p_m++;
+            size_t nameLength = p_m - name;
+            skipSpace();
+            if (p_m == end_m || *p_m != '=')
+                return 0;
+            p_m++;
+            skipSpace();
+            if (p_m == end_m || (*p_m != '\'' && *p_m != '"'))
+                return 0;
+            char quote = *p_m++;
+            const char *value = p_m;
+            while (p_m != end_m && *p_m != quote)
+            {
+                if (*p_m == '&' || *p_m == '<' || (unsigned char)*p_m < 32)
+                    return 0;
+                p_m++;
+            }
+            if (p_m == end_m)
+                return 0;
+            Attribute *attr = 0;
+            for (int i = 0; i < count && !attr; i++)
+            {
+                if (strlen(attrs[i].name) == nameLength && memcmp(attrs[i].name, name, nameLength) == 0)
+                    attr = &attrs[i];
+            }
+            if (!attr || attr->value)
+                return 0;
+            attr->value = value;
+            attr->length = p_m - value;
+            p_m++;
+        }
+    };
+
+    /** Reads "</name>". */
+    bool end(const char *name)
+    {
+        skipSpace();
+        size_t len = strlen(name);
+        if ((size_t)(end_m - p_m) < len + 3 || p_m[0] != '<' || p_m[1] != '/' || memcmp(p_m + 2, name, len) != 0)
+            return false;
+        p_m += len + 2;
+        skipSpace();
+        if (p_m == end_m || *p_m != '>')
+            return false;
+        p_m++;
+        return true;
+    };
+
+    bool finished()
+    {
+        skipSpace();
+        return p_m == end_m;
+    };
+
+private:
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; };
+    void skipSpace()
+    {
+        while (p_m != end_m && isSpace(*p_m))
+            p_m++;
+    };
+
+    const char *p_m;
+    const char *end_m;
+};
+
+/** Appends an attribute escaped and quoted the way TinyXML prints it. */
+static void appendAttribute(std::string& out, const char *name, const char *value, size_t length)
+{
+    bool quot = memchr(value, '"', length) != 0;
+    out.push_back(' ');
+    out.append(name);
+    out.append(quot ? "='" : "=\"");
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = value[i];
+        if (c == '&' && i + 2 < length && value[i + 1] == '#' && value[i + 2] == 'x')
+        {
+            // Character references are passed through
+            do
+                out.push_back(value[i++]);
+            while (i < length - 1 && value[i] != ';');
+            i--;
+        }
+        else if (c == '&')
+            out.append("&amp;");
+        else if (c == '<')
+            out.append("&lt;");
+        else if (c == '>')
+            out.append("&gt;");
+        else if (c == '"')
+            out.append("&quot;");
+        else if (c == '\'')
+            out.append("&apos;");
+        else if (c < 32)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "&#x%02X;", c);
+            out.append(buf);
+        }
+        else
+            out.push_back(c);
+    }
+    out.push_back(quot ? '\'' : '"');
+}
+
+static void putUint32(std::string& out, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((char)(value >> shift));
+}
+
+static uint32_t getUint32(const char *data)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/** Sets the length of the compact frame starting at start. */
+static void setFrameLength(std::string& out, size_t start)
+{
+    uint32_t len = out.size() - start - 4;
+    for (int i = 0; i < 4; i++)
+        out[start + i] = (char)(len >> (24 - 8 * i));
+}
+
+/** WebSocket frame opcodes. */
+enum { WebSocketContinuation = 0x0, WebSocketText = 0x1, WebSocketBinary = 0x2,
+       WebSocketClose = 0x8, WebSocketPing = 0x9, WebSocketPong = 0xa };
+
+/** Inserts at start the header of an unmasked, final WebSocket frame
+ * holding the rest of out. */
+static void insertWebSocketHeader(std::string& out, size_t start, int opcode)
+{
+    uint64_t len = out.size() - start;
+    char header[10];
+    int size = 2;
+    header[0] = (char)(0x80 | opcode);
+    if (len < 126)
+        header[1] = (char)len;
+    else if (len < 0x10000)
+    {
+        header[1] = 126;
+        header[2] = (char)(len >> 8);
+        header[3] = (char)len;
+        size = 4;
+    }
+    else
+    {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++)
+            header[2 + i] = (char)(len >> (56 - 8 * i));
+        size = 10;
+    }
+    out.insert(start, header, size);
+}
+
+static uint32_t rotateLeft(uint32_t value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+/** SHA-1 digest of data, only used for the WebSocket handshake. */
+static std::string sha1(const std::string& data)
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    std::string msg(data);
+    uint64_t bits = (uint64_t)data.size() * 8;
+    msg.push_back((char)0x80);
+    while (msg.size() % 64 != 56)
+        msg.push_back('\0');
+    for (int shift = 56; shift >= 0; shift -= 8)
+        msg.push_back((char)(bits >> shift));
+
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64)
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = getUint32(msg.data() + chunk + 4 * i);
+        for (int i = 16; i < 80; i++)
+            w[i] = rotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++)
+        {
+            uint32_t f, k;
+            if (i < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            }
+            else if (i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            }
+            else if (i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = rotateLeft(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotateLeft(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    std::string digest;
+    for (int i = 0; i < 5; i++)
+        putUint32(digest, h[i]);
+    return digest;
+}
+
+static std::string base64(const std::string& data)
+{
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < data.size(); i += 3)
+    {
+        uint32_t n = (uint32_t)(unsigned char)data[i] << 16;
+        if (i + 1 < data.size())
+            n |= (uint32_t)(unsigned char)data[i + 1] << 8;
+        if (i + 2 < data.size())
+            n |= (unsigned char)data[i + 2];
+        out.push_back(chars[(n >> 18) & 0x3f]);
+        out.push_back(chars[(n >> 12) & 0x3f]);
+        out.push_back(i + 1 < data.size() ? chars[(n >> 6) & 0x3f] : '=');
+        out.push_back(i + 2 < data.size() ? chars[n & 0x3f] : '=');
+    }
+    return out;
+}
+
+/** Whether the comma separated list of an HTTP header has token, case
+ * insensitive. */
+static bool hasToken(const std::string& list, const char *token)
+{
+    size_t len = strlen(token);
+    for (size_t pos = 0; pos < list.size(); )
+    {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+        size_t start = list.find_first_not_of(" \t", pos);
+        size_t last = list.find_last_not_of(" \t", end - 1);
+        if (start < end && last != std::string::npos && last + 1 - start == len && strncasecmp(list.data() + start, token, len) == 0)
+            return true;
+        pos = end + 1;
+    }
+    return false;
+}
+
+/** Objects whose values the compact protocol carries as numbers, the ones
+ * for which toNumber() is the value shown by toString(). */
+static bool isNumber(Object *object)
+{
+    if (dynamic_cast<RGBWObject*>(object))
+        return false;
+    return dynamic_cast<SwitchingObject*>(object) || dynamic_cast<ValueObject*>(object) ||
+           dynamic_cast<ValueObject32*>(object) || dynamic_cast<IntObject*>(object) ||
+           dynamic_cast<S64Object*>(object) || dynamic_cast<U8Object*>(object) ||
+           dynamic_cast<U16Object*>(object) || dynamic_cast<U32Object*>(object);
+}
+
+static void putValue(std::string& out, Object *object, bool number)
+{
+    if (number)
+    {
+        double value = object->getFloatValue();
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        out.push_back((char)ClientConnection::NumberValue);
+        putUint32(out, (uint32_t)(bits >> 32));
+        putUint32(out, (uint32_t)bits);
+    }
+    else
+    {
+        out.push_back((char)ClientConnection::StringValue);
+        out.append(object->getValue());
+    }
+}
+
+static double getDouble(const char *data)
+{
+    uint64_t bits = ((uint64_t)getUint32(data) << 32) | getUint32(data + 4);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void appendObjectValue(std::string& out, Object *obj)
+{
+    const char *id = obj->getID();
+    std::string value = obj->getValue();
+    out.append("\t\t<object");
+    appendAttribute(out, "id", id, strlen(id));
+    appendAttribute(out, "value", value.data(), value.size());
+    out.append(" />\n");
+}
+
+const int XmlServer::DefaultBacklog;
+const int XmlServer::DefaultMaxMessageSize;
+const int XmlServer::DefaultNotifyQueueSize;
+const char ClientConnection::Hello[5] = { '\0', 'L', 'K', 'B', 1 };
+const size_t ClientConnection::HelloSize;
+
+XmlServer::XmlServer (int backlog)
+    : fd_m(-1), backlog_m(backlog), maxMessageSize_m(DefaultMaxMessageSize),
+      notifyQueueSize_m(DefaultNotifyQueueSize), slowConsumer_m(Coalesce), pollfd_m(-1)
+{
+    pth_sem_init (&wakeup_m);
+}
+
 XmlServer::~XmlServer ()
 {
     Stop ();
-    std::list<ClientConnection*>::iterator it;
-    for (it = connections_m.begin(); it != connections_m.end(); it++)
+    std::set<ClientConnection*> connections;
+    connections.swap(connections_m);
+    std::set<ClientConnection*>::iterator it;
+    for (it = connections.begin(); it != connections.end(); it++)
     {
         (*it)->RemoveServer();
-        (*it)->StopDelete();
+        delete (*it);
     }
-    if (!connections_m.empty())
-        pth_sleep (1); // Wait some time to let client connections close
-
+    if (pollfd_m != -1)
+        close (pollfd_m);
     close (fd_m);
 }
 
 bool
 XmlServer::deregister (ClientConnection * con)
 {
-    connections_m.remove(con);
+    unwatch(con);
+    connections_m.erase(con);
+    executing_m.remove(con);
+    flushing_m.remove(con);
+    throttled_m.erase(con);
     return 1;
 }
 
+void XmlServer::waitExecute (ClientConnection *con)
+{
+    if (std::find(executing_m.begin(), executing_m.end(), con) == executing_m.end())
+        executing_m.push_back(con);
+}
+
+void XmlServer::wakeup (ClientConnection *con)
+{
+    if (!con->wakeupPending_m)
+    {
+        con->wakeupPending_m = true;
+        flushing_m.push_back(con);
+    }
+    pth_sem_inc (&wakeup_m, FALSE);
+}
+
+void XmlServer::throttle (ClientConnection *con)
+{
+    if (throttled_m.insert(con).second)
+        pth_sem_inc (&wakeup_m, FALSE);
+}
+
+void XmlServer::update (ClientConnection *con)
+{
+    int events = con->getEvents();
+    if (con->isClosed() || events == con->watched_m)
+        return;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    ev.events = (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+    ev.data.ptr = con;
+    if (epoll_ctl (pollfd_m, con->watched_m == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, con->getFd(), &ev) == -1)
+    {
+        errorStream("XmlServer") << "Unable to watch client connection: " << strerror(errno) << endlog;
+        con->disconnect();
+        return;
+    }
+#endif
+    con->watched_m = events;
+}
+
+void XmlServer::unwatch (ClientConnection *con)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (con->watched_m != -1)
+    {
+        struct epoll_event ev;
+        epoll_ctl (pollfd_m, EPOLL_CTL_DEL, con->getFd(), &ev);
+    }
+#endif
+    con->watched_m = -1;
+}
+
 XmlServer* XmlServer::create(ticpp::Element* pConfig)
 {
     std::string type = pConfig->GetAttributeOrDefault("type", "inet");
+    int backlog;
+    pConfig->GetAttributeOrDefault("backlog", &backlog, DefaultBacklog);
+    if (backlog <= 0)
+        throw ticpp::Exception("XmlServer: backlog must be positive");
+    int maxMessageSize;
+    pConfig->GetAttributeOrDefault("max-message-size", &maxMessageSize, DefaultMaxMessageSize);
+    if (maxMessageSize <= 0)
+        throw ticpp::Exception("XmlServer: max-message-size must be positive");
+    int notifyQueueSize;
+    pConfig->GetAttributeOrDefault("notify-queue-size", &notifyQueueSize, DefaultNotifyQueueSize);
+    if (notifyQueueSize <= 0)
+        throw ticpp::Exception("XmlServer: notify-queue-size must be positive");
+    std::string slowConsumer = pConfig->GetAttributeOrDefault("slow-consumer", "coalesce");
+    SlowConsumerPolicy policy;
+    if (slowConsumer == "coalesce")
+        policy = Coalesce;
+    else if (slowConsumer == "drop")
+        policy = Drop;
+    else if (slowConsumer == "disconnect")
+        policy = Disconnect;
+    else
+    {
+        std::stringstream msg;
+        msg << "XmlServer: slow-consumer policy not supported: '" << slowConsumer << "'" << std::endl;
+        throw ticpp::Exception(msg.str());
+    }
+    XmlServer* server;
     if (type == "inet")
     {
         int port = 0;
         pConfig->GetAttributeOrDefault("port", &port, 1028);
-        return new XmlInetServer(port);
+        server = new XmlInetServer(port, backlog);
     }
     else if (type == "unix")
     {
         std::string path = pConfig->GetAttributeOrDefault("path", "/tmp/xmlserver.sock");
-        return new XmlUnixServer(path.c_str());
+        server = new XmlUnixServer(path.c_str(), backlog);
     }
     else
     {
@@ -72,9 +740,26 @@ XmlServer* XmlServer::create(ticpp::Element* pConfig)
         msg << "XmlServer: server type not supported: '" << type << "'" << std::endl;
         throw ticpp::Exception(msg.str());
     }
+    server->setMaxMessageSize(maxMessageSize);
+    server->setNotifyQueue(notifyQueueSize, policy);
+    return server;
+}
+
+void XmlServer::exportOptions(ticpp::Element* pConfig)
+{
+    if (backlog_m != DefaultBacklog)
+        pConfig->SetAttribute("backlog", backlog_m);
+    if (maxMessageSize_m != DefaultMaxMessageSize)
+        pConfig->SetAttribute("max-message-size", maxMessageSize_m);
+    if (notifyQueueSize_m != DefaultNotifyQueueSize)
+        pConfig->SetAttribute("notify-queue-size", notifyQueueSize_m);
+    if (slowConsumer_m == Drop)
+        pConfig->SetAttribute("slow-consumer", "drop");
+    else if (slowConsumer_m == Disconnect)
+        pConfig->SetAttribute("slow-consumer", "disconnect");
 }
 
-XmlInetServer::XmlInetServer (int port)
+XmlInetServer::XmlInetServer (int port, int backlog) : XmlServer(backlog)
 {
     struct sockaddr_in addr;
     int reuse = 1;
@@ -100,19 +785,20 @@ XmlInetServer::XmlInetServer (int port)
         throw ticpp::Exception(msg.str());
     }
 
-    if (listen (fd_m, 10) == -1)
+    if (listen (fd_m, backlog_m) == -1)
         throw ticpp::Exception("XmlServer: Unable to listen on TCP socket");
 
-    Start ();
+    startPolling ();
 }
 
 void XmlInetServer::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "inet");
     pConfig->SetAttribute("port", port_m);
+    exportOptions(pConfig);
 }
 
-XmlUnixServer::XmlUnixServer (const char *path)
+XmlUnixServer::XmlUnixServer (const char *path, int backlog) : XmlServer(backlog)
 {
     struct sockaddr_un addr;
     addr.sun_family = AF_LOCAL;
@@ -135,575 +821,1726 @@ XmlUnixServer::XmlUnixServer (const char *path)
         throw ticpp::Exception(msg.str());
     }
 
-    if (listen (fd_m, 10) == -1)
+    if (listen (fd_m, backlog_m) == -1)
         throw ticpp::Exception("XmlServer: Unable to listen on UNIX socket");
 
-    Start ();
+    startPolling ();
 }
 
 void XmlUnixServer::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "unix");
     pConfig->SetAttribute("path", path_m);
+    exportOptions(pConfig);
+}
+
+void XmlServer::startPolling ()
+{
+    fcntl (fd_m, F_SETFL, fcntl (fd_m, F_GETFL) | O_NONBLOCK);
+#ifdef HAVE_SYS_EPOLL_H
+    pollfd_m = epoll_create (MaxEvents);
+    if (pollfd_m == -1)
+        throw ticpp::Exception("XmlServer: Unable to create epoll instance");
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+    if (epoll_ctl (pollfd_m, EPOLL_CTL_ADD, fd_m, &ev) == -1)
+        throw ticpp::Exception("XmlServer: Unable to watch server socket");
+#endif
+    Start ();
+}
+
+void XmlServer::acceptConnections ()
+{
+    // Bounded, so that a burst of new clients does not delay the others.
+    for (int i = 0; i < MaxEvents; i++)
+    {
+        int cfd = accept (fd_m, 0, 0);
+        if (cfd == -1)
+        {
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                errorStream("XmlServer") << "Unable to accept connection: " << strerror(errno) << endlog;
+                pth_usleep (100000);
+            }
+            return;
+        }
+        fcntl (cfd, F_SETFL, fcntl (cfd, F_GETFL) | O_NONBLOCK);
+        ClientConnection *c = new ClientConnection (this, cfd);
+        connections_m.insert(c);
+        update(c);
+    }
+}
+
+void XmlServer::dispatch (ClientConnection *con, int events)
+{
+    if (con == 0)
+    {
+        acceptConnections ();
+        return;
+    }
+    if (events & (POLLERR | POLLHUP))
+        con->disconnect ();
+    if (events & POLLOUT)
+        con->onWritable ();
+    if (events & POLLIN)
+        con->onReadable ();
+    if (!con->isClosed())
+        update(con);
+    else if (!con->isExecuting())
+        delete con;
+    else
+        unwatch(con); // Deleted along with its actions once they finish
+}
+
+void XmlServer::checkExecuting ()
+{
+    std::list<ClientConnection*>::iterator it = executing_m.begin();
+    while (it != executing_m.end())
+    {
+        ClientConnection *con = *it;
+        if (!con->checkExecute ())
+        {
+            it++;
+            continue;
+        }
+        it = executing_m.erase(it);
+        // Messages received meanwhile were left in the socket
+        dispatch (con, POLLIN);
+    }
+}
+
+void XmlServer::flushNotifications ()
+{
+    while (!flushing_m.empty())
+    {
+        ClientConnection *con = flushing_m.front();
+        flushing_m.pop_front();
+        con->wakeupPending_m = false;
+        dispatch (con, POLLOUT);
+    }
+}
+
+int64_t XmlServer::checkThrottled ()
+{
+    int64_t now = TimerManager::now(), next = -1;
+    std::set<ClientConnection*>::iterator it = throttled_m.begin();
+    while (it != throttled_m.end())
+    {
+        int64_t deadline = (*it)->sendThrottled (now);
+        if (deadline == -1)
+            throttled_m.erase(it++);
+        else
+        {
+            if (next == -1 || deadline < next)
+                next = deadline;
+            it++;
+        }
+    }
+    return next == -1 ? -1 : std::max(next - now, (int64_t)1);
 }
 
 void XmlServer::Run (pth_sem_t *stop1)
 {
     pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t wakeup = pth_event (PTH_EVENT_SEM, &wakeup_m);
+    pth_event_concat (stop, wakeup, NULL);
     while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
     {
-        int cfd;
-        cfd = pth_accept_ev (fd_m, 0, 0, stop);
-        if (cfd != -1)
+        int64_t timeout = checkThrottled ();
+        pth_sem_set_value (&wakeup_m, 0);
+        flushNotifications ();
+        // Execute requests are checked every second until they complete,
+        // reads as often as RuleServer::initialize waits for the bus.
+        std::list<ClientConnection*>::iterator con;
+        for (con = executing_m.begin(); con != executing_m.end(); con++)
+        {
+            int wait = (*con)->isReading() ? 10 : 1000;
+            if (timeout == -1 || timeout > wait)
+                timeout = wait;
+        }
+        struct timeval tv;
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+#ifdef HAVE_SYS_EPOLL_H
+        struct epoll_event events[MaxEvents];
+        fd_set fds;
+        FD_ZERO (&fds);
+        FD_SET (pollfd_m, &fds);
+        int n = pth_select_ev (pollfd_m + 1, &fds, 0, 0, timeout == -1 ? 0 : &tv, stop);
+        if (n > 0)
+            n = epoll_wait (pollfd_m, events, MaxEvents, 0);
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t ev = events[i].events;
+            dispatch ((ClientConnection*)events[i].data.ptr,
+                      (ev & EPOLLIN ? POLLIN : 0) | (ev & EPOLLOUT ? POLLOUT : 0) |
+                      (ev & EPOLLERR ? POLLERR : 0) | (ev & EPOLLHUP ? POLLHUP : 0));
+        }
+#else
+        std::vector<struct pollfd> fds;
+        std::vector<ClientConnection*> cons;
+        struct pollfd pfd;
+        pfd.fd = fd_m;
+        pfd.events = POLLIN;
+        fds.push_back(pfd);
+        cons.push_back(0);
+        std::set<ClientConnection*>::iterator it;
+        for (it = connections_m.begin(); it != connections_m.end(); it++)
+        {
+            if ((*it)->isClosed() && (*it)->isExecuting())
+                continue;
+            pfd.fd = (*it)->getFd();
+            pfd.events = (*it)->getEvents();
+            fds.push_back(pfd);
+            cons.push_back(*it);
+        }
+        int n = pth_poll_ev (&fds[0], fds.size(), timeout, stop);
+        for (unsigned int i = 0; n > 0 && i < fds.size(); i++)
         {
-            ClientConnection *c = new ClientConnection (this, cfd);
-            connections_m.push_back(c);
-            c->Start ();
+            if (fds[i].revents)
+                dispatch (cons[i], fds[i].revents);
         }
+#endif
+        checkExecuting ();
     }
+    pth_event_isolate (wakeup);
+    pth_event_free (wakeup, PTH_FREE_THIS);
     pth_event_free (stop, PTH_FREE_THIS);
 }
 
 ClientConnection::ClientConnection (XmlServer *server, int fd)
+    : fd_m(fd), server_m(server), closed_m(false), scanned_m(0), protocol_m(UnknownProtocol), replyStart_m(0), closing_m(false),
+      keepAlive_m(true), continueSent_m(false), fragmented_m(false), reading_m(false), watched_m(-1),
+      overflow_m(false), wakeupPending_m(false), sendSeq_m(false), saver_m(0), execDeadline_m(0), execOngoing_m(false), readDeadline_m(0)
 {
-    fd_m = fd;
-    server_m = server;
+    maxMessageSize_m = server ? server->getMaxMessageSize() : XmlServer::DefaultMaxMessageSize;
+    if (server)
+        setNotifyQueue (server->getNotifyQueueSize(), server->getSlowConsumerPolicy());
+    else
+        setNotifyQueue (XmlServer::DefaultNotifyQueueSize, XmlServer::Coalesce);
 }
 
 ClientConnection::~ClientConnection ()
 {
-    NotifyList_t::iterator it;
-    for (it = notifyList_m.begin(); it != notifyList_m.end(); it++)
+    unregisterAll ();
+    std::vector<ObjectHandle>::iterator handle;
+    for (handle = handles_m.begin(); handle != handles_m.end(); handle++)
+        (*handle).object->decRefCount();
+    while (!execActions_m.empty())
     {
-        (*it)->removeChangeListener(this);
-        (*it)->decRefCount();
+        delete execActions_m.front();
+        execActions_m.pop_front();
+    }
+    delete saver_m;
+    while (!pendingReads_m.empty())
+    {
+        pendingReads_m.front()->decRefCount();
+        pendingReads_m.pop_front();
     }
-    notifyList_m.clear();
     if (server_m)
         server_m->deregister (this);
     close (fd_m);
 }
 
-void ClientConnection::Run (pth_sem_t * stop1)
+int ClientConnection::getEvents ()
 {
-    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
-    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    // Requests are processed one at a time, the next one is left
+    // in the socket until the actions of an execute have finished.
+    return (isExecuting() || closing_m ? 0 : POLLIN) | (outbuf_m.empty() && notifyQueue_m.empty() ? 0 : POLLOUT);
+}
+
+void ClientConnection::disconnect ()
+{
+    if (closed_m)
+        return;
+    closed_m = true;
+    outbuf_m.clear();
+    notifyQueue_m.clear();
+    // Reported as a hangup, which lets the server thread delete the
+    // connection even if it was closed from another thread.
+    shutdown (fd_m, SHUT_RDWR);
+}
+
+void ClientConnection::onReadable ()
+{
+    int ret = 0;
+    reading_m = true;
+    while (!closed_m && !closing_m && !isExecuting() && (ret = readmessage (NULL)) == 1)
+        processMessage ();
+    reading_m = false;
+    // Pipelined requests get their replies in as few writes as possible,
+    // the server updates the events to watch afterwards.
+    onWritable ();
+    if (ret == -1)
+        disconnect ();
+    else if (ret == 0 && msgbuf_m.empty())
     {
-        if (readmessage (stop) == -1)
-            break;
-        std::string msgType;
-        try
-        {
-            // Load a document
-            ticpp::Document doc;
-            debugStream("ClientConnection") << "PROCESSING MESSAGE:" << endlog << msg_m << endlog << "END OF MESSAGE" << endlog;
-            doc.LoadFromString(msg_m);
+        // Idle clients keep no buffers
+        msgbuf_m.release();
+        std::string().swap(msg_m);
+    }
+}
 
-            ticpp::Element* pMsg = doc.FirstChildElement();
-            msgType = pMsg->Value();
-            if (msgType == "read")
-            {
-                ticpp::Element* pRead = pMsg->FirstChildElement();
-                if (pRead->Value() == "object")
-                {
-                    std::string id = pRead->GetAttribute("id");
-                    Object* obj = ObjectController::instance()->getObject(id);
-                    std::stringstream msg;
-                    msg << "<read status='success'>" << obj->getValue() << "</read>" << std::endl;
-                    obj->decRefCount();
-                    debugStream("ClientConnection") << "SENDING MESSAGE:" << endlog << msg.str() << endlog << "END OF MESSAGE" << endlog;
-                    sendmessage (msg.str(), stop);
-                }
-                else if (pRead->Value() == "objects")
+void ClientConnection::onWritable ()
+{
+    while (!closed_m && !(outbuf_m.empty() && notifyQueue_m.empty()))
+    {
+        struct iovec iov[MaxIovecs];
+        int count = 0;
+        if (!outbuf_m.empty())
+        {
+            iov[count].iov_base = (void*)outbuf_m.data();
+            iov[count++].iov_len = outbuf_m.size();
+        }
+        std::deque<Notification>::iterator it;
+        for (it = notifyQueue_m.begin(); it != notifyQueue_m.end() && count < MaxIovecs; it++)
+        {
+            iov[count].iov_base = (void*)(*it).msg.data();
+            iov[count++].iov_len = (*it).msg.size();
+        }
+        ssize_t i = writev (fd_m, iov, count);
+        if (i > 0)
+            consume (i);
+        else if (i == -1 && errno == EINTR)
+            continue;
+        else if (i == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        else
+            disconnect ();
+    }
+    if (closing_m)
+        disconnect ();
+}
+
+void ClientConnection::consume (size_t len)
+{
+    size_t n = std::min(len, outbuf_m.size());
+    outbuf_m.erase(0, n);
+    len -= n;
+    while (len > 0)
+    {
+        Notification& notification = notifyQueue_m.front();
+        // What is left of a notification is sent before the next ones.
+        if (len < notification.msg.size())
+            outbuf_m.assign(notification.msg, len, std::string::npos);
+        len -= std::min(len, notification.msg.size());
+        notifyQueue_m.pop_front();
+    }
+    if (notifyQueue_m.empty())
+        overflow_m = false;
+}
+
+void ClientConnection::commitNotifications ()
+{
+    // Replies must not overtake the notifications queued before them.
+    std::deque<Notification>::iterator it;
+    for (it = notifyQueue_m.begin(); it != notifyQueue_m.end(); it++)
+        outbuf_m.append((*it).msg);
+    notifyQueue_m.clear();
+    overflow_m = false;
+}
+
+bool ClientConnection::checkExecute ()
+{
+    if (isReading())
+    {
+        bool expired = TimerManager::now() >= readDeadline_m;
+        std::list<Object*>::iterator it = pendingReads_m.begin();
+        while (it != pendingReads_m.end())
+        {
+            if (!(*it)->isInitialized() && !expired)
+            {
+                ++it;
+                continue;
+            }
+            if (!(*it)->isInitialized())
+            {
+                logger_m.warnStream() << "No answer to read request for object " << (*it)->getID() << endlog;
+                (*it)->endRead();
+            }
+            (*it)->decRefCount();
+            it = pendingReads_m.erase(it);
+        }
+        if (isReading())
+            return false;
+        if (!closed_m)
+            processMessage ();
+        return !isReading();
+    }
+    if (saver_m)
+    {
+        if (!saver_m->isDone())
+            return false;
+        if (saver_m->getError())
+        {
+            errorStream("ClientConnection") << "Unable to write config to file: " << strerror(saver_m->getError()) << endlog;
+            sendreject ("Error writing config to file", "admin");
+        }
+        else
+        {
+            std::stringstream msg;
+            msg << "<admin status='success' serialise-ms='" << saver_m->getSerialiseTime() / 1000.0
+                << "' write-ms='" << saver_m->getWriteTime() / 1000.0 << "'/>" << std::endl;
+            sendmessage (msg.str());
+        }
+        delete saver_m;
+        saver_m = 0;
+        return true;
+    }
+    bool expired = time(0) >= execDeadline_m;
+    while (!execActions_m.empty() && (expired || execActions_m.front()->isFinished()))
+    {
+        delete execActions_m.front();
+        execActions_m.pop_front();
+    }
+    if (!execActions_m.empty())
+    {
+        // An HTTP request gets a single reply
+        if (!execOngoing_m && protocol_m != HttpProtocol)
+            sendmessage ("<execute status='ongoing'/>\n");
+        execOngoing_m = true;
+        return false;
+    }
+    if (expired)
+        sendmessage ("<execute status='timeout'/>\n");
+    else
+        sendmessage ("<execute status='success'/>\n");
+    return true;
+}
+
+void ClientConnection::processMessage ()
+{
+    if (protocol_m == CompactProtocol)
+    {
+        processFrame ();
+        return;
+    }
+    if (processSimpleMessage ())
+        return;
+    std::string msgType;
+    try
+    {
+        // Load a document
+        ticpp::Document doc;
+        debugStream("ClientConnection") << "PROCESSING MESSAGE:" << endlog << msg_m << endlog << "END OF MESSAGE" << endlog;
+        doc.LoadFromString(msg_m);
+
+        ticpp::Element* pMsg = doc.FirstChildElement();
+        msgType = pMsg->Value();
+        if (msgType == "read")
+        {
+            ticpp::Element* pRead = pMsg->FirstChildElement();
+            if (pRead->Value() == "object")
+            {
+                std::string id = pRead->GetAttribute("id");
+                Object* obj = ObjectController::instance()->getObject(id);
+                if (!isValueKnown(obj))
                 {
-                    if (pRead->NoChildren())
-                    {
-                        ObjectController::instance()->exportObjectValues(pRead);
-                    }
-                    else
+                    obj->decRefCount();
+                    return;
+                }
+                std::stringstream msg;
+                msg << "<read status='success'>" << obj->getValue() << "</read>" << std::endl;
+                obj->decRefCount();
+                debugStream("ClientConnection") << "SENDING MESSAGE:" << endlog << msg.str() << endlog << "END OF MESSAGE" << endlog;
+                sendmessage (msg.str());
+            }
+            else if (pRead->Value() == "objects")
+            {
+                if (pRead->NoChildren())
+                {
+                    std::list<Object*> objects = ObjectController::instance()->getObjects();
+                    bool known = areValuesKnown(objects);
+                    for (std::list<Object*>::iterator it = objects.begin(); it != objects.end(); it++)
+                        (*it)->decRefCount();
+                    if (!known)
+                        return;
+                    ObjectController::instance()->exportObjectValues(pRead);
+                }
+                else
+                {
+                    ticpp::Iterator< ticpp::Element > pObjects;
+                    for ( pObjects = pRead->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
                     {
-                        ticpp::Iterator< ticpp::Element > pObjects;
-                        for ( pObjects = pRead->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
+                        if (pObjects->Value() == "object")
                         {
-                            if (pObjects->Value() == "object")
-                            {
-                                std::string id = pObjects->GetAttribute("id");
-                                Object* obj = ObjectController::instance()->getObject(id);
+                            std::string id = pObjects->GetAttribute("id");
+                            Object* obj = ObjectController::instance()->getObject(id);
+                            if (isValueKnown(obj))
                                 pObjects->SetAttribute("value", obj->getValue());
-                                obj->decRefCount();
-                            }
-                            else
-                                throw "Unknown objects element";
+                            obj->decRefCount();
                         }
+                        else
+                            throw "Unknown objects element";
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
+                    if (isReading())
+                        return;
                 }
-                else if (pRead->Value() == "config")
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
+            }
+            else if (pRead->Value() == "changes")
+            {
+                // Registering in the same message leaves no change between
+                // the reply and the first notification unsent.
+                uint64_t since;
+                int64_t epoch;
+                pRead->GetAttributeOrDefault("since", &since, 0);
+                pRead->GetAttributeOrDefault("epoch", &epoch, 0);
+                bool notify = pRead->GetAttribute("notify") == "true";
+                ObjectController* controller = ObjectController::instance();
+                if (!controller->exportChanges(pRead, since, epoch))
+                    pRead->SetAttribute("snapshot", "true");
+                pRead->SetAttribute("epoch", controller->getEpoch());
+                pRead->SetAttribute("seq", controller->getSeq());
+                if (notify)
                 {
-                    ticpp::Element* pConfig = pRead->FirstChildElement(false);
-                    if (pConfig == 0)
-                    {
-                        ticpp::Element objects("objects");
-                        ObjectController::instance()->exportXml(&objects);
-                        pRead->LinkEndChild(&objects);
-
-                        ticpp::Element rules("rules");
-                        RuleServer::instance()->exportXml(&rules);
-                        pRead->LinkEndChild(&rules);
-
-                        ticpp::Element services("services");
-                        Services::instance()->exportXml(&services);
-                        pRead->LinkEndChild(&services);
-
-                        ticpp::Element logging("logging");
-                        Logging::instance()->exportXml(&logging);
-                        pRead->LinkEndChild(&logging);
-                    }
-                    else if (pConfig->Value() == "objects")
-                    {
-                        ObjectController::instance()->exportXml(pConfig);
-                    }
-                    else if (pConfig->Value() == "rules")
-                    {
-                        RuleServer::instance()->exportXml(pConfig);
-                    }
-                    else if (pConfig->Value() == "services")
-                    {
-                        Services::instance()->exportXml(pConfig);
-                    }
-                    else if (pConfig->Value() == "logging")
-                    {
-                        Logging::instance()->exportXml(pConfig);
-                    }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
+                    registerAll ();
+                    sendSeq_m = true;
                 }
-                else if (pRead->Value() == "status")
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
+            }
+            else if (pRead->Value() == "config")
+            {
+                ticpp::Element* pConfig = pRead->FirstChildElement(false);
+                if (pConfig == 0)
                 {
-                    ticpp::Element* pConfig = pRead->FirstChildElement(false);
-                    if (pConfig == 0)
-                    {
-                        ticpp::Element timers("timers");
-                        Services::instance()->getTimerManager()->statusXml(&timers);
-                        pRead->LinkEndChild(&timers);
+                    sendConfig (pRead->GetAttribute("if-version-changed"));
+                    return;
+                }
+                else if (pConfig->Value() == "objects")
+                {
+                    ObjectController::instance()->exportXml(pConfig);
+                }
+                else if (pConfig->Value() == "rules")
+                {
+                    RuleServer::instance()->exportXml(pConfig);
+                }
+                else if (pConfig->Value() == "services")
+                {
+                    Services::instance()->exportXml(pConfig);
+                }
+                else if (pConfig->Value() == "logging")
+                {
+                    Logging::instance()->exportXml(pConfig);
+                }
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
+            }
+            else if (pRead->Value() == "status")
+            {
+                ticpp::Element* pConfig = pRead->FirstChildElement(false);
+                if (pConfig == 0)
+                {
+                    ticpp::Element timers("timers");
+                    Services::instance()->getTimerManager()->statusXml(&timers);
+                    pRead->LinkEndChild(&timers);
 
-                        ticpp::Element rules("rules");
-                        RuleServer::instance()->statusXml(&rules);
-                        pRead->LinkEndChild(&rules);
-                    }
-                    else if (pConfig->Value() == "timers")
-                    {
-                        Services::instance()->getTimerManager()->statusXml(pConfig);
+                    ticpp::Element rules("rules");
+                    RuleServer::instance()->statusXml(&rules);
+                    pRead->LinkEndChild(&rules);
+                }
+                else if (pConfig->Value() == "timers")
+                {
+                    Services::instance()->getTimerManager()->statusXml(pConfig);
+                }
+                else if (pConfig->Value() == "rules")
+                {
+                    RuleServer::instance()->statusXml(pConfig);
+                }
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
+            }
+            else if (pRead->Value() == "calendar")
+            {
+                int year, month, day, h,m;
+                time_t ts = time(0);
+                struct tm * date = localtime(&ts);
+                pRead->GetAttributeOrDefault("year", &year, 0);
+                pRead->GetAttributeOrDefault("month", &month, 0);
+                pRead->GetAttributeOrDefault("day", &day, 0);
+                if (year != 0 || month != 0 || day != 0) {
+                    if (year == 0 && month == 0) {
+                        date->tm_mday += day;
                     }
-                    else if (pConfig->Value() == "rules")
-                    {
-                        RuleServer::instance()->statusXml(pConfig);
+                    else {
+                        if (year >= 1900)
+                            year -= 1900;
+                        if (month > 0)
+                            date->tm_mon = month-1;
+                        if (year > 0)
+                            date->tm_year = year;
+                        date->tm_mday = day;
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
+                    ts = mktime(date);
+                    pRead->SetAttribute("year", date->tm_year+1900);
+                    pRead->SetAttribute("month", date->tm_mon+1);
+                    pRead->SetAttribute("day", date->tm_mday);
                 }
-                else if (pRead->Value() == "calendar")
+
+                SolarInfo info(date);
+                ticpp::Element* pConfig = pRead->FirstChildElement(false);
+                if (pConfig == 0)
                 {
-                    int year, month, day, h,m;
-                    time_t ts = time(0);
-                    struct tm * date = localtime(&ts);
-                    pRead->GetAttributeOrDefault("year", &year, 0);
-                    pRead->GetAttributeOrDefault("month", &month, 0);
-                    pRead->GetAttributeOrDefault("day", &day, 0);
-                    if (year != 0 || month != 0 || day != 0) {
-                        if (year == 0 && month == 0) {
-                            date->tm_mday += day;
-                        }
-                        else {
-                            if (year >= 1900)
-                                year -= 1900;
-                            if (month > 0)
-                                date->tm_mon = month-1;
-                            if (year > 0)
-                                date->tm_year = year;
-                            date->tm_mday = day;
-                        }
-                        ts = mktime(date);
-                        pRead->SetAttribute("year", date->tm_year+1900);
-                        pRead->SetAttribute("month", date->tm_mon+1);
-                        pRead->SetAttribute("day", date->tm_mday);
-                    }
+                    bool isException = Services::instance()->getExceptionDays()->isException(ts);
+                    ticpp::Element exceptionday("exception-day");
+                    exceptionday.SetText(isException ? "true" : "false");
+                    pRead->LinkEndChild(&exceptionday);
 
-                    SolarInfo info(date);
-                    ticpp::Element* pConfig = pRead->FirstChildElement(false);
-                    if (pConfig == 0)
-                    {
-                        bool isException = Services::instance()->getExceptionDays()->isException(ts);
-                        ticpp::Element exceptionday("exception-day");
-                        exceptionday.SetText(isException ? "true" : "false");
-                        pRead->LinkEndChild(&exceptionday);
-
-                        if (info.getSunrise(&m, &h)) {
-                            ticpp::Element sunrise("sunrise");
-                            sunrise.SetAttribute("hour", h);
-                            sunrise.SetAttribute("min", m);
-                            pRead->LinkEndChild(&sunrise);
-                        }
-                        if (info.getSunset(&m, &h)) {
-                            ticpp::Element sunset("sunset");
-                            sunset.SetAttribute("hour", h);
-                            sunset.SetAttribute("min", m);
-                            pRead->LinkEndChild(&sunset);
-                        }
-                        if (info.getNoon(&m, &h)) {
-                            ticpp::Element noon("noon");
-                            noon.SetAttribute("hour", h);
-                            noon.SetAttribute("min", m);
-                            pRead->LinkEndChild(&noon);
-                        }
-                    }
-                    else if (pConfig->Value() == "exception-day")
-                    {
-                        bool isException = Services::instance()->getExceptionDays()->isException(ts);
-                        pConfig->SetText(isException ? "true" : "false");
+                    if (info.getSunrise(&m, &h)) {
+                        ticpp::Element sunrise("sunrise");
+                        sunrise.SetAttribute("hour", h);
+                        sunrise.SetAttribute("min", m);
+                        pRead->LinkEndChild(&sunrise);
                     }
-                    else if (pConfig->Value() == "sunrise")
-                    {
-                        if (!info.getSunrise(&m, &h))
-                            throw "Error while calculating sunrise";
-                        pConfig->SetAttribute("hour", h);
-                        pConfig->SetAttribute("min", m);
+                    if (info.getSunset(&m, &h)) {
+                        ticpp::Element sunset("sunset");
+                        sunset.SetAttribute("hour", h);
+                        sunset.SetAttribute("min", m);
+                        pRead->LinkEndChild(&sunset);
                     }
-                    else if (pConfig->Value() == "sunset")
-                    {
-                        if (!info.getSunset(&m, &h))
-                            throw "Error while calculating sunset";
-                        pConfig->SetAttribute("hour", h);
-                        pConfig->SetAttribute("min", m);
-                    }
-                    else if (pConfig->Value() == "noon")
-                    {
-                        if (!info.getNoon(&m, &h))
-                            throw "Error while calculating solar noon";
-                        pConfig->SetAttribute("hour", h);
-                        pConfig->SetAttribute("min", m);
+                    if (info.getNoon(&m, &h)) {
+                        ticpp::Element noon("noon");
+                        noon.SetAttribute("hour", h);
+                        noon.SetAttribute("min", m);
+                        pRead->LinkEndChild(&noon);
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
                 }
-                else if (pRead->Value() == "version")
+                else if (pConfig->Value() == "exception-day")
                 {
-                    ticpp::Element value("value");
-                    value.SetText(VERSION);
-                    pRead->LinkEndChild(&value);
+                    bool isException = Services::instance()->getExceptionDays()->isException(ts);
+                    pConfig->SetText(isException ? "true" : "false");
+                }
+                else if (pConfig->Value() == "sunrise")
+                {
+                    if (!info.getSunrise(&m, &h))
+                        throw "Error while calculating sunrise";
+                    pConfig->SetAttribute("hour", h);
+                    pConfig->SetAttribute("min", m);
+                }
+                else if (pConfig->Value() == "sunset")
+                {
+                    if (!info.getSunset(&m, &h))
+                        throw "Error while calculating sunset";
+                    pConfig->SetAttribute("hour", h);
+                    pConfig->SetAttribute("min", m);
+                }
+                else if (pConfig->Value() == "noon")
+                {
+                    if (!info.getNoon(&m, &h))
+                        throw "Error while calculating solar noon";
+                    pConfig->SetAttribute("hour", h);
+                    pConfig->SetAttribute("min", m);
+                }
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
+            }
+            else if (pRead->Value() == "version")
+            {
+                ticpp::Element value("value");
+                value.SetText(VERSION);
+                pRead->LinkEndChild(&value);
 
-                    ticpp::Element features("features");
+                ticpp::Element features("features");
 #ifdef HAVE_LIBCURL
-                    ticpp::Element sms("sms");
-                    features.LinkEndChild(&sms);
+                ticpp::Element sms("sms");
+                features.LinkEndChild(&sms);
 #endif
 #ifdef HAVE_LIBESMTP
-                    ticpp::Element email("e-mail");
-                    features.LinkEndChild(&email);
+                ticpp::Element email("e-mail");
+                features.LinkEndChild(&email);
 #endif
 #ifdef HAVE_MYSQL
-                    ticpp::Element mysql("mysql");
-                    features.LinkEndChild(&mysql);
+                ticpp::Element mysql("mysql");
+                features.LinkEndChild(&mysql);
 #endif
 #ifdef SUPPORT_INFLUXDB
-                    ticpp::Element influxdb("influxdb");
-                    features.LinkEndChild(&influxdb);
+                ticpp::Element influxdb("influxdb");
+                features.LinkEndChild(&influxdb);
 #endif
 #ifdef HAVE_LUA
-                    ticpp::Element lua("lua");
-                    features.LinkEndChild(&lua);
+                ticpp::Element lua("lua");
+                features.LinkEndChild(&lua);
 #endif
 #ifdef HAVE_LOG4CPP
-                    ticpp::Element log4cpp("log4cpp");
-                    features.LinkEndChild(&log4cpp);
+                ticpp::Element log4cpp("log4cpp");
+                features.LinkEndChild(&log4cpp);
 #endif
 
-                    pRead->LinkEndChild(&features);
+                pRead->LinkEndChild(&features);
 
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
-                }
-                else
-                    throw "Unknown read element";
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
             }
-            else if (msgType == "write")
+            else
+                throw "Unknown read element";
+        }
+        else if (msgType == "write")
+        {
+            ticpp::Iterator< ticpp::Element > pWrite;
+            for ( pWrite = pMsg->FirstChildElement(); pWrite != pWrite.end(); pWrite++ )
             {
-                ticpp::Iterator< ticpp::Element > pWrite;
-                for ( pWrite = pMsg->FirstChildElement(); pWrite != pWrite.end(); pWrite++ )
+                if (pWrite->Value() == "object")
                 {
-                    if (pWrite->Value() == "object")
-                    {
-                        std::string id = pWrite->GetAttribute("id");
-                        Object* obj = ObjectController::instance()->getObject(id);
-                        obj->setValue(pWrite->GetAttribute("value"));
-                        obj->decRefCount();
-                    }
-                    else if (pWrite->Value() == "config")
+                    std::string id = pWrite->GetAttribute("id");
+                    Object* obj = ObjectController::instance()->getObject(id);
+                    obj->setValue(pWrite->GetAttribute("value"));
+                    obj->decRefCount();
+                }
+                else if (pWrite->Value() == "config")
+                {
+                    ticpp::Iterator< ticpp::Element > pConfigItem;
+                    for ( pConfigItem = pWrite->FirstChildElement(); pConfigItem != pConfigItem.end(); pConfigItem++ )
                     {
-                        ticpp::Iterator< ticpp::Element > pConfigItem;
-                        for ( pConfigItem = pWrite->FirstChildElement(); pConfigItem != pConfigItem.end(); pConfigItem++ )
-                        {
-                            if (pConfigItem->Value() == "objects")
-                                ObjectController::instance()->importXml(&(*pConfigItem));
-                            else if (pConfigItem->Value() == "rules")
-                                RuleServer::instance()->importXml(&(*pConfigItem));
-                            else if (pConfigItem->Value() == "services")
-                                Services::instance()->importXml(&(*pConfigItem));
-                            else if (pConfigItem->Value() == "logging")
-                                Logging::instance()->importXml(&(*pConfigItem));
-                            else
-                                throw "Unknown config element";
-                        }
+                        if (pConfigItem->Value() == "objects")
+                            ObjectController::instance()->importXml(&(*pConfigItem));
+                        else if (pConfigItem->Value() == "rules")
+                            RuleServer::instance()->importXml(&(*pConfigItem));
+                        else if (pConfigItem->Value() == "services")
+                            Services::instance()->importXml(&(*pConfigItem));
+                        else if (pConfigItem->Value() == "logging")
+                            Logging::instance()->importXml(&(*pConfigItem));
+                        else
+                            throw "Unknown config element";
                     }
-                    else
-                        throw "Unknown write element";
+                    // Also after a partial import that failed
+                    Services::instance()->configChanged();
                 }
-                sendmessage ("<write status='success'/>\n", stop);
+                else
+                    throw "Unknown write element";
             }
-            else if (msgType == "execute")
+            sendmessage ("<write status='success'/>\n");
+        }
+        else if (msgType == "execute")
+        {
+            int timeout;
+            pMsg->GetAttributeOrDefault("timeout", &timeout, 60);
+            execDeadline_m = time(0) + timeout;
+            execOngoing_m = false;
+            // Create every action before running any of them, so that an
+            // invalid element rejects the whole request and leaves nothing
+            // running that the connection would have to wait for.
+            std::list<Action*> actions;
+            ticpp::Iterator< ticpp::Element > pExecute;
+            try
             {
-                std::list<Action*> al;
-                int timeout;
-                int count = 0;
-                pMsg->GetAttributeOrDefault("timeout", &timeout, 60);
-                ticpp::Iterator< ticpp::Element > pExecute;
                 for ( pExecute = pMsg->FirstChildElement(); pExecute != pExecute.end(); pExecute++ )
                 {
                     if (pExecute->Value() == "action")
-                    {
-                        Action *action = Action::create(&(*pExecute));
-                        action->execute();
-                        al.push_back(action);
-                    }
+                        actions.push_back(Action::create(&(*pExecute)));
                     else if (pExecute->Value() == "rule-actions")
                     {
-                        std::string id = pExecute->GetAttribute("id");
                         std::string list = pExecute->GetAttribute("list");
-                        Rule* rule = RuleServer::instance()->getRule(id.c_str());
-                        if (rule == 0)
+                        if (RuleServer::instance()->getRule(pExecute->GetAttribute("id").c_str()) == 0)
                             throw "Unknown rule id";
-                        if (list == "true")
-						{
-							rule->executeActions(ActionList::OnTrue);
-							rule->executeActions(ActionList::IfTrue);
-						}
-                        else if (list == "false")
-						{
-							rule->executeActions(ActionList::OnFalse);
-							rule->executeActions(ActionList::IfFalse);
-						}
-                        else
+                        if (list != "true" && list != "false")
                             throw "Invalid list attribute. (Must be 'true' or 'false')";
                     }
                     else
                         throw "Unknown execute element";
                 }
-                while (!al.empty()) {
-                    pth_yield(NULL);
-                    if (al.front()->isFinished() || count == timeout) {
-                        delete al.front();
-                        al.pop_front();
-                    }
-                    else {
-                        if (count++ == 0)
-                            sendmessage ("<execute status='ongoing'/>\n", stop);
-                        pth_sleep(1);
-                    }
+            }
+            catch (...)
+            {
+                while (!actions.empty())
+                {
+                    delete actions.front();
+                    actions.pop_front();
+                }
+                throw;
+            }
+            for ( pExecute = pMsg->FirstChildElement(); pExecute != pExecute.end(); pExecute++ )
+            {
+                if (pExecute->Value() == "action")
+                {
+                    Action *action = actions.front();
+                    actions.pop_front();
+                    action->execute();
+                    execActions_m.push_back(action);
                 }
-
-                if (count == timeout)
-                    sendmessage ("<execute status='timeout'/>\n", stop);
                 else
-                    sendmessage ("<execute status='success'/>\n", stop);
+                {
+                    // An earlier action may have yielded while the rule was removed
+                    Rule* rule = RuleServer::instance()->getRule(pExecute->GetAttribute("id").c_str());
+                    if (rule == 0)
+                        continue;
+                    if (pExecute->GetAttribute("list") == "true")
+					{
+						rule->executeActions(ActionList::OnTrue);
+						rule->executeActions(ActionList::IfTrue);
+					}
+                    else
+					{
+						rule->executeActions(ActionList::OnFalse);
+						rule->executeActions(ActionList::IfFalse);
+					}
+                }
             }
-            else if (msgType == "admin")
+            pth_yield(NULL);
+            if (!checkExecute() && server_m)
+                server_m->waitExecute(this);
+        }
+        else if (msgType == "admin")
+        {
+            // The save is only started once every element was handled, so
+            // that an error cannot leave it running without a reply.
+            std::string saveFile;
+            ticpp::Iterator< ticpp::Element > pAdmin;
+            for ( pAdmin = pMsg->FirstChildElement(); pAdmin != pAdmin.end(); pAdmin++ )
             {
-                ticpp::Iterator< ticpp::Element > pAdmin;
-                for ( pAdmin = pMsg->FirstChildElement(); pAdmin != pAdmin.end(); pAdmin++ )
+                if (pAdmin->Value() == "save")
                 {
-                    if (pAdmin->Value() == "save")
-                    {
-                        std::string filename = pAdmin->GetAttribute("file");
-                        if (filename == "")
-                            filename = Services::instance()->getConfigFile();
-                        if (filename == "")
-                            throw "No file to write config to";
-                        try
-                        {
-                            // Save a document
-                            ticpp::Document doc;
-                            ticpp::Declaration decl("1.0", "", "");
-                            doc.LinkEndChild(&decl);
-                    
-                            ticpp::Element pConfig("config");
-                    
-                            ticpp::Element pServices("services");
-                            Services::instance()->exportXml(&pServices);
-                            pConfig.LinkEndChild(&pServices);
-                            ticpp::Element pObjects("objects");
-                            ObjectController::instance()->exportXml(&pObjects);
-                            pConfig.LinkEndChild(&pObjects);
-                            ticpp::Element pRules("rules");
-                            RuleServer::instance()->exportXml(&pRules);
-                            pConfig.LinkEndChild(&pRules);
-                            ticpp::Element pLogging("logging");
-                            Logging::instance()->exportXml(&pLogging);
-                            pConfig.LinkEndChild(&pLogging);
-                    
-                            doc.LinkEndChild(&pConfig);
-                            doc.SaveFile(filename);
-                        }
-                        catch( ticpp::Exception& ex )
-                        {
-                            // If any function has an error, execution will enter here.
-                            // Report the error
-                            errorStream("ClientConnection") << "Unable to write config to file: " << ex.m_details << endlog;
-                            throw "Error writing config to file";
-                        }
-                    }
-                    else if (pAdmin->Value() == "notification")
+                    if (saveFile != "")
+                        throw "Only one save per admin request";
+                    saveFile = pAdmin->GetAttribute("file");
+                    if (saveFile == "")
+                        saveFile = Services::instance()->getConfigFile();
+                    if (saveFile == "")
+                        throw "No file to write config to";
+                }
+                else if (pAdmin->Value() == "notification")
+                {
+                    ticpp::Iterator< ticpp::Element > pObjects;
+                    for ( pObjects = pAdmin->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
                     {
-                        ticpp::Iterator< ticpp::Element > pObjects;
-                        for ( pObjects = pAdmin->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
+                        if (pObjects->Value() == "register")
                         {
-                            if (pObjects->Value() == "register")
+                            NotificationFilter* filter = NotificationFilter::create(&(*pObjects));
+                            if (filter)
                             {
-                                std::string id = pObjects->GetAttribute("id");
-                                Object* obj = ObjectController::instance()->getObject(id);
-                                notifyList_m.push_back(obj);
-                                obj->addChangeListener(this);
+                                registerFilter(filter);
+                                continue;
                             }
-                            else if (pObjects->Value() == "unregister")
-                            {
-                                std::string id = pObjects->GetAttribute("id");
-                                Object* obj = ObjectController::instance()->getObject(id);
-                                notifyList_m.remove(obj);
-                                obj->decRefCount();
-                                obj->removeChangeListener(this);
-                                obj->decRefCount();
-                            }
-                            else if (pObjects->Value() == "registerall" || pObjects->Value() == "unregisterall")
-                            {
-                                NotifyList_t::iterator it;
-                                for (it=notifyList_m.begin(); it != notifyList_m.end(); it++)
-                                {
-                                    (*it)->removeChangeListener(this);
-                                    (*it)->decRefCount();
-                                }
-                                notifyList_m.clear();
-
-                                if (pObjects->Value() == "registerall") 
-                                {
-                                    std::list<Object*> objList = ObjectController::instance()->getObjects();
-                                    std::list<Object*>::iterator it;
-                                    for (it=objList.begin(); it != objList.end(); it++)
-                                    {
-                                        notifyList_m.push_back((*it));
-                                        (*it)->addChangeListener(this);
-                                    }
-                                }
-                            }
-                            else
-                                throw "Unknown objects element";
+                            std::string id = pObjects->GetAttribute("id");
+                            Object* obj = ObjectController::instance()->getObject(id);
+                            notifyList_m.push_back(obj);
+                            obj->addChangeListener(this);
                         }
+                        else if (pObjects->Value() == "unregister")
+                        {
+                            std::string id = pObjects->GetAttribute("id");
+                            Object* obj = ObjectController::instance()->getObject(id);
+                            notifyList_m.remove(obj);
+                            throttles_m.erase(obj);
+                            obj->decRefCount();
+                            obj->removeChangeListener(this);
+                            obj->decRefCount();
+                        }
+                        else if (pObjects->Value() == "registerall")
+                            registerAll();
+                        else if (pObjects->Value() == "unregisterall")
+                            unregisterAll();
+                        else
+                            throw "Unknown objects element";
                     }
-                    else
-                        throw "Unknown admin element";
                 }
-                sendmessage ("<admin status='success'/>\n", stop);
+                else
+                    throw "Unknown admin element";
             }
-            else
-                throw "Unknown element";
-        }
-        catch( const char* ex )
-        {
-            sendreject (ex, msgType, stop);
-        }
-        catch( ticpp::Exception& ex )
-        {
-            sendreject (ex.m_details.c_str(), msgType, stop);
+            // The reply to a save is sent once the file is written
+            if (saveFile != "")
+            {
+                saver_m = new ConfigSaver(this);
+                saver_m->save(saveFile);
+                if (!checkExecute() && server_m)
+                    server_m->waitExecute(this);
+                return;
+            }
+            sendmessage ("<admin status='success'/>\n");
         }
+        else
+            throw "Unknown element";
+    }
+    catch( const char* ex )
+    {
+        sendreject (ex, msgType);
+    }
+    catch( ticpp::Exception& ex )
+    {
+        sendreject (ex.m_details.c_str(), msgType);
     }
-    pth_event_free (stop, PTH_FREE_THIS);
-    StopDelete ();
 }
 
-int ClientConnection::sendreject (const char* msgstr, const std::string& type, pth_event_t stop)
+int ClientConnection::sendreject (const char* msgstr, const std::string& type)
 {
     std::stringstream msg;
     if (type == "")
         msg << "<error>" << msgstr << "</error>" << std::endl;
     else
         msg << "<" << type << " status='error'>" << msgstr << "</" << type << ">" << std::endl;
-    return sendmessage (msg.str(), stop);
+    return sendmessage (msg.str());
 }
 
-int ClientConnection::sendmessage (std::string msg, pth_event_t stop)
+void ClientConnection::sendConfig (const std::string& knownVersion)
 {
-    msg.push_back('\4');
-    return sendmessage(msg.length(), msg.c_str(), stop);
+    uint64_t version = Services::instance()->getConfigVersion();
+    std::stringstream versionStr;
+    versionStr << version;
+    if (knownVersion == versionStr.str())
+    {
+        sendmessage ("<read status='success'><config version='" + versionStr.str() + "' unchanged='true'/></read>\n");
+        return;
+    }
+    if (configCacheVersion_m != version)
+    {
+        ticpp::Element read("read");
+        read.SetAttribute("status", "success");
+        ticpp::Element config("config");
+        config.SetAttribute("version", version);
+
+        ticpp::Element objects("objects");
+        ObjectController::instance()->exportXml(&objects);
+        config.LinkEndChild(&objects);
+
+        ticpp::Element rules("rules");
+        RuleServer::instance()->exportXml(&rules);
+        config.LinkEndChild(&rules);
+
+        ticpp::Element services("services");
+        Services::instance()->exportXml(&services);
+        config.LinkEndChild(&services);
+
+        ticpp::Element logging("logging");
+        Logging::instance()->exportXml(&logging);
+        config.LinkEndChild(&logging);
+
+        read.LinkEndChild(&config);
+        ticpp::Document doc;
+        doc.LinkEndChild(&read);
+        configCache_m = doc.GetAsString();
+        configCacheVersion_m = version;
+    }
+    sendmessage (configCache_m);
 }
 
-int ClientConnection::sendmessage (int size, const char * msg, pth_event_t stop)
+int ClientConnection::readHttpRequest ()
 {
-    int i;
-    int start = 0;
+    const char *data = msgbuf_m.data();
+    size_t size = msgbuf_m.size();
+    // Only the bytes read since the last call are searched.
+    const char *endOfHead = "\r\n\r\n";
+    const char *end = std::search(data + scanned_m, data + size, endOfHead, endOfHead + 4);
+    if (end == data + size)
+    {
+        scanned_m = size > 3 ? size - 3 : 0;
+        if (size > maxMessageSize_m)
+        {
+            keepAlive_m = false;
+            sendHttpStatus ("431 Request Header Fields Too Large");
+            return 2;
+        }
+        return 0;
+    }
+    scanned_m = 0;
+    size_t head = end - data + 4;
 
-    start = 0;
-    while (start < size)
+    std::string method, target, version, connection, upgrade, key, expect;
+    size_t contentLength = 0;
+    bool chunked = false;
+    std::istringstream lines(std::string(data, head));
+    std::string line;
+    std::getline(lines, line);
+    std::istringstream requestLine(line);
+    requestLine >> method >> target >> version;
+    while (std::getline(lines, line) && line != "\r")
     {
-        i = pth_write_ev (fd_m, msg + start, size - start, stop);
-        if (i <= 0)
-            return -1;
-        start += i;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string name = line.substr(0, colon);
+        size_t start = line.find_first_not_of(" \t", colon + 1);
+        size_t last = line.find_last_not_of(" \t\r");
+        std::string value = start == std::string::npos || last < start ? "" : line.substr(start, last + 1 - start);
+        if (strcasecmp(name.c_str(), "Content-Length") == 0)
+            contentLength = strtoul(value.c_str(), 0, 10);
+        else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0)
+            chunked = true;
+        else if (strcasecmp(name.c_str(), "Connection") == 0)
+            connection = value;
+        else if (strcasecmp(name.c_str(), "Upgrade") == 0)
+            upgrade = value;
+        else if (strcasecmp(name.c_str(), "Sec-WebSocket-Key") == 0)
+            key = value;
+        else if (strcasecmp(name.c_str(), "Expect") == 0)
+            expect = value;
+    }
+    if (version == "HTTP/1.1")
+        keepAlive_m = !hasToken(connection, "close");
+    else
+        keepAlive_m = hasToken(connection, "keep-alive");
+
+    if (version.compare(0, 5, "HTTP/") != 0)
+    {
+        keepAlive_m = false;
+        sendHttpStatus ("400 Bad Request");
+        return 2;
+    }
+    if (chunked)
+    {
+        keepAlive_m = false;
+        sendHttpStatus ("411 Length Required");
+        return 2;
+    }
+    if (contentLength > maxMessageSize_m)
+    {
+        errorStream("ClientConnection") << "Message longer than " << maxMessageSize_m << " bytes, closing connection" << endlog;
+        keepAlive_m = false;
+        sendHttpStatus ("413 Payload Too Large");
+        return 2;
+    }
+    if (size < head + contentLength)
+    {
+        if (!continueSent_m && strcasecmp(expect.c_str(), "100-continue") == 0)
+        {
+            continueSent_m = true;
+            sendraw ("HTTP/1.1 100 Continue\r\n\r\n");
+        }
+        // The head is searched again once the body is there
+        return 0;
     }
-    return 0;
+    continueSent_m = false;
+
+    if (method == "POST")
+    {
+        msg_m.assign(data + head, contentLength);
+        msgbuf_m.consume(head + contentLength);
+        return 1;
+    }
+    msgbuf_m.consume(head + contentLength);
+    if (method == "GET" && strcasecmp(upgrade.c_str(), "websocket") == 0 && key != "")
+    {
+        std::string accept = base64(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+        sendraw ("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                 "Sec-WebSocket-Accept: " + accept + "\r\n\r\n");
+        protocol_m = WebSocketProtocol;
+        return 2;
+    }
+    sendHttpStatus ("405 Method Not Allowed", "Allow: POST\r\n");
+    return 2;
 }
 
-int ClientConnection::readmessage (pth_event_t stop)
+int ClientConnection::readWebSocketFrame ()
+{
+    const unsigned char *data = (const unsigned char *)msgbuf_m.data();
+    size_t size = msgbuf_m.size();
+    if (size < 2)
+        return 0;
+    bool final = data[0] & 0x80;
+    int opcode = data[0] & 0x0f;
+    // Frames from clients are always masked
+    if (!(data[1] & 0x80))
+        return -1;
+    uint64_t len = data[1] & 0x7f;
+    size_t header = 2;
+    if (len == 126)
+    {
+        if (size < 4)
+            return 0;
+        len = (data[2] << 8) | data[3];
+        header = 4;
+    }
+    else if (len == 127)
+    {
+        if (size < 10)
+            return 0;
+        len = 0;
+        for (int i = 2; i < 10; i++)
+            len = (len << 8) | data[i];
+        header = 10;
+    }
+    // The fragments received so far never exceed the maximum
+    if (len > maxMessageSize_m - fragments_m.size())
+    {
+        errorStream("ClientConnection") << "Message longer than " << maxMessageSize_m << " bytes, closing connection" << endlog;
+        std::string msg("\x03\xf1", 2); // Message too big
+        insertWebSocketHeader(msg, 0, WebSocketClose);
+        sendraw (msg);
+        closing_m = true;
+        return 2;
+    }
+    if (size < header + 4 + len)
+        return 0;
+    const unsigned char *mask = data + header;
+    std::string payload((const char *)mask + 4, len);
+    for (size_t i = 0; i < len; i++)
+        payload[i] ^= mask[i % 4];
+    msgbuf_m.consume(header + 4 + len);
+
+    if (opcode == WebSocketClose)
+    {
+        // Echoes the status code
+        payload.resize(std::min(payload.size(), (size_t)2));
+        insertWebSocketHeader(payload, 0, WebSocketClose);
+        sendraw (payload);
+        closing_m = true;
+        return 2;
+    }
+    if (opcode == WebSocketPing)
+    {
+        insertWebSocketHeader(payload, 0, WebSocketPong);
+        sendraw (payload);
+        return 2;
+    }
+    if (opcode == WebSocketPong)
+        return 2;
+    if (opcode != WebSocketText && opcode != WebSocketBinary && opcode != WebSocketContinuation)
+        return -1;
+    // Only a continuation frame may follow a non-final frame, and it may
+    // follow nothing else
+    if ((opcode == WebSocketContinuation) != fragmented_m)
+        return -1;
+    fragments_m.append(payload);
+    fragmented_m = !final;
+    if (!final)
+        return 2;
+    msg_m.swap(fragments_m);
+    fragments_m.clear();
+    return 1;
+}
+
+int ClientConnection::sendmessage (const std::string& msg)
+{
+    if (closed_m)
+        return -1;
+    beginmessage ();
+    outbuf_m.append(msg);
+    return endmessage ();
+}
+
+int ClientConnection::sendraw (const std::string& msg)
+{
+    if (closed_m)
+        return -1;
+    commitNotifications ();
+    outbuf_m.append(msg);
+    return flushmessage ();
+}
+
+int ClientConnection::sendHttpStatus (const char* status, const char* headers)
 {
-    char buf[256];
-    int i;
     std::stringstream msg;
+    msg << "HTTP/1.1 " << status << "\r\n" << headers << "Content-Length: 0\r\n";
+    if (!keepAlive_m)
+    {
+        msg << "Connection: close\r\n";
+        closing_m = true;
+    }
+    msg << "\r\n";
+    return sendraw (msg.str());
+}
 
-    if (msgbuf_m.size() > 0)
+void ClientConnection::beginmessage ()
+{
+    commitNotifications ();
+    replyStart_m = outbuf_m.size();
+}
+
+int ClientConnection::endmessage ()
+{
+    if (protocol_m == HttpProtocol)
     {
-        // we have already some data in the message buffer
-        std::string::size_type len = msgbuf_m.find_first_of('\004');
-        if (std::string::npos != len)
+        std::stringstream header;
+        header << "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\nContent-Length: " << outbuf_m.size() - replyStart_m << "\r\n";
+        if (!keepAlive_m)
         {
-            // Complete message in the buffer
-            msg_m = msgbuf_m.substr(0, len);
-            msgbuf_m.erase(0, len+1);
-            return 1;
+            header << "Connection: close\r\n";
+            closing_m = true;
+        }
+        header << "\r\n";
+        outbuf_m.insert(replyStart_m, header.str());
+    }
+    else if (protocol_m == WebSocketProtocol)
+        insertWebSocketHeader(outbuf_m, replyStart_m, WebSocketText);
+    else
+        outbuf_m.push_back('\4');
+    return flushmessage ();
+}
+
+int ClientConnection::flushmessage ()
+{
+    if (reading_m && outbuf_m.size() < FlushThreshold)
+        return 0;
+    onWritable ();
+    // What the socket did not accept is sent when it becomes writable.
+    if (server_m)
+        server_m->update (this);
+    return closed_m ? -1 : 0;
+}
+
+size_t ClientConnection::beginframe (int opcode)
+{
+    commitNotifications ();
+    size_t start = outbuf_m.size();
+    outbuf_m.append(4, '\0');
+    outbuf_m.push_back((char)opcode);
+    return start;
+}
+
+int ClientConnection::endframe (size_t start)
+{
+    setFrameLength(outbuf_m, start);
+    return flushmessage ();
+}
+
+int ClientConnection::senderror (int opcode, const char* msgstr)
+{
+    if (closed_m)
+        return -1;
+    size_t start = beginframe (Error);
+    outbuf_m.push_back((char)opcode);
+    outbuf_m.append(msgstr);
+    return endframe (start);
+}
+
+void ClientConnection::processFrame ()
+{
+    int opcode = msg_m.empty() ? 0 : (unsigned char)msg_m[0];
+    const char *args = msg_m.data() + 1;
+    size_t argsLength = msg_m.empty() ? 0 : msg_m.size() - 1;
+    size_t start = std::string::npos;
+    try
+    {
+        if (opcode == Resolve)
+        {
+            simpleArg_m.assign(args, argsLength);
+            Object* obj = ObjectController::instance()->getObject(simpleArg_m);
+            std::map<Object*, uint32_t>::iterator it = handleIds_m.find(obj);
+            uint32_t handle;
+            if (it != handleIds_m.end())
+            {
+                handle = (*it).second;
+                obj->decRefCount();
+            }
+            else
+            {
+                // The handle keeps the reference until the connection ends
+                handle = handles_m.size();
+                ObjectHandle objectHandle = { obj, isNumber(obj) };
+                handles_m.push_back(objectHandle);
+                handleIds_m.insert(std::make_pair(obj, handle));
+            }
+            start = beginframe (Handle);
+            putUint32(outbuf_m, handle);
+            outbuf_m.push_back((char)(handles_m[handle].number ? NumberValue : StringValue));
+            endframe (start);
+            return;
+        }
+        if (opcode < Read || opcode > Unsubscribe)
+            throw "Unknown opcode";
+        if (argsLength < 4)
+            throw "Missing handle";
+        uint32_t handle = getUint32(args);
+        if (handle >= handles_m.size())
+            throw "Unknown handle";
+        Object* obj = handles_m[handle].object;
+        int reply;
+        if (opcode == Read)
+        {
+            if (!isValueKnown(obj))
+                return;
+            start = beginframe (Value);
+            putUint32(outbuf_m, handle);
+            putValue(outbuf_m, obj, handles_m[handle].number);
+            endframe (start);
+            return;
+        }
+        else if (opcode == Write)
+        {
+            int type = argsLength > 4 ? (unsigned char)args[4] : 0;
+            if (type == NumberValue && argsLength == 13)
+                obj->setFloatValue(getDouble(args + 5));
+            else if (type == StringValue)
+            {
+                simpleArg_m.assign(args + 5, argsLength - 5);
+                obj->setValue(simpleArg_m);
+            }
+            else
+                throw "Invalid value";
+            reply = Written;
+        }
+        else if (opcode == Subscribe)
+        {
+            NotifyList_t::iterator it = std::find(notifyList_m.begin(), notifyList_m.end(), obj);
+            if (it == notifyList_m.end())
+            {
+                obj->incRefCount();
+                notifyList_m.push_back(obj);
+                obj->addChangeListener(this);
+            }
+            reply = Subscribed;
+        }
+        else
+        {
+            NotifyList_t::iterator it = std::find(notifyList_m.begin(), notifyList_m.end(), obj);
+            if (it != notifyList_m.end())
+            {
+                notifyList_m.erase(it);
+                obj->removeChangeListener(this);
+                obj->decRefCount();
+            }
+            reply = Unsubscribed;
+        }
+        start = beginframe (reply);
+        putUint32(outbuf_m, handle);
+        endframe (start);
+    }
+    catch( const char* ex )
+    {
+        if (start != std::string::npos)
+            outbuf_m.resize(start);
+        senderror (opcode, ex);
+    }
+    catch( ticpp::Exception& ex )
+    {
+        if (start != std::string::npos)
+            outbuf_m.resize(start);
+        senderror (opcode, ex.m_details.c_str());
+    }
+}
+
+bool ClientConnection::processSimpleMessage ()
+{
+    SimpleRequest req(msg_m);
+    SimpleRequest::Attribute attrs[2] = { { "id", 0, 0 }, { "value", 0, 0 } };
+    const char *msgType;
+    bool single = false;
+    simpleArgs_m.clear();
+    if (req.start("read"))
+    {
+        msgType = "read";
+        if (req.attributes(attrs, 0) != 2)
+            return false;
+        if (req.start("object"))
+        {
+            if (req.attributes(attrs, 1) != 1 || !attrs[0].value)
+                return false;
+            simpleArgs_m.push_back(std::make_pair(attrs[0].value, attrs[0].length));
+            single = true;
+        }
+        else if (req.start("objects"))
+        {
+            int content = req.attributes(attrs, 0);
+            if (content == 0)
+                return false;
+            while (content == 2 && req.start("object"))
+            {
+                if (req.attributes(attrs, 1) != 1 || !attrs[0].value)
+                    return false;
+                simpleArgs_m.push_back(std::make_pair(attrs[0].value, attrs[0].length));
+            }
+            if (content == 2 && !req.end("objects"))
+                return false;
+        }
+        else
+            return false;
+    }
+    else if (req.start("write"))
+    {
+        msgType = "write";
+        if (req.attributes(attrs, 0) != 2)
+            return false;
+        while (req.start("object"))
+        {
+            if (req.attributes(attrs, 2) != 1 || !attrs[0].value || !attrs[1].value)
+                return false;
+            simpleArgs_m.push_back(std::make_pair(attrs[0].value, attrs[0].length));
+            simpleArgs_m.push_back(std::make_pair(attrs[1].value, attrs[1].length));
         }
-        msg << msgbuf_m;
     }
+    else
+        return false;
+    if (!req.end(msgType) || !req.finished())
+        return false;
 
-    while ((i = pth_read_ev (fd_m, &buf, 256, stop)) > 0)
+    if (logger_m.isDebugEnabled())
+        logger_m.debugStream() << "PROCESSING MESSAGE:" << endlog << msg_m << endlog << "END OF MESSAGE" << endlog;
+    ObjectController *controller = ObjectController::instance();
+    beginmessage ();
+    size_t mark = replyStart_m;
+    Object *obj = 0;
+    try
     {
-        std::string tstr(buf, i);
-        std::string::size_type len = tstr.find_first_of('\004');
-        if (std::string::npos != len)
+        if (msgType[0] == 'w')
+        {
+            for (unsigned i = 0; i < simpleArgs_m.size(); i += 2)
+            {
+                simpleArg_m.assign(simpleArgs_m[i].first, simpleArgs_m[i].second);
+                obj = controller->getObject(simpleArg_m);
+                simpleArg_m.assign(simpleArgs_m[i + 1].first, simpleArgs_m[i + 1].second);
+                obj->setValue(simpleArg_m);
+                obj->decRefCount();
+                obj = 0;
+            }
+            beginmessage ();
+            outbuf_m.append("<write status='success'/>\n");
+        }
+        else if (single)
+        {
+            simpleArg_m.assign(simpleArgs_m[0].first, simpleArgs_m[0].second);
+            obj = controller->getObject(simpleArg_m);
+            if (isValueKnown(obj))
+            {
+                outbuf_m.append("<read status='success'>");
+                outbuf_m.append(obj->getValue());
+                outbuf_m.append("</read>\n");
+            }
+            obj->decRefCount();
+            obj = 0;
+        }
+        else if (simpleArgs_m.empty())
+        {
+            // Same as the DOM for an element without children
+            outbuf_m.append("<read status=\"success\">\n");
+            std::list<Object*> objects = controller->getObjects();
+            outbuf_m.append(objects.empty() ? "\t<objects />\n" : "\t<objects>\n");
+            bool known = areValuesKnown(objects);
+            for (std::list<Object*>::iterator it = objects.begin(); it != objects.end(); it++)
+            {
+                if (known)
+                    appendObjectValue(outbuf_m, *it);
+                (*it)->decRefCount();
+            }
+            if (!objects.empty())
+                outbuf_m.append("\t</objects>\n");
+            outbuf_m.append("</read>\n");
+        }
+        else
         {
-            // Complete message in the buffer
-            msg << tstr.substr(0, len);
-            msg_m = msg.str();
-            msgbuf_m = tstr.substr(len+1);
+            outbuf_m.append("<read status=\"success\">\n\t<objects>\n");
+            for (unsigned i = 0; i < simpleArgs_m.size(); i++)
+            {
+                simpleArg_m.assign(simpleArgs_m[i].first, simpleArgs_m[i].second);
+                obj = controller->getObject(simpleArg_m);
+                if (isValueKnown(obj))
+                    appendObjectValue(outbuf_m, obj);
+                obj->decRefCount();
+                obj = 0;
+            }
+            outbuf_m.append("\t</objects>\n</read>\n");
+        }
+    }
+    catch( ticpp::Exception& ex )
+    {
+        if (obj)
+            obj->decRefCount();
+        outbuf_m.resize(mark);
+        sendreject (ex.m_details.c_str(), msgType);
+        return true;
+    }
+    // Nothing was flushed yet, checkExecute replies once the values are known
+    if (isReading())
+        outbuf_m.resize(mark);
+    else if (closed_m)
+        outbuf_m.clear();
+    else
+        endmessage ();
+    return true;
+}
+
+bool ClientConnection::isValueKnown (Object* object)
+{
+    if (object->isInitialized())
+        return true;
+    object->requestRead();
+    if (object->isInitialized())
+        return true;
+    if (std::find(pendingReads_m.begin(), pendingReads_m.end(), object) == pendingReads_m.end())
+    {
+        if (pendingReads_m.empty())
+        {
+            readDeadline_m = TimerManager::now() + ReadTimeout;
+            if (server_m)
+                server_m->waitExecute (this);
+        }
+        object->incRefCount();
+        pendingReads_m.push_back(object);
+    }
+    return false;
+}
+
+bool ClientConnection::areValuesKnown (const std::list<Object*>& objects)
+{
+    // Every unknown value is requested at once
+    bool known = true;
+    for (std::list<Object*>::const_iterator it = objects.begin(); it != objects.end(); it++)
+    {
+        if (!isValueKnown(*it))
+            known = false;
+    }
+    return known;
+}
+
+int ClientConnection::readmessage (pth_event_t stop)
+{
+    while (true)
+    {
+        if (protocol_m == UnknownProtocol && !msgbuf_m.empty())
+        {
+            // XML messages never start with the first byte of Hello, nor
+            // with the uppercase letter of an HTTP method
+            const char *data = msgbuf_m.data();
+            if (data[0] >= 'A' && data[0] <= 'Z')
+                protocol_m = HttpProtocol;
+            else if (data[0] != Hello[0] || (msgbuf_m.size() >= HelloSize && memcmp(data, Hello, HelloSize) != 0))
+                protocol_m = XmlProtocol;
+            else if (msgbuf_m.size() >= HelloSize)
+            {
+                protocol_m = CompactProtocol;
+                msgbuf_m.consume(HelloSize);
+                outbuf_m.append(Hello, HelloSize);
+                flushmessage ();
+            }
+        }
+        if ((protocol_m == HttpProtocol || protocol_m == WebSocketProtocol) && !msgbuf_m.empty())
+        {
+            int ret = protocol_m == HttpProtocol ? readHttpRequest () : readWebSocketFrame ();
+            if (ret == 2 && !closing_m)
+                continue;
+            if (ret != 0)
+                return ret == 2 ? 0 : ret;
+        }
+        // Length of the next message, complete or not yet
+        size_t len = 0, header = 0, trailer = 0;
+        bool complete = false;
+        if (protocol_m == CompactProtocol && msgbuf_m.size() >= 4)
+        {
+            header = 4;
+            len = getUint32(msgbuf_m.data());
+            complete = msgbuf_m.size() - header >= len;
+        }
+        else if (protocol_m == XmlProtocol)
+        {
+            // Only the bytes read since the last call are searched.
+            long end = msgbuf_m.find('\004', scanned_m);
+            complete = end != -1;
+            trailer = 1;
+            len = complete ? end : msgbuf_m.size();
+            scanned_m = complete ? 0 : len;
+        }
+        if (len > maxMessageSize_m)
+        {
+            errorStream("ClientConnection") << "Message longer than " << maxMessageSize_m << " bytes, closing connection" << endlog;
+            if (protocol_m == CompactProtocol)
+                senderror (0, "Message too long");
+            else
+                sendreject ("Message too long", "");
+            msgbuf_m.clear();
+            scanned_m = 0;
+            return -1;
+        }
+        if (complete)
+        {
+            msg_m.assign(msgbuf_m.data() + header, len);
+            msgbuf_m.consume(header + len + trailer);
             return 1;
         }
-        msg << tstr;
+        char *buf = msgbuf_m.reserve(4096);
+        int i = pth_read_ev (fd_m, buf, msgbuf_m.space(), stop);
+        if (i > 0)
+            msgbuf_m.commit(i);
+        else if (i == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        else
+            return -1;
     }
+}
 
-    return -1;
+void ClientConnection::registerFilter (NotificationFilter* filter)
+{
+    filters_m.push_back(filter);
+    std::set<Object*> registered(notifyList_m.begin(), notifyList_m.end());
+    std::list<Object*> objects = ObjectController::instance()->getObjects();
+    std::list<Object*>::iterator it;
+    for (it = objects.begin(); it != objects.end(); it++)
+    {
+        Object* obj = *it;
+        if (!filter->matches(obj))
+        {
+            obj->decRefCount();
+            continue;
+        }
+        // The last filter registered for an object replaces the others
+        Throttle& throttle = throttles_m[obj];
+        throttle.filter = filter;
+        throttle.lastSent = -1;
+        throttle.lastValue = 0;
+        throttle.pending = false;
+        if (registered.find(obj) == registered.end())
+        {
+            notifyList_m.push_back(obj);
+            obj->addChangeListener(this);
+        }
+        else
+            obj->decRefCount();
+    }
+}
+
+void ClientConnection::registerAll ()
+{
+    unregisterAll();
+    std::list<Object*> objList = ObjectController::instance()->getObjects();
+    std::list<Object*>::iterator it;
+    for (it=objList.begin(); it != objList.end(); it++)
+    {
+        notifyList_m.push_back((*it));
+        (*it)->addChangeListener(this);
+    }
+}
+
+void ClientConnection::unregisterAll ()
+{
+    NotifyList_t::iterator it;
+    for (it=notifyList_m.begin(); it != notifyList_m.end(); it++)
+    {
+        (*it)->removeChangeListener(this);
+        (*it)->decRefCount();
+    }
+    notifyList_m.clear();
+    throttles_m.clear();
+    deadlines_m.clear();
+    while (!filters_m.empty())
+    {
+        delete filters_m.front();
+        filters_m.pop_front();
+    }
+}
+
+bool ClientConnection::checkThrottle (Object* object, Throttle& throttle, int64_t now)
+{
+    NotificationFilter* filter = throttle.filter;
+    double value = 0;
+    if (filter->getDeadband() > 0 && isNumber(object))
+    {
+        value = object->getFloatValue();
+        if (throttle.lastSent != -1 && fabs(value - throttle.lastValue) < filter->getDeadband())
+        {
+            throttle.pending = false;
+            return false;
+        }
+    }
+    if (throttle.lastSent != -1 && now < throttle.lastSent + filter->getMinInterval())
+    {
+        // The value at the end of the interval is sent then
+        if (!throttle.pending)
+        {
+            throttle.pending = true;
+            deadlines_m.insert(std::make_pair(throttle.lastSent + filter->getMinInterval(), object));
+            if (server_m)
+                server_m->throttle (this);
+        }
+        return false;
+    }
+    throttle.lastSent = now;
+    throttle.lastValue = value;
+    throttle.pending = false;
+    return true;
+}
+
+int64_t ClientConnection::sendThrottled (int64_t now)
+{
+    while (!deadlines_m.empty() && (*deadlines_m.begin()).first <= now)
+    {
+        Object* object = (*deadlines_m.begin()).second;
+        deadlines_m.erase(deadlines_m.begin());
+        std::map<Object*, Throttle>::iterator it = throttles_m.find(object);
+        if (it == throttles_m.end() || !(*it).second.pending)
+            continue;
+        (*it).second.pending = false;
+        if (checkThrottle(object, (*it).second, now))
+            queueNotification (object);
+    }
+    return deadlines_m.empty() ? -1 : (*deadlines_m.begin()).first;
 }
 
 void ClientConnection::onChange(Object* object)
 {
-//    sendmessage ("<notify id=status='success'/>\n", stop);
-    std::stringstream msg;
-    msg << "<notify id='" << object->getID() << "'>" << object->getValue() << "</notify>" << std::endl;
-    sendmessage (msg.str(), NULL);
+    if (closed_m)
+        return;
+    std::map<Object*, Throttle>::iterator it = throttles_m.find(object);
+    if (it != throttles_m.end() && !checkThrottle(object, (*it).second, TimerManager::now()))
+        return;
+    queueNotification (object);
 }
 
+void ClientConnection::queueNotification(Object* object)
+{
+    // Plain HTTP clients have no way to receive them
+    if (protocol_m == HttpProtocol || closing_m)
+        return;
+    // getValue() would block the server thread on the bus, the change
+    // is notified once the answer arrives.
+    if (!object->isInitialized())
+    {
+        object->requestRead();
+        return;
+    }
+    if (notifyQueue_m.size() >= notifyQueueSize_m)
+    {
+        if (!overflow_m)
+            warnStream("ClientConnection") << "Client does not read its notifications fast enough" << endlog;
+        overflow_m = true;
+        if (slowConsumer_m == XmlServer::Disconnect)
+        {
+            disconnect ();
+            return;
+        }
+        if (slowConsumer_m == XmlServer::Drop)
+            return;
+    }
+    Notification* notification = 0;
+    if (overflow_m)
+    {
+        std::deque<Notification>::reverse_iterator it;
+        for (it = notifyQueue_m.rbegin(); it != notifyQueue_m.rend() && !notification; it++)
+        {
+            if ((*it).object == object)
+                notification = &(*it);
+        }
+    }
+    if (!notification)
+    {
+        notifyQueue_m.push_back(Notification());
+        notification = &notifyQueue_m.back();
+        notification->object = object;
+    }
+    std::string& msg = notification->msg;
+    if (protocol_m == CompactProtocol)
+    {
+        uint32_t handle = handleIds_m[object];
+        msg.assign(4, '\0');
+        msg.push_back((char)Notify);
+        putUint32(msg, handle);
+        putValue(msg, object, handles_m[handle].number);
+        setFrameLength(msg, 0);
+    }
+    else
+    {
+        msg.assign("<notify id='");
+        msg.append(object->getID());
+        if (sendSeq_m)
+        {
+            std::stringstream seq;
+            seq << "' seq='" << object->getChangeSeq();
+            msg.append(seq.str());
+        }
+        msg.append("'>");
+        msg.append(object->getValue());
+        if (protocol_m == WebSocketProtocol)
+        {
+            msg.append("</notify>\n");
+            insertWebSocketHeader(msg, 0, WebSocketText);
+        }
+        else
+            msg.append("</notify>\n\004");
+    }
+
+    // Sent with the replies when it comes from the client's own request
+    if (reading_m)
+        return;
+    if (server_m)
+        server_m->wakeup (this);
+    else
+        onWritable ();
+}
@@ -25,14 +25,23 @@
 
 #include "config.h"
 #include "threads.h"
+#include <deque>
 #include <list>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include "ticpp.h"
 #include "objectcontroller.h"
+#include "collections.h"
 
 
 class ClientConnection;
+class Action;
 
+/** Serves all its client connections from a single thread: the sockets
+ * are non-blocking and watched with epoll (or poll where epoll is not
+ * available), each connection buffering its own input and output. */
 class XmlServer : protected Thread
 {
 public:
@@ -43,18 +52,68 @@ public:
     virtual void exportXml(ticpp::Element* pConfig) = 0;
 
     bool deregister (ClientConnection *con);
+    /** Updates the events watched for the connection after its state changed. */
+    void update (ClientConnection *con);
+    void unwatch (ClientConnection *con);
+    /** Checks the connection every second until its execute request
+     * completes, or every 10ms while it waits for object values. */
+    void waitExecute (ClientConnection *con);
+    /** Has the server thread send the notifications queued for the connection. */
+    void wakeup (ClientConnection *con);
+    /** Has the server thread send the notifications the connection held back. */
+    void throttle (ClientConnection *con);
+
+    /** Clients sending longer messages are disconnected. */
+    void setMaxMessageSize (int size) { maxMessageSize_m = size; };
+    int getMaxMessageSize () { return maxMessageSize_m; };
+
+    /** What is done with the notifications of a client that has more than
+     * notify-queue-size of them waiting: Coalesce replaces the ones queued
+     * for the same object (new objects are still queued), Drop discards
+     * them and Disconnect closes the connection. */
+    enum SlowConsumerPolicy { Coalesce, Drop, Disconnect };
+    void setNotifyQueue (int size, SlowConsumerPolicy policy) { notifyQueueSize_m = size; slowConsumer_m = policy; };
+    int getNotifyQueueSize () { return notifyQueueSize_m; };
+    SlowConsumerPolicy getSlowConsumerPolicy () { return slowConsumer_m; };
+
+    static const int DefaultBacklog = 128;
+    static const int DefaultMaxMessageSize = 4 * 1024 * 1024;
+    static const int DefaultNotifyQueueSize = 1000;
 protected:
+    XmlServer(int backlog);
+    /** Makes fd_m non-blocking and starts the server thread. */
+    void startPolling ();
+    /** Exports the options common to all server types. */
+    void exportOptions (ticpp::Element* pConfig);
+
     int fd_m;
+    int backlog_m;
+    int maxMessageSize_m;
+    int notifyQueueSize_m;
+    SlowConsumerPolicy slowConsumer_m;
 private:
-    std::list<ClientConnection*> connections_m;
+    std::set<ClientConnection*> connections_m;
+    std::list<ClientConnection*> executing_m;
+    /** Connections with notifications queued from outside the server loop. */
+    std::list<ClientConnection*> flushing_m;
+    std::set<ClientConnection*> throttled_m;
+    pth_sem_t wakeup_m;
+    int pollfd_m;
 
+    void acceptConnections ();
+    void dispatch (ClientConnection *con, int events);
+    void checkExecuting ();
+    void flushNotifications ();
+    /** Sends the notifications held back that are due, returns the ms
+     * until the next one or -1. */
+    int64_t checkThrottled ();
     void Run (pth_sem_t * stop);
 };
 
 class XmlInetServer : public XmlServer
 {
 public:
-    XmlInetServer(int port);
+    XmlInetServer(int port, int backlog = DefaultBacklog);
     virtual ~XmlInetServer() {};
 
     virtual void exportXml(ticpp::Element* pConfig);
@@ -65,7 +124,7 @@ private:
 class XmlUnixServer : public XmlServer
 {
 public:
-    XmlUnixServer(const char *path);
+    XmlUnixServer(const char *path, int backlog = DefaultBacklog);
     virtual ~XmlUnixServer() {};
 
     virtual void exportXml(ticpp::Element* pConfig);
@@ -73,31 +132,270 @@ private:
     std::string path_m;
 };
 
-class ClientConnection : public Thread, public ChangeListener
+/** Selects the objects of a pattern subscription by id glob, group
+ * address range and type glob, and holds the options limiting its
+ * notifications: at most one per min-interval and object, and only for
+ * changes of at least deadband from the last value sent. */
+class NotificationFilter
 {
 public:
+    /** Returns 0 for a register element naming a single object without
+     * any option. */
+    static NotificationFilter* create(ticpp::Element* pConfig);
+
+    bool matches(Object* object);
+    int getMinInterval() { return minInterval_m; };
+    double getDeadband() { return deadband_m; };
+private:
+    NotificationFilter() : gadMin_m(0), gadMax_m(0xffff), minInterval_m(0), deadband_m(0) {};
+
+    std::string id_m;
+    std::string type_m;
+    eibaddr_t gadMin_m;
+    eibaddr_t gadMax_m;
+    int minInterval_m;
+    double deadband_m;
+};
+
+/** Saves the configuration without blocking the server. save() forks a
+ * process, which has the configuration as it is at that time, serialises
+ * it and writes it to a temporary file that is synced and renamed over
+ * the file. The thread waits for the process and wakes the connection
+ * up once it is done. */
+class ConfigSaver : public Thread
+{
+public:
+    ConfigSaver (ClientConnection *con) : con_m(con), pid_m(-1), pipe_m(-1), error_m(0), done_m(false), serialiseTime_m(0), writeTime_m(0) {};
+    virtual ~ConfigSaver ();
+
+    void save (const std::string& filename);
+    bool isDone() { return done_m; };
+    /** errno of the failed step, 0 if the file was written. */
+    int getError() { return error_m; };
+    /** Durations in us of the export of the configuration to a document,
+     * and of its output to the file with the sync and rename. */
+    int64_t getSerialiseTime() { return serialiseTime_m; };
+    int64_t getWriteTime() { return writeTime_m; };
+
+private:
+    ClientConnection *con_m;
+    std::string filename_m;
+    pid_t pid_m;
+    int pipe_m;
+    int error_m;
+    bool done_m;
+    int64_t serialiseTime_m;
+    int64_t writeTime_m;
+
+    void Run (pth_sem_t * stop);
+    /** Runs in the forked process, reports to fd. */
+    static void writeConfig (const std::string& filename, int fd);
+};
+
+/** A client of the XmlServer. It speaks XML messages terminated by
+ * 0x04, or the compact protocol if its first bytes are the Hello
+ * sequence, which the server echoes back, or HTTP if it starts with an
+ * uppercase letter.
+ *
+ * Over HTTP/1.1, each POST carries one XML message in its body and gets
+ * the reply as text/xml; connections are kept alive unless the client
+ * asks otherwise. A GET with a WebSocket upgrade turns the connection
+ * into a WebSocket where each text message is an XML message, and the
+ * replies and notifications are text messages too.
+ *
+ * Compact frames are a 32-bit length followed by that many bytes: an
+ * opcode and its arguments. Integers are big-endian. Objects are first
+ * resolved to a handle that is valid for the connection, and values are
+ * a type byte followed by a double (NumberValue) or by the rest of the
+ * frame (StringValue). Requests and their replies:
+ *   Resolve id            -> Handle handle type
+ *   Read handle           -> Value handle value
+ *   Write handle value    -> Written handle
+ *   Subscribe handle      -> Subscribed handle, then Notify handle value
+ *   Unsubscribe handle    -> Unsubscribed handle
+ * A failed request gets Error opcode message. Switching, float and
+ * integer objects have number values, the others string values. */
+class ClientConnection : public ChangeListener
+{
+public:
+    enum Opcode
+    {
+        Resolve = 0x01, Read = 0x02, Write = 0x03, Subscribe = 0x04, Unsubscribe = 0x05,
+        Handle = 0x81, Value = 0x82, Written = 0x83, Subscribed = 0x84, Unsubscribed = 0x85,
+        Notify = 0x90, Error = 0xff
+    };
+    enum ValueType { NumberValue = 1, StringValue = 2 };
+    static const char Hello[5];
+    static const size_t HelloSize = sizeof(Hello);
+
     ClientConnection (XmlServer *server, int fd);
     virtual ~ ClientConnection ();
 
     void RemoveServer() { server_m = 0; };
+    int getFd() { return fd_m; };
+    bool isClosed() { return closed_m; };
+    bool isExecuting() { return !execActions_m.empty() || saver_m || isReading(); };
+    /** Whether the reply to a read waits for the values of objects that
+     * were never read from the bus. */
+    bool isReading() { return !pendingReads_m.empty(); };
+    bool isCompact() { return protocol_m == CompactProtocol; };
+    /** Events the connection waits for, as poll flags. */
+    int getEvents();
+
+    /** Reads the available input and processes the complete messages. */
+    void onReadable ();
+    /** Sends as much of the pending output and notifications as the socket
+     * accepts. */
+    void onWritable ();
+    /** Replies to the execute request once its actions are finished or
+     * timed out, to the admin request once the config is saved, or to
+     * the read request once the values are known. Returns false while
+     * they are still pending. */
+    bool checkExecute ();
 
+    /** Returns 1 with the next message (or compact frame without its
+     * length) in msg_m, 0 if the non-blocking socket has no complete
+     * message yet, -1 at the end of the stream or if the message is too
+     * long. */
     int readmessage (pth_event_t stop);
-    int sendmessage (int size, const char * msg, pth_event_t stop);
-    int sendmessage (std::string msg, pth_event_t stop);
-    int sendreject (const char* msgstr, const std::string& type, pth_event_t stop);
+    int sendmessage (const std::string& msg);
+    int sendreject (const char* msgstr, const std::string& type);
 
+    /** Queues a notification, sent by the server thread. */
     virtual void onChange(Object* object);
+    void setNotifyQueue (size_t size, XmlServer::SlowConsumerPolicy policy) { notifyQueueSize_m = size; slowConsumer_m = policy; };
+    /** Sends the notifications held back by min-interval that are due at
+     * now, returns the time of the next one or -1. */
+    int64_t sendThrottled (int64_t now);
 
     std::string msg_m;
-    std::string msgbuf_m;
+    ByteBuffer msgbuf_m;
 private:
     int fd_m;
     XmlServer *server_m;
+    bool closed_m;
+    /** Bytes of msgbuf_m already searched for the end of message. */
+    size_t scanned_m;
+    size_t maxMessageSize_m;
+    enum Protocol { UnknownProtocol, XmlProtocol, CompactProtocol, HttpProtocol, WebSocketProtocol };
+    Protocol protocol_m;
+    std::string outbuf_m;
+    /** Start of the reply in outbuf_m, for the HTTP and WebSocket headers. */
+    size_t replyStart_m;
+    /** Set when the connection is closed once its output is sent. */
+    bool closing_m;
+    /** Whether the HTTP connection stays open after the reply. */
+    bool keepAlive_m;
+    /** Set once the client was told to send the request body. */
+    bool continueSent_m;
+    /** WebSocket message received in several frames. */
+    std::string fragments_m;
+    /** Set while the frames of a fragmented WebSocket message arrive. */
+    bool fragmented_m;
+    /** Set while the messages of one read are processed, their replies
+     * are then sent together. */
+    bool reading_m;
+    /** Events registered with the server, -1 if not registered yet. */
+    int watched_m;
+
+    struct Notification
+    {
+        Object* object;
+        std::string msg;
+    };
+    /** Notifications not handed to the socket yet, sent after outbuf_m. */
+    std::deque<Notification> notifyQueue_m;
+    size_t notifyQueueSize_m;
+    XmlServer::SlowConsumerPolicy slowConsumer_m;
+    bool overflow_m;
+    /** Set while the connection is in the server's flushing list. */
+    bool wakeupPending_m;
+    /** Notifications carry the sequence number of the change, after a
+     * changes request that registered for them. */
+    bool sendSeq_m;
+
+    std::list<Action*> execActions_m;
+    ConfigSaver *saver_m;
+    time_t execDeadline_m;
+    bool execOngoing_m;
+    /** Objects read on the bus for the message in msg_m, which is
+     * processed again once they answered or readDeadline_m passed. */
+    std::list<Object*> pendingReads_m;
+    int64_t readDeadline_m;
 
     typedef std::list<Object*> NotifyList_t;
     NotifyList_t notifyList_m;
 
-    void Run (pth_sem_t * stop);
+    /** Notification state of the objects registered with a filter. */
+    struct Throttle
+    {
+        NotificationFilter* filter;
+        int64_t lastSent;
+        double lastValue;
+        bool pending;
+    };
+    std::map<Object*, Throttle> throttles_m;
+    std::list<NotificationFilter*> filters_m;
+    /** Objects with a notification held back, by the time it is due. */
+    std::multimap<int64_t, Object*> deadlines_m;
+
+    /** Attribute values of the message handled by processSimpleMessage,
+     * pointing into msg_m. */
+    std::vector<std::pair<const char*, size_t> > simpleArgs_m;
+    std::string simpleArg_m;
+
+    /** Objects resolved by a compact client, indexed by handle. */
+    struct ObjectHandle
+    {
+        Object* object;
+        bool number;
+    };
+    std::vector<ObjectHandle> handles_m;
+    std::map<Object*, uint32_t> handleIds_m;
+
+    /** Reply to <read><config/> for the configuration version it was
+     * exported at, shared by all connections. */
+    static std::string configCache_m;
+    static uint64_t configCacheVersion_m;
+    static Logger& logger_m;
+
+    void processMessage ();
+    bool processSimpleMessage ();
+    /** Returns true if the value of the object is known, otherwise sends
+     * a read request and adds it to pendingReads_m, as getValue() would
+     * block the server thread until the answer. */
+    bool isValueKnown (Object* object);
+    bool areValuesKnown (const std::list<Object*>& objects);
+    void processFrame ();
+    /** Sends the whole configuration, exported again only after it
+     * changed, or just its version if the client has it already. */
+    void sendConfig (const std::string& knownVersion);
+    void registerFilter (NotificationFilter* filter);
+    void registerAll ();
+    /** Unregisters all objects and removes the filters. */
+    void unregisterAll ();
+    bool checkThrottle (Object* object, Throttle& throttle, int64_t now);
+    void queueNotification (Object* object);
+    /** Returns 1 with a message in msg_m, 0 if more input is needed, 2
+     * if something else was handled and -1 on a protocol error. */
+    int readHttpRequest ();
+    int readWebSocketFrame ();
+    /** Appends output that is not a reply, like HTTP status lines or
+     * WebSocket control frames. */
+    int sendraw (const std::string& msg);
+    int sendHttpStatus (const char* status, const char* headers = "");
+    void beginmessage ();
+    int endmessage ();
+    int flushmessage ();
+    /** Appends the header of a compact frame, the length is set by endframe. */
+    size_t beginframe (int opcode);
+    int endframe (size_t start);
+    int senderror (int opcode, const char* msgstr);
+    void commitNotifications ();
+    void consume (size_t len);
+    void disconnect ();
+    friend class XmlServer;
+    friend class ConfigSaver;
 };
 
 #endif
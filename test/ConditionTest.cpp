@@ -0,0 +1,315 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "ruleserver.h"
+#include "services.h"
+
+class CountingListener : public ChangeListener
+{
+public:
+    CountingListener() : count_m(0) {};
+    virtual void onChange(Object* object) { count_m++; };
+    int count_m;
+};
+
+class ConditionTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( ConditionTest );
+    CPPUNIT_TEST( testAggregateAny );
+    CPPUNIT_TEST( testAggregateAll );
+    CPPUNIT_TEST( testAggregateCount );
+    CPPUNIT_TEST( testAggregateMinMaxAvg );
+    CPPUNIT_TEST( testAggregateNaN );
+    CPPUNIT_TEST( testAggregateInvalid );
+    CPPUNIT_TEST( testAggregateTrigger );
+    CPPUNIT_TEST( testAggregateExport );
+    CPPUNIT_TEST( testTimerMilliseconds );
+    CPPUNIT_TEST( testTimeCounterExport );
+    CPPUNIT_TEST( testTimerCatchUp );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    std::vector<Object*> windows_m;
+    std::vector<Object*> temps_m;
+
+public:
+    void setUp()
+    {
+        ticpp::Element pConfig;
+        for (int i = 0; i < 5; i++)
+        {
+            std::stringstream id;
+            id << "win_b_" << i;
+            pConfig.SetAttribute("id", id.str());
+            Object* obj = Object::create(&pConfig);
+            ObjectController::instance()->addObject(obj);
+            windows_m.push_back(obj);
+        }
+        pConfig.SetAttribute("id", "win_a_0");
+        ObjectController::instance()->addObject(Object::create(&pConfig));
+
+        pConfig.SetAttribute("type", "9.xxx");
+        for (int i = 0; i < 3; i++)
+        {
+            std::stringstream id;
+            id << "temp_" << i;
+            pConfig.SetAttribute("id", id.str());
+            Object* obj = Object::create(&pConfig);
+            ObjectController::instance()->addObject(obj);
+            temps_m.push_back(obj);
+        }
+    }
+
+    void tearDown()
+    {
+        windows_m.clear();
+        temps_m.clear();
+        ObjectController::reset();
+        Services::reset();
+    }
+
+    Condition* createCondition(const char* xml, ChangeListener* cl = 0)
+    {
+        ticpp::Document doc;
+        doc.LoadFromString(xml);
+        return Condition::create(doc.FirstChildElement(), cl);
+    }
+
+    void testAggregateAny()
+    {
+        Condition* cond = createCondition("<condition type='aggregate' function='any' value='on' pattern='win_b_*'/>");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        windows_m[3]->setValue("on");
+        CPPUNIT_ASSERT(cond->evaluate());
+        windows_m[1]->setValue("on");
+        windows_m[3]->setValue("off");
+        CPPUNIT_ASSERT(cond->evaluate());
+        windows_m[1]->setValue("off");
+        CPPUNIT_ASSERT(!cond->evaluate());
+
+        // win_a_0 does not match the pattern
+        ObjectController::instance()->getObject("win_a_0")->setValue("on");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        delete cond;
+    }
+
+    void testAggregateAll()
+    {
+        Condition* cond = createCondition("<condition type='aggregate' function='all' value='on'>"
+                                          "<object id='win_b_0'/><object id='win_b_1'/></condition>");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        windows_m[0]->setValue("on");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        windows_m[1]->setValue("on");
+        CPPUNIT_ASSERT(cond->evaluate());
+        windows_m[2]->setValue("off");
+        CPPUNIT_ASSERT(cond->evaluate());
+        windows_m[0]->setValue("off");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        delete cond;
+    }
+
+    void testAggregateCount()
+    {
+        Condition* cond = createCondition("<condition type='aggregate' function='count' value='on' min='2' max='3' pattern='win_b_?'/>");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        windows_m[0]->setValue("on");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        windows_m[1]->setValue("on");
+        CPPUNIT_ASSERT(cond->evaluate());
+        windows_m[2]->setValue("on");
+        CPPUNIT_ASSERT(cond->evaluate());
+        windows_m[3]->setValue("on");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        delete cond;
+    }
+
+    void testAggregateMinMaxAvg()
+    {
+        temps_m[0]->setValue("18");
+        temps_m[1]->setValue("20");
+        temps_m[2]->setValue("25");
+        Condition* min = createCondition("<condition type='aggregate' function='min' op='lt' value='19' pattern='temp_*'/>");
+        Condition* max = createCondition("<condition type='aggregate' function='max' op='gte' value='25' pattern='temp_*'/>");
+        Condition* avg = createCondition("<condition type='aggregate' function='avg' op='gt' value='21' pattern='temp_*'/>");
+        CPPUNIT_ASSERT(min->evaluate());
+        CPPUNIT_ASSERT(max->evaluate());
+        CPPUNIT_ASSERT(!avg->evaluate());
+
+        temps_m[0]->setValue("22");
+        CPPUNIT_ASSERT(!min->evaluate());
+        CPPUNIT_ASSERT(max->evaluate());
+        CPPUNIT_ASSERT(avg->evaluate());
+
+        temps_m[2]->setValue("21");
+        CPPUNIT_ASSERT(!max->evaluate());
+        CPPUNIT_ASSERT(!avg->evaluate());
+        delete min;
+        delete max;
+        delete avg;
+    }
+
+    void testAggregateNaN()
+    {
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("type", "14.xxx");
+        pConfig.SetAttribute("id", "float_0");
+        Object* float0 = Object::create(&pConfig);
+        ObjectController::instance()->addObject(float0);
+        pConfig.SetAttribute("id", "float_1");
+        Object* float1 = Object::create(&pConfig);
+        ObjectController::instance()->addObject(float1);
+        float0->setValue("1");
+        float1->setValue("3");
+        Condition* max = createCondition("<condition type='aggregate' function='max' op='gte' value='3' pattern='float_*'/>");
+        Condition* avg = createCondition("<condition type='aggregate' function='avg' op='lt' value='2' pattern='float_*'/>");
+        CPPUNIT_ASSERT(max->evaluate());
+        CPPUNIT_ASSERT(!avg->evaluate());
+
+        // A NaN value received from the bus is left out
+        uint8_t nan[6] = { 0, 0x80, 0x7f, 0xc0, 0, 0 };
+        float1->onWrite(nan, sizeof(nan), 0x1101);
+        CPPUNIT_ASSERT(!max->evaluate());
+        CPPUNIT_ASSERT(avg->evaluate());
+        float0->onWrite(nan, sizeof(nan), 0x1101);
+        CPPUNIT_ASSERT(!max->evaluate());
+        CPPUNIT_ASSERT(!avg->evaluate());
+        float1->setValue("5");
+        CPPUNIT_ASSERT(max->evaluate());
+        CPPUNIT_ASSERT(!avg->evaluate());
+        float0->setValue("-2");
+        CPPUNIT_ASSERT(avg->evaluate());
+        delete max;
+        delete avg;
+    }
+
+    void testAggregateInvalid()
+    {
+        // 'on' is no value for the 9.xxx objects matched first
+        CPPUNIT_ASSERT_THROW(createCondition("<condition type='aggregate' value='on' pattern='*'/>"), ticpp::Exception);
+        for (int i = 0; i < (int)windows_m.size(); i++)
+            CPPUNIT_ASSERT(!windows_m[i]->inUse());
+        for (int i = 0; i < (int)temps_m.size(); i++)
+            CPPUNIT_ASSERT(!temps_m[i]->inUse());
+    }
+
+    void testAggregateTrigger()
+    {
+        CountingListener listener;
+        Condition* cond = createCondition("<condition type='aggregate' value='on' pattern='win_b_*' trigger='true'/>", &listener);
+        windows_m[2]->setValue("on");
+        windows_m[4]->setValue("on");
+        CPPUNIT_ASSERT_EQUAL(2, listener.count_m);
+        ObjectController::instance()->getObject("win_a_0")->setValue("on");
+        CPPUNIT_ASSERT_EQUAL(2, listener.count_m);
+        delete cond;
+
+        // Listener is removed along with the condition
+        windows_m[2]->setValue("off");
+        CPPUNIT_ASSERT_EQUAL(2, listener.count_m);
+    }
+
+    void testAggregateExport()
+    {
+        Condition* cond = createCondition("<condition type='aggregate' function='count' value='on' op='ne' min='1' pattern='win_b_*'>"
+                                          "<object id='win_a_0'/></condition>");
+        ticpp::Element pConfig("condition");
+        cond->exportXml(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(std::string("aggregate"), pConfig.GetAttribute("type"));
+        CPPUNIT_ASSERT_EQUAL(std::string("count"), pConfig.GetAttribute("function"));
+        CPPUNIT_ASSERT_EQUAL(std::string("ne"), pConfig.GetAttribute("op"));
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), pConfig.GetAttribute("min"));
+        CPPUNIT_ASSERT_EQUAL(std::string("win_b_*"), pConfig.GetAttribute("pattern"));
+        CPPUNIT_ASSERT_EQUAL(std::string("win_a_0"), pConfig.FirstChildElement("object")->GetAttribute("id"));
+
+        std::set<Object*> objects;
+        cond->collectObjects(objects);
+        CPPUNIT_ASSERT_EQUAL(6, (int)objects.size());
+
+        // 6 objects are off, so 6 are not "on"
+        CPPUNIT_ASSERT(cond->evaluate());
+        delete cond;
+    }
+
+    void testTimerMilliseconds()
+    {
+        TimerCondition* cond = dynamic_cast<TimerCondition*>(
+            createCondition("<condition type='timer'><every>1500ms</every><during>300ms</during></condition>"));
+        CPPUNIT_ASSERT(cond);
+        ticpp::Element pConfig("condition");
+        cond->exportXml(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(std::string("1500ms"), pConfig.FirstChildElement("every")->GetText());
+        CPPUNIT_ASSERT_EQUAL(std::string("300ms"), pConfig.FirstChildElement("during")->GetText());
+
+        // Called back at the second of its deadline, the task is
+        // rescheduled from the exact deadline: 300ms on, 1200ms off.
+        int64_t deadline = (int64_t)cond->getExecTime() * 1000 + cond->getExecMillis();
+        for (int i = 0; i < 4; i++)
+        {
+            cond->onTimer(cond->getExecTime());
+            cond->reschedule(cond->getExecTime());
+            int64_t next = (int64_t)cond->getExecTime() * 1000 + cond->getExecMillis();
+            CPPUNIT_ASSERT_EQUAL(cond->evaluate() ? (int64_t)300 : (int64_t)1200, next - deadline);
+            deadline = next;
+        }
+        delete cond;
+    }
+
+    void testTimeCounterExport()
+    {
+        CountingListener listener;
+        Condition* cond = createCondition("<condition type='time-counter' threshold='1500ms' reset-delay='30d'>"
+                                          "<condition type='object' id='win_b_0' value='on'/></condition>", &listener);
+        ticpp::Element pConfig("condition");
+        cond->exportXml(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(std::string("1500ms"), pConfig.GetAttribute("threshold"));
+        CPPUNIT_ASSERT_EQUAL(std::string("30d"), pConfig.GetAttribute("reset-delay"));
+
+        CPPUNIT_ASSERT(!cond->evaluate());
+        windows_m[0]->setValue("on");
+        CPPUNIT_ASSERT(!cond->evaluate());
+        TimeCounterCondition* counter = dynamic_cast<TimeCounterCondition*>(cond);
+        int64_t deadline = (int64_t)counter->getExecTime() * 1000 + counter->getExecMillis();
+        int64_t delay = deadline - TimerManager::now();
+        CPPUNIT_ASSERT(delay > 1000 && delay <= 1501);
+        delete cond;
+    }
+
+    void testTimerCatchUp()
+    {
+        CountingListener listener;
+        TimerCondition* cond = dynamic_cast<TimerCondition*>(
+            createCondition("<condition type='timer' trigger='true'><at hour='8' min='0'/><until hour='18' min='0'/></condition>", &listener));
+        CPPUNIT_ASSERT(cond);
+
+        struct tm timeinfo;
+        memset(&timeinfo, 0, sizeof(timeinfo));
+        timeinfo.tm_year = 120;
+        timeinfo.tm_mon = 5;
+        timeinfo.tm_mday = 10;
+        timeinfo.tm_hour = 12;
+        timeinfo.tm_isdst = -1;
+        time_t noon = mktime(&timeinfo);
+        timeinfo.tm_hour = 20;
+        time_t evening = mktime(&timeinfo);
+
+        bool value = cond->evaluate();
+        int count = listener.count_m;
+        cond->onCatchUp(noon);
+        CPPUNIT_ASSERT(cond->evaluate());
+        CPPUNIT_ASSERT_EQUAL(count + (value ? 0 : 1), listener.count_m);
+        time_t next = cond->getExecTime();
+        CPPUNIT_ASSERT_EQUAL(18, localtime(&next)->tm_hour);
+
+        // Catching up twice in the same state does not notify again.
+        cond->onCatchUp(noon + 60);
+        CPPUNIT_ASSERT_EQUAL(count + (value ? 0 : 1), listener.count_m);
+
+        cond->onCatchUp(evening);
+        CPPUNIT_ASSERT(!cond->evaluate());
+        CPPUNIT_ASSERT_EQUAL(count + (value ? 1 : 2), listener.count_m);
+        next = cond->getExecTime();
+        CPPUNIT_ASSERT_EQUAL(8, localtime(&next)->tm_hour);
+        delete cond;
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ConditionTest );
@@ -1,5 +1,8 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "timermanager.h"
+#include <sstream>
+#include <fstream>
+#include <cstdio>
 
 class ExceptionDaysTest : public CppUnit::TestFixture
 {
@@ -9,6 +12,10 @@ class ExceptionDaysTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testIsException );
     CPPUNIT_TEST( testIsExceptionWildcard );
     CPPUNIT_TEST( testIsExceptionWildcard2 );
+    CPPUNIT_TEST( testRemoveDay );
+    CPPUNIT_TEST( testImportCalendar );
+    CPPUNIT_TEST( testManyYears );
+    CPPUNIT_TEST( testReimportCalendar );
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -204,6 +211,127 @@ public:
         CPPUNIT_ASSERT(!exceptiondays_m->isException(time));
     }
 
+
+    void testRemoveDay()
+    {
+        DaySpec* ds = new DaySpec();
+        ds->mday_m = 1;
+        ds->mon_m = 4;
+        exceptiondays_m->addDay(ds);
+        CPPUNIT_ASSERT(exceptiondays_m->isException(110, 4, 1));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(111, 4, 1));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(111, 4, 2));
+
+        exceptiondays_m->removeDay(ds);
+        delete ds;
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(110, 4, 1));
+    }
+
+    void testImportCalendar()
+    {
+        std::istringstream ics(
+            "BEGIN:VCALENDAR\r\n"
+            "VERSION:2.0\r\n"
+            "BEGIN:VEVENT\r\n"
+            "DTSTART;VALUE=DATE:20241225\r\n"
+            "DTEND;VALUE=DATE:20241226\r\n"
+            "SUMMARY:Christmas\r\n"
+            "RRULE:FREQ=YEARLY\r\n"
+            "END:VEVENT\r\n"
+            "BEGIN:VEVENT\r\n"
+            "DTSTART;VALUE=DATE:20240330\r\n"
+            "DTEND;VALUE=DATE:20240402\r\n"
+            "SUMMARY:Easter weekend\r\n"
+            "END:VEVENT\r\n"
+            "BEGIN:VEVENT\r\n"
+            "DTSTART:20240509T000000Z\r\n"
+            "SUMMARY:Ascension\r\n"
+            "END:VEVENT\r\n"
+            "END:VCALENDAR\r\n");
+        exceptiondays_m->importCalendar(ics);
+
+        CPPUNIT_ASSERT(exceptiondays_m->isException(124, 11, 25));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(130, 11, 25));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(124, 11, 26));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(124, 2, 29));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(124, 2, 30));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(124, 2, 31));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(124, 3, 1));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(124, 3, 2));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(125, 2, 31));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(124, 4, 9));
+
+        // Calendar days are not exported one by one
+        ticpp::Element pExport;
+        exceptiondays_m->exportXml(&pExport);
+        CPPUNIT_ASSERT(pExport.FirstChildElement(false) == 0);
+
+        exceptiondays_m->clear();
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(124, 11, 25));
+    }
+
+    void testManyYears()
+    {
+        std::stringstream ics;
+        for (int year = 2000; year < 2100; year++)
+        {
+            ics << "BEGIN:VEVENT\n"
+                << "DTSTART;VALUE=DATE:" << year << "0501\n"
+                << "END:VEVENT\n";
+        }
+        exceptiondays_m->importCalendar(ics);
+
+        struct tm timeinfo;
+        memset(&timeinfo, 0, sizeof(timeinfo));
+        timeinfo.tm_hour = 12;
+        timeinfo.tm_mday = 1;
+        timeinfo.tm_mon = 4;
+        timeinfo.tm_year = 150;
+        timeinfo.tm_isdst = -1;
+        time_t time = mktime(&timeinfo);
+        int count = 0;
+        for (int i = 0; i < 100000; i++)
+        {
+            if (exceptiondays_m->isException(time + (i % 3) * 86400))
+                count++;
+        }
+        CPPUNIT_ASSERT_EQUAL(33334, count);
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(99, 4, 1));
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(200, 4, 1));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(199, 4, 1));
+    }
+
+    void writeCalendar(const char* file, const char* date)
+    {
+        std::ofstream out(file);
+        out << "BEGIN:VEVENT\nDTSTART;VALUE=DATE:" << date << "\nEND:VEVENT\n";
+    }
+
+    void testReimportCalendar()
+    {
+        const char* file = "/tmp/linknx_unittest_calendar.ics";
+        writeCalendar(file, "20240501");
+        ticpp::Element pConfig("exceptiondays");
+        ticpp::Element pCalendar("calendar");
+        pCalendar.SetAttribute("file", file);
+        pConfig.InsertEndChild(pCalendar);
+        exceptiondays_m->importXml(&pConfig);
+        exceptiondays_m->importXml(&pConfig);
+
+        ticpp::Element pExport;
+        exceptiondays_m->exportXml(&pExport);
+        ticpp::Element* pElem = pExport.FirstChildElement("calendar");
+        CPPUNIT_ASSERT_EQUAL(std::string(file), pElem->GetAttribute("file"));
+        CPPUNIT_ASSERT(pElem->NextSiblingElement(false) == 0);
+        CPPUNIT_ASSERT(exceptiondays_m->isException(124, 4, 1));
+
+        // The days of the file are replaced by its new content
+        writeCalendar(file, "20240502");
+        exceptiondays_m->importXml(&pConfig);
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(124, 4, 1));
+        CPPUNIT_ASSERT(exceptiondays_m->isException(124, 4, 2));
+        remove(file);
+    }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( ExceptionDaysTest );
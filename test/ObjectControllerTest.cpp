@@ -11,6 +11,7 @@ class ObjectControllerTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testWrite );
     CPPUNIT_TEST( testExportImport );
     CPPUNIT_TEST( testWriteMultipleGad );
+    CPPUNIT_TEST( testChangeLog );
 //    CPPUNIT_TEST(  );
 //    CPPUNIT_TEST(  );
     
@@ -226,6 +227,59 @@ public:
         CPPUNIT_ASSERT(obj3->getValue() == "off");
     }
 
+
+    std::string changes(uint64_t since, int64_t epoch, bool *complete)
+    {
+        ticpp::Element pObjects("changes");
+        *complete = oc_m->exportChanges(&pObjects, since, epoch);
+        std::string ids;
+        ticpp::Iterator< ticpp::Element > it;
+        for (it = pObjects.FirstChildElement(false); it != it.end(); it++)
+            ids += it->GetAttribute("id") + "=" + it->GetAttribute("value") + " ";
+        return ids;
+    }
+
+    void testChangeLog()
+    {
+        Object* obj1 = new SwitchingSwitchObject();
+        obj1->setID("test_sw1");
+        oc_m->addObject(obj1);
+        Object* obj2 = new SwitchingSwitchObject();
+        obj2->setID("test_sw2");
+        oc_m->addObject(obj2);
+        Object* obj3 = new SwitchingSwitchObject();
+        obj3->setID("test_sw3");
+        oc_m->addObject(obj3);
+        uint64_t seq = oc_m->getSeq();
+        int64_t epoch = oc_m->getEpoch();
+        CPPUNIT_ASSERT_EQUAL(seq, obj3->getChangeSeq());
+
+        bool complete;
+        CPPUNIT_ASSERT_EQUAL(std::string(""), changes(seq, epoch, &complete));
+        CPPUNIT_ASSERT(complete);
+
+        // Objects changed several times are sent once with their last value
+        obj2->setValue("on");
+        obj1->setValue("on");
+        obj2->setValue("off");
+        CPPUNIT_ASSERT_EQUAL(seq + 3, oc_m->getSeq());
+        CPPUNIT_ASSERT_EQUAL(std::string("test_sw1=on test_sw2=off "), changes(seq, epoch, &complete));
+        CPPUNIT_ASSERT(complete);
+        CPPUNIT_ASSERT_EQUAL(std::string("test_sw2=off "), changes(seq + 2, epoch, &complete));
+
+        // Unknown sequences get a snapshot
+        CPPUNIT_ASSERT_EQUAL(std::string("test_sw3=off test_sw1=on test_sw2=off "), changes(seq + 2, epoch + 1, &complete));
+        CPPUNIT_ASSERT(!complete);
+        changes(seq + 10, epoch, &complete);
+        CPPUNIT_ASSERT(!complete);
+
+        uint64_t beforeRemove = oc_m->getSeq();
+        oc_m->removeObject(obj3);
+        CPPUNIT_ASSERT_EQUAL(std::string("test_sw1=on test_sw2=off "), changes(beforeRemove, epoch, &complete));
+        CPPUNIT_ASSERT(!complete);
+        CPPUNIT_ASSERT_EQUAL(std::string(""), changes(oc_m->getSeq(), epoch, &complete));
+        CPPUNIT_ASSERT(complete);
+    }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( ObjectControllerTest );
@@ -1,6 +1,7 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "timermanager.h"
 #include "services.h"
+#include "suncalc.h"
 #include <iostream>
 
 class TestablePeriodicTask : public PeriodicTask
@@ -40,6 +41,12 @@ class PeriodicTaskTest : public CppUnit::TestFixture, public ChangeListener
     CPPUNIT_TEST( testNegativeMinutes );
     CPPUNIT_TEST( testSunriseSpecificDay );
     CPPUNIT_TEST( testFindNextSunsetWithMonthChange );
+    CPPUNIT_TEST( testFindNextOnlyExceptionWithoutExceptionDays );
+    CPPUNIT_TEST( testFindNextSparseException );
+    CPPUNIT_TEST( testFindNextMemoised );
+    CPPUNIT_TEST( testFindNextMemoInvalidated );
+    CPPUNIT_TEST( testFindNextTwilight );
+    CPPUNIT_TEST( testEphemerisFollowsLocation );
 //    CPPUNIT_TEST(  );
     
     CPPUNIT_TEST_SUITE_END();
@@ -924,6 +931,153 @@ public:
         CPPUNIT_ASSERT_EQUAL(7, timeinfo->tm_mon);
         CPPUNIT_ASSERT_EQUAL(112, timeinfo->tm_year);
     }
+
+    void testFindNextOnlyExceptionWithoutExceptionDays()
+    {
+        // Used to recurse forever
+        TimeSpec ts1(30, 16, TimeSpec::Wed, TimeSpec::Yes);
+        CPPUNIT_ASSERT_EQUAL((time_t)0, task_m->callFindNext(timeref1_m, &ts1));
+
+        TimeSpec ts2(30, 16, TimeSpec::All, TimeSpec::Yes);
+        time_t start = time(0);
+        for (int i = 0; i < 10; i++)
+            CPPUNIT_ASSERT_EQUAL((time_t)0, task_m->callFindNext(timeref1_m, &ts2));
+        CPPUNIT_ASSERT(time(0) - start < 5);
+    }
+
+    void testFindNextSparseException()
+    {
+        time_t next;
+        struct tm * timeinfo;
+        // Only on Monday 2012-12-24, nearly 6 years after the start.
+        TimeSpec ts1(0, 8, TimeSpec::Mon, TimeSpec::Yes);
+        DaySpec* ds = new DaySpec();
+        ds->mday_m = 24;
+        ds->mon_m = 11;
+        ds->year_m = 112;
+        Services::instance()->getExceptionDays()->addDay(ds);
+
+        time_t start = time(0);
+        next = task_m->callFindNext(timeref1_m, &ts1);
+        CPPUNIT_ASSERT(next != 0);
+        timeinfo = localtime(&next);
+        CPPUNIT_ASSERT_EQUAL(24, timeinfo->tm_mday);
+        CPPUNIT_ASSERT_EQUAL(11, timeinfo->tm_mon);
+        CPPUNIT_ASSERT_EQUAL(112, timeinfo->tm_year);
+
+        // Rescheduling from any time until the occurrence is a lookup.
+        for (time_t t = timeref1_m; t < next; t += 600)
+            CPPUNIT_ASSERT_EQUAL(next, task_m->callFindNext(t, &ts1));
+        CPPUNIT_ASSERT(time(0) - start < 5);
+
+        CPPUNIT_ASSERT_EQUAL((time_t)0, task_m->callFindNext(next, &ts1));
+    }
+
+    void testFindNextMemoised()
+    {
+        DaySpec* ds = new DaySpec();
+        ds->mday_m = 10;
+        ds->mon_m = 0;
+        Services::instance()->getExceptionDays()->addDay(ds);
+        ds = new DaySpec();
+        ds->mday_m = 25;
+        Services::instance()->getExceptionDays()->addDay(ds);
+
+        TimeSpec specs[] = {
+            TimeSpec(30, 16),
+            TimeSpec(0, 8, TimeSpec::Mon | TimeSpec::Wed, TimeSpec::No),
+            TimeSpec(15, -1, TimeSpec::Fri, TimeSpec::DontCare),
+            TimeSpec(-1, 12, 25, -1, -1, 3600),
+            TimeSpec(45, 6, -1, -1, -1, -7200),
+            TimeSpec(0, 0, 10, -1, -1, 0)
+        };
+        for (unsigned int i = 0; i < sizeof(specs) / sizeof(specs[0]); i++)
+        {
+            for (time_t t = timeref1_m; t < timeref1_m + 100 * 86400; t += 7919)
+            {
+                TestablePeriodicTask fresh(0);
+                time_t expected = fresh.callFindNext(t, &specs[i]);
+                CPPUNIT_ASSERT_EQUAL(expected, task_m->callFindNext(t, &specs[i]));
+            }
+        }
+    }
+
+    void testFindNextMemoInvalidated()
+    {
+        TimeSpec ts1(30, 16, TimeSpec::Wed, TimeSpec::No);
+        time_t next = task_m->callFindNext(timeref1_m, &ts1);
+        CPPUNIT_ASSERT_EQUAL(3, localtime(&next)->tm_mday);
+
+        DaySpec* ds = new DaySpec();
+        ds->mday_m = 3;
+        ds->mon_m = 0;
+        ds->year_m = 107;
+        Services::instance()->getExceptionDays()->addDay(ds);
+        next = task_m->callFindNext(timeref1_m, &ts1);
+        CPPUNIT_ASSERT_EQUAL(10, localtime(&next)->tm_mday);
+
+        ts1.setHour(18);
+        next = task_m->callFindNext(timeref1_m, &ts1);
+        CPPUNIT_ASSERT_EQUAL(18, localtime(&next)->tm_hour);
+    }
+
+    void testFindNextTwilight()
+    {
+        struct tm curtimeinfo;
+        Services::instance()->getLocationInfo()->setCoord(4.84, 45.76); // Near Lyon, France.
+        curtimeinfo.tm_hour = 12;
+        curtimeinfo.tm_min = 0;
+        curtimeinfo.tm_sec = 0;
+        curtimeinfo.tm_mday = 6;
+        curtimeinfo.tm_mon = 10;
+        curtimeinfo.tm_year = 118;
+        curtimeinfo.tm_isdst = -1;
+        time_t curtimeref = mktime(&curtimeinfo);
+
+        const char* types[] = { "astronomical-dawn", "nautical-dawn", "civil-dawn", "sunrise" };
+        time_t prev = curtimeref;
+        for (int i = 0; i < 4; i++)
+        {
+            TimeSpec* ts = TimeSpec::create(types[i], 0);
+            ticpp::Element pConfig("at");
+            ts->exportXml(&pConfig);
+            CPPUNIT_ASSERT_EQUAL(std::string(types[i]), pConfig.GetAttribute("type"));
+
+            time_t next = task_m->callFindNext(curtimeref, ts);
+            CPPUNIT_ASSERT(next > prev);
+            CPPUNIT_ASSERT_EQUAL(7, localtime(&next)->tm_mday);
+            prev = next;
+            delete ts;
+        }
+
+        TimeSpec* dusk = TimeSpec::create("civil-dusk", 0);
+        SunsetTimeSpec sunset;
+        time_t sunsetTime = task_m->callFindNext(curtimeref, &sunset);
+        time_t duskTime = task_m->callFindNext(curtimeref, dusk);
+        CPPUNIT_ASSERT(duskTime > sunsetTime);
+        CPPUNIT_ASSERT(duskTime - sunsetTime < 3600);
+        delete dusk;
+    }
+
+    void testEphemerisFollowsLocation()
+    {
+        LocationInfo* location = Services::instance()->getLocationInfo();
+        double rise1, set1, rise2, set2;
+        location->setCoord(4.84, 45.76);
+        CPPUNIT_ASSERT_EQUAL(0, location->getSunTimes(LocationInfo::RiseSet, 118, 5, 21, &rise1, &set1));
+        CPPUNIT_ASSERT_EQUAL(0, location->getSunTimes(LocationInfo::RiseSet, 118, 5, 21, &rise2, &set2));
+        CPPUNIT_ASSERT(rise1 == rise2 && set1 == set2);
+
+        // One degree east makes the sun rise 4 minutes earlier.
+        location->setCoord(5.84, 45.76);
+        CPPUNIT_ASSERT_EQUAL(0, location->getSunTimes(LocationInfo::RiseSet, 118, 5, 21, &rise2, &set2));
+        CPPUNIT_ASSERT(rise1 - rise2 > 3.5/60 && rise1 - rise2 < 4.5/60);
+
+        // No astronomical night in Oslo around the summer solstice.
+        location->setCoord(10.75, 59.91);
+        CPPUNIT_ASSERT(location->getSunTimes(LocationInfo::AstronomicalTwilight, 118, 5, 21, &rise2, &set2) != 0);
+        CPPUNIT_ASSERT_EQUAL(0, location->getSunTimes(LocationInfo::RiseSet, 118, 5, 21, &rise2, &set2));
+    }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( PeriodicTaskTest );
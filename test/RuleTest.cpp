@@ -2,6 +2,7 @@
 #include "timermanager.h"
 #include "services.h"
 #include <iostream>
+#include <vector>
 
 class ConstantCondition : public Condition
 {
@@ -63,7 +64,7 @@ public:
     }
 };
 
-class RuleTest : public CppUnit::TestFixture/*, public ChangeListener*/
+class RuleTest : public CppUnit::TestFixture, public ChangeListener
 {
     CPPUNIT_TEST_SUITE( RuleTest );
     CPPUNIT_TEST( testIfTrueActionList );
@@ -75,14 +76,27 @@ class RuleTest : public CppUnit::TestFixture/*, public ChangeListener*/
     CPPUNIT_TEST( testOnFalseActionList );
     CPPUNIT_TEST( testOnFalseActionListOnInactiveRule );
     CPPUNIT_TEST( testIfTrueAndOnTrueActionLists );
+    CPPUNIT_TEST( testDebounce );
+    CPPUNIT_TEST( testRateLimit );
+    CPPUNIT_TEST( testCollectInitObjects );
+    CPPUNIT_TEST( testReload );
+    CPPUNIT_TEST( testReloadDebounce );
+    CPPUNIT_TEST( testSequencedAction );
+    CPPUNIT_TEST( testSequencedCycle );
+    CPPUNIT_TEST( testCycleStopCondition );
+    CPPUNIT_TEST( testRepeatWaitsForChildren );
+    CPPUNIT_TEST( testConcurrentSequencedAction );
+    CPPUNIT_TEST( testCancelSequencedAction );
+    CPPUNIT_TEST( testManyPendingActions );
     
     CPPUNIT_TEST_SUITE_END();
 
 public:
-    RuleTest() : rule_m(NULL) {}
+    RuleTest() : rule_m(NULL), changes_m(0) {}
 
 private:
     TestableRule *rule_m;
+    int changes_m;
 
 public:
     void setUp()
@@ -94,12 +108,14 @@ public:
     void tearDown()
     {
         delete rule_m; rule_m = NULL;
+        // Tests drive the timer wheel with fake times, start fresh each time
+        Services::reset();
     }
 
-    /*void onChange(Object* obj)
+    void onChange(Object* obj)
     {
-        isOnChangeCalled_m = true;
-    }*/
+        changes_m++;
+    }
 
     void testIfTrueActionList()
     {
@@ -188,7 +204,471 @@ public:
         CPPUNIT_ASSERT_EQUAL(20, action2->getCounter());
     }
 
+    void testDebounce()
+    {
+        CounterAction *action = new CounterAction(1);
+        rule_m->addAction(action, ActionList::IfTrue);
+        rule_m->setDebounce(100);
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        // A burst of changes only schedules one evaluation.
+        int64_t start = TimerWheel::now();
+        rule_m->onChange(0);
+        rule_m->onChange(0);
+        rule_m->onChange(0);
+        CPPUNIT_ASSERT_EQUAL(1, wheel->getTaskCount());
+        CPPUNIT_ASSERT_EQUAL(0, action->getCounter());
+
+        wheel->advance(start + 50);
+        CPPUNIT_ASSERT_EQUAL(0, action->getCounter());
+
+        // Inputs are stable for the debounce delay, rule is evaluated once.
+        wheel->advance(start + 200);
+        action->waitForCompletion();
+        CPPUNIT_ASSERT_EQUAL(1, action->getCounter());
+        CPPUNIT_ASSERT_EQUAL(0, wheel->getTaskCount());
+    }
+
+    void testRateLimit()
+    {
+        CounterAction *action = new CounterAction(1);
+        rule_m->addAction(action, ActionList::IfTrue);
+        rule_m->setRateLimit(1000);
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        int64_t start = TimerWheel::now();
+        rule_m->evaluate();
+        action->waitForCompletion();
+        CPPUNIT_ASSERT_EQUAL(1, action->getCounter());
+
+        // Second and third evaluations are merged at the end of the period.
+        rule_m->evaluate();
+        rule_m->evaluate();
+        CPPUNIT_ASSERT_EQUAL(1, action->getCounter());
+        CPPUNIT_ASSERT_EQUAL(1, wheel->getTaskCount());
+
+        wheel->advance(start + 1500);
+        action->waitForCompletion();
+        CPPUNIT_ASSERT_EQUAL(2, action->getCounter());
+        CPPUNIT_ASSERT_EQUAL(0, wheel->getTaskCount());
+    }
+
+    void testCollectInitObjects()
+    {
+        ticpp::Element pObj;
+        pObj.SetAttribute("id", "init_sw1");
+        ObjectController::instance()->addObject(Object::create(&pObj));
+        pObj.SetAttribute("id", "init_sw2");
+        ObjectController::instance()->addObject(Object::create(&pObj));
+        pObj.SetAttribute("id", "init_sw3");
+        ObjectController::instance()->addObject(Object::create(&pObj));
+
+        Object* sw1 = ObjectController::instance()->getObject("init_sw1");
+        Object* sw2 = ObjectController::instance()->getObject("init_sw2");
+        ticpp::Document doc;
+        doc.LoadFromString("<rule id='r1' init='eval'><condition type='and'>"
+                  "<condition type='object' id='init_sw1' value='on'/>"
+                  "<condition type='not'><condition type='object-compare' id='init_sw2' id2='init_sw1'/></condition>"
+                  "</condition><actionlist/></rule>");
+        {
+            Rule rule;
+            rule.importXml(doc.FirstChildElement());
+            std::set<Object*> objects;
+            rule.collectInitObjects(objects);
+            CPPUNIT_ASSERT_EQUAL(2, (int)objects.size());
+            CPPUNIT_ASSERT(objects.count(sw1) == 1);
+            CPPUNIT_ASSERT(objects.count(sw2) == 1);
+        }
+
+        // Conditions of rules not evaluated at init are not needed.
+        doc.FirstChildElement()->SetAttribute("init", "false");
+        {
+            Rule rule;
+            rule.importXml(doc.FirstChildElement());
+            std::set<Object*> objects;
+            rule.collectInitObjects(objects);
+            CPPUNIT_ASSERT(objects.empty());
+        }
+        sw1->decRefCount();
+        sw2->decRefCount();
+        ObjectController::reset();
+    }
+
+    void testReload()
+    {
+        ticpp::Element pObj;
+        pObj.SetAttribute("id", "reload_sw1");
+        ObjectController::instance()->addObject(Object::create(&pObj));
+        pObj.SetAttribute("id", "reload_sw2");
+        ObjectController::instance()->addObject(Object::create(&pObj));
+
+        RuleServer* rs = RuleServer::instance();
+        ticpp::Document doc;
+        doc.LoadFromString("<rules>"
+                  "<rule id='r1'><condition type='object' id='reload_sw1' value='on' trigger='true'/>"
+                  "<actionlist><action type='set-value' id='reload_sw2' value='on'/></actionlist></rule>"
+                  "<rule id='r2'><condition type='object' id='reload_sw2' value='on' trigger='true'/>"
+                  "<actionlist><action type='set-value' id='reload_sw1' value='off'/></actionlist></rule>"
+                  "</rules>");
+        rs->importXml(doc.FirstChildElement());
+        Rule* r1 = rs->getRule("r1");
+        Rule* r2 = rs->getRule("r2");
+
+        // Pushing back the exported config leaves all rules alone.
+        ticpp::Element exported("rules");
+        rs->exportXml(&exported);
+        rs->importXml(&exported);
+        CPPUNIT_ASSERT(rs->getRule("r1") == r1);
+        CPPUNIT_ASSERT(rs->getRule("r2") == r2);
+        ticpp::Element status("rules");
+        rs->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status.GetAttribute("reload-touched"));
+
+        // Only the modified rule is replaced.
+        doc.LoadFromString("<rules><rule id='r2'><condition type='object' id='reload_sw2' value='off' trigger='true'/></rule></rules>");
+        rs->importXml(doc.FirstChildElement());
+        CPPUNIT_ASSERT(rs->getRule("r1") == r1);
+        CPPUNIT_ASSERT(rs->getRule("r2") != r2);
+        r2 = rs->getRule("r2");
+        ticpp::Element config("rule");
+        r2->exportXml(&config);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), config.FirstChildElement("condition")->GetAttribute("value"));
+        CPPUNIT_ASSERT(config.FirstChildElement("actionlist", false) != 0);
+
+        // Attribute changes are applied in place.
+        doc.LoadFromString("<rules><rule id='r1' active='no'/></rules>");
+        rs->importXml(doc.FirstChildElement());
+        CPPUNIT_ASSERT(rs->getRule("r1") == r1);
+        CPPUNIT_ASSERT(!r1->isActive());
+
+        RuleServer::reset();
+        ObjectController::reset();
+    }
+
+    void testReloadDebounce()
+    {
+        ticpp::Element pObj;
+        const char* ids[] = { "deb_sw1", "deb_sw2", "deb_sw3" };
+        for (int i = 0; i < 3; i++)
+        {
+            pObj.SetAttribute("id", ids[i]);
+            ObjectController::instance()->addObject(Object::create(&pObj));
+        }
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        RuleServer* rs = RuleServer::instance();
+        ticpp::Document doc;
+        doc.LoadFromString("<rules><rule id='deb' debounce='100ms'>"
+                  "<condition type='object' id='deb_sw1' value='on' trigger='true'/>"
+                  "<actionlist><action type='set-value' id='deb_sw2' value='on'/></actionlist></rule></rules>");
+        rs->importXml(doc.FirstChildElement());
+        Object* sw1 = ObjectController::instance()->getObject("deb_sw1");
+        sw1->setValue("on");
+        sw1->decRefCount();
+        CPPUNIT_ASSERT_EQUAL(1, wheel->getTaskCount());
+
+        // The new rule evaluates when the debounce of the previous one expires
+        doc.LoadFromString("<rules><rule id='deb'>"
+                  "<actionlist><action type='set-value' id='deb_sw3' value='on'/></actionlist></rule></rules>");
+        rs->importXml(doc.FirstChildElement());
+        CPPUNIT_ASSERT_EQUAL(1, wheel->getTaskCount());
+        int64_t start = TimerWheel::now();
+        wheel->advance(start + 200);
+        wheel->advance(start + 400);
+        Object* sw2 = ObjectController::instance()->getObject("deb_sw2");
+        Object* sw3 = ObjectController::instance()->getObject("deb_sw3");
+        // The values were never read, so the actions run in threads
+        for (int i = 0; i < 100 && !sw3->isInitialized(); i++)
+            pth_yield(NULL);
+        CPPUNIT_ASSERT(sw3->isInitialized());
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), sw2->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), sw3->getValue());
+        sw2->decRefCount();
+        sw3->decRefCount();
+
+        RuleServer::reset();
+        ObjectController::reset();
+    }
+
+    void testSequencedAction()
+    {
+        ticpp::Element pObj;
+        pObj.SetAttribute("id", "seq_sw");
+        Object* obj = Object::create(&pObj);
+        ObjectController::instance()->addObject(obj);
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        ticpp::Element pConfig("action");
+        pConfig.SetAttribute("type", "set-value");
+        pConfig.SetAttribute("id", "seq_sw");
+        pConfig.SetAttribute("value", "on");
+        pConfig.SetAttribute("delay", "100ms");
+        Action* action = Action::create(&pConfig);
+
+        int64_t start = TimerWheel::now();
+        action->execute();
+        CPPUNIT_ASSERT(!action->isFinished());
+        CPPUNIT_ASSERT_EQUAL(1, wheel->getTaskCount());
+        wheel->advance(start + 50);
+        CPPUNIT_ASSERT_EQUAL(1, wheel->getTaskCount());
+        // The value of the object is unknown, the step runs in a thread
+        wheel->advance(start + 200);
+        CPPUNIT_ASSERT_EQUAL(0, wheel->getTaskCount());
+        CPPUNIT_ASSERT(!action->isFinished());
+        waitForCompletion(action);
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), obj->getValue());
+
+        // Once it is known, the step runs on the wheel
+        obj->setValue("off");
+        start = TimerWheel::now();
+        action->execute();
+        wheel->advance(start + 200);
+        CPPUNIT_ASSERT(action->isFinished());
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), obj->getValue());
+
+        delete action;
+        ObjectController::reset();
+    }
+
+    void testSequencedCycle()
+    {
+        ticpp::Element pObj;
+        pObj.SetAttribute("id", "seq_cycle");
+        Object* obj = Object::create(&pObj);
+        ObjectController::instance()->addObject(obj);
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        ticpp::Element pConfig("action");
+        pConfig.SetAttribute("type", "cycle-on-off");
+        pConfig.SetAttribute("id", "seq_cycle");
+        pConfig.SetAttribute("on", "100ms");
+        pConfig.SetAttribute("off", "100ms");
+        pConfig.SetAttribute("count", "2");
+        Action* action = Action::create(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+
+        int64_t start = TimerWheel::now();
+        action->execute();
+        wheel->advance(start + 10);
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), obj->getValue());
+        wheel->advance(start + 120);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+
+        // A second cycle keeps running after the first one is done
+        action->execute();
+        wheel->advance(start + 170);
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), obj->getValue());
+        wheel->advance(start + 230);
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), obj->getValue());
+        wheel->advance(start + 280);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+        wheel->advance(start + 340);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+        wheel->advance(start + 390);
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), obj->getValue());
+        wheel->advance(start + 450);
+        CPPUNIT_ASSERT_EQUAL(1, wheel->getTaskCount());
+        wheel->advance(start + 500);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+        CPPUNIT_ASSERT(!action->isFinished());
+        wheel->advance(start + 610);
+        CPPUNIT_ASSERT(action->isFinished());
+
+        delete action;
+        ObjectController::reset();
+    }
+
+    void testCycleStopCondition()
+    {
+        ticpp::Element pObj;
+        const char* ids[] = { "cycle_sw", "cycle_stop" };
+        for (int i = 0; i < 2; i++)
+        {
+            pObj.SetAttribute("id", ids[i]);
+            ObjectController::instance()->addObject(Object::create(&pObj));
+        }
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        ticpp::Document doc;
+        doc.LoadFromString("<action type='cycle-on-off' id='cycle_sw' on='100ms' off='100ms' count='5'>"
+                           "<stopcondition type='object' id='cycle_stop' value='on' trigger='true'/></action>");
+        Action* action = Action::create(doc.FirstChildElement());
+        Object* sw = ObjectController::instance()->getObject("cycle_sw");
+        Object* stop = ObjectController::instance()->getObject("cycle_stop");
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), sw->getValue());
+
+        // The condition stops every running cycle
+        int64_t start = TimerWheel::now();
+        action->execute();
+        action->execute();
+        wheel->advance(start + 10);
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), sw->getValue());
+        CPPUNIT_ASSERT_EQUAL(2, wheel->getTaskCount());
+        stop->setValue("on");
+        CPPUNIT_ASSERT_EQUAL(0, wheel->getTaskCount());
+        CPPUNIT_ASSERT(action->isFinished());
+        wheel->advance(start + 110);
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), sw->getValue());
+
+        // A later execution runs again
+        stop->setValue("off");
+        action->execute();
+        wheel->advance(start + 120);
+        wheel->advance(start + 220);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), sw->getValue());
+        CPPUNIT_ASSERT(!action->isFinished());
+
+        sw->decRefCount();
+        stop->decRefCount();
+        delete action;
+        ObjectController::reset();
+    }
+
+    void testRepeatWaitsForChildren()
+    {
+        ticpp::Element pObj;
+        pObj.SetAttribute("id", "repeat_sw");
+        Object* obj = Object::create(&pObj);
+        ObjectController::instance()->addObject(obj);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        ticpp::Document doc;
+        doc.LoadFromString("<action type='repeat' period='100ms' count='1'>"
+                           "<action type='set-value' id='repeat_sw' value='on' delay='1s'/></action>");
+        Action* action = Action::create(doc.FirstChildElement());
+
+        int64_t start = TimerWheel::now();
+        action->execute();
+        wheel->advance(start + 10);
+        wheel->advance(start + 200);
+        // The repeat is done but its child is still pending
+        CPPUNIT_ASSERT_EQUAL(1, wheel->getTaskCount());
+        CPPUNIT_ASSERT(!action->isFinished());
+        wheel->advance(start + 1100);
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), obj->getValue());
+        CPPUNIT_ASSERT(action->isFinished());
+
+        delete action;
+        ObjectController::reset();
+    }
+
+    void testConcurrentSequencedAction()
+    {
+        ticpp::Element pObj;
+        pObj.SetAttribute("id", "seq_toggle");
+        Object* obj = Object::create(&pObj);
+        ObjectController::instance()->addObject(obj);
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        ticpp::Element pConfig("action");
+        pConfig.SetAttribute("type", "toggle-value");
+        pConfig.SetAttribute("id", "seq_toggle");
+        pConfig.SetAttribute("delay", "100ms");
+        Action* action = Action::create(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+        obj->addChangeListener(this);
+
+        // Executing again while pending runs a second instance
+        int64_t start = TimerWheel::now();
+        action->execute();
+        action->execute();
+        CPPUNIT_ASSERT_EQUAL(2, wheel->getTaskCount());
+        CPPUNIT_ASSERT(!action->isFinished());
+        CPPUNIT_ASSERT_EQUAL(2, wheel->advance(start + 1000));
+        CPPUNIT_ASSERT_EQUAL(2, changes_m);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+        CPPUNIT_ASSERT(action->isFinished());
+
+        action->execute();
+        action->execute();
+        action->cancel();
+        CPPUNIT_ASSERT_EQUAL(0, wheel->getTaskCount());
+        CPPUNIT_ASSERT(action->isFinished());
+        CPPUNIT_ASSERT_EQUAL(2, changes_m);
+
+        obj->removeChangeListener(this);
+        delete action;
+        ObjectController::reset();
+    }
+
+    void testCancelSequencedAction()
+    {
+        ticpp::Element pObj;
+        pObj.SetAttribute("id", "seq_cancel");
+        Object* obj = Object::create(&pObj);
+        ObjectController::instance()->addObject(obj);
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        ticpp::Element pConfig("action");
+        pConfig.SetAttribute("type", "set-value");
+        pConfig.SetAttribute("id", "seq_cancel");
+        pConfig.SetAttribute("value", "on");
+        pConfig.SetAttribute("delay", "100ms");
+        Action* action = Action::create(&pConfig);
+        rule_m->addAction(action, ActionList::IfTrue);
+
+        int64_t start = TimerWheel::now();
+        rule_m->evaluate();
+        CPPUNIT_ASSERT_EQUAL(1, wheel->getTaskCount());
+        rule_m->cancel();
+        CPPUNIT_ASSERT_EQUAL(0, wheel->getTaskCount());
+        wheel->advance(start + 200);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), obj->getValue());
+        CPPUNIT_ASSERT(action->isFinished());
+
+        delete rule_m; rule_m = NULL;
+        ObjectController::reset();
+    }
+
+    /** Pending delayed actions only cost a wheel entry, not a thread. */
+    void testManyPendingActions()
+    {
+        ticpp::Element pObj;
+        pObj.SetAttribute("id", "seq_counter");
+        pObj.SetAttribute("type", "7.xxx");
+        Object* obj = Object::create(&pObj);
+        ObjectController::instance()->addObject(obj);
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), obj->getValue());
+        obj->addChangeListener(this);
+        TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+        ticpp::Element pConfig("action");
+        pConfig.SetAttribute("type", "set-value");
+        pConfig.SetAttribute("id", "seq_counter");
+        pConfig.SetAttribute("delay", "1s");
+        std::vector<Action*> actions;
+        for (int i = 0; i < 10000; i++)
+        {
+            pConfig.SetAttribute("value", i + 1);
+            actions.push_back(Action::create(&pConfig));
+        }
+
+        int64_t start = TimerWheel::now();
+        for (int i = 0; i < 10000; i++)
+            actions[i]->execute();
+        CPPUNIT_ASSERT_EQUAL(10000, wheel->getTaskCount());
+        // The value is known, so every step ran on the wheel
+        CPPUNIT_ASSERT_EQUAL(10000, wheel->advance(start + 2000));
+        CPPUNIT_ASSERT_EQUAL(10000, changes_m);
+        for (int i = 0; i < 10000; i++)
+            CPPUNIT_ASSERT(actions[i]->isFinished());
+
+        obj->removeChangeListener(this);
+        for (int i = 0; i < 10000; i++)
+            delete actions[i];
+        ObjectController::reset();
+    }
+
 private:
+    /** Lets the steps started in threads run. */
+    void waitForCompletion(Action* action)
+    {
+        for (int i = 0; i < 100 && !action->isFinished(); i++)
+            pth_yield(NULL);
+        CPPUNIT_ASSERT(action->isFinished());
+    }
+
     void testOneActionList(bool condition, ActionList::TriggerType type, int expectedCounterAfterOneExec, int expectedCounterAfterSecondExec)
     {
         CounterAction *action = new CounterAction(1);
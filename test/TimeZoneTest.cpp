@@ -0,0 +1,200 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "timezone.h"
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+class TimeZoneTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( TimeZoneTest );
+    CPPUNIT_TEST( testRuleToLocal );
+    CPPUNIT_TEST( testRuleToUtc );
+    CPPUNIT_TEST( testSouthernRule );
+    CPPUNIT_TEST( testNormalize );
+    CPPUNIT_TEST( testInvalidRule );
+    CPPUNIT_TEST( testInvalidFile );
+    CPPUNIT_TEST( testCompareLibc );
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    struct tm makeTm(int year, int mon, int mday, int hour, int min, int isdst)
+    {
+        struct tm timeinfo;
+        memset(&timeinfo, 0, sizeof(timeinfo));
+        timeinfo.tm_year = year - 1900;
+        timeinfo.tm_mon = mon - 1;
+        timeinfo.tm_mday = mday;
+        timeinfo.tm_hour = hour;
+        timeinfo.tm_min = min;
+        timeinfo.tm_isdst = isdst;
+        return timeinfo;
+    }
+
+    void testRuleToLocal()
+    {
+        TimeZone tz;
+        CPPUNIT_ASSERT(tz.loadRule("CET-1CEST,M3.5.0,M10.5.0/3"));
+        struct tm timeinfo;
+
+        // 2020-03-29 01:00 UTC
+        tz.toLocal(1585443600 - 1, &timeinfo);
+        CPPUNIT_ASSERT_EQUAL(1, timeinfo.tm_hour);
+        CPPUNIT_ASSERT_EQUAL(59, timeinfo.tm_min);
+        CPPUNIT_ASSERT_EQUAL(0, timeinfo.tm_isdst);
+        tz.toLocal(1585443600, &timeinfo);
+        CPPUNIT_ASSERT_EQUAL(120, timeinfo.tm_year);
+        CPPUNIT_ASSERT_EQUAL(2, timeinfo.tm_mon);
+        CPPUNIT_ASSERT_EQUAL(29, timeinfo.tm_mday);
+        CPPUNIT_ASSERT_EQUAL(3, timeinfo.tm_hour);
+        CPPUNIT_ASSERT_EQUAL(0, timeinfo.tm_min);
+        CPPUNIT_ASSERT_EQUAL(0, timeinfo.tm_wday);
+        CPPUNIT_ASSERT_EQUAL(88, timeinfo.tm_yday);
+        CPPUNIT_ASSERT_EQUAL(1, timeinfo.tm_isdst);
+        CPPUNIT_ASSERT_EQUAL(3600L, tz.getStandardOffset(1585443600));
+    }
+
+    void testRuleToUtc()
+    {
+        TimeZone tz;
+        CPPUNIT_ASSERT(tz.loadRule("CET-1CEST,M3.5.0,M10.5.0/3"));
+
+        // 02:30 does not exist on 2020-03-29, it is read as 03:30 CEST.
+        struct tm timeinfo = makeTm(2020, 3, 29, 2, 30, -1);
+        CPPUNIT_ASSERT_EQUAL((time_t)1585445400, tz.toUtc(&timeinfo));
+        CPPUNIT_ASSERT_EQUAL(3, timeinfo.tm_hour);
+        CPPUNIT_ASSERT_EQUAL(30, timeinfo.tm_min);
+        CPPUNIT_ASSERT_EQUAL(1, timeinfo.tm_isdst);
+
+        // 02:30 happens twice on 2020-10-25.
+        timeinfo = makeTm(2020, 10, 25, 2, 30, -1);
+        CPPUNIT_ASSERT_EQUAL((time_t)1603589400, tz.toUtc(&timeinfo));
+        CPPUNIT_ASSERT_EQUAL(0, timeinfo.tm_isdst);
+        timeinfo = makeTm(2020, 10, 25, 2, 30, 1);
+        CPPUNIT_ASSERT_EQUAL((time_t)1603585800, tz.toUtc(&timeinfo));
+        CPPUNIT_ASSERT_EQUAL(1, timeinfo.tm_isdst);
+        timeinfo = makeTm(2020, 10, 25, 2, 30, 0);
+        CPPUNIT_ASSERT_EQUAL((time_t)1603589400, tz.toUtc(&timeinfo));
+
+        // Standard time in summer is moved to daylight time.
+        timeinfo = makeTm(2020, 6, 15, 7, 0, 0);
+        tz.toUtc(&timeinfo);
+        CPPUNIT_ASSERT_EQUAL(8, timeinfo.tm_hour);
+        CPPUNIT_ASSERT_EQUAL(1, timeinfo.tm_isdst);
+        timeinfo = makeTm(2020, 6, 15, 7, 0, -1);
+        tz.toUtc(&timeinfo);
+        CPPUNIT_ASSERT_EQUAL(7, timeinfo.tm_hour);
+    }
+
+    void testSouthernRule()
+    {
+        TimeZone tz;
+        CPPUNIT_ASSERT(tz.loadRule("AEST-10AEDT,M10.1.0,M4.1.0/3"));
+        struct tm timeinfo;
+        tz.toLocal(1579046400, &timeinfo); // 2020-01-15 00:00 UTC
+        CPPUNIT_ASSERT_EQUAL(11, timeinfo.tm_hour);
+        CPPUNIT_ASSERT_EQUAL(1, timeinfo.tm_isdst);
+        tz.toLocal(1594771200, &timeinfo); // 2020-07-15 00:00 UTC
+        CPPUNIT_ASSERT_EQUAL(10, timeinfo.tm_hour);
+        CPPUNIT_ASSERT_EQUAL(0, timeinfo.tm_isdst);
+
+        timeinfo = makeTm(2020, 1, 15, 11, 0, -1);
+        CPPUNIT_ASSERT_EQUAL((time_t)1579046400, tz.toUtc(&timeinfo));
+    }
+
+    void testNormalize()
+    {
+        TimeZone tz;
+        CPPUNIT_ASSERT(tz.loadRule("UTC0"));
+        struct tm timeinfo = makeTm(2020, 14, 31, 23, 61, -1);
+        tz.toUtc(&timeinfo);
+        CPPUNIT_ASSERT_EQUAL(121, timeinfo.tm_year);
+        CPPUNIT_ASSERT_EQUAL(2, timeinfo.tm_mon);
+        CPPUNIT_ASSERT_EQUAL(4, timeinfo.tm_mday);
+        CPPUNIT_ASSERT_EQUAL(0, timeinfo.tm_hour);
+        CPPUNIT_ASSERT_EQUAL(1, timeinfo.tm_min);
+        CPPUNIT_ASSERT_EQUAL(4, timeinfo.tm_wday);
+        CPPUNIT_ASSERT_EQUAL(62, timeinfo.tm_yday);
+
+        timeinfo = makeTm(2020, 1, 0, 0, 0, -1);
+        CPPUNIT_ASSERT_EQUAL((time_t)1577750400, tz.toUtc(&timeinfo));
+        CPPUNIT_ASSERT_EQUAL(11, timeinfo.tm_mon);
+        CPPUNIT_ASSERT_EQUAL(31, timeinfo.tm_mday);
+    }
+
+    void testInvalidRule()
+    {
+        TimeZone tz;
+        CPPUNIT_ASSERT(!tz.loadRule("CET"));
+        CPPUNIT_ASSERT(!tz.loadRule("CET-1CEST,M3.5"));
+        CPPUNIT_ASSERT(!tz.loadRule("CET-1CEST,M13.5.0,M10.5.0"));
+        CPPUNIT_ASSERT(!tz.isLoaded());
+        CPPUNIT_ASSERT(!tz.load("No/Such/Zone"));
+    }
+
+    /** Builds a version 1 TZif file with a single UTC+1 type. */
+    std::string makeFile(int timecnt)
+    {
+        std::string data("TZif", 4);
+        data.append(16, '\0');
+        const int counts[6] = { 0, 0, 0, timecnt, 1, 4 };
+        for (int i = 0; i < 6; i++)
+        {
+            for (int shift = 24; shift >= 0; shift -= 8)
+                data += (char)((counts[i] >> shift) & 0xff);
+        }
+        data.append("\0\0\x0e\x10\0\0", 6);
+        data.append("CET\0", 4);
+        return data;
+    }
+
+    void testInvalidFile()
+    {
+        TimeZone tz;
+        std::istringstream valid(makeFile(0));
+        CPPUNIT_ASSERT(tz.loadFile(valid));
+        struct tm timeinfo;
+        tz.toLocal(0, &timeinfo);
+        CPPUNIT_ASSERT_EQUAL(1, timeinfo.tm_hour);
+
+        std::istringstream negative(makeFile(-1));
+        CPPUNIT_ASSERT(!tz.loadFile(negative));
+        std::istringstream truncated(makeFile(1));
+        CPPUNIT_ASSERT(!tz.loadFile(truncated));
+    }
+
+    void testCompareLibc()
+    {
+        TimeZone tz;
+        if (!tz.load("America/New_York"))
+            return; // No tzdata installed
+        const char* saved = getenv("TZ");
+        std::string savedTz = saved ? saved : "";
+        setenv("TZ", "America/New_York", 1);
+        tzset();
+
+        for (time_t t = 946684800; t < 2208988800LL; t += 3593)
+        {
+            struct tm expected, actual;
+            localtime_r(&t, &expected);
+            tz.toLocal(t, &actual);
+            CPPUNIT_ASSERT_EQUAL(expected.tm_year, actual.tm_year);
+            CPPUNIT_ASSERT_EQUAL(expected.tm_yday, actual.tm_yday);
+            CPPUNIT_ASSERT_EQUAL(expected.tm_hour, actual.tm_hour);
+            CPPUNIT_ASSERT_EQUAL(expected.tm_min, actual.tm_min);
+            CPPUNIT_ASSERT_EQUAL(expected.tm_isdst, actual.tm_isdst);
+
+            // Times repeated by a backward transition are ambiguous.
+            actual.tm_isdst = -1;
+            if (actual.tm_hour != 1)
+                CPPUNIT_ASSERT_EQUAL(t, tz.toUtc(&actual));
+        }
+
+        if (saved)
+            setenv("TZ", savedTz.c_str(), 1);
+        else
+            unsetenv("TZ");
+        tzset();
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TimeZoneTest );
@@ -1,5 +1,6 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "timermanager.h"
+#include <vector>
 
 class StubTimerTask : public TimerTask
 {
@@ -13,6 +14,49 @@ public:
     virtual void statusXml(ticpp::Element* pStatus) {};
 };
 
+class OrderedTimerTask : public TimerTask
+{
+public:
+    time_t execTime_m;
+    std::vector<time_t>* fired_m;
+    OrderedTimerTask() : execTime_m(0), fired_m(0) {};
+    virtual void onTimer(time_t time) { fired_m->push_back(execTime_m); };
+    virtual void reschedule(time_t from = 0) {};
+    virtual time_t getExecTime() { return execTime_m; };
+    virtual void statusXml(ticpp::Element* pStatus) {};
+};
+
+class CatchUpTimerTask : public StubTimerTask
+{
+public:
+    bool isOnCatchUpCalled_m;
+    TimerManager* manager_m;
+    CatchUpTimerTask() : isOnCatchUpCalled_m(false), manager_m(0) {};
+    virtual void onCatchUp(time_t time) { isOnCatchUpCalled_m = true; };
+    virtual void reschedule(time_t from = 0)
+    {
+        if (!manager_m)
+            return;
+        execTime_m = from + 10;
+        manager_m->addTask(this);
+    };
+};
+
+class DelayTimerTask : public StubTimerTask
+{
+public:
+    virtual bool shiftDeadline(int64_t drift) { execTime_m += drift / 1000; return true; };
+};
+
+class OwnedTimerTask : public StubTimerTask
+{
+public:
+    const char* owner_m;
+    OwnedTimerTask() : owner_m(0) {};
+    virtual const char* getOwnerID() { return owner_m; };
+    virtual void statusXml(ticpp::Element* pStatus) { pStatus->SetAttribute("exec", execTime_m); };
+};
+
 class TimerManagerTest : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE( TimerManagerTest );
@@ -23,6 +67,17 @@ class TimerManagerTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testTwoTasksOrdered );
     CPPUNIT_TEST( testTwoTasksReversed );
     CPPUNIT_TEST( testAddRemove );
+    CPPUNIT_TEST( testAddTwice );
+    CPPUNIT_TEST( testManyTasks );
+    CPPUNIT_TEST( testProcessTasks );
+    CPPUNIT_TEST( testCatchUpSkip );
+    CPPUNIT_TEST( testCatchUpFireAll );
+    CPPUNIT_TEST( testCatchUpFireLatest );
+    CPPUNIT_TEST( testClockJump );
+    CPPUNIT_TEST( testImportExport );
+    CPPUNIT_TEST( testStatusPaging );
+    CPPUNIT_TEST( testStatusFilter );
+    CPPUNIT_TEST( testStatusSince );
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -176,6 +231,312 @@ public:
         CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref3_m) == TimerManager::Long);
     }
 
+    void testAddTwice()
+    {
+        task1_m.execTime_m = timeref1_m + 5;
+        task2_m.execTime_m = timeref1_m + 10;
+        timermanager_m->addTask(&task1_m);
+        timermanager_m->addTask(&task2_m);
+        task1_m.execTime_m = timeref3_m;
+        timermanager_m->addTask(&task1_m);
+        CPPUNIT_ASSERT_EQUAL(2, timermanager_m->getTaskCount());
+
+        CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref2_m) == TimerManager::Immediate);
+        CPPUNIT_ASSERT(task1_m.isOnTimerCalled_m == false);
+        CPPUNIT_ASSERT(task2_m.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref2_m) == TimerManager::Short);
+
+        timermanager_m->removeTask(&task1_m);
+        timermanager_m->removeTask(&task1_m);
+        CPPUNIT_ASSERT_EQUAL(0, timermanager_m->getTaskCount());
+    }
+
+    void testManyTasks()
+    {
+        const int count = 100000;
+        std::vector<OrderedTimerTask> tasks(count);
+        std::vector<time_t> fired;
+        unsigned int seed = 12345;
+        for (int i = 0; i < count; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            tasks[i].execTime_m = timeref1_m + (seed >> 8) % 50;
+            tasks[i].fired_m = &fired;
+            timermanager_m->addTask(&tasks[i]);
+        }
+        CPPUNIT_ASSERT_EQUAL(count, timermanager_m->getTaskCount());
+
+        for (int i = 0; i < count; i += 2)
+            timermanager_m->removeTask(&tasks[i]);
+        CPPUNIT_ASSERT_EQUAL(count / 2, timermanager_m->getTaskCount());
+
+        while (timermanager_m->checkTaskList(timeref1_m + 50) == TimerManager::Immediate);
+        CPPUNIT_ASSERT_EQUAL(0, timermanager_m->getTaskCount());
+        CPPUNIT_ASSERT_EQUAL(count / 2, (int)fired.size());
+        for (int i = 1; i < count / 2; i++)
+            CPPUNIT_ASSERT(fired[i-1] <= fired[i]);
+    }
+
+    void testProcessTasks()
+    {
+        int64_t ref = (int64_t)timeref1_m * 1000;
+        CPPUNIT_ASSERT_EQUAL((int64_t)-1, timermanager_m->processTasks(ref));
+
+        task1_m.execTime_m = timeref1_m + 5;
+        task2_m.execTime_m = timeref1_m + 10;
+        timermanager_m->addTask(&task1_m);
+        timermanager_m->addTask(&task2_m);
+        CPPUNIT_ASSERT_EQUAL((int64_t)5000, timermanager_m->processTasks(ref));
+        CPPUNIT_ASSERT_EQUAL((int64_t)1, timermanager_m->processTasks(ref + 4999));
+        CPPUNIT_ASSERT(task1_m.isOnTimerCalled_m == false);
+
+        CPPUNIT_ASSERT_EQUAL((int64_t)4997, timermanager_m->processTasks(ref + 5003));
+        CPPUNIT_ASSERT(task1_m.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT(task2_m.isOnTimerCalled_m == false);
+        CPPUNIT_ASSERT_EQUAL(1, timermanager_m->getFiredCount());
+        CPPUNIT_ASSERT_EQUAL((int64_t)3, timermanager_m->getMaxLateness());
+
+        CPPUNIT_ASSERT_EQUAL((int64_t)-1, timermanager_m->processTasks(ref + 10001));
+        CPPUNIT_ASSERT(task2_m.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT_EQUAL(2, timermanager_m->getFiredCount());
+
+        ticpp::Element status("timers");
+        timermanager_m->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), status.GetAttribute("fired"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), status.GetAttribute("late-avg"));
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), status.GetAttribute("late-max"));
+    }
+
+
+    void testCatchUpSkip()
+    {
+        task1_m.execTime_m = timeref1_m;
+        task2_m.execTime_m = timeref1_m + 5;
+        timermanager_m->addTask(&task1_m);
+        timermanager_m->addTask(&task2_m);
+        CPPUNIT_ASSERT_EQUAL((int64_t)-1, timermanager_m->processTasks((int64_t)timeref3_m * 1000 + 120000));
+        CPPUNIT_ASSERT(task1_m.isOnTimerCalled_m == false);
+        CPPUNIT_ASSERT(task2_m.isOnTimerCalled_m == false);
+        CPPUNIT_ASSERT_EQUAL(2, timermanager_m->getSkippedCount());
+        CPPUNIT_ASSERT_EQUAL(0, timermanager_m->getLateCount());
+        CPPUNIT_ASSERT_EQUAL(0, timermanager_m->getFiredCount());
+        CPPUNIT_ASSERT_EQUAL((int64_t)0, timermanager_m->getMaxLateness());
+    }
+
+    void testCatchUpFireAll()
+    {
+        timermanager_m->setCatchUpPolicy(TimerManager::FireAll, 10000);
+        task1_m.execTime_m = timeref1_m;
+        task2_m.execTime_m = timeref1_m + 15;
+        timermanager_m->addTask(&task1_m);
+        timermanager_m->addTask(&task2_m);
+        // Both tasks are handled in one pass, only the first one is late.
+        CPPUNIT_ASSERT_EQUAL((int64_t)-1, timermanager_m->processTasks((int64_t)timeref2_m * 1000));
+        CPPUNIT_ASSERT(task1_m.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT(task2_m.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT_EQUAL(1, timermanager_m->getLateCount());
+        CPPUNIT_ASSERT_EQUAL(0, timermanager_m->getSkippedCount());
+        CPPUNIT_ASSERT_EQUAL(2, timermanager_m->getFiredCount());
+    }
+
+    void testCatchUpFireLatest()
+    {
+        timermanager_m->setCatchUpPolicy(TimerManager::FireLatest, 10000);
+        CatchUpTimerTask task;
+        task.execTime_m = timeref1_m;
+        timermanager_m->addTask(&task);
+        timermanager_m->processTasks((int64_t)timeref2_m * 1000);
+        CPPUNIT_ASSERT(task.isOnCatchUpCalled_m == true);
+        CPPUNIT_ASSERT(task.isOnTimerCalled_m == false);
+        CPPUNIT_ASSERT_EQUAL(1, timermanager_m->getLateCount());
+    }
+
+    void testClockJump()
+    {
+        CatchUpTimerTask task;
+        task.manager_m = timermanager_m;
+        task.execTime_m = timeref3_m;
+        timermanager_m->addTask(&task);
+        DelayTimerTask delay;
+        delay.execTime_m = timeref3_m;
+        timermanager_m->addTask(&delay);
+
+        int64_t now = (int64_t)timeref1_m * 1000;
+        timermanager_m->checkClock(now, 1000000);
+        timermanager_m->checkClock(now + 2000, 1002100);
+        CPPUNIT_ASSERT_EQUAL(0, timermanager_m->getClockJumpCount());
+        CPPUNIT_ASSERT_EQUAL(timeref3_m, task.execTime_m);
+
+        // Wall clock goes back one hour, the task is rescheduled from the
+        // new time and the delay keeps the time it had left.
+        timermanager_m->checkClock(now - 3600000, 1003000);
+        CPPUNIT_ASSERT_EQUAL(1, timermanager_m->getClockJumpCount());
+        CPPUNIT_ASSERT_EQUAL(timeref1_m - 3600 + 10, task.execTime_m);
+        // The wall clock went back 3602s while 0.9s passed
+        CPPUNIT_ASSERT_EQUAL(timeref3_m - 3602, delay.execTime_m);
+        CPPUNIT_ASSERT_EQUAL(2, timermanager_m->getTaskCount());
+
+        // Forward jumps leave dates and times to the catch-up policy.
+        timermanager_m->checkClock(now + 3600000, 1004000);
+        CPPUNIT_ASSERT_EQUAL(2, timermanager_m->getClockJumpCount());
+        CPPUNIT_ASSERT_EQUAL(timeref1_m - 3600 + 10, task.execTime_m);
+        CPPUNIT_ASSERT_EQUAL(timeref3_m - 3602 + 7199, delay.execTime_m);
+        CPPUNIT_ASSERT_EQUAL(2, timermanager_m->getTaskCount());
+        timermanager_m->removeTask(&task);
+        timermanager_m->removeTask(&delay);
+    }
+
+    void testImportExport()
+    {
+        ticpp::Element pConfig("timers");
+        timermanager_m->exportXml(&pConfig);
+        CPPUNIT_ASSERT(pConfig.FirstAttribute(false) == 0);
+
+        pConfig.SetAttribute("catch-up", "fire-latest");
+        pConfig.SetAttribute("tolerance", "5s");
+        timermanager_m->importXml(&pConfig);
+        ticpp::Element pExport("timers");
+        timermanager_m->exportXml(&pExport);
+        CPPUNIT_ASSERT_EQUAL(std::string("fire-latest"), pExport.GetAttribute("catch-up"));
+        CPPUNIT_ASSERT_EQUAL(std::string("5"), pExport.GetAttribute("tolerance"));
+
+        pConfig.SetAttribute("catch-up", "later");
+        CPPUNIT_ASSERT_THROW(timermanager_m->importXml(&pConfig), ticpp::Exception);
+    }
+
+    void testStatusPaging()
+    {
+        OwnedTimerTask tasks[10];
+        for (int i = 0; i < 10; i++)
+        {
+            tasks[i].execTime_m = timeref1_m + 100 - i * 10;
+            timermanager_m->addTask(&tasks[i]);
+        }
+        ticpp::Element pStatus("timers");
+        pStatus.SetAttribute("offset", 3);
+        pStatus.SetAttribute("limit", 4);
+        timermanager_m->statusXml(&pStatus);
+        CPPUNIT_ASSERT_EQUAL(std::string("10"), pStatus.GetAttribute("total"));
+        ticpp::Element* pTask = pStatus.FirstChildElement("task");
+        for (int i = 3; i < 7; i++)
+        {
+            CPPUNIT_ASSERT(pTask);
+            CPPUNIT_ASSERT_EQUAL(timeref1_m + 10 + i * 10, (time_t)atol(pTask->GetAttribute("exec").c_str()));
+            pTask = pTask->NextSiblingElement("task", false);
+        }
+        CPPUNIT_ASSERT(pTask == 0);
+
+        ticpp::Element pEnd("timers");
+        pEnd.SetAttribute("offset", 10);
+        timermanager_m->statusXml(&pEnd);
+        CPPUNIT_ASSERT(pEnd.FirstChildElement("task", false) == 0);
+        for (int i = 0; i < 10; i++)
+            timermanager_m->removeTask(&tasks[i]);
+    }
+
+    void testStatusFilter()
+    {
+        OwnedTimerTask tasks[6];
+        for (int i = 0; i < 6; i++)
+        {
+            tasks[i].execTime_m = timeref1_m + i * 60;
+            tasks[i].owner_m = i % 2 ? "rule_b" : "rule_a";
+            timermanager_m->addTask(&tasks[i]);
+        }
+        ticpp::Element pStatus("timers");
+        pStatus.SetAttribute("owner", "rule_b");
+        std::stringstream from, to;
+        from << timeref1_m + 60;
+        to << timeref1_m + 180;
+        pStatus.SetAttribute("from", from.str());
+        pStatus.SetAttribute("to", to.str());
+        timermanager_m->statusXml(&pStatus);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), pStatus.GetAttribute("total"));
+        ticpp::Element* pTask = pStatus.FirstChildElement("task");
+        CPPUNIT_ASSERT_EQUAL(timeref1_m + 60, (time_t)atol(pTask->GetAttribute("exec").c_str()));
+        pTask = pTask->NextSiblingElement("task");
+        CPPUNIT_ASSERT_EQUAL(timeref1_m + 180, (time_t)atol(pTask->GetAttribute("exec").c_str()));
+
+        // Local date and time, 40s after timeref1_m.
+        char local[32];
+        time_t fromLocal = timeref1_m + 40;
+        strftime(local, sizeof(local), "%Y-%m-%d %H:%M:%S", localtime(&fromLocal));
+        ticpp::Element pLocal("timers");
+        pLocal.SetAttribute("from", local);
+        timermanager_m->statusXml(&pLocal);
+        CPPUNIT_ASSERT_EQUAL(std::string("5"), pLocal.GetAttribute("total"));
+
+        ticpp::Element pBad("timers");
+        pBad.SetAttribute("to", "tomorrow");
+        CPPUNIT_ASSERT_THROW(timermanager_m->statusXml(&pBad), ticpp::Exception);
+        for (int i = 0; i < 6; i++)
+            timermanager_m->removeTask(&tasks[i]);
+    }
+
+    void testStatusSince()
+    {
+        OwnedTimerTask tasks[3];
+        for (int i = 0; i < 3; i++)
+        {
+            tasks[i].execTime_m = timeref2_m + i;
+            timermanager_m->addTask(&tasks[i]);
+        }
+        ticpp::Element pStatus("timers");
+        timermanager_m->statusXml(&pStatus);
+        std::string revision = pStatus.GetAttribute("revision");
+        std::string removedId = pStatus.FirstChildElement("task")->GetAttribute("id");
+
+        // Nothing changed
+        ticpp::Element pSame("timers");
+        pSame.SetAttribute("since", revision);
+        timermanager_m->statusXml(&pSame);
+        CPPUNIT_ASSERT_EQUAL(revision, pSame.GetAttribute("revision"));
+        CPPUNIT_ASSERT(pSame.FirstChildElement(false) == 0);
+
+        timermanager_m->removeTask(&tasks[0]);
+        tasks[2].execTime_m = timeref3_m;
+        timermanager_m->addTask(&tasks[2]);
+        ticpp::Element pDelta("timers");
+        pDelta.SetAttribute("since", revision);
+        timermanager_m->statusXml(&pDelta);
+        ticpp::Element* pElem = pDelta.FirstChildElement();
+        CPPUNIT_ASSERT_EQUAL(std::string("removed"), pElem->Value());
+        CPPUNIT_ASSERT_EQUAL(removedId, pElem->GetAttribute("id"));
+        pElem = pElem->NextSiblingElement();
+        CPPUNIT_ASSERT_EQUAL(std::string("task"), pElem->Value());
+        CPPUNIT_ASSERT_EQUAL(timeref3_m, (time_t)atol(pElem->GetAttribute("exec").c_str()));
+        CPPUNIT_ASSERT(pElem->NextSiblingElement(false) == 0);
+
+        // A task moved out of the window is removed from the client's view
+        std::stringstream to;
+        to << timeref2_m + 10;
+        ticpp::Element pWindow("timers");
+        pWindow.SetAttribute("to", to.str());
+        timermanager_m->statusXml(&pWindow);
+        std::string windowRevision = pWindow.GetAttribute("revision");
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), pWindow.GetAttribute("total"));
+        std::string movedId = pWindow.FirstChildElement("task")->GetAttribute("id");
+        tasks[1].execTime_m = timeref3_m + 60;
+        timermanager_m->addTask(&tasks[1]);
+        ticpp::Element pLeft("timers");
+        pLeft.SetAttribute("to", to.str());
+        pLeft.SetAttribute("since", windowRevision);
+        timermanager_m->statusXml(&pLeft);
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), pLeft.GetAttribute("total"));
+        pElem = pLeft.FirstChildElement();
+        CPPUNIT_ASSERT_EQUAL(std::string("removed"), pElem->Value());
+        CPPUNIT_ASSERT_EQUAL(movedId, pElem->GetAttribute("id"));
+        CPPUNIT_ASSERT(pElem->NextSiblingElement(false) == 0);
+
+        // A revision from the future, e.g. before a restart
+        ticpp::Element pReset("timers");
+        pReset.SetAttribute("since", "1000000");
+        timermanager_m->statusXml(&pReset);
+        CPPUNIT_ASSERT_EQUAL(std::string("true"), pReset.GetAttribute("reset"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), pReset.GetAttribute("total"));
+        timermanager_m->removeTask(&tasks[1]);
+        timermanager_m->removeTask(&tasks[2]);
+    }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( TimerManagerTest );
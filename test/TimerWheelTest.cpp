@@ -0,0 +1,137 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "timermanager.h"
+
+class StubWheelTask : public WheelTask
+{
+public:
+    int count_m;
+    int64_t firedAt_m;
+    StubWheelTask() : count_m(0), firedAt_m(-1) {};
+    virtual void onWheelTimer(int64_t now) { count_m++; firedAt_m = now; };
+};
+
+class ReschedulingWheelTask : public WheelTask
+{
+public:
+    TimerWheel* wheel_m;
+    int count_m;
+    ReschedulingWheelTask(TimerWheel* wheel) : wheel_m(wheel), count_m(0) {};
+    virtual void onWheelTimer(int64_t now) { if (++count_m < 3) wheel_m->schedule(this, now + 100); };
+};
+
+class TimerWheelTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( TimerWheelTest );
+    CPPUNIT_TEST( testEmptyWheel );
+    CPPUNIT_TEST( testOneTask );
+    CPPUNIT_TEST( testPastDeadline );
+    CPPUNIT_TEST( testCancel );
+    CPPUNIT_TEST( testReschedule );
+    CPPUNIT_TEST( testLongDelay );
+    CPPUNIT_TEST( testRescheduleFromCallback );
+    CPPUNIT_TEST( testDeleteScheduledTask );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    TimerWheel *wheel_m;
+    int64_t start_m;
+    StubWheelTask task1_m, task2_m;
+public:
+    void setUp()
+    {
+        wheel_m = new TimerWheel(10, 64);
+        start_m = TimerWheel::now();
+        task1_m.count_m = task2_m.count_m = 0;
+    }
+
+    void tearDown()
+    {
+        delete wheel_m;
+    }
+
+    void testEmptyWheel()
+    {
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->getTaskCount());
+        CPPUNIT_ASSERT(wheel_m->getNextTick(start_m) == -1);
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->advance(start_m + 1000));
+    }
+
+    void testOneTask()
+    {
+        wheel_m->schedule(&task1_m, start_m + 55);
+        CPPUNIT_ASSERT(task1_m.isScheduled());
+        CPPUNIT_ASSERT_EQUAL(1, wheel_m->getTaskCount());
+        int64_t next = wheel_m->getNextTick(start_m);
+        CPPUNIT_ASSERT(next >= start_m + 55 && next <= start_m + 65);
+
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->advance(start_m + 54));
+        CPPUNIT_ASSERT_EQUAL(0, task1_m.count_m);
+        CPPUNIT_ASSERT_EQUAL(1, wheel_m->advance(start_m + 55));
+        CPPUNIT_ASSERT_EQUAL(1, task1_m.count_m);
+        CPPUNIT_ASSERT(task1_m.firedAt_m == start_m + 55);
+        CPPUNIT_ASSERT(!task1_m.isScheduled());
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->getTaskCount());
+    }
+
+    void testPastDeadline()
+    {
+        wheel_m->advance(start_m + 100);
+        wheel_m->schedule(&task1_m, start_m);
+        CPPUNIT_ASSERT_EQUAL(1, wheel_m->advance(start_m + 100));
+        CPPUNIT_ASSERT_EQUAL(1, task1_m.count_m);
+    }
+
+    void testCancel()
+    {
+        wheel_m->schedule(&task1_m, start_m + 20);
+        wheel_m->schedule(&task2_m, start_m + 20);
+        wheel_m->cancel(&task1_m);
+        CPPUNIT_ASSERT(!task1_m.isScheduled());
+        CPPUNIT_ASSERT_EQUAL(1, wheel_m->getTaskCount());
+        CPPUNIT_ASSERT_EQUAL(1, wheel_m->advance(start_m + 100));
+        CPPUNIT_ASSERT_EQUAL(0, task1_m.count_m);
+        CPPUNIT_ASSERT_EQUAL(1, task2_m.count_m);
+    }
+
+    void testReschedule()
+    {
+        wheel_m->schedule(&task1_m, start_m + 20);
+        wheel_m->schedule(&task1_m, start_m + 200);
+        CPPUNIT_ASSERT_EQUAL(1, wheel_m->getTaskCount());
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->advance(start_m + 100));
+        CPPUNIT_ASSERT_EQUAL(1, wheel_m->advance(start_m + 200));
+        CPPUNIT_ASSERT_EQUAL(1, task1_m.count_m);
+    }
+
+    void testLongDelay()
+    {
+        // Deadline several rotations ahead (64 slots of 10ms)
+        wheel_m->schedule(&task1_m, start_m + 2000);
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->advance(start_m + 640));
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->advance(start_m + 1280));
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->advance(start_m + 1999));
+        CPPUNIT_ASSERT_EQUAL(1, wheel_m->advance(start_m + 5000));
+        CPPUNIT_ASSERT_EQUAL(1, task1_m.count_m);
+    }
+
+    void testRescheduleFromCallback()
+    {
+        ReschedulingWheelTask task(wheel_m);
+        wheel_m->schedule(&task, start_m + 100);
+        for (int i = 1; i <= 5; i++)
+            wheel_m->advance(start_m + i * 100);
+        CPPUNIT_ASSERT_EQUAL(3, task.count_m);
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->getTaskCount());
+    }
+
+    void testDeleteScheduledTask()
+    {
+        StubWheelTask* task = new StubWheelTask();
+        wheel_m->schedule(task, start_m + 100);
+        delete task;
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->getTaskCount());
+        CPPUNIT_ASSERT_EQUAL(0, wheel_m->advance(start_m + 200));
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TimerWheelTest );
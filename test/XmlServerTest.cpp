@@ -1,11 +1,13 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "xmlserver.h"
+#include "services.h"
 extern "C"
 {
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/socket.h>
 }
 
 class XmlServerTest : public CppUnit::TestFixture
@@ -16,6 +18,26 @@ class XmlServerTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testReadUnterminatedMessage );
     CPPUNIT_TEST( testReadMultipleMessage );
     CPPUNIT_TEST( testReadLongMessage );
+    CPPUNIT_TEST( testReadPartialMessage );
+    CPPUNIT_TEST( testReadMaxMessageSize );
+    CPPUNIT_TEST( testProcessPipelined );
+    CPPUNIT_TEST( testProcessSimpleRead );
+    CPPUNIT_TEST( testProcessSimpleWrite );
+    CPPUNIT_TEST( testReadUnknownValue );
+    CPPUNIT_TEST( testExecuteReject );
+    CPPUNIT_TEST( testNotifyCoalesce );
+    CPPUNIT_TEST( testNotifyDrop );
+    CPPUNIT_TEST( testNotifyDisconnect );
+    CPPUNIT_TEST( testNotifyFilter );
+    CPPUNIT_TEST( testNotifyThrottle );
+    CPPUNIT_TEST( testReadChanges );
+    CPPUNIT_TEST( testReadConfig );
+    CPPUNIT_TEST( testSaveConfig );
+    CPPUNIT_TEST( testHttp );
+    CPPUNIT_TEST( testWebSocket );
+    CPPUNIT_TEST( testWebSocketContinuation );
+    CPPUNIT_TEST( testCompactProtocol );
+    CPPUNIT_TEST( testCompactNotify );
 //    CPPUNIT_TEST(  );
     
     CPPUNIT_TEST_SUITE_END();
@@ -36,6 +58,7 @@ public:
     {
         if (cc_m)
             delete(cc_m);
+        ObjectController::reset();
     }
 
     int createMsgFd(const char *msg)
@@ -81,6 +104,634 @@ public:
         CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
     }
 
+    /** Returns the connection's end of a non-blocking socket pair. */
+    int createSocket(int *peer)
+    {
+        int fds[2];
+        CPPUNIT_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        *peer = fds[1];
+        return fds[0];
+    }
+
+    void testReadPartialMessage()
+    {
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        CPPUNIT_ASSERT_EQUAL(4, (int)write(peer, "part", 4));
+        CPPUNIT_ASSERT_EQUAL(0, cc_m->readmessage(NULL));
+        CPPUNIT_ASSERT_EQUAL(4, (int)write(peer, "ial\004", 4));
+        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(NULL));
+        CPPUNIT_ASSERT(cc_m->msg_m == "partial");
+        CPPUNIT_ASSERT_EQUAL(0, cc_m->readmessage(NULL));
+        close(peer);
+        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(NULL));
+    }
+
+    void testReadMaxMessageSize()
+    {
+        pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
+        std::string msg(XmlServer::DefaultMaxMessageSize, 'a');
+        msg.append("\004");
+        cc_m = new ClientConnection(NULL, createMsgFd(msg.c_str()));
+        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL((size_t)XmlServer::DefaultMaxMessageSize, cc_m->msg_m.size());
+        delete cc_m;
+
+        msg.insert(0, "a");
+        cc_m = new ClientConnection(NULL, createMsgFd(msg.c_str()));
+        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
+    }
+
+    void testProcessPipelined()
+    {
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        const char *msg = "<read><version/></read>\004<unknown/>\004<read>";
+        CPPUNIT_ASSERT_EQUAL((int)strlen(msg), (int)write(peer, msg, strlen(msg)));
+        cc_m->onReadable();
+        CPPUNIT_ASSERT(!cc_m->isClosed());
+        CPPUNIT_ASSERT_EQUAL(std::string("<read>"), std::string(cc_m->msgbuf_m.data(), cc_m->msgbuf_m.size()));
+
+        char buf[1024];
+        int len = read(peer, buf, sizeof(buf));
+        std::string reply(buf, len > 0 ? len : 0);
+        CPPUNIT_ASSERT(reply.find("<read status=\"success\">") == 0);
+        CPPUNIT_ASSERT(reply.find("<unknown status='error'>Unknown element</unknown>\n\004") != std::string::npos);
+
+        shutdown(peer, SHUT_WR);
+        cc_m->onReadable();
+        CPPUNIT_ASSERT(cc_m->isClosed());
+        close(peer);
+    }
+
+    void addObject(const char *id, const char *type)
+    {
+        ticpp::Element pConfig("object");
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", type);
+        ObjectController::instance()->addObject(Object::create(&pConfig));
+    }
+
+    /** Sends the messages and returns the replies. */
+    std::string exchange(int peer, const std::string& msg)
+    {
+        CPPUNIT_ASSERT_EQUAL((int)msg.size(), (int)write(peer, msg.data(), msg.size()));
+        cc_m->onReadable();
+        CPPUNIT_ASSERT(!cc_m->isClosed());
+        char buf[4096];
+        int len = read(peer, buf, sizeof(buf));
+        return std::string(buf, len > 0 ? len : 0);
+    }
+
+    /** Like exchange, letting the config saver thread run until it replied. */
+    std::string exchangeSave(int peer, const std::string& msg)
+    {
+        CPPUNIT_ASSERT_EQUAL((int)msg.size(), (int)write(peer, msg.data(), msg.size()));
+        cc_m->onReadable();
+        CPPUNIT_ASSERT(cc_m->isExecuting());
+        while (!cc_m->checkExecute())
+            pth_yield(NULL);
+        char buf[4096];
+        int len = read(peer, buf, sizeof(buf));
+        return std::string(buf, len > 0 ? len : 0);
+    }
+
+    void testProcessSimpleRead()
+    {
+        addObject("a", "1.001");
+        addObject("s", "16.000");
+        Object *obj = ObjectController::instance()->getObject("s");
+        obj->setValue("<a&\"b'>");
+        obj->decRefCount();
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n\004"),
+                             exchange(peer, "<read><object id='a'/></read>\004"));
+
+        std::string objects = "<read status=\"success\">\n\t<objects>\n"
+                              "\t\t<object id=\"a\" value=\"off\" />\n"
+                              "\t\t<object id=\"s\" value='&lt;a&amp;&quot;b&apos;&gt;' />\n"
+                              "\t</objects>\n</read>\n\004";
+        CPPUNIT_ASSERT_EQUAL(objects, exchange(peer, "<read>\n <objects >\n  <object id=\"a\" />\n  <object id='s'/>\n </objects>\n</read>\n\004"));
+        CPPUNIT_ASSERT_EQUAL(objects, exchange(peer, "<read><objects/></read>\004"));
+        // The entity makes it go through the DOM, with the same reply
+        CPPUNIT_ASSERT_EQUAL(objects, exchange(peer, "<read><objects><object id='&#x61;'/><object id='s'/></objects></read>\004"));
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='error'>ObjectController: Object ID not found: 'b'\n</read>\n\004"),
+                             exchange(peer, "<read><objects><object id='a'/><object id='b'/></objects></read>\004"));
+
+        ObjectController::reset();
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status=\"success\">\n\t<objects />\n</read>\n\004"),
+                             exchange(peer, "<read><objects></objects></read>\004"));
+        close(peer);
+    }
+
+    void testReadUnknownValue()
+    {
+        addObject("a", "1.001");
+        addObject("b", "1.001");
+        addObject("c", "1.001");
+        // Without a running connection the bus never answers
+        ticpp::Element knx("knxconnection");
+        knx.SetAttribute("url", "ip:127.0.0.1");
+        Services::instance()->getKnxConnection()->importXml(&knx);
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        char buf[1024];
+
+        const char *msg = "<read><objects><object id='a'/><object id='b'/></objects></read>\004";
+        CPPUNIT_ASSERT_EQUAL((int)strlen(msg), (int)write(peer, msg, strlen(msg)));
+        cc_m->onReadable();
+        CPPUNIT_ASSERT(cc_m->isReading());
+        CPPUNIT_ASSERT_EQUAL(-1, (int)recv(peer, buf, sizeof(buf), MSG_DONTWAIT));
+
+        Object *a = ObjectController::instance()->getObject("a");
+        Object *b = ObjectController::instance()->getObject("b");
+        a->setValue("on");
+        CPPUNIT_ASSERT(!cc_m->checkExecute());
+        CPPUNIT_ASSERT_EQUAL(-1, (int)recv(peer, buf, sizeof(buf), MSG_DONTWAIT));
+        b->setValue("on");
+        CPPUNIT_ASSERT(cc_m->checkExecute());
+        CPPUNIT_ASSERT(!cc_m->isExecuting());
+        int len = read(peer, buf, sizeof(buf));
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status=\"success\">\n\t<objects>\n"
+                                         "\t\t<object id=\"a\" value=\"on\" />\n"
+                                         "\t\t<object id=\"b\" value=\"on\" />\n"
+                                         "\t</objects>\n</read>\n\004"), std::string(buf, len > 0 ? len : 0));
+        a->decRefCount();
+        b->decRefCount();
+
+        // The default value is sent if the bus did not answer in time
+        msg = "<read><object id='c'/></read>\004";
+        CPPUNIT_ASSERT_EQUAL((int)strlen(msg), (int)write(peer, msg, strlen(msg)));
+        cc_m->onReadable();
+        CPPUNIT_ASSERT(!cc_m->checkExecute());
+        CPPUNIT_ASSERT_EQUAL(-1, (int)recv(peer, buf, sizeof(buf), MSG_DONTWAIT));
+        while (!cc_m->checkExecute())
+            usleep(10000);
+        len = read(peer, buf, sizeof(buf));
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n\004"), std::string(buf, len > 0 ? len : 0));
+
+        knx.SetAttribute("url", "");
+        Services::instance()->getKnxConnection()->importXml(&knx);
+        close(peer);
+    }
+
+    void testProcessSimpleWrite()
+    {
+        addObject("a", "1.001");
+        addObject("b", "1.001");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n\004"),
+                             exchange(peer, "<write><object id='a' value='on'/><object value=\"on\" id=\"b\"/></write>\004"));
+        Object *a = ObjectController::instance()->getObject("a");
+        Object *b = ObjectController::instance()->getObject("b");
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), a->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), b->getValue());
+
+        // Writes are done in order until the first error, like in the DOM
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='error'>ObjectController: Object ID not found: 'c'\n</write>\n\004"),
+                             exchange(peer, "<write><object id='a' value='off'/><object id='c' value='off'/><object id='b' value='off'/></write>\004"));
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), a->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), b->getValue());
+
+        // A syntax error is reported before anything is written
+        std::string reply = exchange(peer, "<write><object id='a' value='on'/><object id='b' value='off'></write>\004");
+        CPPUNIT_ASSERT(reply.find("<error>") == 0 || reply.find("<write status='error'>") == 0);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), a->getValue());
+        a->decRefCount();
+        b->decRefCount();
+        close(peer);
+    }
+
+    /** Fills the buffer of the connection's socket with zeros. */
+    void fillSocket(int fd)
+    {
+        char buf[4096];
+        memset(buf, 0, sizeof(buf));
+        while (write(fd, buf, sizeof(buf)) > 0);
+        while (write(fd, buf, 1) > 0);
+    }
+
+    /** Reads what the connection sent after the zeros. */
+    std::string drain(int peer)
+    {
+        fcntl(peer, F_SETFL, fcntl(peer, F_GETFL) | O_NONBLOCK);
+        std::string received;
+        char buf[4096];
+        int len;
+        while ((len = read(peer, buf, sizeof(buf))) > 0)
+            received.append(buf, len);
+        size_t start = received.find_first_not_of('\0');
+        return start == std::string::npos ? "" : received.substr(start);
+    }
+
+    /** Queues a, b, a and c on a connection that accepts two notifications. */
+    void notifySlowConsumer(XmlServer::SlowConsumerPolicy policy, int *peer)
+    {
+        addObject("a", "1.001");
+        addObject("b", "1.001");
+        addObject("c", "1.001");
+        cc_m = new ClientConnection(NULL, createSocket(peer));
+        cc_m->setNotifyQueue(2, policy);
+        fillSocket(cc_m->getFd());
+
+        const char *updates[][2] = { { "a", "on" }, { "b", "on" }, { "a", "off" }, { "c", "on" } };
+        for (int i = 0; i < 4 && !cc_m->isClosed(); i++)
+        {
+            Object *obj = ObjectController::instance()->getObject(updates[i][0]);
+            obj->setValue(updates[i][1]);
+            cc_m->onChange(obj);
+            obj->decRefCount();
+        }
+    }
+
+    void testExecuteReject()
+    {
+        addObject("a", "1.001");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        // Nothing runs when a later element is invalid
+        std::string reply = exchange(peer, "<execute><action type='set-value' id='a' value='on' delay='1'/>"
+                                           "<action type='bogus'/></execute>\004");
+        CPPUNIT_ASSERT(reply.find("<execute status='error'>Action type not supported: 'bogus'") == 0);
+        CPPUNIT_ASSERT(!cc_m->isExecuting());
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='error'>Unknown rule id</execute>\n\004"),
+                             exchange(peer, "<execute><action type='set-value' id='a' value='on'/>"
+                                            "<rule-actions id='r' list='true'/></execute>\004"));
+        CPPUNIT_ASSERT(!cc_m->isExecuting());
+        Object *a = ObjectController::instance()->getObject("a");
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), a->getValue());
+        a->decRefCount();
+
+        // The connection still serves requests
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n\004"),
+                             exchange(peer, "<read><object id='a'/></read>\004"));
+        close(peer);
+    }
+
+    void testNotifyCoalesce()
+    {
+        int peer;
+        notifySlowConsumer(XmlServer::Coalesce, &peer);
+        CPPUNIT_ASSERT_EQUAL(std::string(""), drain(peer));
+        cc_m->onWritable();
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id='a'>off</notify>\n\004<notify id='b'>on</notify>\n\004<notify id='c'>on</notify>\n\004"),
+                             drain(peer));
+        close(peer);
+    }
+
+    void testNotifyDrop()
+    {
+        int peer;
+        notifySlowConsumer(XmlServer::Drop, &peer);
+        drain(peer);
+        cc_m->onWritable();
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id='a'>on</notify>\n\004<notify id='b'>on</notify>\n\004"), drain(peer));
+
+        // Replies are sent after the notifications queued before them
+        Object *c = ObjectController::instance()->getObject("c");
+        cc_m->onChange(c);
+        c->decRefCount();
+        cc_m->sendmessage("<reply/>");
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id='c'>on</notify>\n\004<reply/>\004"), drain(peer));
+        close(peer);
+    }
+
+    void testNotifyDisconnect()
+    {
+        int peer;
+        notifySlowConsumer(XmlServer::Disconnect, &peer);
+        CPPUNIT_ASSERT(cc_m->isClosed());
+        close(peer);
+    }
+
+    void addObject(const char *id, const char *type, const char *gad)
+    {
+        ticpp::Element pConfig("object");
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", type);
+        pConfig.SetAttribute("gad", gad);
+        ObjectController::instance()->addObject(Object::create(&pConfig));
+    }
+
+    void setValue(const char *id, const char *value)
+    {
+        Object *obj = ObjectController::instance()->getObject(id);
+        obj->setValue(value);
+        obj->decRefCount();
+    }
+
+    void testNotifyFilter()
+    {
+        addObject("light1", "1.001", "1/0/1");
+        addObject("light2", "1.001", "1/0/2");
+        addObject("temp1", "9.001", "1/1/1");
+        addObject("lightx", "1.001");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='success'/>\n\004"),
+                             exchange(peer, "<admin><notification><register id='light*' gad='1/0/0-1/0/255'/><register type='9.*'/></notification></admin>\004"));
+        setValue("light1", "on");
+        setValue("lightx", "on");
+        setValue("temp1", "21.5");
+        setValue("light2", "on");
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id='light1'>on</notify>\n\004<notify id='temp1'>21.5</notify>\n\004<notify id='light2'>on</notify>\n\004"),
+                             drain(peer));
+
+        // A second filter matching the same object does not register it twice
+        exchange(peer, "<admin><notification><register gad='1/0/1'/></notification></admin>\004");
+        setValue("light1", "off");
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id='light1'>off</notify>\n\004"), drain(peer));
+
+        exchange(peer, "<admin><notification><unregisterall/></notification></admin>\004");
+        setValue("light1", "on");
+        CPPUNIT_ASSERT_EQUAL(std::string(""), drain(peer));
+        close(peer);
+    }
+
+    void testNotifyThrottle()
+    {
+        addObject("temp1", "9.001", "1/1/1");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        exchange(peer, "<admin><notification><register id='temp1' min-interval='10s' deadband='0.5'/></notification></admin>\004");
+        setValue("temp1", "20");
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id='temp1'>20</notify>\n\004"), drain(peer));
+
+        // Changes inside the deadband are not sent, the others wait for the interval
+        setValue("temp1", "20.2");
+        CPPUNIT_ASSERT_EQUAL(std::string(""), drain(peer));
+        setValue("temp1", "21");
+        setValue("temp1", "22");
+        CPPUNIT_ASSERT_EQUAL(std::string(""), drain(peer));
+        int64_t deadline = cc_m->sendThrottled(TimerManager::now());
+        CPPUNIT_ASSERT(deadline > TimerManager::now());
+        CPPUNIT_ASSERT_EQUAL((int64_t)-1, cc_m->sendThrottled(deadline));
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id='temp1'>22</notify>\n\004"), drain(peer));
+
+        // A pending change that returns inside the deadband is dropped
+        setValue("temp1", "23");
+        setValue("temp1", "22.1");
+        CPPUNIT_ASSERT_EQUAL((int64_t)-1, cc_m->sendThrottled(TimerManager::now() + 20000));
+        CPPUNIT_ASSERT_EQUAL(std::string(""), drain(peer));
+        close(peer);
+    }
+
+    void testReadChanges()
+    {
+        addObject("a", "1.001");
+        addObject("b", "1.001");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        ObjectController *controller = ObjectController::instance();
+        std::stringstream epoch;
+        epoch << controller->getEpoch();
+        std::stringstream msg;
+        msg << "<read><changes since='" << controller->getSeq() << "' epoch='" << epoch.str() << "' notify='true'/></read>\004";
+        std::stringstream reply;
+        reply << "<read status=\"success\">\n\t<changes since=\"" << controller->getSeq() << "\" epoch=\"" << epoch.str()
+              << "\" notify=\"true\" seq=\"" << controller->getSeq() << "\" />\n</read>\n\004";
+        CPPUNIT_ASSERT_EQUAL(reply.str(), exchange(peer, msg.str()));
+
+        setValue("b", "on");
+        std::stringstream notify;
+        notify << "<notify id='b' seq='" << controller->getSeq() << "'>on</notify>\n\004";
+        CPPUNIT_ASSERT_EQUAL(notify.str(), drain(peer));
+
+        std::string snapshot = exchange(peer, "<read><changes since='1'/></read>\004");
+        CPPUNIT_ASSERT(snapshot.find("snapshot=\"true\"") != std::string::npos);
+        CPPUNIT_ASSERT(snapshot.find("<object id=\"a\" value=\"off\" />") != std::string::npos);
+        CPPUNIT_ASSERT(snapshot.find("<object id=\"b\" value=\"on\" />") != std::string::npos);
+        close(peer);
+    }
+
+    void testReadConfig()
+    {
+        addObject("a", "1.001");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        std::string config = exchange(peer, "<read><config/></read>\004");
+        CPPUNIT_ASSERT(config.find("<read status=\"success\">\n\t<config version=\"") == 0);
+        CPPUNIT_ASSERT(config.find("<object type=\"1.001\" id=\"a\" />") != std::string::npos);
+        CPPUNIT_ASSERT_EQUAL(config, exchange(peer, "<read><config/></read>\004"));
+
+        std::stringstream version;
+        version << Services::instance()->getConfigVersion();
+        CPPUNIT_ASSERT_EQUAL("<read status='success'><config version='" + version.str() + "' unchanged='true'/></read>\n\004",
+                             exchange(peer, "<read><config if-version-changed='" + version.str() + "'/></read>\004"));
+
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n\004"),
+                             exchange(peer, "<write><config><objects><object id='b' type='1.001'/></objects></config></write>\004"));
+        std::string changed = exchange(peer, "<read><config if-version-changed='" + version.str() + "'/></read>\004");
+        CPPUNIT_ASSERT(changed != config);
+        CPPUNIT_ASSERT(changed.find("<object type=\"1.001\" id=\"b\" />") != std::string::npos);
+    }
+
+    void testSaveConfig()
+    {
+        addObject("a", "1.001");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        std::string reply = exchangeSave(peer, "<admin><save file='/tmp/linknx_unittest_tmp'/></admin>\004");
+        CPPUNIT_ASSERT(reply.find("<admin status='success' serialise-ms='") == 0);
+        CPPUNIT_ASSERT(reply.find("' write-ms='") != std::string::npos);
+        CPPUNIT_ASSERT(!cc_m->isExecuting());
+
+        ticpp::Document doc("/tmp/linknx_unittest_tmp");
+        doc.LoadFile();
+        ticpp::Element* pObject = doc.FirstChildElement("config")->FirstChildElement("objects")->FirstChildElement("object");
+        CPPUNIT_ASSERT_EQUAL(std::string("a"), pObject->GetAttribute("id"));
+
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='error'>Error writing config to file</admin>\n\004"),
+                             exchangeSave(peer, "<admin><save file='/tmp/linknx_unittest_tmp/config.xml'/></admin>\004"));
+
+        // Errors are reported before the save starts
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='error'>Only one save per admin request</admin>\n\004"),
+                             exchange(peer, "<admin><save file='/tmp/linknx_unittest_tmp'/><save file='/tmp/linknx_unittest_tmp'/></admin>\004"));
+        CPPUNIT_ASSERT(!cc_m->isExecuting());
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='error'>Unknown admin element</admin>\n\004"),
+                             exchange(peer, "<admin><save file='/tmp/linknx_unittest_tmp'/><bogus/></admin>\004"));
+        CPPUNIT_ASSERT(!cc_m->isExecuting());
+    }
+
+    std::string post(const std::string& body, const char *version = "HTTP/1.1")
+    {
+        std::stringstream request;
+        request << "POST / " << version << "\r\nHost: localhost\r\nContent-Length: " << body.size() << "\r\n\r\n" << body;
+        return request.str();
+    }
+
+    void testHttp()
+    {
+        addObject("a", "1.001");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        std::string read = "<read><object id='a'/></read>";
+        std::string request = post(read);
+        std::string reply = "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\nContent-Length: 34\r\n\r\n<read status='success'>off</read>\n";
+        CPPUNIT_ASSERT_EQUAL(reply + reply, exchange(peer, request + request));
+
+        // Notifications are not sent over plain HTTP
+        exchange(peer, post("<admin><notification><register id='a'/></notification></admin>"));
+        setValue("a", "on");
+        CPPUNIT_ASSERT_EQUAL(std::string(""), drain(peer));
+
+        CPPUNIT_ASSERT_EQUAL(std::string("HTTP/1.1 405 Method Not Allowed\r\nAllow: POST\r\nContent-Length: 0\r\n\r\n"),
+                             exchange(peer, "GET / HTTP/1.1\r\n\r\n"));
+
+        request = post(read, "HTTP/1.0");
+        CPPUNIT_ASSERT_EQUAL((int)request.size(), (int)write(peer, request.data(), request.size()));
+        cc_m->onReadable();
+        CPPUNIT_ASSERT(cc_m->isClosed());
+        CPPUNIT_ASSERT_EQUAL(std::string("HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\nContent-Length: 33\r\nConnection: close\r\n\r\n"
+                                         "<read status='success'>on</read>\n"), drain(peer));
+        close(peer);
+    }
+
+    /** Builds a masked WebSocket frame. */
+    std::string wsFrame(int opcode, const std::string& payload)
+    {
+        const char mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+        std::string out(1, (char)(0x80 | opcode));
+        out.push_back((char)(0x80 | payload.size()));
+        out.append(mask, 4);
+        for (size_t i = 0; i < payload.size(); i++)
+            out.push_back(payload[i] ^ mask[i % 4]);
+        return out;
+    }
+
+    void testWebSocket()
+    {
+        addObject("a", "1.001");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        // Example of RFC 6455
+        CPPUNIT_ASSERT_EQUAL(std::string("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                         "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n\r\n"),
+                             exchange(peer, "GET /chat HTTP/1.1\r\nHost: server.example.com\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n"));
+
+        std::string reply = "<admin status='success'/>\n";
+        CPPUNIT_ASSERT_EQUAL("\x81" + std::string(1, (char)reply.size()) + reply,
+                             exchange(peer, wsFrame(0x1, "<admin><notification><register id='a'/></notification></admin>")));
+        setValue("a", "on");
+        std::string notify = "<notify id='a'>on</notify>\n";
+        CPPUNIT_ASSERT_EQUAL("\x81" + std::string(1, (char)notify.size()) + notify, drain(peer));
+
+        // A message in two frames, and a ping between them
+        std::string first = wsFrame(0x1, "<read><object ");
+        first[0] = 0x01;
+        reply = "<read status='success'>on</read>\n";
+        CPPUNIT_ASSERT_EQUAL(std::string("\x8a\x02hi", 4) + "\x81" + std::string(1, (char)reply.size()) + reply,
+                             exchange(peer, first + wsFrame(0x9, "hi") + wsFrame(0x0, "id='a'/></read>")));
+
+        std::string close = wsFrame(0x8, "\x03\xe8");
+        CPPUNIT_ASSERT_EQUAL((int)close.size(), (int)write(peer, close.data(), close.size()));
+        cc_m->onReadable();
+        CPPUNIT_ASSERT(cc_m->isClosed());
+        CPPUNIT_ASSERT_EQUAL(std::string("\x88\x02\x03\xe8"), drain(peer));
+        ::close(peer);
+    }
+
+    void testWebSocketContinuation()
+    {
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        exchange(peer, "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n");
+        // A continuation frame without a message to continue
+        std::string stray = wsFrame(0x0, "<read><version/></read>");
+        CPPUNIT_ASSERT_EQUAL((int)stray.size(), (int)write(peer, stray.data(), stray.size()));
+        cc_m->onReadable();
+        CPPUNIT_ASSERT(cc_m->isClosed());
+        ::close(peer);
+    }
+
+    /** Builds a compact frame. */
+    std::string frame(int opcode, int handle = -1, const std::string& args = "")
+    {
+        std::string body(1, (char)opcode);
+        for (int shift = 24; handle >= 0 && shift >= 0; shift -= 8)
+            body.push_back((char)(handle >> shift));
+        body.append(args);
+        std::string out;
+        for (int shift = 24; shift >= 0; shift -= 8)
+            out.push_back((char)(body.size() >> shift));
+        return out + body;
+    }
+
+    std::string number(double value)
+    {
+        unsigned char bytes[8];
+        memcpy(bytes, &value, 8);
+        std::string out(1, (char)ClientConnection::NumberValue);
+        for (int i = 0; i < 8; i++)
+            out.push_back(bytes[isBigEndian() ? i : 7 - i]);
+        return out;
+    }
+
+    bool isBigEndian()
+    {
+        int one = 1;
+        return *(char*)&one == 0;
+    }
+
+    void testCompactProtocol()
+    {
+        addObject("a", "1.001");
+        addObject("t", "9.001");
+        addObject("s", "16.000");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+
+        std::string hello(ClientConnection::Hello, ClientConnection::HelloSize);
+        CPPUNIT_ASSERT_EQUAL(hello + frame(ClientConnection::Handle, 0, std::string(1, (char)ClientConnection::NumberValue)),
+                             exchange(peer, hello + frame(ClientConnection::Resolve, -1, "a")));
+        CPPUNIT_ASSERT(cc_m->isCompact());
+        CPPUNIT_ASSERT_EQUAL(frame(ClientConnection::Handle, 1, std::string(1, (char)ClientConnection::NumberValue)) +
+                             frame(ClientConnection::Handle, 2, std::string(1, (char)ClientConnection::StringValue)) +
+                             frame(ClientConnection::Handle, 0, std::string(1, (char)ClientConnection::NumberValue)),
+                             exchange(peer, frame(ClientConnection::Resolve, -1, "t") + frame(ClientConnection::Resolve, -1, "s") +
+                                      frame(ClientConnection::Resolve, -1, "a")));
+
+        CPPUNIT_ASSERT_EQUAL(frame(ClientConnection::Written, 0) + frame(ClientConnection::Written, 1) + frame(ClientConnection::Written, 2),
+                             exchange(peer, frame(ClientConnection::Write, 0, number(1)) +
+                                      frame(ClientConnection::Write, 1, number(21.5)) +
+                                      frame(ClientConnection::Write, 2, std::string(1, (char)ClientConnection::StringValue) + "hello")));
+        CPPUNIT_ASSERT_EQUAL(frame(ClientConnection::Value, 0, number(1)) + frame(ClientConnection::Value, 1, number(21.5)) +
+                             frame(ClientConnection::Value, 2, std::string(1, (char)ClientConnection::StringValue) + "hello"),
+                             exchange(peer, frame(ClientConnection::Read, 0) + frame(ClientConnection::Read, 1) + frame(ClientConnection::Read, 2)));
+        Object *t = ObjectController::instance()->getObject("t");
+        CPPUNIT_ASSERT_EQUAL(std::string("21.5"), t->getValue());
+        t->decRefCount();
+
+        CPPUNIT_ASSERT_EQUAL(frame(ClientConnection::Error, -1, std::string(1, (char)ClientConnection::Read) + "Unknown handle"),
+                             exchange(peer, frame(ClientConnection::Read, 3)));
+        CPPUNIT_ASSERT_EQUAL(frame(ClientConnection::Error, -1, std::string(1, (char)ClientConnection::Resolve) + "ObjectController: Object ID not found: 'b'\n"),
+                             exchange(peer, frame(ClientConnection::Resolve, -1, "b")));
+        close(peer);
+    }
+
+    void testCompactNotify()
+    {
+        addObject("a", "1.001");
+        int peer;
+        cc_m = new ClientConnection(NULL, createSocket(&peer));
+        std::string hello(ClientConnection::Hello, ClientConnection::HelloSize);
+        exchange(peer, hello + frame(ClientConnection::Resolve, -1, "a"));
+
+        // The notification of the client's own write comes before the reply
+        CPPUNIT_ASSERT_EQUAL(frame(ClientConnection::Subscribed, 0) + frame(ClientConnection::Notify, 0, number(1)) + frame(ClientConnection::Written, 0),
+                             exchange(peer, frame(ClientConnection::Subscribe, 0) + frame(ClientConnection::Write, 0, number(1))));
+        CPPUNIT_ASSERT_EQUAL(frame(ClientConnection::Unsubscribed, 0) + frame(ClientConnection::Written, 0),
+                             exchange(peer, frame(ClientConnection::Unsubscribe, 0) + frame(ClientConnection::Write, 0, number(0))));
+        close(peer);
+    }
+
     void testReadLongMessage()
     {
         const char *msg = "first part must be at least 256 bytes long, first part must be at least 256 bytes long, first part must be at least 256 bytes long, first part must be at least 256 bytes long, first part must be at least 256 bytes long, first part must be at least 256 byte, and this is second part\004";
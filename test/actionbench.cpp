@@ -0,0 +1,158 @@
+/*
+    Action load benchmark: compares the memory of delayed actions waiting in
+    a thread each with the same number waiting on the timer wheel, and the
+    cost of running their steps in threads or directly on the wheel.
+
+    Usage: actionbench [thousands of actions]
+*/
+
+#include "ruleserver.h"
+#include "services.h"
+#include "timermanager.h"
+#include <sys/time.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/** Resident set size of the process in kB. */
+static long residentMemory()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+            return atol(line.c_str() + 6);
+    }
+    return 0;
+}
+
+static std::vector<Action*> createActions(int count, const char* type, const char* delay)
+{
+    std::vector<Action*> actions;
+    actions.reserve(count);
+    ticpp::Element pConfig("action");
+    pConfig.SetAttribute("type", type);
+    pConfig.SetAttribute("delay", delay);
+    for (int i = 0; i < count; i++)
+    {
+        std::stringstream id;
+        id << "bench_" << i;
+        pConfig.SetAttribute("id", id.str());
+        if (std::string(type) == "set-value")
+            pConfig.SetAttribute("value", "on");
+        actions.push_back(Action::create(&pConfig));
+    }
+    return actions;
+}
+
+static void deleteActions(std::vector<Action*>& actions)
+{
+    for (std::vector<Action*>::iterator it = actions.begin(); it != actions.end(); it++)
+        delete *it;
+    actions.clear();
+}
+
+/** Lets the detached threads run until they are gone. */
+static void waitForThreads()
+{
+    while (pth_ctrl(PTH_CTRL_GETTHREADS) > 1)
+        pth_yield(NULL);
+}
+
+/** Lets the threads run until every action is done. */
+static void waitForActions(std::vector<Action*>& actions)
+{
+    for (std::vector<Action*>::iterator it = actions.begin(); it != actions.end(); it++)
+    {
+        while (!(*it)->isFinished())
+            pth_yield(NULL);
+    }
+}
+
+static void report(const char* name, int count, double time, long memory)
+{
+    printf("%-22s %.3f s, %.2f us and %.2f kB per action\n",
+           name, time, time * 1e6 / count, (double)memory / count);
+}
+
+int main(int argc, char **argv)
+{
+    int count = (argc > 1 ? atoi(argv[1]) : 10) * 1000;
+    if (count <= 0)
+    {
+        fprintf(stderr, "Usage: %s [thousands of actions]\n", argv[0]);
+        return 1;
+    }
+    pth_init();
+
+    ticpp::Element logging("logging");
+    logging.SetAttribute("level", "WARN");
+    Logging::instance()->importXml(&logging);
+
+    ticpp::Element pObj("object");
+    for (int i = 0; i < count; i++)
+    {
+        std::stringstream id;
+        id << "bench_" << i;
+        pObj.SetAttribute("id", id.str());
+        ObjectController::instance()->addObject(Object::create(&pObj));
+    }
+    TimerWheel* wheel = Services::instance()->getTimerWheel();
+
+    // Read requests still sleep through their delay in a thread each
+    std::vector<Action*> actions = createActions(count, "send-read-request", "1h");
+    long base = residentMemory();
+    double t0 = seconds();
+    for (int i = 0; i < count; i++)
+        actions[i]->execute();
+    pth_yield(NULL);
+    double t1 = seconds();
+    report("pending in threads:", count, t1 - t0, residentMemory() - base);
+    for (int i = 0; i < count; i++)
+        actions[i]->cancel();
+    waitForThreads();
+    deleteActions(actions);
+
+    actions = createActions(count, "set-value", "1h");
+    base = residentMemory();
+    t0 = seconds();
+    for (int i = 0; i < count; i++)
+        actions[i]->execute();
+    t1 = seconds();
+    report("pending on the wheel:", count, t1 - t0, residentMemory() - base);
+
+    // The objects were never read, so each step may block and gets a thread
+    base = residentMemory();
+    t0 = seconds();
+    wheel->advance(TimerWheel::now() + 3600000);
+    pth_yield(NULL);
+    long memory = residentMemory() - base;
+    waitForActions(actions);
+    t1 = seconds();
+    report("steps in threads:", count, t1 - t0, memory);
+
+    // Now that their values are known, the steps run on the wheel
+    for (int i = 0; i < count; i++)
+        actions[i]->execute();
+    base = residentMemory();
+    t0 = seconds();
+    wheel->advance(TimerWheel::now() + 3600000);
+    t1 = seconds();
+    report("steps on the wheel:", count, t1 - t0, residentMemory() - base);
+
+    deleteActions(actions);
+    Services::reset();
+    ObjectController::reset();
+    return 0;
+}
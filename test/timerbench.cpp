@@ -0,0 +1,149 @@
+/*
+    Timer load benchmark: creates thousands of timer conditions with mixed
+    time specs and runs the timer manager over a simulated period.
+
+    Usage: timerbench [thousands of timers] [days]
+*/
+
+#include "ruleserver.h"
+#include "services.h"
+#include "timermanager.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+class CountingListener : public ChangeListener
+{
+public:
+    CountingListener() : count_m(0) {};
+    virtual void onChange(Object* object) { count_m++; };
+    virtual const char* getID() { return "timerbench"; };
+    unsigned long count_m;
+};
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/** Peak resident set size in kB. */
+static long peakMemory()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/** Fixed times, weekdays, sunrise and sunset with offsets, exception days
+ * and periodic timers in equal parts. */
+static std::string timerSpec(int i)
+{
+    std::stringstream xml;
+    int hour = i % 24, min = (i * 7) % 60;
+    xml << "<condition type='timer' trigger='true'>";
+    switch (i % 6)
+    {
+    case 0:
+        xml << "<at hour='" << hour << "' min='" << min << "'/>"
+            << "<until hour='" << (hour + 3) % 24 << "' min='" << min << "'/>";
+        break;
+    case 1:
+        xml << "<at hour='" << hour << "' min='" << min << "' wdays='" << 1 + i % 5 << "67'/>"
+            << "<during>10m</during>";
+        break;
+    case 2:
+        xml << "<at type='sunrise' offset='" << (i % 60) - 30 << "m'/><during>1h</during>";
+        break;
+    case 3:
+        xml << "<at type='sunset' offset='" << (i % 60) - 30 << "m'/>"
+            << "<until hour='23' min='" << min << "'/>";
+        break;
+    case 4:
+        xml << "<at hour='" << hour << "' min='" << min << "' exception='" << (i % 12 < 6 ? "no" : "yes") << "'/>"
+            << "<during>30m</during>";
+        break;
+    case 5:
+        xml << "<every>" << 1 + i % 12 << "h</every><during>" << 1 + i % 30 << "m</during>";
+        break;
+    }
+    xml << "</condition>";
+    return xml.str();
+}
+
+int main(int argc, char **argv)
+{
+    int count = (argc > 1 ? atoi(argv[1]) : 5) * 1000;
+    int days = argc > 2 ? atoi(argv[2]) : 365;
+    if (count <= 0 || days <= 0)
+    {
+        fprintf(stderr, "Usage: %s [thousands of timers] [days]\n", argv[0]);
+        return 1;
+    }
+
+    ticpp::Element logging("logging");
+    logging.SetAttribute("level", "WARN");
+    Logging::instance()->importXml(&logging);
+
+    Services* services = Services::instance();
+    services->getLocationInfo()->setCoord(4.35, 50.85);
+    ExceptionDays* exceptions = services->getExceptionDays();
+    for (int i = 0; i < 12; i++)
+    {
+        DaySpec* day = new DaySpec();
+        day->mon_m = i;
+        day->mday_m = 1 + (i * 5) % 28;
+        exceptions->addDay(day);
+    }
+    TimerManager* manager = services->getTimerManager();
+
+    CountingListener listener;
+    std::vector<Condition*> timers;
+    timers.reserve(count);
+    long baseMemory = peakMemory();
+    double t0 = seconds();
+    for (int i = 0; i < count; i++)
+    {
+        ticpp::Document doc;
+        doc.LoadFromString(timerSpec(i));
+        timers.push_back(Condition::create(doc.FirstChildElement(), &listener));
+    }
+    double t1 = seconds();
+    unsigned long setupCalls = PeriodicTask::getFindNextCount();
+
+    // Jump from deadline to deadline, every task fires at its exact time.
+    int64_t start = TimerManager::now();
+    int64_t end = start + (int64_t)days * 86400000;
+    int64_t now = start;
+    while (now < end)
+    {
+        int64_t delay = manager->processTasks(now);
+        if (delay < 0)
+            break;
+        now += delay > 0 ? delay : 1;
+    }
+    double t2 = seconds();
+
+    unsigned long fired = manager->getFiredCount();
+    unsigned long calls = PeriodicTask::getFindNextCount() - setupCalls;
+    printf("timers:              %d over %d days\n", count, days);
+    printf("setup:               %.3f s, %.1f us per timer, %lu findNext calls\n",
+           t1 - t0, (t1 - t0) * 1e6 / count, setupCalls);
+    printf("simulation:          %.3f s\n", t2 - t1);
+    printf("fired:               %lu, %.2f us per fire and reschedule\n",
+           fired, fired ? (t2 - t1) * 1e6 / fired : 0.0);
+    printf("findNext calls:      %lu, %.2f per fire, %lu answered from cache\n",
+           calls, fired ? (double)calls / fired : 0.0, PeriodicTask::getFindNextCacheHits());
+    printf("notifications:       %lu\n", listener.count_m);
+    printf("pending tasks:       %d\n", manager->getTaskCount());
+    printf("peak memory:         %ld kB (%ld kB for the timers)\n", peakMemory(), peakMemory() - baseMemory);
+
+    for (std::vector<Condition*>::iterator it = timers.begin(); it != timers.end(); it++)
+        delete *it;
+    Services::reset();
+    return 0;
+}
@@ -0,0 +1,366 @@
+/*
+    XmlServer load benchmark: measures the rate of short-lived connections,
+    of the common requests in XML and in the compact protocol and of
+    notifications, and the memory used by idle clients. The server runs in a child process, the clients in the
+    parent.
+
+    Usage: xmlserverbench [idle connections] [port]
+*/
+
+#include "objectcontroller.h"
+#include "xmlserver.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+static const char* Request = "<read><object id='bench'/></read>\004";
+static const char* Requests[][2] = {
+    { "read object", "<read><object id='bench'/></read>\004" },
+    { "read objects", "<read><objects><object id='bench'/><object id='bench_1'/><object id='bench_2'/></objects></read>\004" },
+    { "write object", "<write><object id='bench_1' value='on'/></write>\004" },
+    { "read version", "<read><version/></read>\004" },
+    { "read config", "<read><config/></read>\004" }
+};
+static const char* CompactRequests[] = { "compact read", "compact write" };
+static const char* Subscribe = "<admin><notification><register id='bench_2'/></notification></admin>\004";
+static const char* Toggle = "<write><object id='bench_2' value='on'/></write>\004<write><object id='bench_2' value='off'/></write>\004";
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/** CPU time used by a process in seconds. */
+static double cpuTime(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    std::ifstream stat(path);
+    std::string line;
+    std::getline(stat, line);
+    size_t pos = line.rfind(')');
+    if (pos == std::string::npos)
+        return 0;
+    // utime and stime are the 12th and 13th fields after the name
+    std::istringstream fields(line.substr(pos + 1));
+    std::string field;
+    for (int i = 0; i < 11; i++)
+        fields >> field;
+    double utime = 0, stime = 0;
+    fields >> utime >> stime;
+    return (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/** Resident set size of a process in kB. */
+static long residentMemory(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    std::ifstream status(path);
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+            return atol(line.c_str() + 6);
+    }
+    return 0;
+}
+
+static int connectTo(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Waits for count messages, XML or compact frames. */
+static bool receive(int fd, int count, bool compact = false)
+{
+    char buf[4096];
+    std::string frames;
+    ssize_t n;
+    while (count > 0 && (n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        if (!compact)
+        {
+            for (char* end = buf; (end = (char*)memchr(end, '\004', buf + n - end)) != 0; end++)
+                count--;
+            continue;
+        }
+        frames.append(buf, n);
+        size_t pos = 0;
+        while (frames.size() - pos >= 4)
+        {
+            const unsigned char* p = (const unsigned char*)frames.data() + pos;
+            size_t len = ((size_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            if (frames.size() - pos - 4 < len)
+                break;
+            pos += 4 + len;
+            count--;
+        }
+        frames.erase(0, pos);
+    }
+    return count == 0;
+}
+
+/** Sends the request count times and waits for all the replies. */
+static bool roundTrip(int fd, const std::string& request = Request, int count = 1, int replies = 1, bool compact = false)
+{
+    std::string batch;
+    for (int i = 0; i < count; i++)
+        batch.append(request);
+    if (write(fd, batch.data(), batch.size()) != (ssize_t)batch.size())
+        return false;
+    return receive(fd, count * replies, compact);
+}
+
+/** A compact protocol frame, see ClientConnection. */
+static std::string frame(int opcode, int handle, const std::string& args = "")
+{
+    std::string body(1, (char)opcode);
+    for (int shift = 24; handle >= 0 && shift >= 0; shift -= 8)
+        body.push_back((char)(handle >> shift));
+    body.append(args);
+    std::string out;
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((char)(body.size() >> shift));
+    return out + body;
+}
+
+/** Opens a compact protocol connection with bench and bench_1 as handles 0 and 1. */
+static int connectCompact(int port)
+{
+    int fd = connectTo(port);
+    std::string hello(ClientConnection::Hello, ClientConnection::HelloSize);
+    std::string request = hello + frame(ClientConnection::Resolve, -1, "bench") + frame(ClientConnection::Resolve, -1, "bench_1");
+    if (fd == -1 || write(fd, request.data(), request.size()) != (ssize_t)request.size())
+        return -1;
+    char buf[ClientConnection::HelloSize];
+    size_t received = 0;
+    ssize_t n;
+    while (received < sizeof(buf) && (n = read(fd, buf + received, sizeof(buf) - received)) > 0)
+        received += n;
+    if (received < sizeof(buf) || !receive(fd, 2, true))
+        return -1;
+    return fd;
+}
+
+static void runServer(int port)
+{
+    pth_init();
+    ticpp::Element logging("logging");
+    logging.SetAttribute("level", "WARN");
+    Logging::instance()->importXml(&logging);
+
+    ticpp::Element pConfig("object");
+    pConfig.SetAttribute("id", "bench");
+    ObjectController::instance()->addObject(Object::create(&pConfig));
+    pConfig.SetAttribute("id", "bench_1");
+    ObjectController::instance()->addObject(Object::create(&pConfig));
+    pConfig.SetAttribute("id", "bench_2");
+    ObjectController::instance()->addObject(Object::create(&pConfig));
+    // A configuration of a typical size for read config
+    for (int i = 0; i < 100; i++)
+    {
+        std::stringstream id;
+        id << "config_" << i;
+        pConfig.SetAttribute("id", id.str());
+        pConfig.SetAttribute("gad", Object::WriteGroupAddr(0x800 + i));
+        ObjectController::instance()->addObject(Object::create(&pConfig));
+    }
+    new XmlInetServer(port, 1024);
+    while (true)
+        pth_sleep(60);
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1000;
+    int port = argc > 2 ? atoi(argv[2]) : 10280;
+    if (count <= 0 || port <= 0)
+    {
+        fprintf(stderr, "Usage: %s [idle connections] [port]\n", argv[0]);
+        return 1;
+    }
+
+    // Both processes need one descriptor per client.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t server = fork();
+    if (server == 0)
+        runServer(port);
+
+    int fd = -1;
+    for (int i = 0; i < 500 && fd == -1; i++)
+    {
+        usleep(10000);
+        fd = connectTo(port);
+    }
+    if (fd == -1 || !roundTrip(fd))
+    {
+        fprintf(stderr, "Unable to reach the server on port %d\n", port);
+        kill(server, SIGTERM);
+        return 1;
+    }
+    close(fd);
+
+    // Short-lived connections, like the PHP pollers.
+    int shortCount = 2000;
+    double t0 = seconds();
+    for (int i = 0; i < shortCount; i++)
+    {
+        fd = connectTo(port);
+        if (fd == -1 || !roundTrip(fd))
+        {
+            fprintf(stderr, "Short-lived connection %d failed\n", i);
+            return 1;
+        }
+        close(fd);
+    }
+    double t1 = seconds();
+
+    // Requests on a persistent connection, one at a time and pipelined.
+    // The server CPU time is measured on the longer pipelined run.
+    const int requestCounts[2] = { 20000, 200000 }, batches[2] = { 1, 50 };
+    const int xmlTypes = sizeof(Requests) / sizeof(Requests[0]);
+    const int requestTypes = xmlTypes + 2;
+    std::string compactRequests[2];
+    compactRequests[0] = frame(ClientConnection::Read, 0);
+    double one = 1.0;
+    unsigned char bytes[8];
+    memcpy(bytes, &one, 8);
+    std::string value(1, (char)ClientConnection::NumberValue);
+    for (int i = 0; i < 8; i++)
+        value.push_back(bytes[htonl(1) == 1 ? i : 7 - i]);
+    compactRequests[1] = frame(ClientConnection::Write, 1, value);
+
+    double rates[requestTypes][2], cpu[requestTypes];
+    fd = connectTo(port);
+    int compactFd = connectCompact(port);
+    if (compactFd == -1)
+    {
+        fprintf(stderr, "Compact protocol handshake failed\n");
+        return 1;
+    }
+    for (int i = 0; i < requestTypes; i++)
+    {
+        bool compact = i >= xmlTypes;
+        const char* name = compact ? CompactRequests[i - xmlTypes] : Requests[i][0];
+        std::string request = compact ? compactRequests[i - xmlTypes] : Requests[i][1];
+        for (int j = 0; j < 2; j++)
+        {
+            double start = seconds(), startCpu = cpuTime(server);
+            for (int k = 0; k < requestCounts[j]; k += batches[j])
+            {
+                if (!roundTrip(compact ? compactFd : fd, request, batches[j], 1, compact))
+                {
+                    fprintf(stderr, "%s request failed\n", name);
+                    return 1;
+                }
+            }
+            rates[i][j] = requestCounts[j] / (seconds() - start);
+            cpu[i] = (cpuTime(server) - startCpu) * 1e6 / requestCounts[j];
+        }
+    }
+    close(fd);
+    close(compactFd);
+
+    // Changes of one object notified to its subscribers.
+    const int subscriberCount = 20, toggleCount = 5000, toggleBatch = 25;
+    std::vector<int> subscribers;
+    for (int i = 0; i < subscriberCount; i++)
+    {
+        subscribers.push_back(connectTo(port));
+        if (subscribers.back() == -1 || !roundTrip(subscribers.back(), Subscribe))
+        {
+            fprintf(stderr, "Subscription failed\n");
+            return 1;
+        }
+    }
+    fd = connectTo(port);
+    double t4 = seconds();
+    for (int k = 0; k < toggleCount; k += toggleBatch)
+    {
+        bool ok = roundTrip(fd, Toggle, toggleBatch, 2);
+        for (int i = 0; ok && i < subscriberCount; i++)
+            ok = receive(subscribers[i], toggleBatch * 2);
+        if (!ok)
+        {
+            fprintf(stderr, "Notification failed\n");
+            return 1;
+        }
+    }
+    double t5 = seconds();
+    close(fd);
+    for (int i = 0; i < subscriberCount; i++)
+        close(subscribers[i]);
+
+    // Idle connections, like the tablets waiting for notifications.
+    usleep(100000);
+    long baseMemory = residentMemory(server);
+    std::vector<int> idle;
+    for (int i = 0; i < count; i++)
+    {
+        fd = connectTo(port);
+        if (fd == -1 || !roundTrip(fd))
+        {
+            fprintf(stderr, "Only %d idle connections could be opened\n", i);
+            break;
+        }
+        idle.push_back(fd);
+    }
+    long idleMemory = residentMemory(server);
+
+    fd = idle.empty() ? -1 : idle.back();
+    int trips = 1000;
+    double t2 = seconds();
+    for (int i = 0; fd != -1 && i < trips; i++)
+        roundTrip(fd);
+    double t3 = seconds();
+
+    printf("short-lived:         %d connections, %.0f connections/s\n",
+           shortCount, shortCount / (t1 - t0));
+    for (int i = 0; i < requestTypes; i++)
+        printf("%-20s %.0f requests/s, %.0f pipelined by %d, %.2f us server CPU\n",
+               (std::string(i < xmlTypes ? Requests[i][0] : CompactRequests[i - xmlTypes]) + ":").c_str(),
+               rates[i][0], rates[i][1], batches[1], cpu[i]);
+    printf("notifications:       %.0f/s to %d subscribers, %.0f changes/s\n",
+           toggleCount * 2.0 * subscriberCount / (t5 - t4), subscriberCount, toggleCount * 2.0 / (t5 - t4));
+    printf("idle clients:        %d\n", (int)idle.size());
+    printf("server memory:       %ld kB, %.2f kB per idle client\n",
+           idleMemory, idle.empty() ? 0.0 : (double)(idleMemory - baseMemory) / idle.size());
+    printf("round trip:          %.1f us with the idle clients connected\n",
+           (t3 - t2) * 1e6 / trips);
+
+    for (std::vector<int>::iterator it = idle.begin(); it != idle.end(); it++)
+        close(*it);
+    kill(server, SIGTERM);
+    waitpid(server, 0, 0);
+    return 0;
+}